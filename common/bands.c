@@ -0,0 +1,102 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * bands.c
+ * Column band helpers for the separable filters.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <libgimp/gimp.h>
+
+#include "bands.h"
+
+
+/*  Copy a block of 'width' x 'height' pixels from 'src' to 'dest',
+ *  swapping rows and columns.  Used to turn tiles into contiguous
+ *  columns and back.
+ */
+void
+bands_transpose (const guchar *src,
+                 gint          src_stride,
+                 guchar       *dest,
+                 gint          dest_stride,
+                 gint          width,
+                 gint          height,
+                 gint          bytes)
+{
+  gint x, y, b;
+
+  for (y = 0; y < height; y++)
+    {
+      const guchar *s = src + y * src_stride;
+      guchar       *d = dest + y * bytes;
+
+      for (x = 0; x < width; x++)
+        {
+          for (b = 0; b < bytes; b++)
+            d[b] = s[b];
+
+          s += bytes;
+          d += dest_stride;
+        }
+    }
+}
+
+/*  Read (or write back) the columns 'x' .. 'x' + 'width' - 1 of a pixel
+ *  region one tile at a time, storing each column contiguously in
+ *  'band'.  'tile_buf' must hold one full tile.
+ */
+void
+bands_transfer (GimpPixelRgn *rgn,
+                guchar       *band,
+                guchar       *tile_buf,
+                gint          x,
+                gint          y,
+                gint          width,
+                gint          height,
+                gint          bytes,
+                gboolean      write)
+{
+  const gint tile_width  = gimp_tile_width ();
+  const gint tile_height = gimp_tile_height ();
+  gint       tx, ty, tw, th;
+
+  for (ty = y; ty < y + height; ty += th)
+    {
+      th = MIN ((ty / tile_height + 1) * tile_height, y + height) - ty;
+
+      for (tx = x; tx < x + width; tx += tw)
+        {
+          guchar *col = band + ((tx - x) * height + (ty - y)) * bytes;
+
+          tw = MIN ((tx / tile_width + 1) * tile_width, x + width) - tx;
+
+          if (write)
+            {
+              bands_transpose (col, height * bytes,
+                               tile_buf, tw * bytes, th, tw, bytes);
+              gimp_pixel_rgn_set_rect (rgn, tile_buf, tx, ty, tw, th);
+            }
+          else
+            {
+              gimp_pixel_rgn_get_rect (rgn, tile_buf, tx, ty, tw, th);
+              bands_transpose (tile_buf, tw * bytes,
+                               col, height * bytes, tw, th, bytes);
+            }
+        }
+    }
+}
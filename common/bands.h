@@ -0,0 +1,49 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * bands.h
+ * Column band helpers for the separable filters.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BANDS_H__
+#define __BANDS_H__
+
+
+/*  A band is a range of full-height columns of a pixel region, stored
+ *  column by column, so that the vertical pass of a separable filter
+ *  can run over contiguous memory like the horizontal one.
+ */
+
+void   bands_transpose (const guchar *src,
+                        gint          src_stride,
+                        guchar       *dest,
+                        gint          dest_stride,
+                        gint          width,
+                        gint          height,
+                        gint          bytes);
+
+void   bands_transfer  (GimpPixelRgn *rgn,
+                        guchar       *band,
+                        guchar       *tile_buf,
+                        gint          x,
+                        gint          y,
+                        gint          width,
+                        gint          height,
+                        gint          bytes,
+                        gboolean      write);
+
+
+#endif /* __BANDS_H__ */
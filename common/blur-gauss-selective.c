@@ -24,22 +24,37 @@
  *      - use memory more efficiently, smaller regions at a time
  *      - integrating with other convolution matrix based filters ?
  *      - create more selective and adaptive filters
- *      - threading
- *      - optimization
  */
 
 #include "config.h"
 
+#include <string.h>
+
 #include <libgimp/gimp.h>
 #include <libgimp/gimpui.h>
 
 #include "libgimp/stdplugins-intl.h"
 
+#include "threads.h"
+
 
 #define PLUG_IN_PROC   "plug-in-sel-gauss"
 #define PLUG_IN_BINARY "blur-gauss-selective"
 #define PLUG_IN_ROLE   "gimp-blur-gauss-selective"
 
+#define ROWS_PER_CHUNK 16
+
+/*  The SSE2 and AVX2 kernels are compiled with function-specific target
+ *  options and selected at runtime, so no special compiler flags are
+ *  needed to build them.
+ */
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) && \
+    (defined(__i386__) || defined(__x86_64__))
+#define HAVE_ACCEL 1
+#define HAVE_AVX2  1
+#include <immintrin.h>
+#endif
+
 #ifndef ALWAYS_INLINE
 #if defined(__GNUC__) && (__GNUC__ > 3 || __GNUC__ == 3 && __GNUC_MINOR__ > 0)
 #    define ALWAYS_INLINE __attribute__((always_inline)) inline
@@ -55,6 +70,11 @@ typedef struct
   gint     maxdelta;
 } BlurValues;
 
+typedef struct _SelGaussJob SelGaussJob;
+
+typedef void (* SelGaussRowFunc) (const SelGaussJob *job,
+                                  gint               y);
+
 
 /* Declare local functions.
  */
@@ -317,310 +337,76 @@ init_matrix (gdouble  radius,
 }
 
 
-#if defined(ARCH_X86) && defined(USE_MMX) && defined(__GNUC__)
-#define HAVE_ACCEL 1
-
-static ALWAYS_INLINE void
-matrixmult_mmx (const guchar  *src,
-                guchar        *dest,
-                gint           width,
-                gint           height,
-                const gdouble *mat,
-                gint           numrad,
-                gint           bytes,
-                gboolean       has_alpha,
-                gint           maxdelta,
-                gboolean       preview_mode)
+/*  The integer weights used by all kernels.  The 1-D weights sum up to
+ *  0x1000, which makes sure that the 2-D sums fit in 32 bits.
+ */
+static gushort *
+init_imatrix (const gdouble *mat,
+              gint           numrad)
 {
-  const gint       rowstride = width * bytes;
-  const long long  maxdelta4 = maxdelta * 0x0001000100010001ULL;
-  gushort         *imat;
-  gdouble          fsum, fscale;
-  gint             i, j, x, y, d;
-
-  g_assert (has_alpha ? (bytes == 4) : (bytes == 3 || bytes == 1));
-
-  imat = g_newa (gushort, 2 * numrad + 3);
+  gushort *imat = g_new (gushort, 2 * numrad);
+  gdouble  fsum, fscale;
+  gint     y;
 
   fsum = 0.0;
   for (y = 1 - numrad; y < numrad; y++)
     fsum += mat[ABS(y)];
 
-  /* Ensure that one pixel's product fits in 16bits,
-   * and that the sum fits in 32bits.
-   */
-  fscale = MIN (0x100 / mat[0], 0x1000 / fsum);
+  fscale = 0x1000 / fsum;
   for (y = 0; y < numrad; y++)
     imat[numrad - y] = imat[numrad + y] = mat[y] * fscale;
 
-  for (y = numrad; y < numrad + 3; y++)
-    imat[numrad + y] = 0;
-
-  for (y = 0; y < height; y++)
-    {
-      asm volatile (
-        "pxor  %%mm7, %%mm7 \n\t":
-      );
-
-      for (x = 0; x < width; x++)
-        {
-          guint r, g, b, fr, fg, fb;
-          gint  offset;
-          gint  dix;
-
-          r = g = b = fr = fg = fb = 0;
-
-          dix = bytes * (width * y + x);
-
-          if (has_alpha)
-            {
-              *(guint*) &dest[dix] = *(guint*) &src[dix];
-
-              if (!src[dix + 3])
-                continue;
-            }
-
-          asm volatile (
-            "movd         %0, %%mm6 \n\t"
-            "punpcklbw %%mm7, %%mm6 \n\t" /* center pixel */
-            :: "m"(src[dix])
-          );
-
-          offset = rowstride * (y - numrad) + bytes * (x - numrad);
-
-          if (bytes == 1)
-            {
-              asm volatile (
-                "pshufw $0, %%mm6, %%mm6 \n\t": /* center pixel x4 */
-              );
-              for (j = 1 - numrad; j < numrad; j++)
-                {
-                  const guchar *src_b;
-                  guint         rowsum  = 0;
-                  guint         rowfact = 0;
-
-                  offset += rowstride;
-
-                  if (y + j < 0 || y + j >= height)
-                    continue;
-
-                  src_b = src + offset - 3;
-
-                  asm volatile (
-                    "pxor  %%mm5, %%mm5 \n\t" /* row fact */
-                    "pxor  %%mm4, %%mm4 \n\t" /* row sum  */
-                    :
-                  );
-
-                  for (i = 1 - numrad; i < numrad; i += 4)
-                    {
-                      src_b += 4;
-                      if (x + i < 0 || x + i >= width)
-                        continue;
-
-                      asm volatile (
-                        "movd         %0, %%mm0 \n\t"
-                        "movq      %%mm6, %%mm1 \n\t"
-                        "punpcklbw %%mm7, %%mm0 \n\t" /* one pixel      */
-                        "psubusw   %%mm0, %%mm1 \n\t" /* diff           */
-                        "movq      %%mm0, %%mm2 \n\t"
-                        "psubusw   %%mm6, %%mm2 \n\t"
-                        "por       %%mm2, %%mm1 \n\t" /* abs diff       */
-                        "pcmpgtw      %1, %%mm1 \n\t" /* threshold      */
-                        "pandn        %2, %%mm1 \n\t" /* weight         */
-                        "pmullw    %%mm1, %%mm0 \n\t" /* pixel * weight */
-                        "paddusw   %%mm1, %%mm5 \n\t" /* fact           */
-                        "movq      %%mm0, %%mm2 \n\t"
-                        "punpcklwd %%mm7, %%mm0 \n\t"
-                        "punpckhwd %%mm7, %%mm2 \n\t"
-                        "paddd     %%mm0, %%mm4 \n\t"
-                        "paddd     %%mm2, %%mm4 \n\t" /* sum            */
-                        :: "m"(*src_b), "m"(maxdelta4), "m"(imat[numrad + i])
-                      );
-                    }
-
-                  asm volatile (
-                    "pshufw $0xb1, %%mm5, %%mm3 \n\t"
-                    "paddusw       %%mm3, %%mm5 \n\t"
-                    "pshufw $0x0e, %%mm4, %%mm2 \n\t"
-                    "pshufw $0x0e, %%mm5, %%mm3 \n\t"
-                    "paddd         %%mm2, %%mm4 \n\t"
-                    "paddusw       %%mm3, %%mm5 \n\t"
-                    "movd          %%mm4, %0    \n\t"
-                    "movd          %%mm5, %1    \n\t"
-                    :"=g"(rowsum), "=g"(rowfact)
-                  );
-                  d = imat[numrad + j];
-                  r += d * rowsum;
-                  fr += d * (gushort) rowfact;
-                }
-
-              if (fr)
-                dest[dix] = r / fr;
-            }
-          else
-            {
-              for (j = 1 - numrad; j < numrad; j++)
-                {
-                  const guchar *src_b;
-                  gushort       rf[4];
-                  guint         rr, rg, rb;
-
-                  offset += rowstride;
-                  if (y + j < 0 || y + j >= height)
-                    continue;
-
-                  src_b = src + offset;
-
-                  asm volatile (
-                    "pxor  %%mm5, %%mm5 \n\t" /* row fact   */
-                    "pxor  %%mm4, %%mm4 \n\t" /* row sum RG */
-                    "pxor  %%mm3, %%mm3 \n\t" /* row sum B  */
-                    :
-                  );
-
-                  for (i = 1 - numrad; i < numrad; i++)
-                    {
-                      src_b += bytes;
-                      if (x + i < 0 || x + i >= width)
-                        continue;
-
-                      if (has_alpha)
-                        asm volatile (
-                          "movd         %0, %%mm0 \n\t"
-                          "movq      %%mm6, %%mm1 \n\t"
-                          "punpcklbw %%mm7, %%mm0 \n\t" /* one pixel       */
-                          "psubusw   %%mm0, %%mm1 \n\t" /* diff            */
-                          "movq      %%mm0, %%mm2 \n\t"
-                          "psubusw   %%mm6, %%mm2 \n\t"
-                          "por       %%mm2, %%mm1 \n\t" /* abs diff        */
-                          "pcmpgtw      %1, %%mm1 \n\t" /* threshold       */
-                          "pshufw   $0, %2, %%mm2 \n\t" /* weight          */
-                          "pandn     %%mm2, %%mm1 \n\t"
-                          "pshufw $0xff, %%mm0, %%mm2 \n\t" /* alpha       */
-                          "psllw        $8, %%mm2 \n\t"
-                          "pmulhuw   %%mm2, %%mm1 \n\t" /* weight *= alpha */
-                          "pmullw    %%mm1, %%mm0 \n\t" /* pixel * weight  */
-                          "paddusw   %%mm1, %%mm5 \n\t" /* fact            */
-                          "movq      %%mm0, %%mm2 \n\t"
-                          "punpcklwd %%mm7, %%mm0 \n\t" /* RG              */
-                          "punpckhwd %%mm7, %%mm2 \n\t" /* B               */
-                          "paddd     %%mm0, %%mm4 \n\t"
-                          "paddd     %%mm2, %%mm3 \n\t"
-                          :: "m"(*src_b), "m"(maxdelta4), "m"(imat[numrad + i])
-                        );
-                      else
-                        asm volatile (
-                          "movd         %0, %%mm0 \n\t"
-                          "movq      %%mm6, %%mm1 \n\t"
-                          "punpcklbw %%mm7, %%mm0 \n\t" /* one pixel       */
-                          "psubusw   %%mm0, %%mm1 \n\t" /* diff            */
-                          "movq      %%mm0, %%mm2 \n\t"
-                          "psubusw   %%mm6, %%mm2 \n\t"
-                          "por       %%mm2, %%mm1 \n\t" /* abs diff        */
-                          "pcmpgtw      %1, %%mm1 \n\t" /* threshold       */
-                          "pshufw   $0, %2, %%mm2 \n\t" /* weight          */
-                          "pandn     %%mm2, %%mm1 \n\t"
-                          "pmullw    %%mm1, %%mm0 \n\t" /* pixel * weight  */
-                          "paddusw   %%mm1, %%mm5 \n\t" /* fact            */
-                          "movq      %%mm0, %%mm2 \n\t"
-                          "punpcklwd %%mm7, %%mm0 \n\t" /* RG              */
-                          "punpckhwd %%mm7, %%mm2 \n\t" /* B               */
-                          "paddd     %%mm0, %%mm4 \n\t"
-                          "paddd     %%mm2, %%mm3 \n\t"
-                          :: "m"(*src_b), "m"(maxdelta4), "m"(imat[numrad + i])
-                        );
-                    }
-
-                  asm volatile (
-                    "movd    %%mm4, %0 \n\t"
-                    "movd    %%mm3, %2 \n\t"
-                    "psrlq  $32, %%mm4 \n\t"
-                    "movq    %%mm5, %3 \n\t"
-                    "movd    %%mm4, %1 \n\t"
-                    :"=g"(rr), "=g"(rg), "=g"(rb), "=m"(*rf)
-                    ::"memory"
-                  );
-                  d = imat[numrad + j];
-                  r += d * rr;
-                  g += d * rg;
-                  b += d * rb;
-                  fr += d * rf[0];
-                  fg += d * rf[1];
-                  fb += d * rf[2];
-                }
-
-              if (has_alpha)
-                {
-                  if (fr)
-                    dest[dix+0] = r / fr;
-                  if (fg)
-                    dest[dix+1] = g / fg;
-                  if (fb)
-                    dest[dix+2] = b / fb;
-                }
-              else
-                {
-                  dest[dix+0] = r / fr;
-                  dest[dix+1] = g / fg;
-                  dest[dix+2] = b / fb;
-                }
-            }
-        }
-
-      if (!(y % 16) && !preview_mode)
-        {
-          asm volatile ("emms");
-          gimp_progress_update ((gdouble) y / (gdouble) height);
-        }
-    }
-
-  asm volatile ("emms");
+  return imat;
 }
-#endif /* ARCH_X86 && USE_MMX && __GNUC__ */
 
 
-static ALWAYS_INLINE void
-matrixmult_int (const guchar  *src,
-                guchar        *dest,
-                gint           width,
-                gint           height,
-                const gdouble *mat,
-                gint           numrad,
-                gint           bytes,
-                gboolean       has_alpha,
-                gint           maxdelta,
-                gboolean       preview_mode)
+struct _SelGaussJob
 {
-  const gint  nb        = bytes - (has_alpha ? 1 : 0);
-  const gint  rowstride = width * bytes;
-  gushort    *imat;
-  gdouble     fsum, fscale;
-  gint        i, j, b, x, y, d;
-
-#ifdef HAVE_ACCEL
-  if (has_alpha ? (bytes == 4) : (bytes == 3 || bytes == 1))
-    {
-      GimpCpuAccelFlags cpu = gimp_cpu_accel_get_support ();
-
-      if (cpu & (GIMP_CPU_ACCEL_X86_MMXEXT | GIMP_CPU_ACCEL_X86_SSE))
-        return matrixmult_mmx (src, dest, width, height, mat, numrad,
-                               bytes, has_alpha, maxdelta, preview_mode);
-    }
-#endif
+  const guchar   *src;
+  guchar         *dest;
+  gint            width;
+  gint            height;
+  gint            bytes;
+  gboolean        has_alpha;
+  gint            maxdelta;
+  gint            numrad;
+  const gushort  *imat;
+
+  /*  planar copy of the source for the SIMD kernels: one plane per
+   *  color channel plus a weight plane that holds the alpha channel
+   *  (or 1 for images without alpha), all with a zero border of
+   *  'numrad' pixels so that the kernels need no bounds checks
+   */
+  guchar        **planes;
+  guchar         *weights;
+  gint            pstride;
 
-  imat = g_newa (gushort, 2 * numrad);
+  SelGaussRowFunc row_func;
 
-  fsum = 0.0;
-  for (y = 1 - numrad; y < numrad; y++)
-    fsum += mat[ABS(y)];
+  volatile gint   next_row;
+  volatile gint   rows_done;
+};
 
-  /* Ensure that the sum fits in 32bits. */
-  fscale = 0x1000 / fsum;
-  for (y = 0; y < numrad; y++)
-    imat[numrad - y] = imat[numrad + y] = mat[y] * fscale;
 
-  for (y = 0; y < height; y++)
+static ALWAYS_INLINE void
+matrixmult_int (const SelGaussJob *job,
+                gint               bytes,
+                gboolean           has_alpha,
+                gint               y_start,
+                gint               y_end)
+{
+  const guchar  *src       = job->src;
+  guchar        *dest      = job->dest;
+  const gushort *imat      = job->imat;
+  const gint     width     = job->width;
+  const gint     height    = job->height;
+  const gint     numrad    = job->numrad;
+  const gint     maxdelta  = job->maxdelta;
+  const gint     nb        = bytes - (has_alpha ? 1 : 0);
+  const gint     rowstride = width * bytes;
+  gint           i, j, b, x, y, d;
+
+  for (y = y_start; y < y_end; y++)
     {
       for (x = 0; x < width; x++)
         {
@@ -689,32 +475,22 @@ matrixmult_int (const guchar  *src,
                 dest[dix + b] = sum / fact;
             }
         }
-
-      if (!(y % 16) && !preview_mode)
-        gimp_progress_update ((gdouble) y / (gdouble) height);
     }
 }
 
 /* Force compilation of several versions with inlined constants. */
 static void
-matrixmult (const guchar  *src,
-            guchar        *dest,
-            gint           width,
-            gint           height,
-            const gdouble *mat,
-            gint           numrad,
-            gint           bytes,
-            gboolean       has_alpha,
-            gint           maxdelta,
-            gboolean       preview_mode)
+matrixmult_rows (const SelGaussJob *job,
+                 gint               y_start,
+                 gint               y_end)
 {
-  has_alpha = has_alpha ? 1 : 0;
+  gint     bytes     = job->bytes;
+  gboolean has_alpha = job->has_alpha ? 1 : 0;
 
 #define EXPAND(BYTES, ALPHA)\
   if (bytes == BYTES && has_alpha == ALPHA)\
     {\
-      matrixmult_int (src, dest, width, height, mat, numrad,\
-                      BYTES, ALPHA, maxdelta, preview_mode);\
+      matrixmult_int (job, BYTES, ALPHA, y_start, y_end);\
       return;\
     }
 
@@ -726,6 +502,384 @@ matrixmult (const guchar  *src,
 #undef EXPAND
 }
 
+
+#ifdef HAVE_ACCEL
+
+/*  The SIMD kernels compute the same integer sums as matrixmult_int(),
+ *  only for 4 (SSE2) or 8 (AVX2) horizontally adjacent pixels of one
+ *  channel at a time.  Out-of-range neighbours have a zero weight in
+ *  the padded planes, which is equivalent to skipping them.  All
+ *  arithmetic is done modulo 2^32 just like in the scalar code, so the
+ *  results are identical.
+ */
+
+static void
+matrixmult_store (const SelGaussJob *job,
+                  gint               b,
+                  gint               x,
+                  gint               y,
+                  gint               n,
+                  const guint       *sum,
+                  const guint       *fact,
+                  const guint       *center)
+{
+  guchar *dest = job->dest + job->bytes * (job->width * y + x) + b;
+  gint    k;
+
+  n = MIN (n, job->width - x);
+
+  for (k = 0; k < n; k++, dest += job->bytes)
+    *dest = fact[k] ? sum[k] / fact[k] : center[k];
+}
+
+static void
+matrixmult_copy_alpha (const SelGaussJob *job,
+                       gint               y)
+{
+  const gint    bytes = job->bytes;
+  const guchar *src   = job->src  + bytes * job->width * y + bytes - 1;
+  guchar       *dest  = job->dest + bytes * job->width * y + bytes - 1;
+  gint          x;
+
+  for (x = 0; x < job->width; x++, src += bytes, dest += bytes)
+    *dest = *src;
+}
+
+static inline __m128i __attribute__ ((target ("sse2")))
+load4_epu8_sse2 (const guchar *p)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  gint32        v;
+
+  memcpy (&v, p, sizeof (v));
+
+  return _mm_unpacklo_epi16 (_mm_unpacklo_epi8 (_mm_cvtsi32_si128 (v), zero),
+                             zero);
+}
+
+/*  SSE2 has no 32 bit low multiply, emulate it with two 32x32->64 ones  */
+static inline __m128i __attribute__ ((target ("sse2")))
+mullo_epi32_sse2 (__m128i a,
+                  __m128i b)
+{
+  __m128i even = _mm_mul_epu32 (a, b);
+  __m128i odd  = _mm_mul_epu32 (_mm_srli_si128 (a, 4), _mm_srli_si128 (b, 4));
+
+  return _mm_unpacklo_epi32 (_mm_shuffle_epi32 (even, _MM_SHUFFLE (0,0,2,0)),
+                             _mm_shuffle_epi32 (odd,  _MM_SHUFFLE (0,0,2,0)));
+}
+
+static void __attribute__ ((target ("sse2")))
+matrixmult_row_sse2 (const SelGaussJob *job,
+                     gint               y)
+{
+  const gint     nb      = job->bytes - (job->has_alpha ? 1 : 0);
+  const gint     numrad  = job->numrad;
+  const gint     pstride = job->pstride;
+  const __m128i  pos_max = _mm_set1_epi32 (job->maxdelta);
+  const __m128i  neg_max = _mm_set1_epi32 (- job->maxdelta);
+  gint           b, x, i, j;
+
+  for (b = 0; b < nb; b++)
+    {
+      for (x = 0; x < job->width; x += 4)
+        {
+          const gint    base   = (y + numrad) * pstride + x + numrad;
+          const __m128i center = load4_epu8_sse2 (job->planes[b] + base);
+          __m128i       sum    = _mm_setzero_si128 ();
+          __m128i       fact   = _mm_setzero_si128 ();
+          guint         out_sum[4], out_fact[4], out_center[4];
+
+          for (j = 1 - numrad; j < numrad; j++)
+            {
+              const guchar *s_row   = job->planes[b] + base + j * pstride;
+              const guchar *w_row   = job->weights   + base + j * pstride;
+              __m128i       rowsum  = _mm_setzero_si128 ();
+              __m128i       rowfact = _mm_setzero_si128 ();
+              __m128i       dj;
+
+              for (i = 1 - numrad; i < numrad; i++)
+                {
+                  __m128i s    = load4_epu8_sse2 (s_row + i);
+                  __m128i w    = load4_epu8_sse2 (w_row + i);
+                  __m128i diff = _mm_sub_epi32 (center, s);
+                  __m128i skip = _mm_or_si128 (_mm_cmpgt_epi32 (diff, pos_max),
+                                               _mm_cmplt_epi32 (diff, neg_max));
+                  __m128i d;
+
+                  d = mullo_epi32_sse2 (_mm_set1_epi32 (job->imat[numrad + i]),
+                                        w);
+                  d = _mm_andnot_si128 (skip, d);
+
+                  rowsum  = _mm_add_epi32 (rowsum, mullo_epi32_sse2 (d, s));
+                  rowfact = _mm_add_epi32 (rowfact, d);
+                }
+
+              if (job->has_alpha)
+                {
+                  rowsum  = _mm_srli_epi32 (rowsum, 8);
+                  rowfact = _mm_srli_epi32 (rowfact, 8);
+                }
+
+              dj = _mm_set1_epi32 (job->imat[numrad + j]);
+
+              sum  = _mm_add_epi32 (sum,  mullo_epi32_sse2 (dj, rowsum));
+              fact = _mm_add_epi32 (fact, mullo_epi32_sse2 (dj, rowfact));
+            }
+
+          _mm_storeu_si128 ((__m128i *) out_sum,    sum);
+          _mm_storeu_si128 ((__m128i *) out_fact,   fact);
+          _mm_storeu_si128 ((__m128i *) out_center, center);
+
+          matrixmult_store (job, b, x, y, 4, out_sum, out_fact, out_center);
+        }
+    }
+
+  if (job->has_alpha)
+    matrixmult_copy_alpha (job, y);
+}
+
+#ifdef HAVE_AVX2
+
+static inline __m256i __attribute__ ((target ("avx2")))
+load8_epu8_avx2 (const guchar *p)
+{
+  return _mm256_cvtepu8_epi32 (_mm_loadl_epi64 ((const __m128i *) p));
+}
+
+static void __attribute__ ((target ("avx2")))
+matrixmult_row_avx2 (const SelGaussJob *job,
+                     gint               y)
+{
+  const gint     nb      = job->bytes - (job->has_alpha ? 1 : 0);
+  const gint     numrad  = job->numrad;
+  const gint     pstride = job->pstride;
+  const __m256i  pos_max = _mm256_set1_epi32 (job->maxdelta);
+  const __m256i  neg_max = _mm256_set1_epi32 (- job->maxdelta);
+  gint           b, x, i, j;
+
+  for (b = 0; b < nb; b++)
+    {
+      for (x = 0; x < job->width; x += 8)
+        {
+          const gint    base   = (y + numrad) * pstride + x + numrad;
+          const __m256i center = load8_epu8_avx2 (job->planes[b] + base);
+          __m256i       sum    = _mm256_setzero_si256 ();
+          __m256i       fact   = _mm256_setzero_si256 ();
+          guint         out_sum[8], out_fact[8], out_center[8];
+
+          for (j = 1 - numrad; j < numrad; j++)
+            {
+              const guchar *s_row   = job->planes[b] + base + j * pstride;
+              const guchar *w_row   = job->weights   + base + j * pstride;
+              __m256i       rowsum  = _mm256_setzero_si256 ();
+              __m256i       rowfact = _mm256_setzero_si256 ();
+              __m256i       dj;
+
+              for (i = 1 - numrad; i < numrad; i++)
+                {
+                  __m256i s    = load8_epu8_avx2 (s_row + i);
+                  __m256i w    = load8_epu8_avx2 (w_row + i);
+                  __m256i diff = _mm256_sub_epi32 (center, s);
+                  __m256i skip = _mm256_or_si256 (_mm256_cmpgt_epi32 (diff, pos_max),
+                                                  _mm256_cmpgt_epi32 (neg_max, diff));
+                  __m256i d;
+
+                  d = _mm256_mullo_epi32 (_mm256_set1_epi32 (job->imat[numrad + i]),
+                                          w);
+                  d = _mm256_andnot_si256 (skip, d);
+
+                  rowsum  = _mm256_add_epi32 (rowsum, _mm256_mullo_epi32 (d, s));
+                  rowfact = _mm256_add_epi32 (rowfact, d);
+                }
+
+              if (job->has_alpha)
+                {
+                  rowsum  = _mm256_srli_epi32 (rowsum, 8);
+                  rowfact = _mm256_srli_epi32 (rowfact, 8);
+                }
+
+              dj = _mm256_set1_epi32 (job->imat[numrad + j]);
+
+              sum  = _mm256_add_epi32 (sum,  _mm256_mullo_epi32 (dj, rowsum));
+              fact = _mm256_add_epi32 (fact, _mm256_mullo_epi32 (dj, rowfact));
+            }
+
+          _mm256_storeu_si256 ((__m256i *) out_sum,    sum);
+          _mm256_storeu_si256 ((__m256i *) out_fact,   fact);
+          _mm256_storeu_si256 ((__m256i *) out_center, center);
+
+          matrixmult_store (job, b, x, y, 8, out_sum, out_fact, out_center);
+        }
+    }
+
+  if (job->has_alpha)
+    matrixmult_copy_alpha (job, y);
+}
+
+#endif /* HAVE_AVX2 */
+
+/*  Split the source into padded planes for the SIMD kernels.  */
+static void
+matrixmult_init_planes (SelGaussJob *job)
+{
+  const gint nb      = job->bytes - (job->has_alpha ? 1 : 0);
+  const gint pad     = job->numrad;
+  const gint pstride = job->width + 2 * pad + 8;
+  const gint psize   = pstride * (job->height + 2 * pad);
+  gint       b, x, y;
+
+  job->pstride = pstride;
+  job->planes  = g_new (guchar *, nb);
+
+  for (b = 0; b < nb; b++)
+    job->planes[b] = g_malloc0 (psize);
+
+  job->weights = g_malloc0 (psize);
+
+  for (y = 0; y < job->height; y++)
+    {
+      const guchar *s = job->src + y * job->width * job->bytes;
+      gint          p = (y + pad) * pstride + pad;
+
+      for (x = 0; x < job->width; x++, p++, s += job->bytes)
+        {
+          for (b = 0; b < nb; b++)
+            job->planes[b][p] = s[b];
+
+          job->weights[p] = job->has_alpha ? s[nb] : 1;
+        }
+    }
+}
+
+static void
+matrixmult_free_planes (SelGaussJob *job)
+{
+  const gint nb = job->bytes - (job->has_alpha ? 1 : 0);
+  gint       b;
+
+  if (! job->planes)
+    return;
+
+  for (b = 0; b < nb; b++)
+    g_free (job->planes[b]);
+
+  g_free (job->planes);
+  g_free (job->weights);
+}
+
+#endif /* HAVE_ACCEL */
+
+
+/*  Rows are handed out in small chunks from a shared counter so that
+ *  threads finishing early keep picking up work.  Only the main thread
+ *  reports progress.
+ */
+static void
+matrixmult_process (SelGaussJob *job,
+                    gboolean     report_progress)
+{
+  gint y;
+
+  while ((y = g_atomic_int_add (&job->next_row, ROWS_PER_CHUNK)) < job->height)
+    {
+      gint y_end = MIN (y + ROWS_PER_CHUNK, job->height);
+
+      if (job->row_func)
+        {
+          gint row;
+
+          for (row = y; row < y_end; row++)
+            job->row_func (job, row);
+        }
+      else
+        {
+          matrixmult_rows (job, y, y_end);
+        }
+
+      g_atomic_int_add (&job->rows_done, y_end - y);
+
+      if (report_progress)
+        gimp_progress_update ((gdouble) g_atomic_int_get (&job->rows_done) /
+                              (gdouble) job->height);
+    }
+}
+
+static gpointer
+matrixmult_thread (gpointer data)
+{
+  matrixmult_process (data, FALSE);
+
+  return NULL;
+}
+
+static void
+matrixmult (const guchar  *src,
+            guchar        *dest,
+            gint           width,
+            gint           height,
+            const gdouble *mat,
+            gint           numrad,
+            gint           bytes,
+            gboolean       has_alpha,
+            gint           maxdelta,
+            gboolean       preview_mode)
+{
+  SelGaussJob  job = { 0, };
+  GThread     *threads[THREADS_MAX];
+  gushort     *imat;
+  gint         n_threads;
+  gint         i;
+
+  imat = init_imatrix (mat, numrad);
+
+  job.src       = src;
+  job.dest      = dest;
+  job.width     = width;
+  job.height    = height;
+  job.bytes     = bytes;
+  job.has_alpha = has_alpha;
+  job.maxdelta  = maxdelta;
+  job.numrad    = numrad;
+  job.imat      = imat;
+
+#ifdef HAVE_ACCEL
+  {
+    GimpCpuAccelFlags cpu = gimp_cpu_accel_get_support ();
+
+    if (cpu & GIMP_CPU_ACCEL_X86_SSE2)
+      {
+        job.row_func = matrixmult_row_sse2;
+
+#ifdef HAVE_AVX2
+        if (__builtin_cpu_supports ("avx2"))
+          job.row_func = matrixmult_row_avx2;
+#endif
+
+        matrixmult_init_planes (&job);
+      }
+  }
+#endif
+
+  n_threads = MIN (threads_get_count (),
+                   (height + ROWS_PER_CHUNK - 1) / ROWS_PER_CHUNK);
+
+  for (i = 1; i < n_threads; i++)
+    threads[i] = g_thread_create (matrixmult_thread, &job, TRUE, NULL);
+
+  matrixmult_process (&job, ! preview_mode);
+
+  for (i = 1; i < n_threads; i++)
+    if (threads[i])
+      g_thread_join (threads[i]);
+
+#ifdef HAVE_ACCEL
+  matrixmult_free_planes (&job);
+#endif
+
+  g_free (imat);
+}
+
 static void
 sel_gauss (GimpDrawable *drawable,
            gdouble       radius,
@@ -752,9 +906,7 @@ sel_gauss (GimpDrawable *drawable,
   mat = g_new (gdouble, numrad);
   init_matrix (radius, mat, numrad);
 
-  /*  allocate with extra padding because MMX instructions may read
-      more than strictly necessary  */
-  src  = g_new (guchar, width * height * bytes + 16);
+  src  = g_new (guchar, width * height * bytes);
   dest = g_new (guchar, width * height * bytes);
 
   gimp_pixel_rgn_init (&src_rgn,
@@ -814,9 +966,7 @@ preview_update (GimpPreview *preview)
                        FALSE, FALSE);
   render_buffer = g_new (guchar, width * height * bytes);
 
-  /*  allocate with extra padding because MMX instructions may read
-      more than strictly necessary  */
-  src = g_new (guchar, width * height * bytes + 16);
+  src = g_new (guchar, width * height * bytes);
 
   /* render image */
   gimp_pixel_rgn_get_rect (&srcPR, src, x, y, width, height);
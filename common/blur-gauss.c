@@ -24,6 +24,9 @@
 
 #include "libgimp/stdplugins-intl.h"
 
+#include "bands.h"
+#include "threads.h"
+
 #define GAUSS_PROC      "plug-in-gauss"
 #define GAUSS_IIR_PROC  "plug-in-gauss-iir"
 #define GAUSS_IIR2_PROC "plug-in-gauss-iir2"
@@ -870,6 +873,400 @@ do_full_lre (const gint *src,
     }
 }
 
+/*
+ * The blur is separable, so each pass is a set of independent 1-D
+ * convolutions along the rows (horizontal pass) or the columns
+ * (vertical pass) of the drawable.  The passes below read a band of
+ * lines into memory, split the band between a small set of worker
+ * threads and write the result back.  libgimp is not thread-safe, so
+ * all pixel region access stays in the main thread; the workers only
+ * ever see plain memory.
+ *
+ * Every line is computed exactly as in the single-threaded version,
+ * so the result does not depend on the number of threads used.
+ */
+
+typedef struct
+{
+  BlurMethod  method;
+  gint        bytes;
+  gboolean    has_alpha;
+
+  /*  IIR  */
+  gdouble     n_p[5], n_m[5];
+  gdouble     d_p[5], d_m[5];
+  gdouble     bd_p[5], bd_m[5];
+
+  /*  RLE  */
+  gint       *curve;
+  gint       *sum;
+  gint        length;
+  gint        total;
+} GaussKernel;
+
+typedef struct
+{
+  const GaussKernel *kernel;
+
+  /*  the band to work on, lines are contiguous in memory  */
+  guchar            *buf;
+  gint               line_stride;   /* distance between two lines  */
+  gint               line_len;      /* number of pixels in a line  */
+  gint               first_line;
+  gint               n_lines;
+
+  /*  per-thread scratch space, allocated once per pass  */
+  gdouble           *val_p;
+  gdouble           *val_m;
+  gint              *rle;
+  gint              *pix;
+} GaussWorker;
+
+
+static void
+iir_line (const GaussKernel *k,
+          const guchar      *src,
+          guchar            *dest,
+          gdouble           *val_p,
+          gdouble           *val_m,
+          gint               len)
+{
+  const gint    bytes = k->bytes;
+  const guchar *sp_p, *sp_m;
+  gdouble      *vp, *vm;
+  gint          initial_p[4];
+  gint          initial_m[4];
+  gint          i, j, b, pos;
+
+  memset (val_p, 0, len * bytes * sizeof (gdouble));
+  memset (val_m, 0, len * bytes * sizeof (gdouble));
+
+  sp_p = src;
+  sp_m = src + (len - 1) * bytes;
+  vp = val_p;
+  vm = val_m + (len - 1) * bytes;
+
+  /*  Set up the first vals  */
+  for (i = 0; i < bytes; i++)
+    {
+      initial_p[i] = sp_p[i];
+      initial_m[i] = sp_m[i];
+    }
+
+  for (pos = 0; pos < len; pos++)
+    {
+      gdouble *vpptr, *vmptr;
+      gint     terms = (pos < 4) ? pos : 4;
+
+      for (b = 0; b < bytes; b++)
+        {
+          vpptr = vp + b; vmptr = vm + b;
+
+          for (i = 0; i <= terms; i++)
+            {
+              *vpptr += k->n_p[i] * sp_p[(-i * bytes) + b] -
+                k->d_p[i] * vp[(-i * bytes) + b];
+              *vmptr += k->n_m[i] * sp_m[(i * bytes) + b] -
+                k->d_m[i] * vm[(i * bytes) + b];
+            }
+          for (j = i; j <= 4; j++)
+            {
+              *vpptr += (k->n_p[j] - k->bd_p[j]) * initial_p[b];
+              *vmptr += (k->n_m[j] - k->bd_m[j]) * initial_m[b];
+            }
+        }
+
+      sp_p += bytes;
+      sp_m -= bytes;
+      vp += bytes;
+      vm -= bytes;
+    }
+
+  transfer_pixels (val_p, val_m, dest, bytes, len);
+}
+
+static void
+rle_line (const GaussKernel *k,
+          const guchar      *src,
+          guchar            *dest,
+          gint              *rle,
+          gint              *pix,
+          gint               len)
+{
+  gint b;
+
+  for (b = 0; b < k->bytes; b++)
+    {
+      gint same = run_length_encode (src + b, rle, pix, k->bytes,
+                                     len, k->length, TRUE);
+
+      if (same > (3 * len) / 4)
+        {
+          /* encoded_rle is only fastest if there are a lot of
+           * repeating pixels
+           */
+          do_encoded_lre (rle, pix, dest + b, len, k->length, k->bytes,
+                          k->curve, k->total, k->sum);
+        }
+      else
+        {
+          /* else a full but more simple algorithm is better */
+          do_full_lre (pix, dest + b, len, k->length, k->bytes,
+                       k->curve, k->total);
+        }
+    }
+}
+
+static gpointer
+gauss_worker_run (gpointer data)
+{
+  GaussWorker       *w     = data;
+  const GaussKernel *k     = w->kernel;
+  const gint         bytes = k->bytes;
+  gint               line;
+
+  /*  Both line kernels read their input completely before they write
+   *  the corresponding output, so the lines are blurred in place.
+   */
+  for (line = w->first_line; line < w->first_line + w->n_lines; line++)
+    {
+      guchar *p = w->buf + line * w->line_stride;
+
+      if (k->has_alpha)
+        multiply_alpha (p, w->line_len, bytes);
+
+      if (k->method == BLUR_IIR)
+        iir_line (k, p, p, w->val_p, w->val_m, w->line_len);
+      else
+        rle_line (k, p, p, w->rle, w->pix, w->line_len);
+
+      if (k->has_alpha)
+        separate_alpha (p, w->line_len, bytes);
+    }
+
+  return NULL;
+}
+
+/*  Process 'n_lines' lines of a band, split between 'n_workers' threads.
+ *  The calling thread takes the first share itself.
+ */
+static void
+gauss_process_band (GaussWorker *workers,
+                    gint         n_workers,
+                    guchar      *buf,
+                    gint         line_stride,
+                    gint         n_lines)
+{
+  GThread *threads[THREADS_MAX];
+  gint     n_used = MIN (n_workers, n_lines);
+  gint     i;
+
+  for (i = 0; i < n_used; i++)
+    {
+      GaussWorker *w = &workers[i];
+
+      w->buf         = buf;
+      w->line_stride = line_stride;
+      w->first_line  = (n_lines * i) / n_used;
+      w->n_lines     = (n_lines * (i + 1)) / n_used - w->first_line;
+    }
+
+  for (i = 1; i < n_used; i++)
+    {
+      threads[i] = g_thread_create (gauss_worker_run, &workers[i], TRUE, NULL);
+
+      /*  if we can't get a thread, do the work ourselves  */
+      if (! threads[i])
+        gauss_worker_run (&workers[i]);
+    }
+
+  gauss_worker_run (&workers[0]);
+
+  for (i = 1; i < n_used; i++)
+    if (threads[i])
+      g_thread_join (threads[i]);
+}
+
+static GaussWorker *
+gauss_workers_new (const GaussKernel *kernel,
+                   gint               n_workers,
+                   gint               line_len)
+{
+  GaussWorker *workers = g_new0 (GaussWorker, n_workers);
+  gint         i;
+
+  for (i = 0; i < n_workers; i++)
+    {
+      GaussWorker *w = &workers[i];
+
+      w->kernel   = kernel;
+      w->line_len = line_len;
+
+      if (kernel->method == BLUR_IIR)
+        {
+          w->val_p = g_new (gdouble, line_len * kernel->bytes);
+          w->val_m = g_new (gdouble, line_len * kernel->bytes);
+        }
+      else
+        {
+          /* rle[] and pix[] extend from -length to line_len+length-1 */
+          w->rle = g_new (gint, line_len + 2 * kernel->length) + kernel->length;
+          w->pix = g_new (gint, line_len + 2 * kernel->length) + kernel->length;
+        }
+    }
+
+  return workers;
+}
+
+static void
+gauss_workers_free (GaussWorker *workers,
+                    gint         n_workers)
+{
+  gint i;
+
+  for (i = 0; i < n_workers; i++)
+    {
+      GaussWorker *w = &workers[i];
+
+      g_free (w->val_p);
+      g_free (w->val_m);
+
+      if (w->rle)
+        {
+          g_free (w->rle - w->kernel->length);
+          g_free (w->pix - w->kernel->length);
+        }
+    }
+
+  g_free (workers);
+}
+
+/*  The vertical pass reads a band of full-height columns from
+ *  'src_rgn', blurs each column and writes the band either to
+ *  'dest_rgn' or into the preview buffer.  Bands are aligned to the
+ *  tile grid and transposed on the way in and out, so every tile is
+ *  fetched once and the line kernels run on contiguous memory just
+ *  like in the horizontal pass.
+ */
+static void
+gauss_vertical_pass (const GaussKernel *kernel,
+                     GimpPixelRgn      *src_rgn,
+                     GimpPixelRgn      *dest_rgn,
+                     guchar            *preview_buffer,
+                     gint               x1,
+                     gint               y1,
+                     gint               width,
+                     gint               height,
+                     gint               n_threads,
+                     gdouble           *progress,
+                     gdouble            progress_weight,
+                     gdouble            max_progress)
+{
+  GaussWorker *workers;
+  guchar      *band;
+  guchar      *tile_buf;
+  const gint   bytes      = kernel->bytes;
+  const gint   tile_width = gimp_tile_width ();
+  gint         col;
+
+  workers  = gauss_workers_new (kernel, n_threads, height);
+  band     = g_new (guchar, tile_width * n_threads * height * bytes);
+  tile_buf = g_new (guchar, tile_width * gimp_tile_height () * bytes);
+
+  for (col = 0; col < width; )
+    {
+      gint x  = col + x1;
+      gint bw = MIN ((x / tile_width + n_threads) * tile_width,
+                     x1 + width) - x;
+
+      bands_transfer (src_rgn, band, tile_buf,
+                      x, y1, bw, height, bytes, FALSE);
+
+      gauss_process_band (workers, n_threads,
+                          band, height * bytes, bw);
+
+      if (! preview_buffer)
+        {
+          bands_transfer (dest_rgn, band, tile_buf,
+                          x, y1, bw, height, bytes, TRUE);
+
+          *progress += bw * height * progress_weight;
+          gimp_progress_update (*progress / max_progress);
+        }
+      else
+        {
+          bands_transpose (band, height * bytes,
+                           preview_buffer + col * bytes, width * bytes,
+                           height, bw, bytes);
+        }
+
+      col += bw;
+    }
+
+  g_free (tile_buf);
+  g_free (band);
+  gauss_workers_free (workers, n_threads);
+}
+
+/*  The horizontal pass works on bands of full-width rows, aligned to
+ *  the tile grid.  For the preview it operates in place on the preview
+ *  buffer.
+ */
+static void
+gauss_horizontal_pass (const GaussKernel *kernel,
+                       GimpPixelRgn      *src_rgn,
+                       GimpPixelRgn      *dest_rgn,
+                       guchar            *preview_buffer,
+                       gint               x1,
+                       gint               y1,
+                       gint               width,
+                       gint               height,
+                       gint               n_threads,
+                       gdouble           *progress,
+                       gdouble            progress_weight,
+                       gdouble            max_progress)
+{
+  GaussWorker *workers;
+  guchar      *band        = NULL;
+  const gint   bytes       = kernel->bytes;
+  const gint   tile_height = gimp_tile_height ();
+  gint         row, bh;
+
+  workers = gauss_workers_new (kernel, n_threads, width);
+
+  if (! preview_buffer)
+    band = g_new (guchar, width * tile_height * n_threads * bytes);
+
+  for (row = 0; row < height; row += bh)
+    {
+      gint y = row + y1;
+
+      bh = MIN ((y / tile_height + n_threads) * tile_height, y1 + height) - y;
+
+      if (! preview_buffer)
+        {
+          gimp_pixel_rgn_get_rect (src_rgn, band, x1, row + y1, width, bh);
+
+          gauss_process_band (workers, n_threads,
+                              band, width * bytes, bh);
+
+          gimp_pixel_rgn_set_rect (dest_rgn, band, x1, row + y1, width, bh);
+
+          *progress += width * bh * progress_weight;
+          gimp_progress_update (*progress / max_progress);
+        }
+      else
+        {
+          gauss_process_band (workers, n_threads,
+                              preview_buffer + row * width * bytes,
+                              width * bytes, bh);
+        }
+    }
+
+  g_free (band);
+  gauss_workers_free (workers, n_threads);
+}
+
 static void
 gauss_iir (GimpDrawable *drawable,
            gdouble       horz,
@@ -882,36 +1279,19 @@ gauss_iir (GimpDrawable *drawable,
            gint          height)
 {
   GimpPixelRgn  src_rgn, dest_rgn;
-  gint          bytes;
-  gint          has_alpha;
-  guchar       *dest;
-  guchar       *src,  *sp_p, *sp_m;
-  gdouble       n_p[5], n_m[5];
-  gdouble       d_p[5], d_m[5];
-  gdouble       bd_p[5], bd_m[5];
-  gdouble      *val_p = NULL;
-  gdouble      *val_m = NULL;
-  gdouble      *vp, *vm;
-  gint          i, j;
-  gint          row, col, b;
-  gint          terms;
+  GaussKernel   kernel = { 0, };
   gdouble       progress, max_progress;
-  gint          initial_p[4];
-  gint          initial_m[4];
   gdouble       std_dev;
+  gint          n_threads;
   gboolean      direct;
-  gint          progress_step;
 
   direct = (preview_buffer == NULL);
 
-  bytes = drawable->bpp;
-  has_alpha = gimp_drawable_has_alpha (drawable->drawable_id);
-
-  val_p = g_new (gdouble, MAX (width, height) * bytes);
-  val_m = g_new (gdouble, MAX (width, height) * bytes);
+  kernel.method    = BLUR_IIR;
+  kernel.bytes     = drawable->bpp;
+  kernel.has_alpha = gimp_drawable_has_alpha (drawable->drawable_id);
 
-  src =  g_new (guchar, MAX (width, height) * bytes);
-  dest = g_new (guchar, MAX (width, height) * bytes);
+  n_threads = threads_get_count ();
 
   gimp_pixel_rgn_init (&src_rgn,
                        drawable, 0, 0, drawable->width, drawable->height,
@@ -935,92 +1315,16 @@ gauss_iir (GimpDrawable *drawable,
       vert = fabs (vert) + 1.0;
       std_dev = sqrt (-(vert * vert) / (2 * log (1.0 / 255.0)));
 
-      /* We do not want too many progress updates because they
-       * can slow down the processing significantly for very
-       * large images
-       */
-      progress_step = width / 16;
-
-      if (progress_step < 5)
-        progress_step = 5;
-
       /*  derive the constants for calculating the gaussian
        *  from the std dev
        */
+      find_iir_constants (kernel.n_p, kernel.n_m,
+                          kernel.d_p, kernel.d_m,
+                          kernel.bd_p, kernel.bd_m, std_dev);
 
-      find_iir_constants (n_p, n_m, d_p, d_m, bd_p, bd_m, std_dev);
-
-      for (col = 0; col < width; col++)
-        {
-          memset (val_p, 0, height * bytes * sizeof (gdouble));
-          memset (val_m, 0, height * bytes * sizeof (gdouble));
-
-          gimp_pixel_rgn_get_col (&src_rgn, src, col + x1, y1, height);
-
-          if (has_alpha)
-            multiply_alpha (src, height, bytes);
-
-          sp_p = src;
-          sp_m = src + (height - 1) * bytes;
-          vp = val_p;
-          vm = val_m + (height - 1) * bytes;
-
-          /*  Set up the first vals  */
-          for (i = 0; i < bytes; i++)
-            {
-              initial_p[i] = sp_p[i];
-              initial_m[i] = sp_m[i];
-            }
-
-          for (row = 0; row < height; row++)
-            {
-              gdouble *vpptr, *vmptr;
-              terms = (row < 4) ? row : 4;
-
-              for (b = 0; b < bytes; b++)
-                {
-                  vpptr = vp + b; vmptr = vm + b;
-                  for (i = 0; i <= terms; i++)
-                    {
-                      *vpptr += n_p[i] * sp_p[(-i * bytes) + b] - d_p[i] * vp[(-i * bytes) + b];
-                      *vmptr += n_m[i] * sp_m[(i * bytes) + b] - d_m[i] * vm[(i * bytes) + b];
-                    }
-                  for (j = i; j <= 4; j++)
-                    {
-                      *vpptr += (n_p[j] - bd_p[j]) * initial_p[b];
-                      *vmptr += (n_m[j] - bd_m[j]) * initial_m[b];
-                    }
-                }
-
-              sp_p += bytes;
-              sp_m -= bytes;
-              vp += bytes;
-              vm -= bytes;
-            }
-
-          transfer_pixels (val_p, val_m, dest, bytes, height);
-
-
-          if (has_alpha)
-            separate_alpha (dest, height, bytes);
-
-          if (direct)
-            {
-              gimp_pixel_rgn_set_col(&dest_rgn, dest, col + x1, y1, height);
-
-              progress += height * vert;
-
-              if ((col % progress_step) == 0)
-                gimp_progress_update (progress / max_progress);
-            }
-          else
-            {
-              for (row = 0; row < height; row++)
-                memcpy (preview_buffer + (row * width + col) * bytes,
-                        dest + row * bytes,
-                        bytes);
-            }
-        }
+      gauss_vertical_pass (&kernel, &src_rgn, &dest_rgn, preview_buffer,
+                           x1, y1, width, height, n_threads,
+                           &progress, vert, max_progress);
 
       /*  prepare for the horizontal pass  */
       gimp_pixel_rgn_init (&src_rgn,
@@ -1040,16 +1344,6 @@ gauss_iir (GimpDrawable *drawable,
   /*  Now the horizontal pass  */
   if (horz > 0.0)
     {
-
-      /* We do not want too many progress updates because they
-       * can slow down the processing significantly for very
-       * large images
-       */
-      progress_step = height / 16;
-
-      if (progress_step < 5)
-        progress_step = 5;
-
       horz = fabs (horz) + 1.0;
 
       if (horz != vert)
@@ -1059,105 +1353,15 @@ gauss_iir (GimpDrawable *drawable,
           /*  derive the constants for calculating the gaussian
            *  from the std dev
            */
-          find_iir_constants (n_p, n_m, d_p, d_m, bd_p, bd_m, std_dev);
-
+          find_iir_constants (kernel.n_p, kernel.n_m,
+                              kernel.d_p, kernel.d_m,
+                              kernel.bd_p, kernel.bd_m, std_dev);
         }
 
-
-      for (row = 0; row < height; row++)
-        {
-
-          memset (val_p, 0, width * bytes * sizeof (gdouble));
-          memset (val_m, 0, width * bytes * sizeof (gdouble));
-
-          if (direct)
-            {
-              gimp_pixel_rgn_get_row (&src_rgn, src, x1, row + y1, width);
-            }
-          else
-            {
-              memcpy (src,
-                      preview_buffer + row * width * bytes,
-                      width * bytes);
-            }
-
-
-          if (has_alpha)
-            multiply_alpha (src, width, bytes);
-
-
-          sp_p = src;
-          sp_m = src + (width - 1) * bytes;
-          vp = val_p;
-          vm = val_m + (width - 1) * bytes;
-
-          /*  Set up the first vals  */
-          for (i = 0; i < bytes; i++)
-            {
-              initial_p[i] = sp_p[i];
-              initial_m[i] = sp_m[i];
-            }
-
-          for (col = 0; col < width; col++)
-            {
-              gdouble *vpptr, *vmptr;
-
-              terms = (col < 4) ? col : 4;
-
-              for (b = 0; b < bytes; b++)
-                {
-                  vpptr = vp + b; vmptr = vm + b;
-
-                  for (i = 0; i <= terms; i++)
-                    {
-                      *vpptr += n_p[i] * sp_p[(-i * bytes) + b] -
-                        d_p[i] * vp[(-i * bytes) + b];
-                      *vmptr += n_m[i] * sp_m[(i * bytes) + b] -
-                        d_m[i] * vm[(i * bytes) + b];
-                    }
-                  for (j = i; j <= 4; j++)
-                    {
-                      *vpptr += (n_p[j] - bd_p[j]) * initial_p[b];
-                      *vmptr += (n_m[j] - bd_m[j]) * initial_m[b];
-                    }
-                }
-
-              sp_p += bytes;
-              sp_m -= bytes;
-              vp += bytes;
-              vm -= bytes;
-            }
-
-          transfer_pixels (val_p, val_m, dest, bytes, width);
-
-          if (has_alpha)
-            separate_alpha (dest, width, bytes);
-
-          if (direct)
-            {
-              gimp_pixel_rgn_set_row (&dest_rgn, dest, x1, row + y1, width);
-
-              progress += width * horz;
-
-              if ((row % progress_step) == 0)
-                gimp_progress_update (progress / max_progress);
-            }
-          else
-            {
-              memcpy (preview_buffer + row * width * bytes,
-                      dest,
-                      width * bytes);
-            }
-        }
+      gauss_horizontal_pass (&kernel, &src_rgn, &dest_rgn, preview_buffer,
+                             x1, y1, width, height, n_threads,
+                             &progress, horz, max_progress);
     }
-
-  /*  free up buffers  */
-
-  g_free (val_p);
-  g_free (val_m);
-
-  g_free (src);
-  g_free (dest);
 }
 
 
@@ -1173,27 +1377,20 @@ gauss_rle (GimpDrawable *drawable,
            gint          height)
 {
   GimpPixelRgn  src_rgn, dest_rgn;
-  gint          bytes;
-  gboolean      has_alpha;
-  guchar       *dest;
-  guchar       *src;
-  gint          row, col, b;
+  GaussKernel   kernel = { 0, };
   gdouble       progress, max_progress;
   gdouble       std_dev;
-  gint          total = 1;
-  gint         *curve = NULL;
-  gint         *sum   = NULL;
-  gint          length;
+  gint          n_threads;
   gboolean      direct;
-  gint          progress_step;
 
   direct = (preview_buffer == NULL);
 
-  bytes = drawable->bpp;
-  has_alpha = gimp_drawable_has_alpha (drawable->drawable_id);
+  kernel.method    = BLUR_RLE;
+  kernel.bytes     = drawable->bpp;
+  kernel.has_alpha = gimp_drawable_has_alpha (drawable->drawable_id);
+  kernel.total     = 1;
 
-  src  = g_new (guchar, MAX (width, height) * bytes);
-  dest = g_new (guchar, MAX (width, height) * bytes);
+  n_threads = threads_get_count ();
 
   gimp_pixel_rgn_init (&src_rgn,
                        drawable, 0, 0, drawable->width, drawable->height,
@@ -1212,82 +1409,16 @@ gauss_rle (GimpDrawable *drawable,
   /*  First the vertical pass  */
   if (vert > 0.0)
     {
-      gint   * rle = NULL;
-      gint   * pix = NULL;
-
       vert = fabs (vert) + 1.0;
       std_dev = sqrt (-(vert * vert) / (2 * log (1.0 / 255.0)));
 
-      /* Insure that we do not have too many progress updates for
-       * images with a lot of rows or columns
-       */
-      progress_step = width / 16;
-
-      if (progress_step < 5)
-        progress_step = 5;
-
-      make_rle_curve (std_dev, &curve, &length, &sum, &total);
-
-      rle = g_new (gint, height + 2 * length);
-      rle += length; /* rle[] extends from -length to height+length-1 */
-
-      pix = g_new (gint, height + 2 * length);
-      pix += length; /* pix[] extends from -length to height+length-1 */
-
-      for (col = 0; col < width; col++)
-        {
-
-          gimp_pixel_rgn_get_col (&src_rgn, src, col + x1, y1, height);
-
-          if (has_alpha)
-            multiply_alpha (src, height, bytes);
-
-          for (b = 0; b < bytes; b++)
-            {
-              gint same =  run_length_encode (src + b, rle, pix, bytes,
-                                              height, length, TRUE);
-
-              if (same > (3 * height) / 4)
-                {
-                  /* encoded_rle is only fastest if there are a lot of
-                   * repeating pixels
-                   */
-                  do_encoded_lre (rle, pix, dest + b, height, length, bytes,
-                                  curve, total, sum);
-                }
-              else
-                {
-                  /* else a full but more simple algorithm is better */
-                  do_full_lre (pix, dest + b, height, length, bytes,
-                               curve, total);
-                }
-            }
-
-          if (has_alpha)
-            separate_alpha (dest, height, bytes);
-
-          if (direct)
-            {
-              gimp_pixel_rgn_set_col (&dest_rgn, dest, col + x1, y1, height);
-
-              progress += height * vert;
-
-              if ((col % progress_step) == 0)
-                gimp_progress_update (progress / max_progress);
-            }
-          else
-            {
-              for (row = 0; row < height; row++)
-                memcpy (preview_buffer + (row * width + col) * bytes,
-                        dest + row * bytes,
-                        bytes);
-            }
-
-        }
-
+      make_rle_curve (std_dev,
+                      &kernel.curve, &kernel.length,
+                      &kernel.sum, &kernel.total);
 
-      g_free (rle - length);
-      g_free (pix - length);
+      gauss_vertical_pass (&kernel, &src_rgn, &dest_rgn, preview_buffer,
+                           x1, y1, width, height, n_threads,
+                           &progress, vert, max_progress);
 
       /* prepare for the horizontal pass  */
       gimp_pixel_rgn_init (&src_rgn,
@@ -1303,111 +1434,30 @@ gauss_rle (GimpDrawable *drawable,
   /*  Now the horizontal pass  */
   if (horz > 0.0)
     {
-      gint   * rle = NULL;
-      gint   * pix = NULL;
-
-      /* Insure that we do not have too many progress updates for
-       * images with a lot of rows or columns
-       */
-      progress_step = height / 16;
-
-      if (progress_step < 5) {
-        progress_step = 5;
-      }
-
       horz = fabs (horz) + 1.0;
 
       /* euse the same curve if possible else recompute a new one */
       if (horz != vert)
         {
-
           std_dev = sqrt (-(horz * horz) / (2 * log (1.0 / 255.0)));
 
-          if (curve != NULL) {
-            free_rle_curve(curve, length, sum);
-          }
-
-          make_rle_curve(std_dev, &curve, &length, &sum, &total);
+          if (kernel.curve != NULL)
+            free_rle_curve (kernel.curve, kernel.length, kernel.sum);
 
+          make_rle_curve (std_dev,
+                          &kernel.curve, &kernel.length,
+                          &kernel.sum, &kernel.total);
         }
 
-
-      rle = g_new (gint, width+2*length);
-      rle += length; /* so rle[] extends from -width to width+length-1 */
-
-      pix = g_new (gint, width+2*length);
-      pix += length; /* so pix[] extends from -width to width+length-1 */
-
-      for (row = 0; row < height; row++)
-        {
-          if (direct)
-            {
-              gimp_pixel_rgn_get_row (&src_rgn, src, x1, row + y1, width);
-            }
-          else
-            {
-              memcpy (src,
-                      preview_buffer + row * width * bytes,
-                      width * bytes);
-            }
-
-          if (has_alpha)
-            multiply_alpha (src, width, bytes);
-
-          for (b = 0; b < bytes; b++)
-            {
-              gint same = run_length_encode (src + b, rle, pix, bytes,
-                                             width, length, TRUE);
-
-              if (same > (3 * width) / 4)
-                {
-                  /* encoded_rle is only fastest if there are a lot of
-                   * repeating pixels
-                   */
-                  do_encoded_lre (rle, pix, dest + b, width, length, bytes,
-                                  curve, total, sum);
-                }
-              else
-                {
-                  /* else a full but more simple algorithm is better */
-                  do_full_lre (pix, dest + b, width, length, bytes,
-                               curve, total);
-                }
-            }
-
-
-          if (has_alpha)
-            separate_alpha (dest, width, bytes);
-
-          if (direct)
-            {
-              gimp_pixel_rgn_set_row (&dest_rgn, dest, x1, row + y1, width);
-
-              progress += width * horz;
-
-              if ((row % progress_step) == 0)
-                gimp_progress_update (progress / max_progress);
-            }
-          else
-            {
-              memcpy (preview_buffer + row * width * bytes,
-                      dest,
-                      width * bytes);
-            }
-        }
-
-      g_free (rle - length);
-      g_free (pix - length);
+      gauss_horizontal_pass (&kernel, &src_rgn, &dest_rgn, preview_buffer,
+                             x1, y1, width, height, n_threads,
+                             &progress, horz, max_progress);
     }
 
-  if (curve)
-    free_rle_curve (curve, length, sum);
-
-  g_free (src);
-  g_free (dest);
+  if (kernel.curve)
+    free_rle_curve (kernel.curve, kernel.length, kernel.sum);
 }
 
-
 static void
 gauss (GimpDrawable *drawable,
        gdouble       horz,
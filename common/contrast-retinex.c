@@ -24,8 +24,11 @@
 
 #include "libgimp/stdplugins-intl.h"
 
+#include "threads.h"
+
 
 #define PLUG_IN_PROC        "plug-in-retinex"
+#define PLUG_IN_PROC2       "plug-in-retinex2"
 #define PLUG_IN_BINARY      "contrast-retinex"
 #define PLUG_IN_ROLE        "gimp-contrast-retinex"
 #define MAX_RETINEX_SCALES    8
@@ -33,6 +36,10 @@
 #define MAX_GAUSSIAN_SCALE  250
 #define SCALE_WIDTH         150
 #define ENTRY_WIDTH           4
+#define MAX_PYRAMID_LEVELS    8
+#define PYRAMID_MIN_SIGMA     4.0  /* smallest blur done on a reduced level */
+#define PYRAMID_MIN_SIZE      8    /* smallest reduced level dimension */
+#define BAND_HEIGHT          64
 
 
 typedef struct
@@ -41,6 +48,7 @@ typedef struct
   gint     nscales;
   gint     scales_mode;
   gfloat   cvar;
+  gboolean pyramid;
 } RetinexParams;
 
 typedef enum
@@ -69,6 +77,91 @@ typedef struct
   gdouble b[4];
 } gauss3_coefs;
 
+/*
+ * Work that is split between threads: func is called with consecutive
+ * ranges of at most chunk items out of n_items, and a scratch buffer of
+ * scratch_size floats private to the calling thread.
+ */
+typedef void (* RetinexFunc) (gpointer  data,
+                              gint      start,
+                              gint      end,
+                              gfloat   *scratch);
+
+typedef struct
+{
+  RetinexFunc  func;
+  gpointer     data;
+  gint         n_items;
+  gint         chunk;
+  gint         scratch_size;
+  gboolean     report;          /* update progress from the main thread */
+  gdouble      progress_start;
+  gdouble      progress_end;
+  gint         next;
+  gint         done;
+} RetinexTask;
+
+typedef struct
+{
+  gfloat       *in;
+  gfloat       *out;
+  gint          width;
+  gint          height;
+  gauss3_coefs *coef;
+} RetinexSmooth;
+
+typedef struct
+{
+  const guchar *src;
+  gfloat       *dst;
+  const gfloat *out;
+  gint          width;
+  gint          bytes;
+  gint          channel;
+  gfloat        weight;
+  gdouble       log_src[256];   /* log (v + 1) */
+} RetinexSummary;
+
+/*
+ * State of the pyramid mode, see MSRCR_pyramid().
+ */
+typedef struct
+{
+  const guchar *src;
+  guchar       *dest;
+  gint          width;
+  gint          height;
+  gint          bytes;
+  gint          nscales;
+  gfloat        weight;
+
+  gint          level[MAX_RETINEX_SCALES];
+  gauss3_coefs  coef[MAX_RETINEX_SCALES];    /* full size */
+  gauss3_coefs  coef_x[MAX_RETINEX_SCALES];  /* reduced levels */
+  gauss3_coefs  coef_y[MAX_RETINEX_SCALES];
+  gint          max_level;
+  gint          level_width[MAX_PYRAMID_LEVELS];
+  gint          level_height[MAX_PYRAMID_LEVELS];
+  gint         *level_ix[MAX_PYRAMID_LEVELS];
+  gfloat       *level_fx[MAX_PYRAMID_LEVELS];
+
+  gfloat       *pyramid[3][MAX_PYRAMID_LEVELS];
+  gfloat       *blurred[3][MAX_RETINEX_SCALES];  /* log, reduced scales only */
+
+  gint          margin;         /* extra rows for the full size scales */
+  gint          last_full;      /* last full size scale, or -1 */
+  gint          n_bands;
+  gdouble      *band_sum;
+  gdouble      *band_sum2;
+  gboolean      final_pass;
+  gfloat        mini;
+  gfloat        range;
+
+  gdouble       log_src[256];   /* log (v + 1)             */
+  gdouble       log_alpha[256]; /* log (128 * (v + 1))     */
+  gdouble       log_sum[766];   /* log (r + g + b + 3)     */
+} RetinexPyramid;
+
 
 /*
  * Declare local functions.
@@ -105,7 +198,9 @@ static void     gausssmooth                 (gfloat       *in,
                                              gfloat       *out,
                                              gint          size,
                                              gint          rowtride,
-                                             gauss3_coefs *c);
+                                             gauss3_coefs *c,
+                                             gfloat       *w1,
+                                             gfloat       *w2);
 
 /*
  * MSRCR = MultiScale Retinex with Color Restoration
@@ -115,6 +210,11 @@ static void     MSRCR                       (guchar       *src,
                                              gint          height,
                                              gint          bytes,
                                              gboolean      preview_mode);
+static void     MSRCR_pyramid               (guchar       *src,
+                                             gint          width,
+                                             gint          height,
+                                             gint          bytes,
+                                             gboolean      preview_mode);
 
 
 /*
@@ -125,9 +225,12 @@ static RetinexParams rvals =
   240,             /* Scale */
   3,               /* Scales */
   RETINEX_UNIFORM, /* Echelles reparties uniformement */
-  1.2              /* A voir */
+  1.2,             /* A voir */
+  FALSE            /* Full size filtering */
 };
 
+static gint retinex_n_threads = 1;
+
 static GimpPlugInInfo PLUG_IN_INFO =
 {
   NULL,  /* init_proc  */
@@ -152,6 +255,18 @@ query (void)
     { GIMP_PDB_FLOAT,    "cvar",        "Variance value"                      }
   };
 
+  static const GimpParamDef args2[] =
+  {
+    { GIMP_PDB_INT32,    "run-mode",    "The run mode { RUN-INTERACTIVE (0), RUN-NONINTERACTIVE (1) }"        },
+    { GIMP_PDB_IMAGE,    "image",       "Input image (unused)"                },
+    { GIMP_PDB_DRAWABLE, "drawable",    "Input drawable"                      },
+    { GIMP_PDB_INT32,    "scale",       "Biggest scale value"                 },
+    { GIMP_PDB_INT32,    "nscales",     "Number of scales"                    },
+    { GIMP_PDB_INT32,    "scales-mode", "Retinex distribution through scales" },
+    { GIMP_PDB_FLOAT,    "cvar",        "Variance value"                      },
+    { GIMP_PDB_INT32,    "pyramid",     "Filter the larger scales on reduced copies of the image { FALSE (0), TRUE (1) }" }
+  };
+
   gimp_install_procedure (PLUG_IN_PROC,
                           N_("Enhance contrast using the Retinex method"),
                           "The Retinex Image Enhancement Algorithm is an "
@@ -170,6 +285,21 @@ query (void)
                           args, NULL);
 
   gimp_plugin_menu_register (PLUG_IN_PROC, "<Image>/Colors/Modify");
+
+  gimp_install_procedure (PLUG_IN_PROC2,
+                          "Enhance contrast using the Retinex method",
+                          "Same as plug-in-retinex, with an additional "
+                          "argument to filter the larger scales on reduced "
+                          "copies of the image, which is much faster and "
+                          "gives a close approximation.",
+                          "The GIMP Team",
+                          "The GIMP Team",
+                          "2026",
+                          NULL,
+                          "RGB*",
+                          GIMP_PLUGIN,
+                          G_N_ELEMENTS (args2), 0,
+                          args2, NULL);
 }
 
 static void
@@ -223,7 +353,7 @@ run (const gchar      *name,
 
     case GIMP_RUN_NONINTERACTIVE:
       /*  Make sure all the arguments are there!  */
-      if (nparams != 7)
+      if (nparams != (strcmp (name, PLUG_IN_PROC2) == 0 ? 8 : 7))
         {
           status = GIMP_PDB_CALLING_ERROR;
         }
@@ -233,6 +363,7 @@ run (const gchar      *name,
           rvals.nscales      = (param[4].data.d_int32);
           rvals.scales_mode  = (param[5].data.d_int32);
           rvals.cvar         = (param[6].data.d_float);
+          rvals.pyramid      = (nparams == 8 && param[7].data.d_int32);
         }
       break;
 
@@ -277,6 +408,7 @@ retinex_dialog (GimpDrawable *drawable)
   GtkWidget *preview;
   GtkWidget *table;
   GtkWidget *combo;
+  GtkWidget *toggle;
   GtkObject *adj;
   gboolean   run;
 
@@ -373,6 +505,18 @@ retinex_dialog (GimpDrawable *drawable)
                             G_CALLBACK (gimp_preview_invalidate),
                             preview);
 
+  toggle = gtk_check_button_new_with_mnemonic (_("_Fast approximation"));
+  gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (toggle), rvals.pyramid);
+  gtk_box_pack_start (GTK_BOX (main_vbox), toggle, FALSE, FALSE, 0);
+  gtk_widget_show (toggle);
+
+  g_signal_connect (toggle, "toggled",
+                    G_CALLBACK (gimp_toggle_button_update),
+                    &rvals.pyramid);
+  g_signal_connect_swapped (toggle, "toggled",
+                            G_CALLBACK (gimp_preview_invalidate),
+                            preview);
+
   gtk_widget_show (dialog);
 
   run = (gimp_dialog_run (GIMP_DIALOG (dialog)) == GTK_RESPONSE_OK);
@@ -557,7 +701,8 @@ compute_coefs3 (gauss3_coefs *c, gfloat sigma)
 }
 
 static void
-gausssmooth (gfloat *in, gfloat *out, gint size, gint rowstride, gauss3_coefs *c)
+gausssmooth (gfloat *in, gfloat *out, gint size, gint rowstride, gauss3_coefs *c,
+             gfloat *w1, gfloat *w2)
 {
   /*
    * Papers:  "Recursive Implementation of the gaussian filter.",
@@ -565,15 +710,13 @@ gausssmooth (gfloat *in, gfloat *out, gint size, gint rowstride, gauss3_coefs *c
    * formula: 9a        forward filter
    *          9b        backward filter
    *          fig7      algorithm
+   *
+   * w1 and w2 are scratch buffers of at least size + 3 values.
    */
-  gint i,n, bufsize;
-  gfloat *w1,*w2;
+  gint i,n;
 
   /* forward pass */
-  bufsize = size+3;
   size -= 1;
-  w1 = (gfloat *) g_try_malloc (bufsize * sizeof (gfloat));
-  w2 = (gfloat *) g_try_malloc (bufsize * sizeof (gfloat));
   w1[0] = in[0];
   w1[1] = in[0];
   w1[2] = in[0];
@@ -596,9 +739,121 @@ gausssmooth (gfloat *in, gfloat *out, gint size, gint rowstride, gauss3_coefs *c
                                              c->b[2]*w2[n+2] +
                                              c->b[3]*w2[n+3] ) / c->b[0]));
     }
+}
+
+static void
+retinex_task_process (RetinexTask *task,
+                      gboolean     report)
+{
+  gfloat *scratch = NULL;
+  gint    start;
+
+  if (task->scratch_size)
+    scratch = g_new (gfloat, task->scratch_size);
+
+  while ((start = g_atomic_int_add (&task->next, task->chunk)) < task->n_items)
+    {
+      gint end = MIN (start + task->chunk, task->n_items);
+
+      task->func (task->data, start, end, scratch);
+
+      g_atomic_int_add (&task->done, end - start);
+
+      if (report)
+        gimp_progress_update (task->progress_start +
+                              (task->progress_end - task->progress_start) *
+                              g_atomic_int_get (&task->done) / task->n_items);
+    }
+
+  g_free (scratch);
+}
+
+static gpointer
+retinex_task_thread (gpointer data)
+{
+  retinex_task_process (data, FALSE);
+
+  return NULL;
+}
+
+/*
+ * Run a task on up to retinex_n_threads threads, the calling (main)
+ * thread included.  Only the main thread reports progress.
+ */
+static void
+retinex_parallel (RetinexTask *task)
+{
+  GThread *threads[THREADS_MAX];
+  gint     n_threads;
+  gint     i;
+
+  task->next = 0;
+  task->done = 0;
+
+  n_threads = MIN (retinex_n_threads,
+                   (task->n_items + task->chunk - 1) / task->chunk);
+
+  for (i = 1; i < n_threads; i++)
+    threads[i] = g_thread_create (retinex_task_thread, task, TRUE, NULL);
+
+  retinex_task_process (task, task->report);
+
+  for (i = 1; i < n_threads; i++)
+    if (threads[i])
+      g_thread_join (threads[i]);
+}
+
+static void
+smooth_rows (gpointer  data,
+             gint      start,
+             gint      end,
+             gfloat   *scratch)
+{
+  RetinexSmooth *smooth = data;
+  gint           row;
+
+  for (row = start; row < end; row++)
+    {
+      gint pos = row * smooth->width;
+
+      gausssmooth (smooth->in + pos, smooth->out + pos,
+                   smooth->width, 1, smooth->coef,
+                   scratch, scratch + smooth->width + 3);
+    }
+}
+
+static void
+smooth_columns (gpointer  data,
+                gint      start,
+                gint      end,
+                gfloat   *scratch)
+{
+  RetinexSmooth *smooth = data;
+  gint           col;
+
+  for (col = start; col < end; col++)
+    {
+      gausssmooth (smooth->in + col, smooth->out + col,
+                   smooth->height, smooth->width, smooth->coef,
+                   scratch, scratch + smooth->height + 3);
+    }
+}
+
+static void
+summarize_rows (gpointer  data,
+                gint      start,
+                gint      end,
+                gfloat   *scratch)
+{
+  RetinexSummary *summary = data;
+  gint            i   = start * summary->width;
+  gint            pos = i * summary->bytes + summary->channel;
 
-  g_free (w1);
-  g_free (w2);
+  for (; i < end * summary->width; i++, pos += summary->bytes)
+    {
+      summary->dst[pos] += summary->weight * (summary->log_src[summary->src[pos]] -
+                                              log (summary->out[i]));
+    }
 }
 
 /*
@@ -610,7 +865,7 @@ static void
 MSRCR (guchar *src, gint width, gint height, gint bytes, gboolean preview_mode)
 {
 
-  gint          scale,row,col;
+  gint          scale;
   gint          i,j;
   gint          size;
   gint          channel;
@@ -627,6 +882,11 @@ MSRCR (guchar *src, gint width, gint height, gint bytes, gboolean preview_mode)
   gfloat        gain;
   gfloat        offset;
   gdouble       max_preview = 0.0;
+  RetinexTask   task    = { 0, };
+  RetinexSmooth smooth;
+  RetinexSummary summary;
+
+  retinex_n_threads = threads_get_count ();
 
   if (!preview_mode)
     {
@@ -634,6 +894,20 @@ MSRCR (guchar *src, gint width, gint height, gint bytes, gboolean preview_mode)
       max_preview = 3 * rvals.nscales;
     }
 
+  /*
+     Calculate the scales of filtering according to the
+     number of filter and their distribution.
+   */
+
+  retinex_scales_distribution (RetinexScales,
+                               rvals.nscales, rvals.scales_mode, rvals.scale);
+
+  if (rvals.pyramid)
+    {
+      MSRCR_pyramid (src, width, height, bytes, preview_mode);
+      return;
+    }
+
   /* Allocate all the memory needed for algorithm*/
   size = width * height * bytes;
   dst = g_try_malloc (size * sizeof (gfloat));
@@ -662,15 +936,6 @@ MSRCR (guchar *src, gint width, gint height, gint bytes, gboolean preview_mode)
       return; /* do some clever stuff */
     }
 
-
-  /*
-     Calculate the scales of filtering according to the
-     number of filter and their distribution.
-   */
-
-  retinex_scales_distribution (RetinexScales,
-                               rvals.nscales, rvals.scales_mode, rvals.scale);
-
   /*
       Filtering according to the various scales.
       Summerize the results of the various filters according to a
@@ -678,6 +943,25 @@ MSRCR (guchar *src, gint width, gint height, gint bytes, gboolean preview_mode)
   */
   weight = 1./ (gfloat) rvals.nscales;
 
+  smooth.in     = in;
+  smooth.out    = out;
+  smooth.width  = width;
+  smooth.height = height;
+  smooth.coef   = &coef;
+
+  summary.src    = src;
+  summary.dst    = dst;
+  summary.out    = out;
+  summary.width  = width;
+  summary.bytes  = bytes;
+  summary.weight = weight;
+
+  for (i = 0; i < 256; i++)
+    summary.log_src[i] = log (i + 1.);
+
+  task.chunk        = 16;
+  task.scratch_size = 2 * (MAX (width, height) + 3);
+
   /*
     The recursive filtering algorithm needs different coefficients according
     to the selected scale (~ = standard deviation of Gaussian).
@@ -699,11 +983,10 @@ MSRCR (guchar *src, gint width, gint height, gint bytes, gboolean preview_mode)
            *
            *  Filter rows first
            */
-          for (row=0 ;row < height; row++)
-            {
-              pos =  row * width;
-              gausssmooth (in + pos, out + pos, width, 1, &coef);
-            }
+          task.func    = smooth_rows;
+          task.data    = &smooth;
+          task.n_items = height;
+          retinex_parallel (&task);
 
           memcpy(in,  out, channelsize * sizeof(gfloat));
           memset(out, 0  , channelsize * sizeof(gfloat));
@@ -713,20 +996,20 @@ MSRCR (guchar *src, gint width, gint height, gint bytes, gboolean preview_mode)
            *
            *  Second columns
            */
-          for (col=0; col < width; col++)
-            {
-              pos = col;
-              gausssmooth(in + pos, out + pos, height, width, &coef);
-            }
+          task.func    = smooth_columns;
+          task.n_items = width;
+          retinex_parallel (&task);
 
           /*
              Summarize the filtered values.
              In fact one calculates a ratio between the original values and the filtered values.
            */
-          for (i = 0, pos = channel; i < channelsize; i++, pos += bytes)
-            {
-              dst[pos] += weight * (log (src[pos] + 1.) - log (out[i]));
-            }
+          summary.channel = channel;
+
+          task.func    = summarize_rows;
+          task.data    = &summary;
+          task.n_items = height;
+          retinex_parallel (&task);
 
            if (!preview_mode)
              gimp_progress_update ((channel * rvals.nscales + scale) /
@@ -794,6 +1077,537 @@ MSRCR (guchar *src, gint width, gint height, gint bytes, gboolean preview_mode)
   g_free (dst);
 }
 
+/*
+ * Pyramid mode.
+ *
+ * The full size algorithm above filters each scale over the whole image
+ * and keeps several float copies of it.  Here every scale whose sigma is
+ * at least twice PYRAMID_MIN_SIGMA is filtered on a copy of the image
+ * reduced by 2x2 averaging as often as that allows, and the log of the
+ * result is interpolated back to full size.  Only the smaller scales are
+ * filtered at full size, band by band, with enough extra rows around
+ * each band for the filter to settle.  The final values are computed
+ * twice, band by band, once for their mean and variance and once for
+ * the output, so no full size float buffer is needed.
+ *
+ * Note that the full size code filters each scale's rows on top of the
+ * previous scales' row filtering, while the columns only get the
+ * scale's own sigma.  The bands repeat that row filtering as it is;
+ * the reduced levels use one row filter with the combined spread of
+ * all the scales so far.
+ */
+
+static void
+pyramid_build (gpointer  data,
+               gint      start,
+               gint      end,
+               gfloat   *scratch)
+{
+  RetinexPyramid *p = data;
+  gint            c, level;
+
+  for (c = start; c < end; c++)
+    {
+      for (level = 1; level <= p->max_level; level++)
+        {
+          gint    pw   = p->level_width[level - 1];
+          gint    ph   = p->level_height[level - 1];
+          gint    w    = p->level_width[level];
+          gint    h    = p->level_height[level];
+          gfloat *dest = g_new (gfloat, w * h);
+          gint    x, y;
+
+          for (y = 0; y < h; y++)
+            {
+              gint y0 = 2 * y;
+              gint y1 = MIN (2 * y + 1, ph - 1);
+
+              for (x = 0; x < w; x++)
+                {
+                  gint x0 = 2 * x;
+                  gint x1 = MIN (2 * x + 1, pw - 1);
+
+                  if (level == 1)
+                    {
+                      const guchar *src = p->src + c;
+                      const gint    b   = p->bytes;
+
+                      /* 0-255 => 1-256 */
+                      dest[y * w + x] = 0.25 * (src[(y0 * pw + x0) * b] +
+                                                src[(y0 * pw + x1) * b] +
+                                                src[(y1 * pw + x0) * b] +
+                                                src[(y1 * pw + x1) * b]) + 1.0;
+                    }
+                  else
+                    {
+                      const gfloat *src = p->pyramid[c][level - 1];
+
+                      dest[y * w + x] = 0.25 * (src[y0 * pw + x0] +
+                                                src[y0 * pw + x1] +
+                                                src[y1 * pw + x0] +
+                                                src[y1 * pw + x1]);
+                    }
+                }
+            }
+
+          p->pyramid[c][level] = dest;
+        }
+    }
+}
+
+static void
+pyramid_blur (gpointer  data,
+              gint      start,
+              gint      end,
+              gfloat   *scratch)
+{
+  RetinexPyramid *p = data;
+  gint            t;
+
+  for (t = start; t < end; t++)
+    {
+      gint    c     = t / p->nscales;
+      gint    scale = t % p->nscales;
+      gint    level = p->level[scale];
+      gint    w, h;
+      gfloat *tmp;
+      gfloat *out;
+      gint    i;
+
+      if (level == 0)
+        continue;
+
+      w   = p->level_width[level];
+      h   = p->level_height[level];
+      tmp = g_new (gfloat, w * h);
+      out = g_new (gfloat, w * h);
+
+      for (i = 0; i < h; i++)
+        gausssmooth (p->pyramid[c][level] + i * w, tmp + i * w, w, 1,
+                     &p->coef_x[scale], scratch, scratch + w + 3);
+
+      for (i = 0; i < w; i++)
+        gausssmooth (tmp + i, out + i, h, w,
+                     &p->coef_y[scale], scratch, scratch + h + 3);
+
+      for (i = 0; i < w * h; i++)
+        out[i] = log (out[i]);
+
+      g_free (tmp);
+
+      p->blurred[c][scale] = out;
+    }
+}
+
+/*
+ * Add the bilinear interpolation of a reduced level to the rows y1 to
+ * y2 - 1 of acc.
+ */
+static void
+pyramid_add_level (RetinexPyramid *p,
+                   const gfloat   *plane,
+                   gint            level,
+                   gfloat         *acc,
+                   gint            y1,
+                   gint            y2)
+{
+  const gint    w      = p->level_width[level];
+  const gint    h      = p->level_height[level];
+  const gint   *ix     = p->level_ix[level];
+  const gfloat *fx     = p->level_fx[level];
+  const gfloat  factor = 1 << level;
+  gint          x, y;
+
+  for (y = y1; y < y2; y++, acc += p->width)
+    {
+      gfloat        v   = CLAMP ((y + 0.5) / factor - 0.5, 0, h - 1);
+      gint          iy  = (gint) v;
+      gfloat        fy  = v - iy;
+      const gfloat *top = plane + iy * w;
+      const gfloat *bot = plane + MIN (iy + 1, h - 1) * w;
+
+      for (x = 0; x < p->width; x++)
+        {
+          gint   x0 = ix[x];
+          gint   x1 = MIN (x0 + 1, w - 1);
+          gfloat t  = top[x0] + fx[x] * (top[x1] - top[x0]);
+          gfloat b  = bot[x0] + fx[x] * (bot[x1] - bot[x0]);
+
+          acc[x] += t + fy * (b - t);
+        }
+    }
+}
+
+static void
+pyramid_bands (gpointer  data,
+               gint      start,
+               gint      end,
+               gfloat   *scratch)
+{
+  RetinexPyramid *p        = data;
+  const gint      width    = p->width;
+  const gint      bytes    = p->bytes;
+  const gint      rows_max = BAND_HEIGHT + 2 * p->margin;
+  gfloat         *in_buf   = scratch;
+  gfloat         *tmp_buf  = in_buf  + width * rows_max;
+  gfloat         *out      = tmp_buf + width * rows_max;
+  gfloat         *acc      = out     + width * rows_max;
+  gfloat         *w1       = acc + width * BAND_HEIGHT;
+  gfloat         *w2       = w1  + MAX (width, rows_max) + 3;
+  gint            band;
+
+  for (band = start; band < end; band++)
+    {
+      const gint y1   = band * BAND_HEIGHT;
+      const gint y2   = MIN (y1 + BAND_HEIGHT, p->height);
+      const gint m1   = MAX (y1 - p->margin, 0);
+      const gint m2   = MIN (y2 + p->margin, p->height);
+      const gint rows = m2 - m1;
+      gdouble    sum  = 0.0;
+      gdouble    sum2 = 0.0;
+      gint       c, scale, x, y;
+
+      for (c = 0; c < 3; c++)
+        {
+          gfloat *in  = in_buf;
+          gfloat *tmp = tmp_buf;
+
+          memset (acc, 0, width * (y2 - y1) * sizeof (gfloat));
+
+          if (p->margin > 0)
+            {
+              for (y = m1; y < m2; y++)
+                for (x = 0; x < width; x++)
+                  in[(y - m1) * width + x] =
+                    p->src[(y * width + x) * bytes + c] + 1.0;
+            }
+
+          for (scale = 0; scale < p->nscales; scale++)
+            {
+              /*  the rows are filtered by every scale in turn, like in
+               *  the full size code, as long as a full size scale needs
+               *  them
+               */
+              if (scale <= p->last_full)
+                {
+                  gfloat *swap;
+
+                  for (y = 0; y < rows; y++)
+                    gausssmooth (in + y * width, tmp + y * width, width, 1,
+                                 &p->coef[scale], w1, w2);
+
+                  swap = in;
+                  in   = tmp;
+                  tmp  = swap;
+                }
+
+              if (p->level[scale] > 0)
+                {
+                  pyramid_add_level (p, p->blurred[c][scale], p->level[scale],
+                                     acc, y1, y2);
+                  continue;
+                }
+
+              for (x = 0; x < width; x++)
+                gausssmooth (in + x, out + x, rows, width,
+                             &p->coef[scale], w1, w2);
+
+              for (y = y1; y < y2; y++)
+                for (x = 0; x < width; x++)
+                  acc[(y - y1) * width + x] += log (out[(y - m1) * width + x]);
+            }
+
+          for (y = y1; y < y2; y++)
+            {
+              const guchar *src = p->src + y * width * bytes;
+              const gfloat *a   = acc + (y - y1) * width;
+
+              for (x = 0; x < width; x++, src += bytes)
+                {
+                  gfloat r = 0.0;
+                  gfloat v;
+
+                  if (p->nscales)
+                    r = p->weight * (p->nscales * p->log_src[src[c]] - a[x]);
+
+                  v = (p->log_alpha[src[c]] -
+                       (gfloat) p->log_sum[src[0] + src[1] + src[2]]) * r;
+
+                  if (! p->final_pass)
+                    {
+                      sum  += v;
+                      sum2 += v * v;
+                    }
+                  else
+                    {
+                      gfloat d = 255 * (v - p->mini) / p->range;
+
+                      p->dest[(y * width + x) * bytes + c] =
+                        (guchar) CLAMP (d, 0, 255);
+                    }
+                }
+            }
+        }
+
+      if (! p->final_pass)
+        {
+          p->band_sum[band]  = sum;
+          p->band_sum2[band] = sum2;
+        }
+    }
+}
+
+/*
+ * The spread of the recursive filter is only roughly the sigma it is
+ * asked for, and the error grows with sigma.  Measure it from the
+ * impulse response.
+ */
+static gdouble
+gauss_effective_sigma (gfloat sigma)
+{
+  gauss3_coefs  coef;
+  gint          size = 2 * (gint) ceil (8 * sigma) + 65;
+  gfloat       *in   = g_new0 (gfloat, size);
+  gfloat       *out  = g_new (gfloat, size);
+  gfloat       *w    = g_new (gfloat, 2 * (size + 3));
+  gdouble       sum  = 0.0;
+  gdouble       var  = 0.0;
+  gint          i;
+
+  compute_coefs3 (&coef, sigma);
+
+  in[size / 2] = 1.0;
+  gausssmooth (in, out, size, 1, &coef, w, w + size + 3);
+
+  for (i = 0; i < size; i++)
+    {
+      sum += out[i];
+      var += out[i] * SQR (i - size / 2);
+    }
+
+  g_free (in);
+  g_free (out);
+  g_free (w);
+
+  return sqrt (var / sum);
+}
+
+/*
+ * Coefficients for filtering a reduced level so that, together with the
+ * 2x2 averaging that produced the level, the result spreads as much as
+ * full size filtering with the given effective sigma.
+ */
+static void
+pyramid_coefs (gauss3_coefs *coef,
+               gdouble       effective_sigma,
+               gint          level)
+{
+  gdouble factor = 1 << level;
+  gdouble target;
+  gdouble lo, hi;
+  gint    i;
+
+  /*  variance added by the averaging, in full size pixels  */
+  target = SQR (effective_sigma) - (SQR (factor) - 1.0) / 12.0;
+  target = sqrt (MAX (target, 1.0)) / factor;
+
+  lo = 0.5;
+  hi = 2 * target + 1.0;
+
+  for (i = 0; i < 24; i++)
+    {
+      gdouble mid = 0.5 * (lo + hi);
+
+      if (gauss_effective_sigma (mid) < target)
+        lo = mid;
+      else
+        hi = mid;
+    }
+
+  compute_coefs3 (coef, 0.5 * (lo + hi));
+}
+
+static void
+MSRCR_pyramid (guchar *src, gint width, gint height, gint bytes,
+               gboolean preview_mode)
+{
+  RetinexPyramid *p;
+  RetinexTask     task      = { 0, };
+  gdouble         var_x     = 0.0;
+  gfloat          max_sigma = 0.0;
+  gdouble         sum       = 0.0;
+  gdouble         sum2      = 0.0;
+  gdouble         mean, var;
+  gint            size      = width * height * bytes;
+  gint            scale;
+  gint            level;
+  gint            c, i;
+
+  p = g_new0 (RetinexPyramid, 1);
+
+  p->src     = src;
+  p->dest    = g_try_malloc (size);
+  p->width   = width;
+  p->height  = height;
+  p->bytes   = bytes;
+  p->nscales = rvals.nscales;
+  p->weight  = 1. / (gfloat) rvals.nscales;
+  p->last_full = -1;
+
+  if (p->dest == NULL)
+    {
+      g_free (p);
+      g_warning ("Failed to allocate memory");
+      return;
+    }
+
+  memcpy (p->dest, src, size);
+
+  for (i = 0; i < 256; i++)
+    {
+      p->log_src[i]   = log (i + 1.);
+      p->log_alpha[i] = log (128. * (i + 1.));
+    }
+
+  for (i = 0; i < 766; i++)
+    p->log_sum[i] = log (i + 3.);
+
+  p->level_width[0]  = width;
+  p->level_height[0] = height;
+
+  for (level = 1; level < MAX_PYRAMID_LEVELS; level++)
+    {
+      p->level_width[level]  = (p->level_width[level - 1] + 1) / 2;
+      p->level_height[level] = (p->level_height[level - 1] + 1) / 2;
+    }
+
+  /*  pick a level for each scale  */
+  for (scale = 0; scale < p->nscales; scale++)
+    {
+      gfloat  sigma   = RetinexScales[scale];
+      gdouble sigma_y = gauss_effective_sigma (sigma);
+
+      var_x += SQR (sigma_y);
+
+      level = 0;
+      while (level + 1 < MAX_PYRAMID_LEVELS &&
+             sigma / (1 << (level + 1)) >= PYRAMID_MIN_SIGMA &&
+             p->level_width[level + 1]  >= PYRAMID_MIN_SIZE &&
+             p->level_height[level + 1] >= PYRAMID_MIN_SIZE)
+        level++;
+
+      compute_coefs3 (&p->coef[scale], sigma);
+
+      if (level > 0)
+        {
+          pyramid_coefs (&p->coef_x[scale], sqrt (var_x), level);
+          pyramid_coefs (&p->coef_y[scale], sigma_y, level);
+        }
+
+      p->level[scale] = level;
+      p->max_level    = MAX (p->max_level, level);
+
+      if (level == 0)
+        {
+          max_sigma    = MAX (max_sigma, sigma);
+          p->last_full = scale;
+        }
+    }
+
+  if (max_sigma > 0.0)
+    p->margin = (gint) ceil (4 * max_sigma);
+
+  for (level = 1; level <= p->max_level; level++)
+    {
+      gfloat factor = 1 << level;
+
+      p->level_ix[level] = g_new (gint, width);
+      p->level_fx[level] = g_new (gfloat, width);
+
+      for (i = 0; i < width; i++)
+        {
+          gfloat v = CLAMP ((i + 0.5) / factor - 0.5,
+                            0, p->level_width[level] - 1);
+
+          p->level_ix[level][i] = (gint) v;
+          p->level_fx[level][i] = v - (gint) v;
+        }
+    }
+
+  /*  reduce the channels and filter the reduced scales  */
+  task.func         = pyramid_build;
+  task.data         = p;
+  task.n_items      = 3;
+  task.chunk        = 1;
+  retinex_parallel (&task);
+
+  task.func         = pyramid_blur;
+  task.n_items      = 3 * p->nscales;
+  task.scratch_size = 2 * (MAX (width, height) + 3);
+  task.report       = ! preview_mode;
+  task.progress_end = 0.2;
+  retinex_parallel (&task);
+
+  for (c = 0; c < 3; c++)
+    for (level = 1; level <= p->max_level; level++)
+      {
+        g_free (p->pyramid[c][level]);
+        p->pyramid[c][level] = NULL;
+      }
+
+  /*  first pass: mean and variance  */
+  p->n_bands   = (height + BAND_HEIGHT - 1) / BAND_HEIGHT;
+  p->band_sum  = g_new (gdouble, p->n_bands);
+  p->band_sum2 = g_new (gdouble, p->n_bands);
+
+  task.func           = pyramid_bands;
+  task.n_items        = p->n_bands;
+  task.scratch_size   = (3 * width * (BAND_HEIGHT + 2 * p->margin) +
+                         width * BAND_HEIGHT +
+                         2 * (MAX (width, BAND_HEIGHT + 2 * p->margin) + 3));
+  task.progress_start = 0.2;
+  task.progress_end   = 0.6;
+  retinex_parallel (&task);
+
+  for (i = 0; i < p->n_bands; i++)
+    {
+      sum  += p->band_sum[i];
+      sum2 += p->band_sum2[i];
+    }
+
+  mean = sum / size;
+  var  = sqrt (MAX (sum2 / size - SQR (mean), 0.0));
+
+  p->mini  = mean - rvals.cvar * var;
+  p->range = 2 * rvals.cvar * var;
+
+  if (! p->range)
+    p->range = 1.0;
+
+  /*  second pass: output  */
+  p->final_pass       = TRUE;
+  task.progress_start = 0.6;
+  task.progress_end   = 1.0;
+  retinex_parallel (&task);
+
+  memcpy (src, p->dest, size);
+
+  for (c = 0; c < 3; c++)
+    for (scale = 0; scale < p->nscales; scale++)
+      g_free (p->blurred[c][scale]);
+
+  for (level = 1; level <= p->max_level; level++)
+    {
+      g_free (p->level_ix[level]);
+      g_free (p->level_fx[level]);
+    }
+
+  g_free (p->band_sum);
+  g_free (p->band_sum2);
+  g_free (p->dest);
+  g_free (p);
+}
+
 /*
  * Calculate the average and variance in one go.
  */
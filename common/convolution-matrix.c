@@ -28,6 +28,7 @@
 
 
 #define PLUG_IN_PROC   "plug-in-convmatrix"
+#define FILE_PROC      "plug-in-convmatrix-file"
 #define PLUG_IN_BINARY "convolution-matrix"
 #define PLUG_IN_ROLE   "gimp-convolution-matrix"
 
@@ -44,12 +45,14 @@
 #define MATRIX_SIZE   (11)
 #endif
 
-#define HALF_WINDOW   (MATRIX_SIZE/2)
 #define MATRIX_CELLS  (MATRIX_SIZE*MATRIX_SIZE)
-#define DEST_ROWS     (MATRIX_SIZE/2 + 1)
 #define CHANNELS      (5)
 #define BORDER_MODES  (3)
 
+#define MAX_KERNEL_SIZE   (63)   /* largest kernel loaded from a file     */
+#define FFT_MIN_SIZE      (15)   /* use the FFT for kernels this large    */
+#define SEPARABLE_EPSILON (1e-6) /* relative tolerance of the rank-1 test */
+
 
 
 typedef enum
@@ -59,6 +62,34 @@ typedef enum
   CLEAR
 } BorderMode;
 
+typedef struct
+{
+  gint      size;       /* odd width and height of the kernel     */
+  gfloat   *values;     /* size * size values, row by row         */
+  gfloat    matrixsum;  /* sum of the absolute values             */
+
+  /*  rank-1 factorization, values[y][x] == col[y] * row[x] / pivot;
+   *  col and row are taken from the kernel as they are, so integer
+   *  kernels are summed exactly in the separable path, too
+   */
+  gboolean  separable;
+  gfloat   *col;
+  gfloat   *row;
+  gfloat    pivot;
+} ConvKernel;
+
+typedef struct
+{
+  const ConvKernel *kernel;
+  GimpPixelRgn     *srcPR;
+  GimpPixelRgn     *destPR;
+  gint              bpp;
+  gint              x1, y1;
+  gint              x2, y2;
+  gboolean          chanmask[CHANNELS - 1];
+  gboolean          show_progress;
+} ConvJob;
+
 static gchar * const channel_labels[] =
 {
   N_("Gr_ey"),
@@ -90,10 +121,11 @@ static void      convolve_image        (GimpDrawable  *drawable,
 
 static void      check_config          (GimpDrawable  *drawable);
 
-static gfloat    convolve_pixel        (guchar       **src_row,
-                                        gint           x_offset,
-                                        gint           channel,
-                                        GimpDrawable  *drawable);
+static ConvKernel * conv_kernel_new_from_file (const gchar  *filename,
+                                               GError      **error);
+static void         conv_kernel_free          (ConvKernel   *kernel);
+
+static gint         conv_fft_block_size       (gint          size);
 
 const GimpPlugInInfo PLUG_IN_INFO =
 {
@@ -105,6 +137,9 @@ const GimpPlugInInfo PLUG_IN_INFO =
 
 static gboolean run_flag = FALSE;
 
+/*  set when running FILE_PROC, overrides the 5x5 matrix of the config  */
+static ConvKernel *file_kernel = NULL;
+
 typedef struct
 {
   gfloat     matrix[MATRIX_SIZE][MATRIX_SIZE];
@@ -197,6 +232,20 @@ query (void)
     { GIMP_PDB_INT32,      "bmode",         "Mode for treating image borders { EXTEND (0), WRAP (1), CLEAR (2) }" },
   };
 
+  static const GimpParamDef file_args[] =
+  {
+    { GIMP_PDB_INT32,      "run-mode",      "The run mode { RUN-NONINTERACTIVE (1) }" },
+    { GIMP_PDB_IMAGE,      "image",         "Input image (unused)" },
+    { GIMP_PDB_DRAWABLE,   "drawable",      "Input drawable" },
+    { GIMP_PDB_STRING,     "filename",      "Text file holding the convolution matrix" },
+    { GIMP_PDB_INT32,      "alpha-alg",     "Enable weighting by alpha channel" },
+    { GIMP_PDB_FLOAT,      "divisor",       "Divisor" },
+    { GIMP_PDB_FLOAT,      "offset",        "Offset" },
+    { GIMP_PDB_INT32,      "argc-channels", "The number of elements in following array. Should be always 5." },
+    { GIMP_PDB_INT32ARRAY, "channels",      "Mask of the channels to be filtered" },
+    { GIMP_PDB_INT32,      "bmode",         "Mode for treating image borders { EXTEND (0), WRAP (1), CLEAR (2) }" },
+  };
+
   gimp_install_procedure (PLUG_IN_PROC,
                           N_("Apply a generic 5x5 convolution matrix"),
                           "",
@@ -209,6 +258,23 @@ query (void)
                           G_N_ELEMENTS (args), 0,
                           args, NULL);
 
+  gimp_install_procedure (FILE_PROC,
+                          N_("Apply a convolution matrix loaded from a file"),
+                          "Applies a square convolution matrix of odd size "
+                          "up to 63x63.  The file holds one matrix row per "
+                          "line, with the values separated by whitespace; "
+                          "empty lines and text after a '#' are ignored.  "
+                          "Separable matrices are applied as two 1-D passes "
+                          "and large matrices are applied using the FFT.",
+                          "The GIMP Team",
+                          "The GIMP Team",
+                          "2026",
+                          NULL,
+                          "RGB*, GRAY*",
+                          GIMP_PLUGIN,
+                          G_N_ELEMENTS (file_args), 0,
+                          file_args, NULL);
+
   gimp_plugin_menu_register (PLUG_IN_PROC, "<Image>/Filters/Generic");
 }
 
@@ -219,11 +285,12 @@ run (const gchar      *name,
      gint             *nreturn_vals,
      GimpParam       **return_vals)
 {
-  static GimpParam   values[1];
+  static GimpParam   values[2];
   GimpRunMode        run_mode;
   GimpPDBStatusType  status = GIMP_PDB_SUCCESS;
   gint               x, y;
   GimpDrawable      *drawable;
+  GError            *error  = NULL;
 
   INIT_I18N ();
 
@@ -247,7 +314,57 @@ run (const gchar      *name,
     }
 
   config = default_config;
-  if (run_mode == GIMP_RUN_NONINTERACTIVE)
+  if (strcmp (name, FILE_PROC) == 0)
+    {
+      if (nparams != 10 || param[7].data.d_int32 != CHANNELS)
+        {
+          status = GIMP_PDB_CALLING_ERROR;
+        }
+      else if (! param[3].data.d_string)
+        {
+          g_set_error (&error, 0, 0, "%s", _("No matrix file was given."));
+          status = GIMP_PDB_CALLING_ERROR;
+        }
+      else if (param[9].data.d_int32 < EXTEND ||
+               param[9].data.d_int32 > CLEAR)
+        {
+          g_set_error (&error, 0, 0, _("Invalid border mode %d."),
+                       param[9].data.d_int32);
+          status = GIMP_PDB_CALLING_ERROR;
+        }
+      else
+        {
+          config.alpha_weighting = param[4].data.d_int32 ? 1 : 0;
+          config.divisor         = param[5].data.d_float;
+          config.offset          = param[6].data.d_float;
+
+          for (y = 0; y < CHANNELS; y++)
+            config.channels[y] = param[8].data.d_int32array[y];
+
+          config.bmode = param[9].data.d_int32;
+
+          if (! gimp_drawable_has_alpha (drawable->drawable_id))
+            {
+              config.alpha_weighting = -1;
+
+              if (config.bmode == CLEAR)
+                config.bmode = EXTEND;
+            }
+
+          if (config.divisor == 0.0)
+            status = GIMP_PDB_CALLING_ERROR;
+        }
+
+      if (status == GIMP_PDB_SUCCESS)
+        {
+          file_kernel = conv_kernel_new_from_file (param[3].data.d_string,
+                                                   &error);
+
+          if (! file_kernel)
+            status = GIMP_PDB_EXECUTION_ERROR;
+        }
+    }
+  else if (run_mode == GIMP_RUN_NONINTERACTIVE)
     {
       if ((nparams != 11) && (nparams != 12))
         {
@@ -311,15 +428,30 @@ run (const gchar      *name,
       if (gimp_drawable_is_rgb (drawable->drawable_id) ||
           gimp_drawable_is_gray (drawable->drawable_id))
         {
+          gint size = file_kernel ? file_kernel->size : MATRIX_SIZE;
+          gint rows = size / gimp_tile_height () + 2;
+
+          /*  the FFT path reads blocks of n rows and writes the
+           *  n - size + 1 valid ones, across the whole width
+           */
+          if (file_kernel && ! file_kernel->separable &&
+              size >= FFT_MIN_SIZE)
+            {
+              gint n = conv_fft_block_size (size);
+
+              rows = ((n / gimp_tile_height () + 2) +
+                      ((n - size + 1) / gimp_tile_height () + 2));
+            }
+
           gimp_progress_init (_("Applying convolution"));
-          gimp_tile_cache_ntiles (2 * (drawable->width /
-                                  gimp_tile_width () + 1));
+          gimp_tile_cache_ntiles (rows *
+                                  (drawable->width / gimp_tile_width () + 2));
           convolve_image (drawable, NULL);
 
           if (run_mode != GIMP_RUN_NONINTERACTIVE)
             gimp_displays_flush ();
 
-          if (run_mode == GIMP_RUN_INTERACTIVE)
+          if (run_mode == GIMP_RUN_INTERACTIVE && ! file_kernel)
             gimp_set_data (PLUG_IN_PROC, &config, sizeof (config));
         }
       else
@@ -329,6 +461,15 @@ run (const gchar      *name,
 
       gimp_drawable_detach (drawable);
     }
+  else if (error)
+    {
+      *nreturn_vals = 2;
+      values[1].type          = GIMP_PDB_STRING;
+      values[1].data.d_string = error->message;
+    }
+
+  if (file_kernel)
+    conv_kernel_free (file_kernel);
 
   values[0].type = GIMP_PDB_STATUS;
   values[0].data.d_status = status;
@@ -461,35 +602,220 @@ my_get_row (GimpPixelRgn *PR,
     }
 }
 
-static gfloat
-convolve_pixel (guchar       **src_row,
-                gint           x_offset,
-                gint           channel,
-                GimpDrawable  *drawable)
+/*  Kernels  */
+
+static ConvKernel *
+conv_kernel_new (gint size)
 {
-  static gfloat matrixsum = 0; /* FIXME: this certainly breaks the preview */
-  static gint bpp         = 0;
+  ConvKernel *kernel = g_slice_new0 (ConvKernel);
 
-  gfloat sum              = 0;
-  gfloat alphasum         = 0;
-  gint   x, y;
-  gint   alpha_channel;
+  kernel->size   = size;
+  kernel->values = g_new0 (gfloat, size * size);
 
-  if (!bpp)
-    {
-      bpp = drawable->bpp;
+  return kernel;
+}
 
-      for (y = 0; y < MATRIX_SIZE; y++)
-        for (x = 0; x < MATRIX_SIZE; x++)
-          matrixsum += ABS (config.matrix[x][y]);
-    }
+static void
+conv_kernel_free (ConvKernel *kernel)
+{
+  g_free (kernel->values);
+  g_free (kernel->col);
+  g_free (kernel->row);
+
+  g_slice_free (ConvKernel, kernel);
+}
+
+/*  Check whether the kernel is the outer product of a column and a row
+ *  vector, in which case it can be applied as two 1-D passes.
+ */
+static void
+conv_kernel_factorize (ConvKernel *kernel)
+{
+  const gint  size  = kernel->size;
+  gfloat      pivot = 0.0;
+  gint        pr    = 0;
+  gint        pc    = 0;
+  gint        x, y;
+
+  kernel->matrixsum = 0.0;
+
+  for (y = 0; y < size; y++)
+    for (x = 0; x < size; x++)
+      {
+        gfloat v = kernel->values[y * size + x];
+
+        kernel->matrixsum += ABS (v);
+
+        if (ABS (v) > ABS (pivot))
+          {
+            pivot = v;
+            pr    = y;
+            pc    = x;
+          }
+      }
+
+  kernel->separable = FALSE;
+
+  /*  nothing to gain for tiny kernels  */
+  if (pivot == 0.0 || size < 3)
+    return;
+
+  kernel->col = g_new (gfloat, size);
+  kernel->row = g_new (gfloat, size);
+
+  for (y = 0; y < size; y++)
+    kernel->col[y] = kernel->values[y * size + pc];
 
-  alpha_channel = bpp - 1;
+  for (x = 0; x < size; x++)
+    kernel->row[x] = kernel->values[pr * size + x];
+
+  kernel->pivot = pivot;
+
+  for (y = 0; y < size; y++)
+    for (x = 0; x < size; x++)
+      {
+        gfloat diff = (kernel->values[y * size + x] -
+                       kernel->col[y] * kernel->row[x] / pivot);
+
+        if (ABS (diff) > SEPARABLE_EPSILON * ABS (pivot))
+          {
+            g_free (kernel->col);
+            g_free (kernel->row);
+            kernel->col = kernel->row = NULL;
+
+            return;
+          }
+      }
+
+  kernel->separable = TRUE;
+}
+
+static ConvKernel *
+conv_kernel_new_from_config (void)
+{
+  ConvKernel *kernel = conv_kernel_new (MATRIX_SIZE);
+  gint        x, y;
 
   for (y = 0; y < MATRIX_SIZE; y++)
     for (x = 0; x < MATRIX_SIZE; x++)
+      kernel->values[y * MATRIX_SIZE + x] = config.matrix[x][y];
+
+  conv_kernel_factorize (kernel);
+
+  return kernel;
+}
+
+/*  Load a kernel from a text file.  The file contains one matrix row
+ *  per line, with the values separated by whitespace.  Empty lines and
+ *  everything after a '#' are ignored.  The matrix must be square with
+ *  an odd size of at most MAX_KERNEL_SIZE.
+ */
+static ConvKernel *
+conv_kernel_new_from_file (const gchar  *filename,
+                           GError      **error)
+{
+  ConvKernel  *kernel = NULL;
+  GArray      *values;
+  gchar       *contents;
+  gchar      **lines;
+  gint         size = 0;
+  gint         rows = 0;
+  gint         i;
+
+  if (! g_file_get_contents (filename, &contents, NULL, error))
+    return NULL;
+
+  values = g_array_new (FALSE, FALSE, sizeof (gfloat));
+  lines  = g_strsplit (contents, "\n", -1);
+
+  for (i = 0; lines[i]; i++)
+    {
+      gchar *p       = lines[i];
+      gchar *comment = strchr (p, '#');
+      gint   count   = 0;
+
+      if (comment)
+        *comment = '\0';
+
+      while (TRUE)
+        {
+          gchar  *end;
+          gfloat  v;
+
+          while (g_ascii_isspace (*p))
+            p++;
+
+          if (! *p)
+            break;
+
+          v = g_ascii_strtod (p, &end);
+
+          if (end == p)
+            {
+              g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                           _("Invalid value in line %d of '%s'."),
+                           i + 1, gimp_filename_to_utf8 (filename));
+              goto out;
+            }
+
+          g_array_append_val (values, v);
+          count++;
+          p = end;
+        }
+
+      if (count == 0)
+        continue;
+
+      if (rows == 0)
+        size = count;
+
+      if (count != size || ++rows > MAX_KERNEL_SIZE)
+        break;
+    }
+
+  if (rows != size || size % 2 == 0 || size > MAX_KERNEL_SIZE)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   _("'%s' does not contain a square matrix of odd size "
+                     "up to %dx%d."),
+                   gimp_filename_to_utf8 (filename),
+                   MAX_KERNEL_SIZE, MAX_KERNEL_SIZE);
+      goto out;
+    }
+
+  kernel = conv_kernel_new (size);
+  memcpy (kernel->values, values->data, size * size * sizeof (gfloat));
+
+  conv_kernel_factorize (kernel);
+
+ out:
+  g_strfreev (lines);
+  g_free (contents);
+  g_array_free (values, TRUE);
+
+  return kernel;
+}
+
+
+/*  Direct convolution, one output pixel at a time  */
+
+static gfloat
+convolve_pixel (const ConvJob  *job,
+                guchar        **src_row,
+                gint            x_offset,
+                gint            channel)
+{
+  const ConvKernel *kernel        = job->kernel;
+  const gint        bpp           = job->bpp;
+  const gint        alpha_channel = bpp - 1;
+  gfloat            sum           = 0;
+  gfloat            alphasum      = 0;
+  gint              x, y;
+
+  for (y = 0; y < kernel->size; y++)
+    for (x = 0; x < kernel->size; x++)
       {
-        gfloat temp = config.matrix[x][y];
+        gfloat temp = kernel->values[y * kernel->size + x];
 
         if (channel != alpha_channel && config.alpha_weighting == 1)
           {
@@ -506,7 +832,7 @@ convolve_pixel (guchar       **src_row,
   if (channel != alpha_channel && config.alpha_weighting == 1)
     {
       if (alphasum != 0)
-        sum = sum * matrixsum / alphasum;
+        sum = sum * kernel->matrixsum / alphasum;
       else
         sum = 0;
     }
@@ -516,22 +842,644 @@ convolve_pixel (guchar       **src_row,
   return sum;
 }
 
+static void
+convolve_direct (const ConvJob *job)
+{
+  const gint   size      = job->kernel->size;
+  const gint   half      = size / 2;
+  const gint   bpp       = job->bpp;
+  const gint   src_w     = job->x2 - job->x1;
+  const gint   src_row_w = src_w + 2 * half;
+  guchar     **src_row;
+  guchar      *dest_row;
+  guchar      *tmp_row;
+  gint         row, col, i;
+
+  src_row = g_new (guchar *, size);
+
+  for (i = 0; i < size; i++)
+    src_row[i] = g_new (guchar, src_row_w * bpp);
+
+  dest_row = g_new (guchar, src_w * bpp);
+
+  /* initialize source arrays */
+  for (i = 0; i < size; i++)
+    my_get_row (job->srcPR, src_row[i], job->x1 - half,
+                job->y1 - half + i, src_row_w);
+
+  for (row = job->y1; row < job->y2; row++)
+    {
+      gint x_offset = 0;
+      gint channel;
+
+      for (col = job->x1; col < job->x2; col++)
+        for (channel = 0; channel < bpp; channel++)
+          {
+            guchar d;
+
+            if (job->chanmask[channel])
+              {
+                gint result;
+
+                result = ROUND (convolve_pixel (job, src_row,
+                                                x_offset, channel));
+                d = CLAMP (result, 0, 255);
+              }
+            else
+              {
+                /* copy unmodified pixel */
+                d = src_row[half][x_offset + half * bpp];
+              }
+
+            dest_row[x_offset] = d;
+            x_offset++;
+          }
+
+      gimp_pixel_rgn_set_row (job->destPR, dest_row, job->x1, row, src_w);
+
+      if (row < job->y2 - 1)
+        {
+          tmp_row = src_row[0];
+
+          for (i = 0; i < size - 1; i++)
+            src_row[i] = src_row[i + 1];
+
+          src_row[size - 1] = tmp_row;
+
+          my_get_row (job->srcPR, src_row[size - 1],
+                      job->x1 - half, row + half + 1, src_row_w);
+        }
+
+      if ((row % 10 == 0) && job->show_progress)
+        gimp_progress_update ((gdouble) (row - job->y1) /
+                              (job->y2 - job->y1));
+    }
+
+  for (i = 0; i < size; i++)
+    g_free (src_row[i]);
+
+  g_free (src_row);
+  g_free (dest_row);
+}
+
+
+/*  Finish a pixel the same way convolve_pixel() does  */
+static inline guchar
+convolve_finish (const ConvJob *job,
+                 gfloat         sum,
+                 gfloat         alphasum,
+                 gboolean       weighted)
+{
+  gint result;
+
+  sum /= config.divisor;
+
+  if (weighted)
+    {
+      if (alphasum != 0)
+        sum = sum * job->kernel->matrixsum / alphasum;
+      else
+        sum = 0;
+    }
+
+  sum += config.offset;
+
+  result = ROUND (sum);
+
+  return CLAMP (result, 0, 255);
+}
+
+
+/*  Separable convolution: a horizontal pass into a ring buffer of
+ *  'size' filtered rows, followed by a vertical pass over the ring.
+ *  Alpha weighting separates as well, since |m(x,y)| = |col(y)| |row(x)|.
+ *  The passes sum in double and divide by the pivot only at the end;
+ *  for integer kernels that gives the exact sum the 2-D path computes,
+ *  so both round the same way.
+ */
+static void
+convolve_separable (const ConvJob *job)
+{
+  const ConvKernel *kernel    = job->kernel;
+  const gint        size      = kernel->size;
+  const gint        half      = size / 2;
+  const gint        bpp       = job->bpp;
+  const gint        alpha     = bpp - 1;
+  const gint        src_w     = job->x2 - job->x1;
+  const gint        src_row_w = src_w + 2 * half;
+  const gint        first     = job->y1 - half;
+  gdouble          *abs_row   = g_new (gdouble, size);
+  gdouble          *abs_col   = g_new (gdouble, size);
+  guchar           *row_buf   = g_new (guchar, src_row_w * bpp);
+  guchar           *raw       = g_new (guchar, size * src_w * bpp);
+  gdouble          *hsum      = g_new (gdouble, size * src_w * bpp);
+  gdouble          *hasum     = g_new (gdouble, size * src_w);
+  guchar           *dest_row  = g_new (guchar, src_w * bpp);
+  gint              x, y, c, i;
+
+  for (i = 0; i < size; i++)
+    {
+      abs_row[i] = ABS (kernel->row[i]);
+      abs_col[i] = ABS (kernel->col[i]);
+    }
+
+  for (y = first; y < job->y2 + half; y++)
+    {
+      const gint  slot = (y - first) % size;
+      gdouble    *hs   = hsum  + slot * src_w * bpp;
+      gdouble    *ha   = hasum + slot * src_w;
+
+      my_get_row (job->srcPR, row_buf, job->x1 - half, y, src_row_w);
+
+      memcpy (raw + slot * src_w * bpp, row_buf + half * bpp, src_w * bpp);
+
+      /*  horizontal pass  */
+      for (x = 0; x < src_w; x++)
+        {
+          const guchar *p = row_buf + x * bpp;
+
+          if (config.alpha_weighting == 1)
+            {
+              gdouble a = 0;
+
+              for (i = 0; i < size; i++)
+                a += abs_row[i] * p[i * bpp + alpha];
+
+              ha[x] = a;
+            }
+
+          for (c = 0; c < bpp; c++)
+            {
+              gdouble s = 0;
+
+              if (! job->chanmask[c])
+                continue;
+
+              if (c != alpha && config.alpha_weighting == 1)
+                {
+                  for (i = 0; i < size; i++)
+                    s += kernel->row[i] * p[i * bpp + c] * p[i * bpp + alpha];
+                }
+              else
+                {
+                  for (i = 0; i < size; i++)
+                    s += kernel->row[i] * p[i * bpp + c];
+                }
+
+              hs[x * bpp + c] = s;
+            }
+        }
+
+      /*  vertical pass, once the ring holds all rows for output row y - half  */
+      if (y >= job->y1 + half)
+        {
+          const gint    row    = y - half;
+          const guchar *center = raw + ((row - first) % size) * src_w * bpp;
+
+          for (x = 0; x < src_w; x++)
+            for (c = 0; c < bpp; c++)
+              {
+                gboolean weighted;
+                gdouble  s = 0;
+                gdouble  a = 0;
+
+                if (! job->chanmask[c])
+                  {
+                    dest_row[x * bpp + c] = center[x * bpp + c];
+                    continue;
+                  }
+
+                weighted = (c != alpha && config.alpha_weighting == 1);
+
+                for (i = 0; i < size; i++)
+                  {
+                    gint s_slot = (row - half + i - first) % size;
+
+                    s += kernel->col[i] * hsum[(s_slot * src_w + x) * bpp + c];
+
+                    if (weighted)
+                      a += abs_col[i] * hasum[s_slot * src_w + x];
+                  }
+
+                dest_row[x * bpp + c] =
+                  convolve_finish (job,
+                                   s / kernel->pivot,
+                                   a / ABS (kernel->pivot),
+                                   weighted);
+              }
+
+          gimp_pixel_rgn_set_row (job->destPR, dest_row, job->x1, row, src_w);
+
+          if ((row % 10 == 0) && job->show_progress)
+            gimp_progress_update ((gdouble) (row - job->y1) /
+                                  (job->y2 - job->y1));
+        }
+    }
+
+  g_free (abs_row);
+  g_free (abs_col);
+  g_free (row_buf);
+  g_free (raw);
+  g_free (hsum);
+  g_free (hasum);
+  g_free (dest_row);
+}
+
+
+/*  FFT convolution for large kernels.  The region is processed in
+ *  blocks with the overlap-save method: each FFT_SIZE x FFT_SIZE input
+ *  block yields (FFT_SIZE - size + 1)^2 valid output pixels.  Since the
+ *  kernel is real, two channels are transformed at once, one in the
+ *  real and one in the imaginary part.
+ */
+
+typedef struct
+{
+  gint     n;
+  gint    *rev;
+  gdouble *cos_tab;
+  gdouble *sin_tab;
+  gdouble *tmp_re;
+  gdouble *tmp_im;
+} ConvFFT;
+
+static ConvFFT *
+conv_fft_new (gint n)
+{
+  ConvFFT *fft = g_slice_new (ConvFFT);
+  gint     bits, i;
+
+  fft->n       = n;
+  fft->rev     = g_new (gint, n);
+  fft->cos_tab = g_new (gdouble, n / 2);
+  fft->sin_tab = g_new (gdouble, n / 2);
+  fft->tmp_re  = g_new (gdouble, n);
+  fft->tmp_im  = g_new (gdouble, n);
+
+  for (bits = 0; (1 << bits) < n; bits++);
+
+  for (i = 0; i < n; i++)
+    {
+      gint r = 0;
+      gint b;
+
+      for (b = 0; b < bits; b++)
+        if (i & (1 << b))
+          r |= 1 << (bits - 1 - b);
+
+      fft->rev[i] = r;
+    }
+
+  for (i = 0; i < n / 2; i++)
+    {
+      fft->cos_tab[i] = cos (2.0 * G_PI * i / n);
+      fft->sin_tab[i] = sin (2.0 * G_PI * i / n);
+    }
+
+  return fft;
+}
+
+static void
+conv_fft_free (ConvFFT *fft)
+{
+  g_free (fft->rev);
+  g_free (fft->cos_tab);
+  g_free (fft->sin_tab);
+  g_free (fft->tmp_re);
+  g_free (fft->tmp_im);
+
+  g_slice_free (ConvFFT, fft);
+}
+
+/*  In-place iterative radix-2 transform of one line.  The inverse
+ *  transform is not normalized.
+ */
+static void
+conv_fft_line (const ConvFFT *fft,
+               gdouble       *re,
+               gdouble       *im,
+               gboolean       inverse)
+{
+  const gint n    = fft->n;
+  gdouble    sign = inverse ? 1.0 : -1.0;
+  gint       i, len;
+
+  for (i = 0; i < n; i++)
+    {
+      gint j = fft->rev[i];
+
+      if (j > i)
+        {
+          gdouble t;
+
+          t = re[i]; re[i] = re[j]; re[j] = t;
+          t = im[i]; im[i] = im[j]; im[j] = t;
+        }
+    }
+
+  for (len = 2; len <= n; len <<= 1)
+    {
+      const gint half = len / 2;
+      const gint step = n / len;
+      gint       start, k;
+
+      for (start = 0; start < n; start += len)
+        for (k = 0; k < half; k++)
+          {
+            gdouble wr = fft->cos_tab[k * step];
+            gdouble wi = sign * fft->sin_tab[k * step];
+            gint    a  = start + k;
+            gint    b  = a + half;
+            gdouble tr = re[b] * wr - im[b] * wi;
+            gdouble ti = re[b] * wi + im[b] * wr;
+
+            re[b] = re[a] - tr;
+            im[b] = im[a] - ti;
+            re[a] += tr;
+            im[a] += ti;
+          }
+    }
+}
+
+static void
+conv_fft_2d (ConvFFT  *fft,
+             gdouble  *re,
+             gdouble  *im,
+             gboolean  inverse)
+{
+  const gint n = fft->n;
+  gint       x, y;
+
+  for (y = 0; y < n; y++)
+    conv_fft_line (fft, re + y * n, im + y * n, inverse);
+
+  for (x = 0; x < n; x++)
+    {
+      for (y = 0; y < n; y++)
+        {
+          fft->tmp_re[y] = re[y * n + x];
+          fft->tmp_im[y] = im[y * n + x];
+        }
+
+      conv_fft_line (fft, fft->tmp_re, fft->tmp_im, inverse);
+
+      for (y = 0; y < n; y++)
+        {
+          re[y * n + x] = fft->tmp_re[y];
+          im[y * n + x] = fft->tmp_im[y];
+        }
+    }
+}
+
+/*  Transform of the kernel, mirrored around the origin so that the
+ *  circular convolution computes the same correlation as
+ *  convolve_pixel().  If 'absolute' is set, |m| is used instead of m.
+ */
+static void
+conv_fft_kernel (ConvFFT          *fft,
+                 const ConvKernel *kernel,
+                 gboolean          absolute,
+                 gdouble          *re,
+                 gdouble          *im)
+{
+  const gint n    = fft->n;
+  const gint half = kernel->size / 2;
+  gint       x, y;
+
+  memset (re, 0, n * n * sizeof (gdouble));
+  memset (im, 0, n * n * sizeof (gdouble));
+
+  for (y = 0; y < kernel->size; y++)
+    for (x = 0; x < kernel->size; x++)
+      {
+        gdouble v  = kernel->values[y * kernel->size + x];
+        gint    fx = (n - (x - half)) % n;
+        gint    fy = (n - (y - half)) % n;
+
+        re[fy * n + fx] = absolute ? ABS (v) : v;
+      }
+
+  conv_fft_2d (fft, re, im, FALSE);
+}
+
+/*  Convolve the planes 'a' and 'b' (b may be NULL) with the transformed
+ *  kernel (kre, kim), in place.
+ */
+static void
+conv_fft_apply (ConvFFT       *fft,
+                const gdouble *kre,
+                const gdouble *kim,
+                gdouble       *a,
+                gdouble       *b,
+                gdouble       *scratch)
+{
+  const gint    n    = fft->n;
+  const gdouble norm = 1.0 / ((gdouble) n * n);
+  gint          i;
+
+  if (b)
+    memcpy (scratch, b, n * n * sizeof (gdouble));
+  else
+    memset (scratch, 0, n * n * sizeof (gdouble));
+
+  conv_fft_2d (fft, a, scratch, FALSE);
+
+  for (i = 0; i < n * n; i++)
+    {
+      gdouble r = a[i] * kre[i] - scratch[i] * kim[i];
+      gdouble s = a[i] * kim[i] + scratch[i] * kre[i];
+
+      a[i]       = r;
+      scratch[i] = s;
+    }
+
+  conv_fft_2d (fft, a, scratch, TRUE);
+
+  for (i = 0; i < n * n; i++)
+    {
+      a[i] *= norm;
+
+      if (b)
+        b[i] = scratch[i] * norm;
+    }
+}
+
+/*  The FFT size for a kernel, a power of two of at least 64  */
+static gint
+conv_fft_block_size (gint size)
+{
+  gint n;
+
+  for (n = 64; n < 4 * size; n <<= 1);
+
+  return n;
+}
+
+static void
+convolve_fft (const ConvJob *job)
+{
+  const ConvKernel *kernel  = job->kernel;
+  const gint        size    = kernel->size;
+  const gint        half    = size / 2;
+  const gint        bpp     = job->bpp;
+  const gint        alpha   = bpp - 1;
+  const gboolean    weight  = (config.alpha_weighting == 1);
+  ConvFFT          *fft;
+  gint              n, valid;
+  gdouble          *kre, *kim;
+  gdouble          *abs_kre = NULL;
+  gdouble          *abs_kim = NULL;
+  gdouble          *planes[CHANNELS];
+  gdouble          *alpha_plane = NULL;
+  gdouble          *scratch;
+  guchar           *in_buf;
+  guchar           *out_buf;
+  gint              bx, by, c;
+  gint              done  = 0;
+  gint              total = (job->x2 - job->x1) * (job->y2 - job->y1);
+
+  n     = conv_fft_block_size (size);
+  valid = n - size + 1;
+
+  fft = conv_fft_new (n);
+
+  kre = g_new (gdouble, n * n);
+  kim = g_new (gdouble, n * n);
+  conv_fft_kernel (fft, kernel, FALSE, kre, kim);
+
+  if (weight)
+    {
+      abs_kre = g_new (gdouble, n * n);
+      abs_kim = g_new (gdouble, n * n);
+      conv_fft_kernel (fft, kernel, TRUE, abs_kre, abs_kim);
+
+      alpha_plane = g_new (gdouble, n * n);
+    }
+
+  for (c = 0; c < bpp; c++)
+    planes[c] = g_new (gdouble, n * n);
+
+  scratch = g_new (gdouble, n * n);
+  in_buf  = g_new (guchar, n * n * bpp);
+  out_buf = g_new (guchar, valid * valid * bpp);
+
+  for (by = job->y1; by < job->y2; by += valid)
+    for (bx = job->x1; bx < job->x2; bx += valid)
+      {
+        const gint  bw     = MIN (valid, job->x2 - bx);
+        const gint  bh     = MIN (valid, job->y2 - by);
+        gdouble    *pair   = NULL;
+        gint        x, y, i;
+
+        /*  the input block, including the kernel border; whatever lies
+         *  beyond only affects outputs that are discarded
+         */
+        memset (in_buf, 0, n * n * bpp);
+
+        for (y = 0; y < bh + 2 * half; y++)
+          my_get_row (job->srcPR, in_buf + y * n * bpp,
+                      bx - half, by - half + y, bw + 2 * half);
+
+        for (c = 0; c < bpp; c++)
+          {
+            gboolean weighted = (weight && c != alpha);
+
+            if (! job->chanmask[c])
+              continue;
+
+            for (i = 0; i < n * n; i++)
+              {
+                const guchar *p = in_buf + i * bpp;
+
+                planes[c][i] = weighted ? p[c] * p[alpha] : p[c];
+              }
+
+            if (pair)
+              {
+                conv_fft_apply (fft, kre, kim, pair, planes[c], scratch);
+                pair = NULL;
+              }
+            else
+              {
+                pair = planes[c];
+              }
+          }
+
+        if (pair)
+          conv_fft_apply (fft, kre, kim, pair, NULL, scratch);
+
+        if (weight)
+          {
+            for (i = 0; i < n * n; i++)
+              alpha_plane[i] = in_buf[i * bpp + alpha];
+
+            conv_fft_apply (fft, abs_kre, abs_kim, alpha_plane, NULL, scratch);
+          }
+
+        for (y = 0; y < bh; y++)
+          for (x = 0; x < bw; x++)
+            {
+              const gint  i_in = (y + half) * n + x + half;
+              guchar     *d    = out_buf + (y * bw + x) * bpp;
+
+              for (c = 0; c < bpp; c++)
+                {
+                  gboolean weighted = (weight && c != alpha);
+
+                  if (job->chanmask[c])
+                    d[c] = convolve_finish (job,
+                                            planes[c][i_in],
+                                            weighted ? alpha_plane[i_in] : 0,
+                                            weighted);
+                  else
+                    d[c] = in_buf[i_in * bpp + c];
+                }
+            }
+
+        gimp_pixel_rgn_set_rect (job->destPR, out_buf, bx, by, bw, bh);
+
+        done += bw * bh;
+
+        if (job->show_progress)
+          gimp_progress_update ((gdouble) done / total);
+      }
+
+  for (c = 0; c < bpp; c++)
+    g_free (planes[c]);
+
+  g_free (kre);
+  g_free (kim);
+  g_free (abs_kre);
+  g_free (abs_kim);
+  g_free (alpha_plane);
+  g_free (scratch);
+  g_free (in_buf);
+  g_free (out_buf);
+
+  conv_fft_free (fft);
+}
+
+
 static void
 convolve_image (GimpDrawable *drawable,
                 GimpPreview  *preview)
 {
   GimpPixelRgn  srcPR, destPR;
-  gint          width, height, row, col;
-  gint          src_w, src_row_w, src_h, i;
+  ConvJob       job;
+  ConvKernel   *kernel;
+  gint          width, height;
   gint          src_x1, src_y1, src_x2, src_y2;
+  gint          src_w, src_h;
   gint          x1, x2, y1, y2;
-  guchar       *dest_row[DEST_ROWS];
-  guchar       *src_row[MATRIX_SIZE];
-  guchar       *tmp_row;
-  gint          x_offset;
-  gboolean      chanmask[CHANNELS - 1];
-  gint          bpp;
-  gint          alpha_channel;
+  gint          half;
+  gint          i;
+
+  if (file_kernel)
+    kernel = file_kernel;
+  else
+    kernel = conv_kernel_new_from_config ();
+
+  half = kernel->size / 2;
 
   /* Get the input area. This is the bounding box of the selection in
    *  the image (or the entire image if there is no selection). Only
@@ -559,108 +1507,51 @@ convolve_image (GimpDrawable *drawable,
    */
   width  = drawable->width;
   height = drawable->height;
-  bpp  = drawable->bpp;
-  alpha_channel = bpp - 1;
+
+  job.kernel        = kernel;
+  job.bpp           = drawable->bpp;
+  job.x1            = src_x1;
+  job.y1            = src_y1;
+  job.x2            = src_x2;
+  job.y2            = src_y2;
+  job.show_progress = (preview == NULL);
+
+  for (i = 0; i < CHANNELS - 1; i++)
+    job.chanmask[i] = FALSE;
 
   if (gimp_drawable_is_rgb (drawable->drawable_id))
     {
       for (i = 0; i < CHANNELS - 1; i++)
-        chanmask[i] = config.channels[i + 1];
+        job.chanmask[i] = config.channels[i + 1];
     }
   else /* Grayscale */
     {
-      chanmask[0] = config.channels[0];
+      job.chanmask[0] = config.channels[0];
     }
 
   if (gimp_drawable_has_alpha (drawable->drawable_id))
-    chanmask[alpha_channel] = config.channels[4];
-
-  src_row_w = src_w + HALF_WINDOW + HALF_WINDOW;
-
-  for (i = 0; i < MATRIX_SIZE; i++)
-    src_row[i] = g_new (guchar, src_row_w * bpp);
-
-  for (i = 0; i < DEST_ROWS; i++)
-    dest_row[i]= g_new (guchar, src_w * bpp);
+    job.chanmask[job.bpp - 1] = config.channels[4];
 
   /*  initialize the pixel regions  */
-  x1 = MAX (src_x1 - HALF_WINDOW, 0);
-  y1 = MAX (src_y1 - HALF_WINDOW, 0);
-  x2 = MIN (src_x2 + HALF_WINDOW, width);
-  y2 = MIN (src_y2 + HALF_WINDOW, height);
+  x1 = MAX (src_x1 - half, 0);
+  y1 = MAX (src_y1 - half, 0);
+  x2 = MIN (src_x2 + half, width);
+  y2 = MIN (src_y2 + half, height);
   gimp_pixel_rgn_init (&srcPR, drawable,
                        x1, y1, x2 - x1, y2 - y1, FALSE, FALSE);
   gimp_pixel_rgn_init (&destPR, drawable,
                        src_x1, src_y1, src_w, src_h,
                        preview == NULL, TRUE);
 
-  /* initialize source arrays */
-  for (i = 0; i < MATRIX_SIZE; i++)
-    my_get_row (&srcPR, src_row[i], src_x1 - HALF_WINDOW,
-                src_y1 - HALF_WINDOW + i , src_row_w);
-
-  for (row = src_y1; row < src_y2; row++)
-    {
-      gint channel;
-
-      x_offset = 0;
-
-      for (col = src_x1; col < src_x2; col++)
-        for (channel = 0; channel < bpp; channel++)
-          {
-            guchar d;
-
-            if (chanmask[channel])
-              {
-                gint result;
-
-                result = ROUND (convolve_pixel (src_row,
-                                                x_offset, channel, drawable));
-                d = CLAMP (result, 0, 255);
-              }
-            else
-              {
-                /* copy unmodified pixel */
-                d = src_row[HALF_WINDOW][x_offset + HALF_WINDOW * bpp];
-              }
-
-            dest_row[HALF_WINDOW][x_offset] = d;
-            x_offset++;
-          }
-
-      if (row >= src_y1 + HALF_WINDOW)
-        gimp_pixel_rgn_set_row (&destPR,
-                                dest_row[0], src_x1, row - HALF_WINDOW, src_w);
-
-      if (row < src_y2 - 1)
-        {
-          tmp_row = dest_row[0];
-
-          for (i = 0; i < DEST_ROWS - 1; i++)
-            dest_row[i] = dest_row[i + 1];
-
-          dest_row[DEST_ROWS - 1] = tmp_row;
-
-          tmp_row = src_row[0];
-
-          for (i = 0; i < MATRIX_SIZE - 1; i++)
-            src_row[i] = src_row[i + 1];
-
-          src_row[MATRIX_SIZE-1] = tmp_row;
-
-          my_get_row (&srcPR, src_row[MATRIX_SIZE - 1],
-                      src_x1 - HALF_WINDOW, row + HALF_WINDOW + 1, src_row_w);
-        }
-
-      if ((row % 10 == 0) && !preview)
-        gimp_progress_update ((double) (row - src_y1) / src_h);
-    }
-
-  /* put the remaining rows in the buffer in place */
-  for (i = 1; i <  DEST_ROWS; i++)
-    gimp_pixel_rgn_set_row (&destPR, dest_row[i],
-                            src_x1, src_y2 + i - 1 - HALF_WINDOW, src_w);
+  job.srcPR  = &srcPR;
+  job.destPR = &destPR;
 
+  if (kernel->separable)
+    convolve_separable (&job);
+  else if (kernel->size >= FFT_MIN_SIZE)
+    convolve_fft (&job);
+  else
+    convolve_direct (&job);
 
   /*  update the region  */
   if (preview)
@@ -677,11 +1568,8 @@ convolve_image (GimpDrawable *drawable,
                             src_x1, src_y1, src_x2 - src_x1, src_y2 - src_y1);
     }
 
-  for (i = 0; i < MATRIX_SIZE; i++)
-    g_free (src_row[i]);
-
-  for (i = 0; i < DEST_ROWS; i++)
-    g_free (dest_row[i]);
+  if (kernel != file_kernel)
+    conv_kernel_free (kernel);
 }
 
 /***************************************************
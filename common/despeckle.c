@@ -29,6 +29,8 @@
 
 #include "libgimp/stdplugins-intl.h"
 
+#include "threads.h"
+
 
 /*
  * Constants...
@@ -41,6 +43,7 @@
 #define SCALE_WIDTH      100
 #define ENTRY_WIDTH        3
 #define MAX_RADIUS        30
+#define BAND_HEIGHT       64
 
 #define FILTER_ADAPTIVE  0x01
 #define FILTER_RECURSIVE 0x02
@@ -63,19 +66,58 @@ typedef struct
 typedef struct
 {
   gint       elems[256]; /* Number of pixels that fall into each luma bucket */
+  gint       coarse[16]; /* Sums of 16 consecutive luma buckets */
   PixelsList origs[256]; /* Original pixels */
   gint       xmin;
   gint       ymin;
   gint       xmax;
   gint       ymax; /* Source rect */
+
+  /* Number of pixels in the histogram falling into each category */
+  gint       hist0;    /* Less than min treshold */
+  gint       hist255;  /* More than max treshold */
+  gint       histrest; /* From min to max        */
+
+  GRand     *gr;
 } DespeckleHistogram;
 
-/* Number of pixels in actual histogram falling into each category */
-static gint                hist0;    /* Less than min treshold */
-static gint                hist255;  /* More than max treshold */
-static gint                histrest; /* From min to max        */
+/* Luma histogram of one image column, 2 * radius + 1 pixels high, used
+ * by the non-adaptive median (Perreault and Hebert, "Median Filtering
+ * in Constant Time").  Only values between the black and white levels
+ * are counted.
+ */
+typedef struct
+{
+  guint16    fine[256];
+  guint16    coarse[16];
+  guint16    count;
+} DespeckleColumn;
+
+/* Sum of the column histograms under the filter box.  The coarse
+ * buckets are kept current as the box moves; each 16 bucket segment
+ * of the fine histogram is only brought up to date when the median
+ * falls into it.
+ */
+typedef struct
+{
+  gint       fine[256];
+  gint       coarse[16];
+  gint       synced[16]; /* Box position each fine segment is valid for */
+  gint       count;
+} DespeckleWindow;
 
-static DespeckleHistogram  histogram;
+typedef struct
+{
+  guchar    *src;
+  guchar    *dst;
+  guchar    *luma;       /* Luminance of src, non-adaptive filter only */
+  gint       width;
+  gint       height;
+  gint       bpp;
+  gint       radius;
+  gint       next_row;
+  gint       rows_done;
+} DespeckleJob;
 
 
 /*
@@ -373,8 +415,9 @@ pixel_copy (guchar       *dest,
  * 'despeckle()' - Despeckle an image using a median filter.
  *
  * A median filter basically collects pixel values in a region around the
- * target pixel, sorts them, and uses the median value. This code uses a
- * circular row buffer to improve performance.
+ * target pixel, sorts them, and uses the median value. The image is split
+ * into bands of rows which are filtered in parallel, and the plain median
+ * is found in constant time per pixel from per column histograms.
  *
  * The adaptive filter is based on the median filter but analizes the histogram
  * of the region around the target pixel and adjusts the despeckle diameter
@@ -653,9 +696,10 @@ list_del_elem (PixelsList* list)
 }
 
 static inline const guchar *
-list_get_random_elem (PixelsList *list)
+list_get_random_elem (PixelsList *list,
+                      GRand      *gr)
 {
-  const gint pos = list->start + rand () % list->count;
+  const gint pos = list->start + g_rand_int_range (gr, 0, list->count);
 
   if (pos >= MAX_LIST_ELEMS)
     return list->elems[pos - MAX_LIST_ELEMS];
@@ -669,6 +713,7 @@ histogram_add (DespeckleHistogram *hist,
                const guchar       *orig)
 {
   hist->elems[val]++;
+  hist->coarse[val >> 4]++;
   list_add_elem (&hist->origs[val], orig);
 }
 
@@ -677,6 +722,7 @@ histogram_remove (DespeckleHistogram *hist,
                   guchar              val)
 {
   hist->elems[val]--;
+  hist->coarse[val >> 4]--;
   list_del_elem (&hist->origs[val]);
 }
 
@@ -690,13 +736,20 @@ histogram_clean (DespeckleHistogram *hist)
       hist->elems[i] = 0;
       hist->origs[i].count = 0;
     }
+
+  for (i = 0; i < 16; i++)
+    hist->coarse[i] = 0;
+
+  hist->hist0    = 0;
+  hist->hist255  = 0;
+  hist->histrest = 0;
 }
 
 static inline const guchar *
 histogram_get_median (DespeckleHistogram *hist,
                       const guchar       *_default)
 {
-  gint count = histrest;
+  gint count = hist->histrest;
   gint i;
   gint sum = 0;
 
@@ -705,11 +758,16 @@ histogram_get_median (DespeckleHistogram *hist,
 
   count = (count + 1) / 2;
 
+  /* find the coarse bucket first, then the luma value inside it */
   i = 0;
+  while (sum + hist->coarse[i] < count)
+    sum += hist->coarse[i++];
+
+  i <<= 4;
   while ((sum += hist->elems[i]) < count)
     i++;
 
-  return list_get_random_elem (&hist->origs[i]);
+  return list_get_random_elem (&hist->origs[i], hist->gr);
 }
 
 static inline void
@@ -726,15 +784,15 @@ add_val (DespeckleHistogram *hist,
   if (value > black_level && value < white_level)
   {
     histogram_add (hist, value, src + pos);
-    histrest++;
+    hist->histrest++;
   }
   else
   {
     if (value <= black_level)
-      hist0++;
+      hist->hist0++;
 
     if (value >= white_level)
-      hist255++;
+      hist->hist255++;
   }
 }
 
@@ -752,15 +810,15 @@ del_val (DespeckleHistogram *hist,
   if (value > black_level && value < white_level)
   {
     histogram_remove (hist, value);
-    histrest--;
+    hist->histrest--;
   }
   else
   {
     if (value <= black_level)
-      hist0--;
+      hist->hist0--;
 
     if (value >= white_level)
-      hist255--;
+      hist->hist255--;
   }
 }
 
@@ -844,73 +902,379 @@ update_histogram (DespeckleHistogram *hist,
   hist->ymax = ymax;
 }
 
+static inline gboolean
+luma_in_range (gint value)
+{
+  return value > black_level && value < white_level;
+}
 
 static void
-despeckle_median (guchar   *src,
-                  guchar   *dst,
-                  gint      width,
-                  gint      height,
-                  gint      bpp,
-                  gint      radius,
-                  gboolean  preview)
+columns_update_row (DespeckleColumn *columns,
+                    const guchar    *luma,
+                    gint             width,
+                    gint             delta)
 {
-  guint  progress;
-  guint  max_progress;
-  gint   x, y;
-  gint   adapt_radius;
-  gint   pos;
-  gint   ymin;
-  gint   ymax;
-  gint   xmin;
-  gint   xmax;
+  gint x;
 
-  memset (&histogram, 0, sizeof(histogram));
-  progress     = 0;
-  max_progress = width * height;
+  for (x = 0; x < width; x++)
+    {
+      const gint value = luma[x];
 
-  if (! preview)
-    gimp_progress_init(_("Despeckle"));
+      if (luma_in_range (value))
+        {
+          columns[x].fine[value]        += delta;
+          columns[x].coarse[value >> 4] += delta;
+          columns[x].count              += delta;
+        }
+    }
+}
+
+static inline void
+window_reset (DespeckleWindow *win)
+{
+  gint k;
+
+  memset (win, 0, sizeof (DespeckleWindow));
+
+  for (k = 0; k < 16; k++)
+    win->synced[k] = G_MININT / 2;
+}
+
+static inline void
+window_add_column (DespeckleWindow       *win,
+                   const DespeckleColumn *col)
+{
+  gint k;
+
+  for (k = 0; k < 16; k++)
+    win->coarse[k] += col->coarse[k];
+
+  win->count += col->count;
+}
+
+static inline void
+window_remove_column (DespeckleWindow       *win,
+                      const DespeckleColumn *col)
+{
+  gint k;
+
+  for (k = 0; k < 16; k++)
+    win->coarse[k] -= col->coarse[k];
+
+  win->count -= col->count;
+}
+
+/* Bring fine segment @k up to date for a box centered on column @x,
+ * either by sliding it over the columns passed since it was last used
+ * or, when that would be more work, by summing the box from scratch.
+ */
+static inline void
+window_sync_segment (DespeckleWindow       *win,
+                     const DespeckleColumn *columns,
+                     gint                   width,
+                     gint                   radius,
+                     gint                   k,
+                     gint                   x)
+{
+  gint *fine = win->fine + (k << 4);
+  gint  last = win->synced[k];
+  gint  c, i;
+
+  if (last == x)
+    return;
 
-  adapt_radius = radius;
-  for (y = 0; y < height; y++)
+  if (x - last > radius)
+    {
+      const gint xmin = MAX (0, x - radius);
+      const gint xmax = MIN (width - 1, x + radius);
+
+      for (i = 0; i < 16; i++)
+        fine[i] = 0;
+
+      for (c = xmin; c <= xmax; c++)
+        {
+          const guint16 *col = columns[c].fine + (k << 4);
+
+          for (i = 0; i < 16; i++)
+            fine[i] += col[i];
+        }
+    }
+  else
+    {
+      for (c = last + 1; c <= x; c++)
+        {
+          if (c + radius < width)
+            {
+              const guint16 *col = columns[c + radius].fine + (k << 4);
+
+              for (i = 0; i < 16; i++)
+                fine[i] += col[i];
+            }
+
+          if (c - radius - 1 >= 0)
+            {
+              const guint16 *col = columns[c - radius - 1].fine + (k << 4);
+
+              for (i = 0; i < 16; i++)
+                fine[i] -= col[i];
+            }
+        }
+    }
+
+  win->synced[k] = x;
+}
+
+static inline gint
+window_get_median (DespeckleWindow       *win,
+                   const DespeckleColumn *columns,
+                   gint                   width,
+                   gint                   radius,
+                   gint                   x)
+{
+  gint count = (win->count + 1) / 2;
+  gint sum   = 0;
+  gint i     = 0;
+
+  while (sum + win->coarse[i] < count)
+    sum += win->coarse[i++];
+
+  window_sync_segment (win, columns, width, radius, i, x);
+
+  i <<= 4;
+  while ((sum += win->fine[i]) < count)
+    i++;
+
+  return i;
+}
+
+/* Change the luma of pixel (x, y) in the column and box histograms by
+ * @delta, used by the recursive filter when it overwrites a pixel.
+ */
+static inline void
+window_update_value (DespeckleWindow *win,
+                     DespeckleColumn *columns,
+                     gint             width,
+                     gint             radius,
+                     gint             x,
+                     gint             value,
+                     gint             delta)
+{
+  if (! luma_in_range (value))
+    return;
+
+  window_sync_segment (win, columns, width, radius, value >> 4, x);
+
+  columns[x].fine[value]        += delta;
+  columns[x].coarse[value >> 4] += delta;
+  columns[x].count              += delta;
+
+  win->fine[value]        += delta;
+  win->coarse[value >> 4] += delta;
+  win->count              += delta;
+}
+
+/* Find the pixel inside the box whose luma is @value and which lies
+ * closest to the box center.  The column histograms tell which columns
+ * to look at.  Returns the pixel index or -1.
+ */
+static inline gint
+window_find_value (const DespeckleColumn *columns,
+                   const guchar          *luma,
+                   gint                   width,
+                   gint                   x,
+                   gint                   y,
+                   gint                   xmin,
+                   gint                   ymin,
+                   gint                   xmax,
+                   gint                   ymax,
+                   gint                   value)
+{
+  const gint max_dx = MAX (x - xmin, xmax - x);
+  const gint max_dy = MAX (y - ymin, ymax - y);
+  gint       dx, dy;
+
+  for (dx = 0; dx <= max_dx; dx++)
+    {
+      gint side;
+
+      for (side = 0; side < (dx ? 2 : 1); side++)
+        {
+          const gint c = side ? x + dx : x - dx;
+
+          if (c < xmin || c > xmax || ! columns[c].fine[value])
+            continue;
+
+          for (dy = 0; dy <= max_dy; dy++)
+            {
+              if (y - dy >= ymin && luma[(y - dy) * width + c] == value)
+                return (y - dy) * width + c;
+
+              if (y + dy <= ymax && luma[(y + dy) * width + c] == value)
+                return (y + dy) * width + c;
+            }
+        }
+    }
+
+  return -1;
+}
+
+/*
+ * 'despeckle_median_band()' - Plain median of the rows y1 to y2 - 1.
+ *
+ * The columns are histograms of 2 * radius + 1 rows around the current
+ * row; they move down by one pixel per row, and the box histogram moves
+ * right by adding one column and removing another, so the cost per pixel
+ * does not depend on the radius.
+ */
+
+static void
+despeckle_median_band (DespeckleJob    *job,
+                       DespeckleColumn *columns,
+                       gint             y1,
+                       gint             y2)
+{
+  guchar          *src    = job->src;
+  guchar          *dst    = job->dst;
+  guchar          *luma   = job->luma;
+  const gint       width  = job->width;
+  const gint       height = job->height;
+  const gint       bpp    = job->bpp;
+  const gint       radius = job->radius;
+  DespeckleWindow  window;
+  gint             x, y;
+
+  memset (columns, 0, width * sizeof (DespeckleColumn));
+
+  for (y = MAX (0, y1 - radius); y <= MIN (height - 1, y1 + radius); y++)
+    columns_update_row (columns, luma + y * width, width, 1);
+
+  for (y = y1; y < y2; y++)
+    {
+      const gint ymin = MAX (0, y - radius);
+      const gint ymax = MIN (height - 1, y + radius);
+
+      if (y > y1)
+        {
+          if (y - radius - 1 >= 0)
+            columns_update_row (columns,
+                                luma + (y - radius - 1) * width, width, -1);
+
+          if (y + radius < height)
+            columns_update_row (columns,
+                                luma + (y + radius) * width, width, 1);
+        }
+
+      window_reset (&window);
+
+      for (x = 0; x <= MIN (radius, width - 1); x++)
+        window_add_column (&window, &columns[x]);
+
+      for (x = 0; x < width; x++)
+        {
+          const gint    pos   = x + y * width;
+          const guchar *pixel = src + pos * bpp;
+
+          if (x > 0)
+            {
+              if (x + radius < width)
+                window_add_column (&window, &columns[x + radius]);
+
+              if (x - radius - 1 >= 0)
+                window_remove_column (&window, &columns[x - radius - 1]);
+            }
+
+          if (window.count)
+            {
+              gint value = window_get_median (&window, columns,
+                                              width, radius, x);
+              gint found = window_find_value (columns, luma, width, x, y,
+                                              MAX (0, x - radius), ymin,
+                                              MIN (width - 1, x + radius),
+                                              ymax, value);
+
+              if (found >= 0 && found != pos)
+                {
+                  pixel = src + found * bpp;
+
+                  if (filter_type & FILTER_RECURSIVE)
+                    {
+                      window_update_value (&window, columns, width, radius,
+                                           x, luma[pos], -1);
+                      pixel_copy (src + pos * bpp, pixel, bpp);
+                      luma[pos] = value;
+                      window_update_value (&window, columns, width, radius,
+                                           x, luma[pos], 1);
+                    }
+                }
+            }
+
+          pixel_copy (dst + pos * bpp, pixel, bpp);
+        }
+    }
+}
+
+/*
+ * 'despeckle_adaptive_band()' - Adaptive median of the rows y1 to y2 - 1.
+ *
+ * The box size changes from pixel to pixel here, so the histogram of the
+ * box is updated directly as it moves.
+ */
+
+static void
+despeckle_adaptive_band (DespeckleJob       *job,
+                         DespeckleHistogram *hist,
+                         gint               *adapt_radius,
+                         gint                y1,
+                         gint                y2)
+{
+  guchar     *src    = job->src;
+  guchar     *dst    = job->dst;
+  const gint  width  = job->width;
+  const gint  height = job->height;
+  const gint  bpp    = job->bpp;
+  const gint  radius = job->radius;
+  gint        x, y;
+  gint        pos;
+  gint        ymin;
+  gint        ymax;
+  gint        xmin;
+  gint        xmax;
+
+  for (y = y1; y < y2; y++)
     {
       x = 0;
-      ymin = MAX (0, y - adapt_radius);
-      ymax = MIN (height - 1, y + adapt_radius);
-      xmin = MAX (0, x - adapt_radius);
-      xmax = MIN (width - 1, x + adapt_radius);
-      hist0   = 0;
-      histrest = 0;
-      hist255 = 0;
-      histogram_clean (&histogram);
-      histogram.xmin = xmin;
-      histogram.ymin = ymin;
-      histogram.xmax = xmax;
-      histogram.ymax = ymax;
-      add_vals (&histogram,
+      ymin = MAX (0, y - *adapt_radius);
+      ymax = MIN (height - 1, y + *adapt_radius);
+      xmin = MAX (0, x - *adapt_radius);
+      xmax = MIN (width - 1, x + *adapt_radius);
+      histogram_clean (hist);
+      hist->xmin = xmin;
+      hist->ymin = ymin;
+      hist->xmax = xmax;
+      hist->ymax = ymax;
+      add_vals (hist,
                 src, width, bpp,
-                histogram.xmin, histogram.ymin, histogram.xmax, histogram.ymax);
+                hist->xmin, hist->ymin, hist->xmax, hist->ymax);
 
       for (x = 0; x < width; x++)
         {
           const guchar *pixel;
 
-          ymin = MAX (0, y - adapt_radius); /* update ymin, ymax when adapt_radius changed (FILTER_ADAPTIVE) */
-          ymax = MIN (height - 1, y + adapt_radius);
-          xmin = MAX (0, x - adapt_radius);
-          xmax = MIN (width - 1, x + adapt_radius);
+          ymin = MAX (0, y - *adapt_radius); /* update ymin, ymax when adapt_radius changed (FILTER_ADAPTIVE) */
+          ymax = MIN (height - 1, y + *adapt_radius);
+          xmin = MAX (0, x - *adapt_radius);
+          xmax = MIN (width - 1, x + *adapt_radius);
 
-          update_histogram (&histogram,
-                            src, width, bpp, xmin, ymin, xmax, ymax);
+          update_histogram (hist, src, width, bpp, xmin, ymin, xmax, ymax);
 
           pos = (x + (y * width)) * bpp;
-          pixel = histogram_get_median (&histogram, src + pos);
+          pixel = histogram_get_median (hist, src + pos);
 
           if (filter_type & FILTER_RECURSIVE)
             {
-              del_val (&histogram, src, width, bpp, x, y);
+              del_val (hist, src, width, bpp, x, y);
               pixel_copy (src + pos, pixel, bpp);
-              add_val (&histogram, src, width, bpp, x, y);
+              add_val (hist, src, width, bpp, x, y);
             }
 
           pixel_copy (dst + pos, pixel, bpp);
@@ -918,26 +1282,133 @@ despeckle_median (guchar   *src,
           /*
            * Check the histogram and adjust the diameter accordingly...
            */
-          if (filter_type & FILTER_ADAPTIVE)
+          if (hist->hist0 >= *adapt_radius || hist->hist255 >= *adapt_radius)
             {
-              if (hist0 >= adapt_radius || hist255 >= adapt_radius)
-                {
-                  if (adapt_radius < radius)
-                    adapt_radius++;
-                }
-              else if (adapt_radius > 1)
-                {
-                  adapt_radius--;
-                }
+              if (*adapt_radius < radius)
+                (*adapt_radius)++;
+            }
+          else if (*adapt_radius > 1)
+            {
+              (*adapt_radius)--;
             }
         }
+    }
+}
+
+/*  Bands of rows are handed out from a shared counter.  Only the main
+ *  thread reports progress.  The adaptive filter starts every band with
+ *  the full radius and a random generator seeded from the band, so the
+ *  result doesn't depend on which thread takes which band.
+ */
+static void
+despeckle_process (DespeckleJob *job,
+                   gboolean      report_progress)
+{
+  DespeckleHistogram *hist         = NULL;
+  DespeckleColumn    *columns      = NULL;
+  gint                adapt_radius;
+  gint                y1;
+
+  if (filter_type & FILTER_ADAPTIVE)
+    {
+      hist = g_new0 (DespeckleHistogram, 1);
+      hist->gr = g_rand_new_with_seed (0);
+    }
+  else
+    {
+      columns = g_new (DespeckleColumn, job->width);
+    }
+
+  while ((y1 = g_atomic_int_add (&job->next_row, BAND_HEIGHT)) < job->height)
+    {
+      gint y2 = MIN (y1 + BAND_HEIGHT, job->height);
+
+      if (hist)
+        {
+          adapt_radius = job->radius;
+          g_rand_set_seed (hist->gr, y1);
+
+          despeckle_adaptive_band (job, hist, &adapt_radius, y1, y2);
+        }
+      else
+        despeckle_median_band (job, columns, y1, y2);
+
+      g_atomic_int_add (&job->rows_done, y2 - y1);
+
+      if (report_progress)
+        gimp_progress_update ((gdouble) g_atomic_int_get (&job->rows_done) /
+                              (gdouble) job->height);
+    }
+
+  if (hist)
+    {
+      g_rand_free (hist->gr);
+      g_free (hist);
+    }
+
+  g_free (columns);
+}
+
+static gpointer
+despeckle_thread (gpointer data)
+{
+  despeckle_process (data, FALSE);
 
-      progress += width;
+  return NULL;
+}
 
-      if (! preview && y % 32 == 0)
-        gimp_progress_update ((gdouble) progress / (gdouble) max_progress);
+static void
+despeckle_median (guchar   *src,
+                  guchar   *dst,
+                  gint      width,
+                  gint      height,
+                  gint      bpp,
+                  gint      radius,
+                  gboolean  preview)
+{
+  DespeckleJob  job = { 0, };
+  GThread      *threads[THREADS_MAX];
+  gint          n_threads;
+  gint          i;
+
+  job.src    = src;
+  job.dst    = dst;
+  job.width  = width;
+  job.height = height;
+  job.bpp    = bpp;
+  job.radius = radius;
+
+  if (! (filter_type & FILTER_ADAPTIVE))
+    {
+      job.luma = g_new (guchar, width * height);
+
+      for (i = 0; i < width * height; i++)
+        job.luma[i] = pixel_luminance (src + i * bpp, bpp);
     }
 
+  if (! preview)
+    gimp_progress_init(_("Despeckle"));
+
+  /* the recursive filter feeds its output back into the source, so
+   * bands would depend on the rows above them; keep it sequential
+   */
+  if (filter_type & FILTER_RECURSIVE)
+    n_threads = 1;
+  else
+    n_threads = MIN (threads_get_count (),
+                     (height + BAND_HEIGHT - 1) / BAND_HEIGHT);
+
+  for (i = 1; i < n_threads; i++)
+    threads[i] = g_thread_create (despeckle_thread, &job, TRUE, NULL);
+
+  despeckle_process (&job, ! preview);
+
+  for (i = 1; i < n_threads; i++)
+    if (threads[i])
+      g_thread_join (threads[i]);
+
   if (! preview)
     gimp_progress_update (1.0);
+
+  g_free (job.luma);
 }
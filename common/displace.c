@@ -50,6 +50,8 @@
 
 #include "libgimp/stdplugins-intl.h"
 
+#include "resampler.h"
+
 
 /* Some useful macros */
 
@@ -79,6 +81,20 @@ typedef struct
   DisplaceMode mode;
 } DisplaceVals;
 
+typedef struct
+{
+  guchar  *map_x;
+  guchar  *map_y;
+  gint     xm_alpha;
+  gint     ym_alpha;
+  gint     xm_bytes;
+  gint     ym_bytes;
+  gint     x1, y1;
+  gint     width;
+  gdouble  cx, cy;
+  gint     bytes;
+} DisplaceParam;
+
 
 /*
  * Function prototypes.
@@ -101,12 +117,12 @@ static void      displace_radio_update   (GtkWidget     *widget,
 static void      displace_set_labels     (void);
 static gint      displace_get_label_size (void);
 
-static gboolean  displace_map_constrain    (gint32     image_id,
-                                            gint32     drawable_id,
-                                            gpointer   data);
-static gdouble   displace_map_give_value   (guchar    *ptr,
-                                            gint       alpha,
-                                            gint       bytes);
+static gboolean  displace_map_constrain    (gint32        image_id,
+                                            gint32        drawable_id,
+                                            gpointer      data);
+static gdouble   displace_map_give_value   (const guchar *ptr,
+                                            gint          alpha,
+                                            gint          bytes);
 
 /***** Local vars *****/
 
@@ -506,71 +522,172 @@ displace_dialog (GimpDrawable *drawable)
   return run;
 }
 
+/* Reads the part of a displacement map under the destination area. */
+
+static guchar *
+displace_map_read (gint32  drawable_id,
+                   gint    x1,
+                   gint    y1,
+                   gint    width,
+                   gint    height,
+                   gint   *bytes,
+                   gint   *alpha)
+{
+  GimpDrawable *map;
+  GimpPixelRgn  map_rgn;
+  guchar       *buffer;
+
+  map = gimp_drawable_get (drawable_id);
+
+  *alpha = gimp_drawable_has_alpha (map->drawable_id) ? 1 : 0;
+  *bytes = map->bpp;
+
+  buffer = g_new (guchar, width * height * map->bpp);
+
+  gimp_pixel_rgn_init (&map_rgn, map, x1, y1, width, height, FALSE, FALSE);
+  gimp_pixel_rgn_get_rect (&map_rgn, buffer, x1, y1, width, height);
+
+  gimp_drawable_detach (map);
+
+  return buffer;
+}
+
 /* The displacement is done here. */
 
 static void
-displace (GimpDrawable *drawable,
-          GimpPreview  *preview)
+displace_row (const Resampler *resampler,
+              gint             x,
+              gint             y,
+              gint             width,
+              const guchar    *src,
+              guchar          *dest,
+              gpointer         data)
 {
-  GimpDrawable     *map_x = NULL;
-  GimpDrawable     *map_y = NULL;
-  GimpPixelRgn      dest_rgn;
-  GimpPixelRgn      map_x_rgn;
-  GimpPixelRgn      map_y_rgn;
-  gpointer          pr;
-  GimpPixelFetcher *pft;
-
-  gint              width;
-  gint              height;
-  gint              bytes;
-  guchar           *destrow, *dest;
-  guchar           *mxrow, *mx;
-  guchar           *myrow, *my;
-  guchar            pixel[4][4];
-  gint              x1, y1;
-  gint              x, y;
-  gdouble           cx, cy;
-  gint              progress, max_progress;
-
-  gdouble           amnt;
-  gdouble           needx, needy;
-  gdouble           radius, d_alpha;
-  gint              xi, yi;
-
-  guchar            values[4];
-  guchar            val;
-
-  gint              k;
-
-  gdouble           xm_val, ym_val;
-  gint              xm_alpha = 0;
-  gint              ym_alpha = 0;
-  gint              xm_bytes = 1;
-  gint              ym_bytes = 1;
-  guchar           *buffer   = NULL;
-  gdouble           pi;
-
-  /* initialize */
+  const DisplaceParam *param = data;
+  const guchar        *mx    = NULL;
+  const guchar        *my    = NULL;
+  guchar               scratch[4 * 4];
+  guchar              *pixel[4];
+  gdouble              cx    = param->cx;
+  gdouble              cy    = param->cy;
+  gdouble              amnt;
+  gdouble              needx, needy;
+  gdouble              radius, d_alpha;
+  gdouble              xm_val, ym_val;
+  guchar               values[4];
+  gint                 xi, yi;
+  gint                 k;
 
   /* get rid of uninitialized warnings */
-  cx = cy = needx = needy = radius = d_alpha = 0.0;
+  needx = needy = radius = d_alpha = 0.0;
+
+  if (param->map_x)
+    mx = param->map_x + ((y - param->y1) * param->width +
+                         (x - param->x1)) * param->xm_bytes;
+  if (param->map_y)
+    my = param->map_y + ((y - param->y1) * param->width +
+                         (x - param->x1)) * param->ym_bytes;
+
+  for (; width--; x++)
+    {
+      if (mx)
+        {
+          xm_val = displace_map_give_value (mx, param->xm_alpha,
+                                            param->xm_bytes);
+          amnt = dvals.amount_x * (xm_val - 127.5) / 127.5;
+          /* CARTESIAN_MODE == 0 - performance important here */
+          if (! dvals.mode)
+            {
+              needx = x + amnt;
+            }
+          else
+            {
+              radius = sqrt (SQR (x - cx) + SQR (y - cy)) + amnt;
+            }
+          mx += param->xm_bytes;
+        }
+      else
+        {
+          if (! dvals.mode)
+            needx = x;
+          else
+            radius = sqrt ((x - cx) * (x - cx) + (y - cy) * (y - cy));
+        }
+
+      if (my)
+        {
+          ym_val = displace_map_give_value (my, param->ym_alpha,
+                                            param->ym_bytes);
+          amnt = dvals.amount_y * (ym_val - 127.5) / 127.5;
+          if (! dvals.mode)
+            {
+              needy = y + amnt;
+            }
+          else
+            {
+              d_alpha = atan2 (x - cx, y - cy) + (dvals.amount_y / 180)
+                        * G_PI * (ym_val - 127.5) / 127.5;
+            }
+          my += param->ym_bytes;
+        }
+      else
+        {
+          if (! dvals.mode)
+            needy = y;
+          else
+            d_alpha = atan2 (x - cx, y - cy);
+        }
 
-  pi = 4 * atan (1);
+      if (dvals.mode)
+        {
+          needx = cx + radius * sin (d_alpha);
+          needy = cy + radius * cos (d_alpha);
+        }
+
+      /* Calculations complete; now copy the proper pixel */
 
-  mxrow = NULL;
-  myrow = NULL;
+      if (needx >= 0.0)
+        xi = (int) needx;
+      else
+        xi = -((int) -needx + 1);
 
-  pft = gimp_pixel_fetcher_new (drawable, FALSE);
-  gimp_pixel_fetcher_set_edge_mode (pft, dvals.displace_type);
+      if (needy >= 0.0)
+        yi = (int) needy;
+      else
+        yi = -((int) -needy + 1);
 
-  bytes  = drawable->bpp;
+      resampler_get_quad (resampler, xi, yi, pixel, scratch);
 
+      for (k = 0; k < param->bytes; k++)
+        {
+          values[0] = pixel[0][k];
+          values[1] = pixel[1][k];
+          values[2] = pixel[2][k];
+          values[3] = pixel[3][k];
+
+          *dest++ = gimp_bilinear_8 (needx, needy, values);
+        }
+    }
+}
+
+static void
+displace (GimpDrawable *drawable,
+          GimpPreview  *preview)
+{
+  Resampler     *resampler;
+  DisplaceParam  param = { NULL, };
+  gint           x1, y1;
+  gint           width, height;
+
+  /*
+   * The algorithm used here is simple - see
+   * http://the-tech.mit.edu/KPT/Tips/KPT7/KPT7.html for a description.
+   */
 
   if (preview)
     {
       gimp_preview_get_position (preview, &x1, &y1);
       gimp_preview_get_size (preview, &width, &height);
-      buffer = g_new (guchar, width * height * bytes);
     }
   else if (! gimp_drawable_mask_intersect (drawable->drawable_id, &x1, &y1,
                                            &width, &height))
@@ -578,209 +695,68 @@ displace (GimpDrawable *drawable,
       return;
     }
 
+  param.x1    = x1;
+  param.y1    = y1;
+  param.width = width;
+  param.bytes = drawable->bpp;
+
   if (dvals.mode == POLAR_MODE)
     {
-      cx = x1 + width / 2.0;
-      cy = y1 + height / 2.0;
+      param.cx = x1 + width / 2.0;
+      param.cy = y1 + height / 2.0;
     }
 
-  progress     = 0;
-  max_progress = width * height;
-
-  /*
-   * The algorithm used here is simple - see
-   * http://the-tech.mit.edu/KPT/Tips/KPT7/KPT7.html for a description.
-   */
-
-  /* Get the drawables  */
+  /* The maps are read up front, so the rows can be done in parallel. */
   if (dvals.displace_map_x != -1 && dvals.do_x)
-    {
-      map_x = gimp_drawable_get (dvals.displace_map_x);
-      gimp_pixel_rgn_init (&map_x_rgn, map_x,
-                           x1, y1, width, height, FALSE, FALSE);
-
-      if (gimp_drawable_has_alpha (map_x->drawable_id))
-        xm_alpha = 1;
-
-      xm_bytes = gimp_drawable_bpp (map_x->drawable_id);
-    }
+    param.map_x = displace_map_read (dvals.displace_map_x,
+                                     x1, y1, width, height,
+                                     &param.xm_bytes, &param.xm_alpha);
 
   if (dvals.displace_map_y != -1 && dvals.do_y)
-    {
-      map_y = gimp_drawable_get (dvals.displace_map_y);
-      gimp_pixel_rgn_init (&map_y_rgn, map_y,
-                           x1, y1, width, height, FALSE, FALSE);
-
-      if (gimp_drawable_has_alpha (map_y->drawable_id))
-        ym_alpha = 1;
-
-      ym_bytes = gimp_drawable_bpp (map_y->drawable_id);
-    }
-
-  gimp_pixel_rgn_init (&dest_rgn, drawable,
-                       x1, y1, width, height,
-                       preview == NULL, preview == NULL);
-
-  /*  Register the pixel regions  */
-  if (dvals.do_x && dvals.do_y)
-    pr = gimp_pixel_rgns_register (3, &dest_rgn, &map_x_rgn, &map_y_rgn);
-  else if (dvals.do_x)
-    pr = gimp_pixel_rgns_register (2, &dest_rgn, &map_x_rgn);
-  else if (dvals.do_y)
-    pr = gimp_pixel_rgns_register (2, &dest_rgn, &map_y_rgn);
-  else
-    pr = NULL;
+    param.map_y = displace_map_read (dvals.displace_map_y,
+                                     x1, y1, width, height,
+                                     &param.ym_bytes, &param.ym_alpha);
 
-  for (pr = pr; pr != NULL; pr = gimp_pixel_rgns_process (pr))
+  if (preview)
     {
-      destrow = dest_rgn.data;
-      if (dvals.do_x)
-        mxrow = map_x_rgn.data;
-      if (dvals.do_y)
-        myrow = map_y_rgn.data;
+      guchar *buffer = g_new (guchar, width * height * param.bytes);
+      gint    pad    = 1;
 
-      for (y = dest_rgn.y; y < (dest_rgn.y + dest_rgn.h); y++)
-        {
-          if (preview)
-            dest = buffer + ((y - y1) * width + (dest_rgn.x - x1)) * bytes;
-          else
-            dest = destrow;
-          mx = mxrow;
-          my = myrow;
-
-          /*
-           * We could move the displacement image address calculation
-           * out of here, but when we can have different sized
-           * displacement and destination images we'd have to move it
-           * back anyway.
-           */
-
-          for (x = dest_rgn.x; x < (dest_rgn.x + dest_rgn.w); x++)
-            {
-              if (dvals.do_x)
-                {
-                  xm_val = displace_map_give_value(mx, xm_alpha, xm_bytes);
-                  amnt = dvals.amount_x * (xm_val - 127.5) / 127.5;
-                  /* CARTESIAN_MODE == 0 - performance important here */
-                  if (! dvals.mode)
-                    {
-                      needx = x + amnt;
-                    }
-                  else
-                    {
-                      radius = sqrt (SQR (x - cx) + SQR (y - cy)) + amnt;
-                    }
-                  mx += xm_bytes;
-                }
-              else
-                {
-                  if (! dvals.mode)
-                    needx = x;
-                  else
-                    radius = sqrt ((x - cx) * (x - cx) + (y - cy) * (y - cy));
-                }
-
-
-              if (dvals.do_y)
-                {
-                  ym_val = displace_map_give_value(my, ym_alpha, ym_bytes);
-                  amnt = dvals.amount_y * (ym_val - 127.5) / 127.5;
-                  if (! dvals.mode)
-                    {
-                      needy = y + amnt;
-                    }
-                  else
-                    {
-                      d_alpha = atan2 (x - cx, y - cy) + (dvals.amount_y / 180)
-                                * pi * (ym_val - 127.5) / 127.5;
-                    }
-                  my += ym_bytes;
-                }
-              else
-                {
-                  if (! dvals.mode)
-                    needy = y;
-                  else
-                    d_alpha = atan2 (x - cx, y - cy);
-                }
-              if (dvals.mode)
-                {
-                   needx = cx + radius * sin (d_alpha);
-                   needy = cy + radius * cos (d_alpha);
-                }
-              /* Calculations complete; now copy the proper pixel */
-
-              if (needx >= 0.0)
-                xi = (int) needx;
-              else
-                xi = -((int) -needx + 1);
-
-              if (needy >= 0.0)
-                yi = (int) needy;
-              else
-                yi = -((int) -needy + 1);
-
-              gimp_pixel_fetcher_get_pixel (pft, xi, yi, pixel[0]);
-              gimp_pixel_fetcher_get_pixel (pft, xi + 1, yi, pixel[1]);
-              gimp_pixel_fetcher_get_pixel (pft, xi, yi + 1, pixel[2]);
-              gimp_pixel_fetcher_get_pixel (pft, xi + 1, yi + 1, pixel[3]);
-
-              for (k = 0; k < bytes; k++)
-                {
-                  values[0] = pixel[0][k];
-                  values[1] = pixel[1][k];
-                  values[2] = pixel[2][k];
-                  values[3] = pixel[3][k];
-                  val = gimp_bilinear_8 (needx, needy, values);
-
-                  *dest++ = val;
-                } /* for */
-            }
+      /*  the cartesian displacement is bounded by the amounts, the
+       *  polar one is not; pixels outside the area are fetched singly
+       */
+      if (dvals.mode == CARTESIAN_MODE)
+        pad += ceil (MAX (fabs (dvals.amount_x), fabs (dvals.amount_y)));
 
-          destrow += dest_rgn.rowstride;
+      resampler = resampler_new_area (drawable,
+                                      x1 - pad, y1 - pad,
+                                      width + 2 * pad, height + 2 * pad);
+      resampler_set_edge_mode (resampler, dvals.displace_type);
 
-          if (dvals.do_x)
-            mxrow += map_x_rgn.rowstride;
-          if (dvals.do_y)
-            myrow += map_y_rgn.rowstride;
-        }
-
-      if (!preview)
-        {
-          progress += dest_rgn.w * dest_rgn.h;
-          gimp_progress_update ((double) progress / (double) max_progress);
-        }
-    } /* for */
-
-  gimp_pixel_fetcher_destroy (pft);
-
-  /*  detach from the map drawables  */
-  if (dvals.do_x)
-    gimp_drawable_detach (map_x);
-  if (dvals.do_y)
-    gimp_drawable_detach (map_y);
+      resampler_render_buffer (resampler, x1, y1, width, height, buffer,
+                               displace_row, &param);
 
-  if (preview)
-    {
-/*      gimp_drawable_preview_draw_region (GIMP_DRAWABLE_PREVIEW (preview),
-                                         &dest_rgn);*/
-      gimp_preview_draw_buffer (preview, buffer, width * bytes);
+      gimp_preview_draw_buffer (preview, buffer, width * param.bytes);
       g_free (buffer);
     }
   else
     {
-      gimp_progress_update (1.0);
-      /*  update the region  */
-      gimp_drawable_flush (drawable);
-      gimp_drawable_merge_shadow (drawable->drawable_id, TRUE);
-      gimp_drawable_update (drawable->drawable_id, x1, y1, width, height);
+      resampler = resampler_new (drawable);
+      resampler_set_edge_mode (resampler, dvals.displace_type);
+
+      resampler_render (resampler, drawable, displace_row, &param);
     }
+
+  resampler_free (resampler);
+
+  g_free (param.map_x);
+  g_free (param.map_y);
 }
 
 static gdouble
-displace_map_give_value (guchar *pt,
-                         gint    alpha,
-                         gint    bytes)
+displace_map_give_value (const guchar *pt,
+                         gint          alpha,
+                         gint          bytes)
 {
   gdouble ret, val_alpha;
 
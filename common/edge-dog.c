@@ -33,11 +33,16 @@
 
 #include "libgimp/stdplugins-intl.h"
 
+#include "threads.h"
+
 
 #define PLUG_IN_PROC   "plug-in-dog"
+#define PLUG_IN_PROC2  "plug-in-dog2"
 #define PLUG_IN_BINARY "edge-dog"
 #define PLUG_IN_ROLE   "gimp-edge-dog"
 
+#define CHUNK_SIZE     16   /* columns or rows handed out at a time */
+
 
 typedef struct
 {
@@ -45,8 +50,43 @@ typedef struct
   gdouble  outer;
   gboolean normalize;
   gboolean invert;
+  gboolean signed_diff;
 } DoGValues;
 
+typedef enum
+{
+  DOG_PASS_VERTICAL,
+  DOG_PASS_HORIZONTAL,
+  DOG_PASS_NORMALIZE
+} DoGPass;
+
+typedef struct
+{
+  gint *sum;      /* cumulative curve, indexed from -length to length */
+  gint  length;
+  gint  total;
+} DoGCurve;
+
+typedef struct
+{
+  const guchar *src;
+  guchar       *dest;
+  guchar       *diff;       /* signed difference, NULL if not wanted */
+  guchar       *blur1;      /* both images after the vertical pass */
+  guchar       *blur2;
+  guchar       *row_max;    /* largest difference in each row */
+  gint          width;
+  gint          height;
+  gint          bpp;
+  gboolean      has_alpha;
+  DoGCurve      curves[2];
+  gdouble       factor;
+  gint          pass;
+  gint          n_items;
+  gint          next;
+  gint          done;
+} DoGJob;
+
 
 /* Declare local functions.
  */
@@ -60,21 +100,17 @@ static void      run    (const gchar      *name,
 static gint      dog_dialog           (gint32        image_ID,
                                        GimpDrawable *drawable);
 
-static void      gauss_rle            (GimpDrawable *drawable,
-                                       gdouble       radius,
-                                       gint          pass,
+static void      dog_buffer           (const guchar *src,
+                                       guchar       *dest,
+                                       guchar       *diff,
+                                       gint          width,
+                                       gint          height,
+                                       gint          bpp,
+                                       gboolean      has_alpha,
+                                       gdouble       inner,
+                                       gdouble       outer,
                                        gboolean      show_progress);
 
-static void      compute_difference   (GimpDrawable *drawable,
-                                       GimpDrawable *drawable1,
-                                       GimpDrawable *drawable2,
-                                       guchar       *maxval);
-
-static void      normalize_invert     (GimpDrawable *drawable,
-                                       gboolean      normalize,
-                                       guint         maxval,
-                                       gboolean      invert);
-
 static void      dog                  (gint32        image_ID,
                                        GimpDrawable *drawable,
                                        gdouble       inner,
@@ -112,7 +148,8 @@ static DoGValues dogvals =
   3.0,  /* inner radius  */
   1.0,  /* outer radius  */
   TRUE, /* normalize     */
-  TRUE  /* invert        */
+  TRUE, /* invert        */
+  FALSE /* signed diff   */
 };
 
 MAIN ()
@@ -131,6 +168,18 @@ query (void)
     { GIMP_PDB_INT32,    "invert",    "Invert { TRUE, FALSE }" }
   };
 
+  static const GimpParamDef args2[] =
+  {
+    { GIMP_PDB_INT32,    "run-mode",    "The run mode { RUN-INTERACTIVE (0), RUN-NONINTERACTIVE (1) }" },
+    { GIMP_PDB_IMAGE,    "image",       "Input image" },
+    { GIMP_PDB_DRAWABLE, "drawable",    "Input drawable" },
+    { GIMP_PDB_FLOAT,    "inner",       "Radius of inner gaussian blur (in pixels, > 0.0)" },
+    { GIMP_PDB_FLOAT,    "outer",       "Radius of outer gaussian blur (in pixels, > 0.0)" },
+    { GIMP_PDB_INT32,    "normalize",   "Normalize { TRUE, FALSE }" },
+    { GIMP_PDB_INT32,    "invert",      "Invert { TRUE, FALSE }" },
+    { GIMP_PDB_INT32,    "signed-diff", "Also add the signed difference as a new layer, offset by half the range { TRUE, FALSE }" }
+  };
+
   gimp_install_procedure (PLUG_IN_PROC,
                           N_("Edge detection with control of edge thickness"),
                           "Applies two Gaussian blurs to the drawable, and "
@@ -146,6 +195,20 @@ query (void)
                           args, NULL);
 
   gimp_plugin_menu_register (PLUG_IN_PROC, "<Image>/Filters/Edge-Detect");
+
+  gimp_install_procedure (PLUG_IN_PROC2,
+                          "Edge detection with control of edge thickness",
+                          "Same as plug-in-dog, with an additional argument "
+                          "to also add the signed difference of the two "
+                          "blurs as a new layer.",
+                          "The GIMP Team",
+                          "The GIMP Team",
+                          "2026",
+                          NULL,
+                          "RGB*, GRAY*",
+                          GIMP_PLUGIN,
+                          G_N_ELEMENTS (args2), 0,
+                          args2, NULL);
 }
 
 static void
@@ -191,7 +254,8 @@ run (const gchar      *name,
                               (MAX (drawable->width, drawable->height) /
                                gimp_tile_width () + 1));
 
-      if (strcmp (name, PLUG_IN_PROC) == 0)
+      if (strcmp (name, PLUG_IN_PROC)  == 0 ||
+          strcmp (name, PLUG_IN_PROC2) == 0)
         {
           switch (run_mode)
             {
@@ -206,7 +270,7 @@ run (const gchar      *name,
 
             case GIMP_RUN_NONINTERACTIVE:
               /*  Make sure all the arguments are there!  */
-              if (nparams != 7)
+              if (nparams != (strcmp (name, PLUG_IN_PROC2) == 0 ? 8 : 7))
                 status = GIMP_PDB_CALLING_ERROR;
 
               if (status == GIMP_PDB_SUCCESS)
@@ -215,6 +279,8 @@ run (const gchar      *name,
                   dogvals.outer     = param[4].data.d_float;
                   dogvals.normalize = param[5].data.d_int32;
                   dogvals.invert    = param[6].data.d_int32;
+                  dogvals.signed_diff = (nparams == 8 &&
+                                         param[7].data.d_int32);
 
                   if (dogvals.inner <= 0.0 || dogvals.outer <= 0.0)
                     status = GIMP_PDB_CALLING_ERROR;
@@ -381,6 +447,15 @@ dog_dialog (gint32        image_ID,
                             preview);
   gtk_widget_show (button);
 
+  button = gtk_check_button_new_with_mnemonic (_("Add _signed difference layer"));
+  gtk_box_pack_start (GTK_BOX (main_vbox), button, FALSE, FALSE, 0);
+  gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (button),
+                                dogvals.signed_diff);
+  g_signal_connect (button, "toggled",
+                    G_CALLBACK (gimp_toggle_button_update),
+                    &dogvals.signed_diff);
+  gtk_widget_show (button);
+
   gtk_widget_show (dialog);
 
   run = (gimp_dialog_run (GIMP_DIALOG (dialog)) == GTK_RESPONSE_OK);
@@ -445,448 +520,470 @@ separate_alpha (guchar *buf,
     }
 }
 
+/*
+ * Set up the cumulative curve of a blur with the given radius.  Without
+ * a radius (<= 0) there is no curve and the blur leaves its input alone.
+ */
 static void
-dog (gint32        image_ID,
-     GimpDrawable *drawable,
-     gdouble       inner,
-     gdouble       outer,
-     gboolean      show_progress)
+dog_curve_init (DoGCurve *curve,
+                gdouble   radius)
 {
-  GimpDrawable *drawable1;
-  GimpDrawable *drawable2;
-  gint32        drawable_id = drawable->drawable_id;
-  gint32        layer1;
-  gint32        layer2;
-  gint          width, height;
-  gint          x1, y1, x2, y2;
-  guchar        maxval = 255;
-
-  gimp_drawable_mask_bounds (drawable_id, &x1, &y1, &x2, &y2);
-
-  width  = (x2 - x1);
-  height = (y2 - y1);
-
-  gimp_drawable_flush (drawable);
-
-  layer1 = gimp_layer_copy (drawable_id);
-  gimp_item_set_visible (layer1, FALSE);
-  gimp_item_set_name (layer1, "dog_scratch_layer1");
-  gimp_image_insert_layer (image_ID, layer1,
-                           gimp_item_get_parent (drawable_id), 0);
+  gint    *kernel;
+  gint    *sum;
+  gint     length;
+  gint     i;
+  gdouble  std_dev;
 
-  layer2 = gimp_layer_copy (drawable_id);
-  gimp_item_set_visible (layer2, FALSE);
-  gimp_item_set_name (layer2, "dog_scratch_layer2");
-  gimp_image_insert_layer (image_ID, layer2,
-                           gimp_item_get_parent (drawable_id), 0);
+  curve->sum = NULL;
 
-  drawable1 = gimp_drawable_get (layer1);
-  drawable2 = gimp_drawable_get (layer2);
+  if (radius <= 0.0)
+    return;
 
-  gauss_rle (drawable1, inner, 0, show_progress);
-  gauss_rle (drawable2, outer, 1, show_progress);
+  radius = fabs (radius) + 1.0;
+  std_dev = sqrt (-(radius * radius) / (2 * log (1.0 / 255.0)));
 
-  compute_difference (drawable, drawable1, drawable2, &maxval);
+  kernel = make_curve (std_dev, &length);
+  sum = g_new (gint, 2 * length + 1);
 
-  gimp_drawable_detach (drawable1);
-  gimp_drawable_detach (drawable2);
+  sum[0] = 0;
 
-  gimp_image_remove_layer (image_ID, layer1);
-  gimp_image_remove_layer (image_ID, layer2);
+  for (i = 1; i <= length*2; i++)
+    sum[i] = kernel[i-length-1] + sum[i-1];
+  sum += length;
 
-  gimp_drawable_flush (drawable);
-  gimp_drawable_merge_shadow (drawable_id, TRUE);
-  gimp_drawable_update (drawable_id, x1, y1, width, height);
+  g_free (kernel - length);
 
-  if (dogvals.normalize || dogvals.invert)
-    /* gimp_invert doesn't work properly with previews due to shadow handling
-     * so reimplement it here - see Bug 557380
-     */
-    {
-      normalize_invert (drawable, dogvals.normalize, maxval, dogvals.invert);
-      gimp_drawable_flush (drawable);
-      gimp_drawable_merge_shadow (drawable_id, TRUE);
-      gimp_drawable_update (drawable_id, x1, y1, width, height);
-    }
+  curve->sum    = sum;
+  curve->length = length;
+  curve->total  = sum[length] - sum[-length];
 }
 
-
 static void
-compute_difference (GimpDrawable *drawable,
-                    GimpDrawable *drawable1,
-                    GimpDrawable *drawable2,
-                    guchar       *maxval)
+dog_curve_free (DoGCurve *curve)
 {
-  GimpPixelRgn src1_rgn, src2_rgn, dest_rgn;
-  gint         width, height;
-  gint         bpp;
-  gpointer     pr;
-  gint         x, y, k;
-  gint         x1, y1, x2, y2;
-  gboolean     has_alpha;
-
-  *maxval = 0;
-
-  gimp_drawable_mask_bounds (drawable->drawable_id, &x1, &y1, &x2, &y2);
-
-  width  = (x2 - x1);
-  height = (y2 - y1);
-
-  if (width < 1 || height < 1)
-    return;
-
-  bpp = drawable->bpp;
-  has_alpha = gimp_drawable_has_alpha (drawable->drawable_id);
-
-  gimp_pixel_rgn_init (&src1_rgn,
-                       drawable1, 0, 0, drawable1->width, drawable1->height,
-                       FALSE, FALSE);
-  gimp_pixel_rgn_init (&src2_rgn,
-                       drawable2, 0, 0, drawable1->width, drawable1->height,
-                       FALSE, FALSE);
-  gimp_pixel_rgn_init (&dest_rgn,
-                       drawable, 0, 0, drawable->width, drawable->height,
-                       TRUE, TRUE);
-
-  for (pr = gimp_pixel_rgns_register (3, &src1_rgn, &src2_rgn, &dest_rgn);
-       pr != NULL;
-       pr = gimp_pixel_rgns_process (pr))
-    {
-      guchar *src1 = src1_rgn.data;
-      guchar *src2 = src2_rgn.data;
-      guchar *dest = dest_rgn.data;
-      gint    row  = src1_rgn.y - y1;
-
-      for (y = 0; y < src1_rgn.h; y++, row++)
-        {
-          guchar *s1  = src1;
-          guchar *s2  = src2;
-          guchar *d   = dest;
-          gint    col = src1_rgn.x - x1;
+  if (curve->sum)
+    g_free (curve->sum - curve->length);
+}
 
-          for (x = 0; x < src1_rgn.w; x++, col++)
-            {
+/*
+ * Premultiply a line of pixels into 'premult' and run-length encode
+ * each of its channels into 'rle'.
+ */
+static void
+encode_pixels (const DoGJob *job,
+               const guchar *src,
+               guchar       *premult,
+               gint         *rle,
+               gint          n)
+{
+  gint bytes = job->bpp;
+  gint b;
 
-              if (has_alpha)
-                {
-                  for (k = 0; k < bpp-1; k++)
-                    {
-                      d[k] = CLAMP0255 (s1[k] - s2[k]);
-                      *maxval = MAX (d[k], *maxval);
-                    }
-                }
-              else
-                {
-                  for (k = 0; k < bpp; k++)
-                    {
-                      d[k] = CLAMP0255 (s1[k] - s2[k]);
-                      *maxval = MAX (d[k], *maxval);
-                    }
-                }
+  memcpy (premult, src, n * bytes);
 
-              s1 += bpp;
-              s2 += bpp;
-              d += bpp;
-            }
+  if (job->has_alpha)
+    multiply_alpha (premult, n, bytes);
 
-          src1 += src1_rgn.rowstride;
-          src2 += src2_rgn.rowstride;
-          dest += dest_rgn.rowstride;
-        }
-    }
+  for (b = 0; b < bytes; b++)
+    run_length_encode (premult + b, rle + b * n * 2, bytes, n);
 }
 
-
+/*
+ * Blur a line of pixels encoded by encode_pixels().  Without a curve
+ * the separated source line is copied instead.
+ */
 static void
-normalize_invert (GimpDrawable *drawable,
-                  gboolean      normalize,
-                  guint         maxval,
-                  gboolean      invert)
+blur_pixels (const DoGJob   *job,
+             const DoGCurve *curve,
+             const guchar   *premult,
+             const gint     *rle,
+             const guchar   *src,
+             guchar         *dest,
+             gint            n)
 {
-  GimpPixelRgn src_rgn, dest_rgn;
-  gint         bpp;
-  gpointer     pr;
-  gint         x, y, k;
-  gint         x1, y1, x2, y2;
-  gboolean     has_alpha;
-  gdouble      factor;
-
-  if (normalize && maxval != 0) {
-      factor = 255.0 / maxval;
+  const gint *sum    = curve->sum;
+  gint        length = curve->length;
+  gint        bytes  = job->bpp;
+  gint        initial_p, initial_m;
+  gint        pos, i, b, start, end, val, pixels;
+  const gint *bb;
+
+  if (! sum)
+    {
+      memcpy (dest, src, n * bytes);
+      return;
     }
-  else
-    factor = 1.0;
 
-  gimp_drawable_mask_bounds (drawable->drawable_id, &x1, &y1, &x2, &y2);
-  bpp = drawable->bpp;
-  has_alpha = gimp_drawable_has_alpha(drawable->drawable_id);
-
-  gimp_pixel_rgn_init (&src_rgn,
-                       drawable, 0, 0, drawable->width, drawable->height,
-                       FALSE, FALSE);
-  gimp_pixel_rgn_init (&dest_rgn,
-                       drawable, 0, 0, drawable->width, drawable->height,
-                       TRUE, TRUE);
-
-  for (pr = gimp_pixel_rgns_register (2, &src_rgn, &dest_rgn);
-       pr != NULL;
-       pr = gimp_pixel_rgns_process (pr))
+  for (b = 0; b < bytes; b++, rle += n * 2)
     {
-      guchar *src  = src_rgn.data;
-      guchar *dest = dest_rgn.data;
-      gint    row  = src_rgn.y - y1;
+      initial_p = premult[b];
+      initial_m = premult[(n-1) * bytes + b];
 
-      for (y = 0; y < src_rgn.h; y++, row++)
+      for (pos = 0; pos < n; pos++)
         {
-          guchar *s   = src;
-          guchar *d   = dest;
-          gint    col = src_rgn.x - x1;
+          start = (pos < length) ? -pos : -length;
+          end = (n <= (pos + length)) ? (n - pos - 1) : length;
+
+          val = 0;
+          i = start;
+          bb = rle + (pos + i) * 2;
 
-          for (x = 0; x < src_rgn.w; x++, col++)
+          if (start != -length)
+            val += initial_p * (sum[start] - sum[-length]);
+
+          while (i < end)
             {
+              pixels = bb[0];
+              i += pixels;
 
-              if (has_alpha)
-                {
-                  for (k = 0; k < bpp-1; k++)
-                    {
-                      d[k] = factor * s[k];
-                      if (invert)
-                        d[k] = 255 - d[k];
-                    }
-                }
-              else
-                {
-                  for (k = 0; k < bpp; k++)
-                    {
-                      d[k] = factor * s[k];
-                      if (invert)
-                        d[k] = 255 - d[k];
-                    }
-                }
+              if (i > end)
+                i = end;
 
-              s += bpp;
-              d += bpp;
+              val += bb[1] * (sum[i] - sum[start]);
+              bb += (pixels * 2);
+              start = i;
             }
 
-          src += src_rgn.rowstride;
-          dest += dest_rgn.rowstride;
+          if (end != length)
+            val += initial_m * (sum[length] - sum[end]);
+
+          dest[pos * bytes + b] = val / curve->total;
         }
     }
-}
 
+  if (job->has_alpha)
+    separate_alpha (dest, n, bytes);
+}
 
+/*  The vertical pass: both blurs share one read of the column.  */
 static void
-gauss_rle (GimpDrawable *drawable,
-           gdouble       radius,
-           gint          pass,
-           gboolean      show_progress)
+dog_column (DoGJob *job,
+            gint    col,
+            gint   *rle,
+            guchar *line)
 {
-  GimpPixelRgn src_rgn, dest_rgn;
-  gint     width, height;
-  gint     bytes;
-  gint     has_alpha;
-  guchar  *dest, *dp;
-  guchar  *src, *sp;
-  gint    *buf, *bb;
-  gint     pixels;
-  gint     total = 1;
-  gint     x1, y1, x2, y2;
-  gint     i, row, col, b;
-  gint     start, end;
-  gdouble  progress, max_progress;
-  gint    *curve;
-  gint    *sum = NULL;
-  gint     val;
-  gint     length;
-  gint     initial_p, initial_m;
-  gdouble  std_dev;
-
-  if (radius <= 0.0)
-    return;
-
-  gimp_drawable_mask_bounds (drawable->drawable_id, &x1, &y1, &x2, &y2);
+  gint    width   = job->width;
+  gint    height  = job->height;
+  gint    bpp     = job->bpp;
+  guchar *column  = line;
+  guchar *premult = line + height * bpp;
+  guchar *out1    = line + 2 * height * bpp;
+  guchar *out2    = line + 3 * height * bpp;
+  gint    row;
 
-  width  = (x2 - x1);
-  height = (y2 - y1);
-
-  if (width < 1 || height < 1)
-    return;
+  for (row = 0; row < height; row++)
+    memcpy (column + row * bpp, job->src + (row * width + col) * bpp, bpp);
 
-  bytes = drawable->bpp;
-  has_alpha = gimp_drawable_has_alpha(drawable->drawable_id);
+  if (job->curves[0].sum || job->curves[1].sum)
+    encode_pixels (job, column, premult, rle, height);
 
-  buf = g_new (gint, MAX (width, height) * 2);
+  blur_pixels (job, &job->curves[0], premult, rle, column, out1, height);
+  blur_pixels (job, &job->curves[1], premult, rle, column, out2, height);
 
-  /*  allocate buffers for source and destination pixels  */
-  src = g_new (guchar, MAX (width, height) * bytes);
-  dest = g_new (guchar, MAX (width, height) * bytes);
+  for (row = 0; row < height; row++)
+    {
+      memcpy (job->blur1 + (row * width + col) * bpp, out1 + row * bpp, bpp);
+      memcpy (job->blur2 + (row * width + col) * bpp, out2 + row * bpp, bpp);
+    }
+}
 
-  gimp_pixel_rgn_init (&src_rgn,
-                       drawable, 0, 0, drawable->width, drawable->height,
-                       FALSE, FALSE);
-  gimp_pixel_rgn_init (&dest_rgn,
-                       drawable, 0, 0, drawable->width, drawable->height,
-                       TRUE, TRUE);
+/*
+ * The horizontal pass finishes both blurs of a row and writes their
+ * difference, keeping the alpha of the source.  The signed difference,
+ * if wanted, is stored offset by half the range.
+ */
+static void
+dog_row (DoGJob *job,
+         gint    row,
+         gint   *rle,
+         guchar *line)
+{
+  gint          width    = job->width;
+  gint          bpp      = job->bpp;
+  gint          offset   = row * width * bpp;
+  gint          channels = job->has_alpha ? bpp - 1 : bpp;
+  const guchar *src      = job->src + offset;
+  guchar       *dest     = job->dest + offset;
+  guchar       *diff     = job->diff ? job->diff + offset : NULL;
+  guchar       *premult  = line;
+  guchar       *out1     = line + width * bpp;
+  guchar       *out2     = line + 2 * width * bpp;
+  guchar        maxval   = 0;
+  gint          x, k;
+
+  if (job->curves[0].sum)
+    encode_pixels (job, job->blur1 + offset, premult, rle, width);
+  blur_pixels (job, &job->curves[0], premult, rle,
+               job->blur1 + offset, out1, width);
+
+  if (job->curves[1].sum)
+    encode_pixels (job, job->blur2 + offset, premult, rle, width);
+  blur_pixels (job, &job->curves[1], premult, rle,
+               job->blur2 + offset, out2, width);
+
+  for (x = 0; x < width * bpp; x += bpp)
+    {
+      for (k = 0; k < channels; k++)
+        {
+          gint delta = out1[x + k] - out2[x + k];
 
-  progress = 0.0;
-  max_progress  = 2 * width * height;
+          dest[x + k] = CLAMP0255 (delta);
+          maxval = MAX (dest[x + k], maxval);
 
-  /*  First the vertical pass  */
-  radius = fabs (radius) + 1.0;
-  std_dev = sqrt (-(radius * radius) / (2 * log (1.0 / 255.0)));
+          if (diff)
+            diff[x + k] = (delta + 256) >> 1;
+        }
 
-  curve = make_curve (std_dev, &length);
-  sum = g_new (gint, 2 * length + 1);
+      if (job->has_alpha)
+        {
+          dest[x + channels] = src[x + channels];
 
-  sum[0] = 0;
+          if (diff)
+            diff[x + channels] = src[x + channels];
+        }
+    }
 
-  for (i = 1; i <= length*2; i++)
-    sum[i] = curve[i-length-1] + sum[i-1];
-  sum += length;
+  job->row_max[row] = maxval;
+}
 
-  total = sum[length] - sum[-length];
+static void
+normalize_invert (DoGJob *job,
+                  gint    row)
+{
+  gint    bpp      = job->bpp;
+  gint    channels = job->has_alpha ? bpp - 1 : bpp;
+  guchar *d        = job->dest + row * job->width * bpp;
+  gint    x, k;
 
-  for (col = 0; col < width; col++)
+  for (x = 0; x < job->width; x++, d += bpp)
     {
-      gimp_pixel_rgn_get_col (&src_rgn, src, col + x1, y1, (y2 - y1));
+      for (k = 0; k < channels; k++)
+        {
+          d[k] = job->factor * d[k];
+          if (dogvals.invert)
+            d[k] = 255 - d[k];
+        }
+    }
+}
 
-      if (has_alpha)
-        multiply_alpha (src, height, bytes);
+/*
+ * Columns or rows, depending on the pass, are handed out from a shared
+ * counter; only the main thread reports progress.
+ */
+static void
+dog_process (DoGJob   *job,
+             gboolean  show_progress)
+{
+  gint    max_len = MAX (job->width, job->height);
+  gint   *rle     = g_new (gint, max_len * 2 * job->bpp);
+  guchar *line    = g_new (guchar, max_len * 4 * job->bpp);
+  gint    start;
 
-      sp = src;
-      dp = dest;
+  while ((start = g_atomic_int_add (&job->next, CHUNK_SIZE)) < job->n_items)
+    {
+      gint end = MIN (start + CHUNK_SIZE, job->n_items);
+      gint i;
 
-      for (b = 0; b < bytes; b++)
+      for (i = start; i < end; i++)
         {
-          initial_p = sp[b];
-          initial_m = sp[(height-1) * bytes + b];
-
-          /*  Determine a run-length encoded version of the row  */
-          run_length_encode (sp + b, buf, bytes, height);
-
-          for (row = 0; row < height; row++)
+          switch (job->pass)
             {
-              start = (row < length) ? -row : -length;
-              end = (height <= (row + length) ?
-                     (height - row - 1) : length);
-
-              val = 0;
-              i = start;
-              bb = buf + (row + i) * 2;
-
-              if (start != -length)
-                val += initial_p * (sum[start] - sum[-length]);
+            case DOG_PASS_VERTICAL:
+              dog_column (job, i, rle, line);
+              break;
 
-              while (i < end)
-                {
-                  pixels = bb[0];
-                  i += pixels;
+            case DOG_PASS_HORIZONTAL:
+              dog_row (job, i, rle, line);
+              break;
 
-                  if (i > end)
-                    i = end;
+            case DOG_PASS_NORMALIZE:
+              normalize_invert (job, i);
+              break;
+            }
+        }
 
-                  val += bb[1] * (sum[i] - sum[start]);
-                  bb += (pixels * 2);
-                  start = i;
-                }
+      g_atomic_int_add (&job->done, end - start);
 
-              if (end != length)
-                val += initial_m * (sum[length] - sum[end]);
+      if (show_progress && job->pass != DOG_PASS_NORMALIZE)
+        gimp_progress_update (0.5 * (job->pass +
+                                     (gdouble) g_atomic_int_get (&job->done) /
+                                     (gdouble) job->n_items));
+    }
 
-              dp[row * bytes + b] = val / total;
-            }
-        }
+  g_free (rle);
+  g_free (line);
+}
 
-      if (has_alpha)
-        separate_alpha (dest, height, bytes);
+static gpointer
+dog_thread (gpointer data)
+{
+  dog_process (data, FALSE);
 
-      gimp_pixel_rgn_set_col (&dest_rgn, dest, col + x1, y1, (y2 - y1));
+  return NULL;
+}
 
-      if (show_progress)
+/*
+ * The whole difference of Gaussians runs on one in-memory copy of the
+ * area.  Both blurs share each read of a column in the vertical pass,
+ * and the horizontal pass finishes both blurs of a row and writes
+ * their difference directly.  Only the normalization has to wait for
+ * the maximum over the whole area, so it is a third, cheap pass.
+ */
+static void
+dog_buffer (const guchar *src,
+            guchar       *dest,
+            guchar       *diff,
+            gint          width,
+            gint          height,
+            gint          bpp,
+            gboolean      has_alpha,
+            gdouble       inner,
+            gdouble       outer,
+            gboolean      show_progress)
+{
+  GThread *threads[THREADS_MAX];
+  DoGJob   job;
+  guchar   maxval = 0;
+  gint     n_threads;
+  gint     i;
+
+  job.src       = src;
+  job.dest      = dest;
+  job.diff      = diff;
+  job.blur1     = g_new (guchar, width * height * bpp);
+  job.blur2     = g_new (guchar, width * height * bpp);
+  job.row_max   = g_new (guchar, height);
+  job.width     = width;
+  job.height    = height;
+  job.bpp       = bpp;
+  job.has_alpha = has_alpha;
+  job.factor    = 1.0;
+
+  dog_curve_init (&job.curves[0], inner);
+  dog_curve_init (&job.curves[1], outer);
+
+  for (job.pass = DOG_PASS_VERTICAL;
+       job.pass <= DOG_PASS_NORMALIZE;
+       job.pass++)
+    {
+      if (job.pass == DOG_PASS_NORMALIZE)
         {
-          progress += height;
+          if (! dogvals.normalize && ! dogvals.invert)
+            break;
+
+          for (i = 0; i < height; i++)
+            maxval = MAX (job.row_max[i], maxval);
 
-          if ((col % 32) == 0)
-            gimp_progress_update (0.5 * (pass + (progress / max_progress)));
+          if (dogvals.normalize && maxval != 0)
+            job.factor = 255.0 / maxval;
         }
-    }
 
-  /*  prepare for the horizontal pass  */
-  gimp_pixel_rgn_init (&src_rgn,
-                       drawable, 0, 0, drawable->width, drawable->height,
-                       FALSE, TRUE);
+      job.n_items = (job.pass == DOG_PASS_VERTICAL) ? width : height;
+      job.next    = 0;
+      job.done    = 0;
 
-  /*  Now the horizontal pass  */
-  for (row = 0; row < height; row++)
-    {
-      gimp_pixel_rgn_get_row (&src_rgn, src, x1, row + y1, (x2 - x1));
-      if (has_alpha)
-        multiply_alpha (src, width, bytes);
+      n_threads = MIN (threads_get_count (),
+                       (job.n_items + CHUNK_SIZE - 1) / CHUNK_SIZE);
 
-      sp = src;
-      dp = dest;
+      for (i = 1; i < n_threads; i++)
+        threads[i] = g_thread_create (dog_thread, &job, TRUE, NULL);
 
-      for (b = 0; b < bytes; b++)
-        {
-          initial_p = sp[b];
-          initial_m = sp[(width-1) * bytes + b];
+      dog_process (&job, show_progress);
 
-          /*  Determine a run-length encoded version of the row  */
-          run_length_encode (sp + b, buf, bytes, width);
+      for (i = 1; i < n_threads; i++)
+        if (threads[i])
+          g_thread_join (threads[i]);
+    }
 
-          for (col = 0; col < width; col++)
-            {
-              start = (col < length) ? -col : -length;
-              end = (width <= (col + length)) ? (width - col - 1) : length;
+  dog_curve_free (&job.curves[0]);
+  dog_curve_free (&job.curves[1]);
 
-              val = 0;
-              i = start;
-              bb = buf + (col + i) * 2;
+  g_free (job.blur1);
+  g_free (job.blur2);
+  g_free (job.row_max);
+}
 
-              if (start != -length)
-                val += initial_p * (sum[start] - sum[-length]);
+static void
+dog (gint32        image_ID,
+     GimpDrawable *drawable,
+     gdouble       inner,
+     gdouble       outer,
+     gboolean      show_progress)
+{
+  GimpPixelRgn  src_rgn, dest_rgn;
+  gint32        drawable_id = drawable->drawable_id;
+  gint          width, height;
+  gint          x1, y1, x2, y2;
+  gint          bpp;
+  guchar       *src;
+  guchar       *dest;
+  guchar       *diff = NULL;
 
-              while (i < end)
-                {
-                  pixels = bb[0];
-                  i += pixels;
+  gimp_drawable_mask_bounds (drawable_id, &x1, &y1, &x2, &y2);
 
-                  if (i > end)
-                    i = end;
+  width  = (x2 - x1);
+  height = (y2 - y1);
 
-                  val += bb[1] * (sum[i] - sum[start]);
-                  bb += (pixels * 2);
-                  start = i;
-                }
+  if (width < 1 || height < 1)
+    return;
 
-              if (end != length)
-                val += initial_m * (sum[length] - sum[end]);
+  bpp = drawable->bpp;
 
-              dp[col * bytes + b] = val / total;
-            }
-        }
+  src  = g_new (guchar, width * height * bpp);
+  dest = g_new (guchar, width * height * bpp);
 
-      if (has_alpha)
-        separate_alpha (dest, width, bytes);
+  if (dogvals.signed_diff)
+    diff = g_new (guchar, width * height * bpp);
 
-      gimp_pixel_rgn_set_row (&dest_rgn, dest, x1, row + y1, (x2 - x1));
+  gimp_pixel_rgn_init (&src_rgn, drawable,
+                       x1, y1, width, height, FALSE, FALSE);
+  gimp_pixel_rgn_get_rect (&src_rgn, src, x1, y1, width, height);
 
-      if (show_progress)
-        {
-          progress += width;
+  dog_buffer (src, dest, diff, width, height, bpp,
+              gimp_drawable_has_alpha (drawable_id),
+              inner, outer, show_progress);
 
-          if ((row % 32) == 0)
-            gimp_progress_update (0.5 * (pass + (progress / max_progress)));
-        }
-    }
+  gimp_pixel_rgn_init (&dest_rgn, drawable,
+                       x1, y1, width, height, TRUE, TRUE);
+  gimp_pixel_rgn_set_rect (&dest_rgn, dest, x1, y1, width, height);
 
-  /*  merge the shadow, update the drawable  */
   gimp_drawable_flush (drawable);
-  gimp_drawable_merge_shadow (drawable->drawable_id, TRUE);
-  gimp_drawable_update (drawable->drawable_id, x1, y1, (x2 - x1), (y2 - y1));
+  gimp_drawable_merge_shadow (drawable_id, TRUE);
+  gimp_drawable_update (drawable_id, x1, y1, width, height);
+
+  if (diff)
+    {
+      GimpDrawable *diff_drawable;
+      GimpPixelRgn  diff_rgn;
+      gint32        layer;
+      gint          off_x, off_y;
+
+      gimp_drawable_offsets (drawable_id, &off_x, &off_y);
+
+      layer = gimp_layer_new (image_ID, _("DoG signed difference"),
+                              width, height,
+                              gimp_drawable_type (drawable_id),
+                              100,
+                              GIMP_NORMAL_MODE);
+      gimp_image_insert_layer (image_ID, layer,
+                               gimp_item_get_parent (drawable_id),
+                               gimp_image_get_item_position (image_ID,
+                                                             drawable_id));
+      gimp_layer_set_offsets (layer, off_x + x1, off_y + y1);
+
+      diff_drawable = gimp_drawable_get (layer);
+
+      gimp_pixel_rgn_init (&diff_rgn, diff_drawable,
+                           0, 0, width, height, TRUE, FALSE);
+      gimp_pixel_rgn_set_rect (&diff_rgn, diff, 0, 0, width, height);
+
+      gimp_drawable_flush (diff_drawable);
+      gimp_drawable_update (layer, 0, 0, width, height);
+      gimp_drawable_detach (diff_drawable);
+
+      g_free (diff);
+    }
 
-  /*  free buffers  */
-  g_free (buf);
   g_free (src);
   g_free (dest);
 }
@@ -973,53 +1070,31 @@ preview_update_preview (GimpPreview  *preview,
   gint          x1, y1;
   gint          width, height;
   gint          bpp;
-  guchar       *buffer;
+  guchar       *src;
+  guchar       *dest;
   GimpPixelRgn  src_rgn;
-  GimpPixelRgn  preview_rgn;
-  gint32        image_id, src_image_id;
-  gint32        preview_id;
-  GimpDrawable *preview_drawable;
 
   bpp = gimp_drawable_bpp (drawable->drawable_id);
 
   gimp_preview_get_position (preview, &x1, &y1);
   gimp_preview_get_size (preview, &width, &height);
 
-  buffer = g_new (guchar, width * height * bpp);
+  src  = g_new (guchar, width * height * bpp);
+  dest = g_new (guchar, width * height * bpp);
 
   gimp_pixel_rgn_init (&src_rgn, drawable,
                        x1, y1, width, height, FALSE, FALSE);
-  gimp_pixel_rgn_get_rect (&src_rgn, buffer,
+  gimp_pixel_rgn_get_rect (&src_rgn, src,
                            x1, y1, width, height);
 
-  /* set up gimp drawable for rendering preview into */
-  src_image_id = gimp_item_get_image (drawable->drawable_id);
-  image_id = gimp_image_new (width, height,
-                             gimp_image_base_type (src_image_id));
-  preview_id = gimp_layer_new (image_id, "preview", width, height,
-                               gimp_drawable_type (drawable->drawable_id),
-                               100,
-                               GIMP_NORMAL_MODE);
-  preview_drawable = gimp_drawable_get (preview_id);
-  gimp_image_insert_layer (image_id, preview_id, -1, 0);
-  gimp_layer_set_offsets (preview_id, 0, 0);
-  gimp_pixel_rgn_init (&preview_rgn, preview_drawable,
-                       0, 0, width, height, TRUE, TRUE);
-  gimp_pixel_rgn_set_rect (&preview_rgn, buffer,
-                           0, 0, width, height);
-  gimp_drawable_flush (preview_drawable);
-  gimp_drawable_merge_shadow (preview_id, TRUE);
-  gimp_drawable_update (preview_id, 0, 0, width, height);
-
-  dog (image_id, preview_drawable, dogvals.inner, dogvals.outer, FALSE);
-
-  gimp_pixel_rgn_get_rect (&preview_rgn, buffer,
-                           0, 0, width, height);
-
-  gimp_preview_draw_buffer (preview, buffer, width * bpp);
-
-  gimp_image_delete (image_id);
-  g_free (buffer);
+  dog_buffer (src, dest, NULL, width, height, bpp,
+              gimp_drawable_has_alpha (drawable->drawable_id),
+              dogvals.inner, dogvals.outer, FALSE);
+
+  gimp_preview_draw_buffer (preview, dest, width * bpp);
+
+  g_free (src);
+  g_free (dest);
 }
 
 static void
@@ -70,11 +70,16 @@
 
 #include "libgimp/stdplugins-intl.h"
 
+#include "threads.h"
+
 
 #define LOAD_PROC      "file-tiff-load"
 #define PLUG_IN_BINARY "file-tiff-load"
 #define PLUG_IN_ROLE   "gimp-file-tiff-load"
 
+#define MAX_BAND_SIZE  (16 << 20)  /* larger strips are read by scanline */
+#define BATCH_SIZE     (16 << 20)  /* decoded pixels in flight per batch */
+
 
 typedef struct
 {
@@ -99,6 +104,55 @@ typedef struct
   gint *pages;
 } TiffSelectedPages;
 
+/* A strip band or tile, decoded into its own channel buffers */
+typedef struct
+{
+  gint          x, y;
+  gint          cols, rows;
+  channel_data *channel;
+} TiffBlock;
+
+typedef struct _TiffDecodeJob TiffDecodeJob;
+
+typedef struct
+{
+  TiffDecodeJob *job;
+  TIFF          *tif;      /* private handle, the main one for worker 0 */
+  guchar        *buffer;   /* undecoded strips or tile */
+} TiffWorker;
+
+struct _TiffDecodeJob
+{
+  gushort        bps;
+  gushort        photomet;
+  gboolean       alpha;
+  gboolean       is_bw;
+  gint           extra;
+  gint           n_channels;
+
+  gboolean       tiled;
+  gboolean       by_scanline;  /* a single huge strip, read in order */
+  uint32         image_width;
+  uint32         image_length;
+  uint32         unit_width;   /* tile size, or image width and band rows */
+  uint32         unit_length;
+  uint32         rows_per_strip;
+  tsize_t        line_size;
+  tsize_t        buffer_size;
+  gint           units_across;
+  gint           n_units;
+
+  TiffBlock     *batch;        /* blocks being decoded */
+  gint           first_unit;
+  gint           n_batch;
+  volatile gint  next_unit;
+
+  gint           n_threads;
+  gint           n_running;
+  TiffWorker     workers[THREADS_MAX];
+  GThread       *threads[THREADS_MAX];
+};
+
 /* Declare some local functions.
  */
 static void   query     (void);
@@ -135,6 +189,27 @@ static void      load_tiles    (TIFF         *tif,
 static void      load_paths    (TIFF         *tif,
                                 gint          image);
 
+static void      decode_job_init (TiffDecodeJob *job,
+                                  TIFF          *tif,
+                                  gushort        bps,
+                                  gushort        photomet,
+                                  gboolean       alpha,
+                                  gboolean       is_bw,
+                                  gint           extra);
+static void      load_blocks   (TIFF          *tif,
+                                channel_data  *channel,
+                                TiffDecodeJob *job);
+static TIFF    * open_worker_tiff (TIFF       *tif);
+static void      decode_unit   (TiffWorker    *worker,
+                                TiffBlock     *block,
+                                gint           unit);
+static gpointer  decode_thread (gpointer       data);
+static void      decode_start  (TiffDecodeJob *job,
+                                TiffBlock     *batch,
+                                gint           first_unit,
+                                gint           n_batch);
+static void      decode_finish (TiffDecodeJob *job);
+
 static void      read_separate (const guchar *source,
                                 channel_data *channel,
                                 gushort       bps,
@@ -148,8 +223,6 @@ static void      read_separate (const guchar *source,
 static void      read_16bit    (const guchar *source,
                                 channel_data *channel,
                                 gushort       photomet,
-                                gint          startcol,
-                                gint          startrow,
                                 gint          rows,
                                 gint          cols,
                                 gboolean      alpha,
@@ -158,8 +231,6 @@ static void      read_16bit    (const guchar *source,
 static void      read_8bit     (const guchar *source,
                                 channel_data *channel,
                                 gushort       photomet,
-                                gint          startcol,
-                                gint          startrow,
                                 gint          rows,
                                 gint          cols,
                                 gboolean      alpha,
@@ -167,8 +238,6 @@ static void      read_8bit     (const guchar *source,
                                 gint          align);
 static void      read_bw       (const guchar *source,
                                 channel_data *channel,
-                                gint          startcol,
-                                gint          startrow,
                                 gint          rows,
                                 gint          cols,
                                 gint          align);
@@ -176,8 +245,6 @@ static void      read_default  (const guchar *source,
                                 channel_data *channel,
                                 gushort       bps,
                                 gushort       photomet,
-                                gint          startcol,
-                                gint          startrow,
                                 gint          rows,
                                 gint          cols,
                                 gboolean      alpha,
@@ -192,6 +259,8 @@ static void      tiff_warning  (const gchar  *module,
 static void      tiff_error    (const gchar  *module,
                                 const gchar  *fmt,
                                 va_list       ap);
+static void      tiff_report   (const gchar  *fmt,
+                                va_list       ap);
 
 
 const GimpPlugInInfo PLUG_IN_INFO =
@@ -214,6 +283,10 @@ static GimpPageSelectorTarget  target        = GIMP_PAGE_SELECTOR_TARGET_LAYERS;
 
 static guchar       bit2byte[256 * 8];
 
+/* libtiff messages from decoding threads wait here for the main thread */
+static GThread     *main_thread    = NULL;
+static gpointer     worker_message = NULL;
+
 
 MAIN ()
 
@@ -274,6 +347,8 @@ run (const gchar      *name,
   values[0].type          = GIMP_PDB_STATUS;
   values[0].data.d_status = GIMP_PDB_EXECUTION_ERROR;
 
+  main_thread = g_thread_self ();
+
   TIFFSetWarningHandler (tiff_warning);
   TIFFSetErrorHandler (tiff_error);
 
@@ -431,7 +506,7 @@ tiff_warning (const gchar *module,
       return;
     }
 
-  g_logv (G_LOG_DOMAIN, G_LOG_LEVEL_MESSAGE, fmt, ap);
+  tiff_report (fmt, ap);
 }
 
 static void
@@ -444,7 +519,31 @@ tiff_error (const gchar *module,
   if (! strcmp (fmt, "Compression algorithm does not support random access"))
     return;
 
-  g_logv (G_LOG_DOMAIN, G_LOG_LEVEL_MESSAGE, fmt, ap);
+  tiff_report (fmt, ap);
+}
+
+static void
+tiff_report (const gchar *fmt,
+             va_list      ap)
+{
+  gchar *msg;
+
+  if (g_thread_self () == main_thread)
+    {
+      g_logv (G_LOG_DOMAIN, G_LOG_LEVEL_MESSAGE, fmt, ap);
+      return;
+    }
+
+  /* libgimp must only be called from the main thread: keep the first
+   * message for load_blocks() to show and send the others to the console.
+   */
+  msg = g_strdup_vprintf (fmt, ap);
+
+  if (! g_atomic_pointer_compare_and_exchange (&worker_message, NULL, msg))
+    {
+      g_printerr ("%s\n", msg);
+      g_free (msg);
+    }
 }
 
 /* returns a pointer into the TIFF */
@@ -1402,76 +1501,20 @@ load_tiles (TIFF         *tif,
             gboolean      is_bw,
             gint          extra)
 {
-  uint16  planar = PLANARCONFIG_CONTIG;
-  uint32  imageWidth, imageLength;
-  uint32  tileWidth, tileLength;
-  uint32  x, y, rows, cols;
-  guchar *buffer;
-  gdouble progress = 0.0, one_row;
-  gint    i;
-
-  TIFFGetField (tif, TIFFTAG_PLANARCONFIG, &planar);
-  TIFFGetField (tif, TIFFTAG_IMAGEWIDTH, &imageWidth);
-  TIFFGetField (tif, TIFFTAG_IMAGELENGTH, &imageLength);
-  TIFFGetField (tif, TIFFTAG_TILEWIDTH, &tileWidth);
-  TIFFGetField (tif, TIFFTAG_TILELENGTH, &tileLength);
-
-  if (tileWidth > gimp_tile_width () || tileLength > gimp_tile_height ())
-    {
-      gimp_tile_cache_ntiles ((1 + tileWidth / gimp_tile_width ()) *
-                              (1 + tileLength / gimp_tile_width ()));
-    }
-
-  one_row = (gdouble) tileLength / (gdouble) imageLength;
-  buffer = g_malloc (TIFFTileSize (tif));
-
-  for (i = 0; i <= extra; ++i)
-    {
-      channel[i].pixels = g_new (guchar,
-                                 tileWidth * tileLength *
-                                 channel[i].drawable->bpp);
-    }
-
-  for (y = 0; y < imageLength; y += tileLength)
-    {
-      for (x = 0; x < imageWidth; x += tileWidth)
-        {
-          gimp_progress_update (progress + one_row *
-                                ( (gdouble) x / (gdouble) imageWidth));
+  TiffDecodeJob job;
 
-          TIFFReadTile (tif, buffer, x, y, 0, 0);
+  decode_job_init (&job, tif, bps, photomet, alpha, is_bw, extra);
 
-          cols = MIN (imageWidth - x, tileWidth);
-          rows = MIN (imageLength - y, tileLength);
-
-          if (bps == 16)
-            {
-              read_16bit (buffer, channel, photomet, y, x, rows, cols, alpha,
-                          extra, tileWidth - cols);
-            }
-          else if (bps == 8)
-            {
-              read_8bit (buffer, channel, photomet, y, x, rows, cols, alpha,
-                         extra, tileWidth - cols);
-            }
-          else if (is_bw)
-            {
-              read_bw (buffer, channel, y, x, rows, cols, tileWidth - cols);
-            }
-          else
-            {
-              read_default (buffer, channel, bps, photomet, y, x, rows, cols,
-                            alpha, extra, tileWidth - cols);
-            }
-        }
+  job.tiled = TRUE;
+  TIFFGetField (tif, TIFFTAG_TILEWIDTH, &job.unit_width);
+  TIFFGetField (tif, TIFFTAG_TILELENGTH, &job.unit_length);
+  job.buffer_size = TIFFTileSize (tif);
 
-      progress += one_row;
-    }
+  /* Tiles are placed a row at a time, keep one row of GIMP tiles around */
+  gimp_tile_cache_ntiles ((job.image_width / gimp_tile_width () + 2) *
+                          (job.unit_length / gimp_tile_height () + 2));
 
-  for (i = 0; i <= extra; ++i)
-    g_free(channel[i].pixels);
-
-  g_free(buffer);
+  load_blocks (tif, channel, &job);
 }
 
 static void
@@ -1495,52 +1538,77 @@ load_lines (TIFF         *tif,
 
   lineSize = TIFFScanlineSize (tif);
 
-  for (i = 0; i <= extra; ++i)
-    {
-      channel[i].pixels = g_new (guchar,
-                                 tile_height * cols * channel[i].drawable->bpp);
-    }
-
   gimp_tile_cache_ntiles (1 + cols / gimp_tile_width ());
 
-  buffer = g_malloc (lineSize * tile_height);
-
   if (planar == PLANARCONFIG_CONTIG)
     {
-      for (y = 0; y < imageLength; y += tile_height )
-        {
-          gimp_progress_update ((gdouble) y / (gdouble) imageLength);
+      TiffDecodeJob job;
+      uint32        rps;
 
-          rows = MIN (tile_height, imageLength - y);
+      decode_job_init (&job, tif, bps, photomet, alpha, is_bw, extra);
 
-          for (i = 0; i < rows; ++i)
-            TIFFReadScanline (tif, buffer + i * lineSize, y + i, 0);
+      TIFFGetFieldDefaulted (tif, TIFFTAG_ROWSPERSTRIP, &rps);
+      rps = CLAMP (rps, 1, imageLength);
 
-          if (bps == 16)
-            {
-              read_16bit (buffer, channel, photomet, y, 0, rows, cols,
-                          alpha, extra, 0);
-            }
-          else if (bps == 8)
+      job.unit_width     = cols;
+      job.rows_per_strip = rps;
+
+      if (rps == imageLength || (gdouble) rps * lineSize > MAX_BAND_SIZE)
+        {
+          /* Nothing to split, or too big to hold a strip per thread */
+          job.by_scanline = TRUE;
+          job.unit_length = tile_height;
+        }
+      else
+        {
+          guint64 band = rps;
+          uint32  a    = rps;
+          uint32  b    = tile_height;
+
+          /* Whole strips that also end on a row of GIMP tiles, unless
+           * that leaves too few bands to share between the threads.
+           */
+          while (b)
             {
-              read_8bit (buffer, channel, photomet, y, 0, rows, cols,
-                         alpha, extra, 0);
+              uint32 t = a % b;
+
+              a = b;
+              b = t;
             }
-          else if (is_bw)
+
+          band = band / a * tile_height;
+
+          if ((gdouble) band * lineSize <= MAX_BAND_SIZE &&
+              (imageLength + band - 1) / band >= threads_get_count ())
             {
-              read_bw (buffer, channel, y, 0, rows, cols, 0);
+              job.unit_length = band;
             }
           else
             {
-              read_default (buffer, channel, bps, photomet, y, 0, rows, cols,
-                            alpha, extra, 0);
+              /* A tile row is shared by two bands, keep it cached */
+              job.unit_length = rps * ((tile_height + rps - 1) / rps);
+
+              gimp_tile_cache_ntiles (2 * (1 + cols / gimp_tile_width ()));
             }
         }
+
+      job.buffer_size = job.unit_length * lineSize;
+
+      load_blocks (tif, channel, &job);
     }
   else
     { /* PLANARCONFIG_SEPARATE  -- Just say "No" */
       uint16 s, samples;
 
+      for (i = 0; i <= extra; ++i)
+        {
+          channel[i].pixels = g_new (guchar,
+                                     tile_height * cols *
+                                     channel[i].drawable->bpp);
+        }
+
+      buffer = g_malloc (lineSize * tile_height);
+
       TIFFGetField(tif, TIFFTAG_SAMPLESPERPIXEL, &samples);
 
       for (s = 0; s < samples; ++s)
@@ -1557,20 +1625,333 @@ load_lines (TIFF         *tif,
                              y, 0, rows, cols, alpha, extra, s);
             }
         }
+
+      for (i = 0; i <= extra; ++i)
+        g_free(channel[i].pixels);
+
+      g_free(buffer);
+    }
+}
+
+static void
+decode_job_init (TiffDecodeJob *job,
+                 TIFF          *tif,
+                 gushort        bps,
+                 gushort        photomet,
+                 gboolean       alpha,
+                 gboolean       is_bw,
+                 gint           extra)
+{
+  memset (job, 0, sizeof (TiffDecodeJob));
+
+  job->bps        = bps;
+  job->photomet   = photomet;
+  job->alpha      = alpha;
+  job->is_bw      = is_bw;
+  job->extra      = extra;
+  job->n_channels = is_bw ? 1 : extra + 1;
+  job->line_size  = TIFFScanlineSize (tif);
+
+  TIFFGetField (tif, TIFFTAG_IMAGEWIDTH, &job->image_width);
+  TIFFGetField (tif, TIFFTAG_IMAGELENGTH, &job->image_length);
+}
+
+/* Decodes the strips or tiles described by job, on as many threads as
+ * there are processors.  While the workers decode one batch of blocks
+ * the main thread copies the previous one into the drawables.
+ */
+static void
+load_blocks (TIFF          *tif,
+             channel_data  *channel,
+             TiffDecodeJob *job)
+{
+  TiffBlock *blocks;
+  TiffBlock *batch;
+  gint       units_down;
+  gint       batch_size;
+  gsize      block_size;
+  gint       unit, n;
+  gint       i, j;
+
+  job->units_across = ((job->image_width + job->unit_width - 1) /
+                       job->unit_width);
+  units_down        = ((job->image_length + job->unit_length - 1) /
+                       job->unit_length);
+  job->n_units      = job->units_across * units_down;
+
+  job->n_threads = (job->by_scanline ?
+                    1 : MIN (threads_get_count (), job->n_units));
+
+  job->workers[0].tif = tif;
+
+  for (i = 1; i < job->n_threads; i++)
+    {
+      job->workers[i].tif = open_worker_tiff (tif);
+
+      if (! job->workers[i].tif)
+        {
+          job->n_threads = i;
+          break;
+        }
+    }
+
+  for (i = 0; i < job->n_threads; i++)
+    {
+      job->workers[i].job    = job;
+      job->workers[i].buffer = g_malloc (job->buffer_size);
+    }
+
+  block_size = ((gsize) job->unit_width * job->unit_length *
+                (channel[0].drawable->bpp + job->n_channels - 1));
+
+  batch_size = MAX (BATCH_SIZE / block_size, job->n_threads);
+  batch_size = MIN (batch_size, job->n_units);
+
+  /* Two batches: one being decoded, one being placed */
+  blocks = g_new (TiffBlock, 2 * batch_size);
+
+  for (j = 0; j < 2 * batch_size; j++)
+    {
+      blocks[j].channel = g_new (channel_data, job->n_channels);
+
+      for (i = 0; i < job->n_channels; i++)
+        {
+          blocks[j].channel[i].drawable = channel[i].drawable;
+          blocks[j].channel[i].pixels   =
+            g_new (guchar, (gsize) job->unit_width * job->unit_length *
+                           channel[i].drawable->bpp);
+        }
+    }
+
+  batch = blocks;
+  n     = MIN (batch_size, job->n_units);
+
+  decode_start (job, batch, 0, n);
+  decode_finish (job);
+
+  for (unit = 0; unit < job->n_units;)
+    {
+      TiffBlock *next      = (batch == blocks) ? blocks + batch_size : blocks;
+      gint       next_unit = unit + n;
+      gint       next_n    = MIN (batch_size, job->n_units - next_unit);
+
+      if (next_n > 0)
+        decode_start (job, next, next_unit, next_n);
+
+      for (j = 0; j < n; j++)
+        {
+          TiffBlock *block = batch + j;
+
+          for (i = 0; i < job->n_channels; i++)
+            {
+              gimp_pixel_rgn_init (&(channel[i].pixel_rgn),
+                                   channel[i].drawable,
+                                   block->x, block->y,
+                                   block->cols, block->rows, TRUE, FALSE);
+              gimp_pixel_rgn_set_rect (&(channel[i].pixel_rgn),
+                                       block->channel[i].pixels,
+                                       block->x, block->y,
+                                       block->cols, block->rows);
+            }
+        }
+
+      gimp_progress_update ((gdouble) (unit + n) / (gdouble) job->n_units);
+
+      if (next_n > 0)
+        decode_finish (job);
+
+      unit  = next_unit;
+      batch = next;
+      n     = next_n;
+    }
+
+  if (worker_message)
+    {
+      g_message ("%s", (gchar *) worker_message);
+      g_free (worker_message);
+      worker_message = NULL;
+    }
+
+  for (j = 0; j < 2 * batch_size; j++)
+    {
+      for (i = 0; i < job->n_channels; i++)
+        g_free (blocks[j].channel[i].pixels);
+
+      g_free (blocks[j].channel);
+    }
+
+  g_free (blocks);
+
+  for (i = 0; i < job->n_threads; i++)
+    {
+      g_free (job->workers[i].buffer);
+
+      if (i > 0)
+        TIFFClose (job->workers[i].tif);
+    }
+}
+
+/* Opens another handle on the file and page of tif, for a decoding thread */
+static TIFF *
+open_worker_tiff (TIFF *tif)
+{
+  TIFFErrorHandler  warning_handler;
+  TIFF             *copy;
+  gint              fd;
+
+  fd = g_open (TIFFFileName (tif), O_RDONLY | _O_BINARY, 0);
+
+  if (fd == -1)
+    return NULL;
+
+  /* The main handle has already warned about anything in this file */
+  warning_handler = TIFFSetWarningHandler (NULL);
+
+  copy = TIFFFdOpen (fd, TIFFFileName (tif), "r");
+
+  if (! copy)
+    {
+      close (fd);
+    }
+  else if (! TIFFSetDirectory (copy, TIFFCurrentDirectory (tif)))
+    {
+      TIFFClose (copy);
+      copy = NULL;
+    }
+
+  TIFFSetWarningHandler (warning_handler);
+
+  return copy;
+}
+
+static void
+decode_unit (TiffWorker *worker,
+             TiffBlock  *block,
+             gint        unit)
+{
+  TiffDecodeJob *job    = worker->job;
+  TIFF          *tif    = worker->tif;
+  guchar        *buffer = worker->buffer;
+  gint           align  = 0;
+  tsize_t        size;
+  tsize_t        done;
+  gint           row;
+
+  block->x    = (unit % job->units_across) * job->unit_width;
+  block->y    = (unit / job->units_across) * job->unit_length;
+  block->cols = MIN (job->image_width - block->x, job->unit_width);
+  block->rows = MIN (job->image_length - block->y, job->unit_length);
+
+  /* Anything libtiff can not decode is left black */
+  if (job->tiled)
+    {
+      size = job->buffer_size;
+      done = TIFFReadEncodedTile (tif,
+                                  TIFFComputeTile (tif, block->x, block->y,
+                                                   0, 0),
+                                  buffer, size);
+      if (done < size)
+        memset (buffer + MAX (done, 0), 0, size - MAX (done, 0));
+
+      if (job->is_bw)
+        align = (job->unit_width + 7) / 8 - (block->cols + 7) / 8;
+      else
+        align = job->unit_width - block->cols;
+    }
+  else if (job->by_scanline)
+    {
+      for (row = 0; row < block->rows; row++)
+        if (TIFFReadScanline (tif, buffer + row * job->line_size,
+                              block->y + row, 0) < 0)
+          memset (buffer + row * job->line_size, 0, job->line_size);
+    }
+  else
+    {
+      for (row = 0; row < block->rows; row += job->rows_per_strip)
+        {
+          guchar *strip = buffer + row * job->line_size;
+
+          size = (MIN (job->rows_per_strip, block->rows - row) *
+                  job->line_size);
+          done = TIFFReadEncodedStrip (tif,
+                                       TIFFComputeStrip (tif,
+                                                         block->y + row, 0),
+                                       strip, size);
+          if (done < size)
+            memset (strip + MAX (done, 0), 0, size - MAX (done, 0));
+        }
     }
 
-  for (i = 0; i <= extra; ++i)
-    g_free(channel[i].pixels);
+  if (job->bps == 16)
+    {
+      read_16bit (buffer, block->channel, job->photomet,
+                  block->rows, block->cols, job->alpha, job->extra, align);
+    }
+  else if (job->bps == 8)
+    {
+      read_8bit (buffer, block->channel, job->photomet,
+                 block->rows, block->cols, job->alpha, job->extra, align);
+    }
+  else if (job->is_bw)
+    {
+      read_bw (buffer, block->channel, block->rows, block->cols, align);
+    }
+  else
+    {
+      read_default (buffer, block->channel, job->bps, job->photomet,
+                    block->rows, block->cols, job->alpha, job->extra, align);
+    }
+}
+
+static gpointer
+decode_thread (gpointer data)
+{
+  TiffWorker    *worker = data;
+  TiffDecodeJob *job    = worker->job;
+  gint           i;
+
+  while ((i = g_atomic_int_add (&job->next_unit, 1)) < job->n_batch)
+    decode_unit (worker, job->batch + i, job->first_unit + i);
+
+  return NULL;
+}
+
+static void
+decode_start (TiffDecodeJob *job,
+              TiffBlock     *batch,
+              gint           first_unit,
+              gint           n_batch)
+{
+  gint  i;
+
+  job->batch      = batch;
+  job->first_unit = first_unit;
+  job->n_batch    = n_batch;
+  job->next_unit  = 0;
+  job->n_running  = MIN (job->n_threads, n_batch);
+
+  for (i = 1; i < job->n_running; i++)
+    job->threads[i] = g_thread_create (decode_thread, &job->workers[i],
+                                       TRUE, NULL);
+}
+
+static void
+decode_finish (TiffDecodeJob *job)
+{
+  gint  i;
 
-  g_free(buffer);
+  /* Help the worker threads, then wait for them */
+  decode_thread (&job->workers[0]);
+
+  for (i = 1; i < job->n_running; i++)
+    if (job->threads[i])
+      g_thread_join (job->threads[i]);
 }
 
 static void
 read_16bit (const guchar *source,
             channel_data *channel,
             gushort       photomet,
-            gint          startrow,
-            gint          startcol,
             gint          rows,
             gint          cols,
             gboolean      alpha,
@@ -1581,12 +1962,6 @@ read_16bit (const guchar *source,
   gint    gray_val, red_val, green_val, blue_val, alpha_val;
   gint    col, row, i;
 
-  for (i = 0; i <= extra; ++i)
-    {
-      gimp_pixel_rgn_init (&(channel[i].pixel_rgn), channel[i].drawable,
-                           startcol, startrow, cols, rows, TRUE, FALSE);
-    }
-
 #if G_BYTE_ORDER == G_LITTLE_ENDIAN
   source++; /* offset source once, to look at the high byte */
 #endif
@@ -1731,18 +2106,12 @@ read_16bit (const guchar *source,
             }
         }
     }
-
-  for (i = 0; i <= extra; ++i)
-    gimp_pixel_rgn_set_rect (&(channel[i].pixel_rgn), channel[i].pixels,
-                             startcol, startrow, cols, rows);
 }
 
 static void
 read_8bit (const guchar *source,
            channel_data *channel,
            gushort       photomet,
-           gint          startrow,
-           gint          startcol,
            gint          rows,
            gint          cols,
            gboolean      alpha,
@@ -1753,12 +2122,6 @@ read_8bit (const guchar *source,
   gint    gray_val, red_val, green_val, blue_val, alpha_val;
   gint    col, row, i;
 
-  for (i = 0; i <= extra; ++i)
-    {
-      gimp_pixel_rgn_init (&(channel[i].pixel_rgn), channel[i].drawable,
-                           startcol, startrow, cols, rows, TRUE, FALSE);
-    }
-
   for (row = 0; row < rows; ++row)
     {
       dest = channel[0].pixels + row * cols * channel[0].drawable->bpp;
@@ -1896,17 +2259,11 @@ read_8bit (const guchar *source,
             }
         }
     }
-
-  for (i = 0; i <= extra; ++i)
-    gimp_pixel_rgn_set_rect(&(channel[i].pixel_rgn), channel[i].pixels,
-                            startcol, startrow, cols, rows);
 }
 
 static void
 read_bw (const guchar *source,
          channel_data *channel,
-         gint          startrow,
-         gint          startcol,
          gint          rows,
          gint          cols,
          gint          align)
@@ -1914,9 +2271,6 @@ read_bw (const guchar *source,
   guchar *dest;
   gint    col, row;
 
-  gimp_pixel_rgn_init (&(channel[0].pixel_rgn), channel[0].drawable,
-                       startcol, startrow, cols, rows, TRUE, FALSE);
-
   for (row = 0; row < rows; ++row)
     {
       dest = channel[0].pixels + row * cols * channel[0].drawable->bpp;
@@ -1940,9 +2294,6 @@ read_bw (const guchar *source,
 
       source += align;
     }
-
-  gimp_pixel_rgn_set_rect(&(channel[0].pixel_rgn), channel[0].pixels,
-                          startcol, startrow, cols, rows);
 }
 
 /* Step through all <= 8-bit samples in an image */
@@ -1963,8 +2314,6 @@ read_default (const guchar *source,
               channel_data *channel,
               gushort       bps,
               gushort       photomet,
-              gint          startrow,
-              gint          startcol,
               gint          rows,
               gint          cols,
               gboolean      alpha,
@@ -1976,12 +2325,6 @@ read_default (const guchar *source,
   gint    col, row, i;
   gint    bitsleft = 8, maxval = (1 << bps) - 1;
 
-  for (i = 0; i <= extra; ++i)
-    {
-      gimp_pixel_rgn_init (&(channel[i].pixel_rgn), channel[i].drawable,
-                           startcol, startrow, cols, rows, TRUE, FALSE);
-    }
-
   for (row = 0; row < rows; ++row)
     {
       dest = channel[0].pixels + row * cols * channel[0].drawable->bpp;
@@ -2132,10 +2475,6 @@ read_default (const guchar *source,
 
       bitsleft = 0;
     }
-
-  for (i = 0; i <= extra; ++i)
-    gimp_pixel_rgn_set_rect (&(channel[i].pixel_rgn), channel[i].pixels,
-                             startcol, startrow, cols, rows);
 }
 
 static void
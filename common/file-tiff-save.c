@@ -70,18 +70,28 @@
 
 #include "libgimp/stdplugins-intl.h"
 
+#include "threads.h"
+
 
 #define SAVE_PROC      "file-tiff-save"
 #define SAVE2_PROC     "file-tiff-save2"
+#define SAVE3_PROC     "file-tiff-save3"
 #define PLUG_IN_BINARY "file-tiff-save"
 #define PLUG_IN_ROLE   "gimp-file-tiff-save"
 
+#define BATCH_SIZE          (16 << 20)  /* pixels in flight per batch */
+#define DEFAULT_TILE_SIZE   256
+#define CLASSIC_TIFF_LIMIT  4.0e9       /* larger raw data needs BigTIFF */
+
 
 typedef struct
 {
   gint      compression;
   gint      fillorder;
   gboolean  save_transp_pixels;
+  gint      rows_per_strip;  /* 0 for the GIMP tile height        */
+  gint      tile_size;       /* 0 to write strips instead of tiles */
+  gboolean  bigtiff;
 } TiffSaveVals;
 
 typedef struct
@@ -93,6 +103,62 @@ typedef struct
   guchar       *pixel;
 } channel_data;
 
+/* An in-memory file for the scratch handles of the encoding threads */
+typedef struct
+{
+  GByteArray *data;
+  toff_t      offset;
+  gsize       header;  /* what TIFFClientOpen() wrote */
+} TiffMemFile;
+
+/* A strip or tile on its way from the drawable to the file */
+typedef struct
+{
+  gint        x, y;
+  gint        cols, rows;
+  guchar     *pixels;  /* as read from the drawable         */
+  guchar     *data;    /* laid out as the strip or tile     */
+  GByteArray *raw;     /* compressed, unless job->direct    */
+} TiffSaveBlock;
+
+typedef struct _TiffEncodeJob TiffEncodeJob;
+
+typedef struct
+{
+  TiffEncodeJob *job;
+  TIFF          *tif;  /* scratch handle with the layout of the file */
+  TiffMemFile    file;
+} TiffEncoder;
+
+struct _TiffEncodeJob
+{
+  GimpImageType  drawable_type;
+  gint           bpp;
+  gint           samplesperpixel;
+  gboolean       is_bw;
+  gboolean       invert;
+
+  gboolean       tiled;
+  gboolean       direct;       /* the main handle does the encoding */
+  gint           width;
+  gint           height;
+  gint           unit_width;   /* tile size, or image width and strip rows */
+  gint           unit_length;
+  gint           units_across;
+  gint           n_units;
+  tsize_t        unit_size;    /* bytes in a whole strip or tile */
+  tsize_t        row_size;
+
+  TiffSaveBlock *batch;        /* blocks being encoded */
+  gint           n_batch;
+  volatile gint  next_unit;
+
+  gint           n_threads;
+  gint           n_running;
+  TiffEncoder    encoders[THREADS_MAX];
+  GThread       *threads[THREADS_MAX];
+};
+
 /* Declare some local functions.
  */
 static void   query     (void);
@@ -112,9 +178,33 @@ static gboolean  save_image             (const gchar  *filename,
                                          gint32        orig_image,
                                          GError      **error);
 
+static gboolean  write_blocks           (TIFF          *tif,
+                                         GimpPixelRgn  *pixel_rgn,
+                                         TiffEncodeJob *job);
+static gboolean  write_block            (TIFF          *tif,
+                                         TiffEncodeJob *job,
+                                         TiffSaveBlock *block);
+static TIFF    * open_scratch_tiff      (TIFF          *tif,
+                                         TiffMemFile   *file);
+static void      convert_rows           (TiffEncodeJob *job,
+                                         const guchar  *src,
+                                         guchar        *dest,
+                                         gint           cols,
+                                         gint           rows);
+static void      encode_unit            (TiffEncoder   *encoder,
+                                         TiffSaveBlock *block);
+static gpointer  encode_thread          (gpointer       data);
+static void      encode_start           (TiffEncodeJob *job,
+                                         TiffSaveBlock *batch,
+                                         gint           n_batch);
+static void      encode_finish          (TiffEncodeJob *job);
+
 static gboolean  save_dialog            (gboolean      has_alpha,
                                          gboolean      is_monochrome);
 
+static void      tiles_toggle_callback  (GtkWidget    *widget,
+                                         gpointer      data);
+
 static void      comment_entry_callback (GtkWidget    *widget,
                                          gpointer      data);
 
@@ -129,6 +219,8 @@ static void      tiff_warning           (const gchar *module,
 static void      tiff_error             (const gchar *module,
                                          const gchar *fmt,
                                          va_list      ap);
+static void      tiff_report            (const gchar *fmt,
+                                         va_list      ap);
 
 const GimpPlugInInfo PLUG_IN_INFO =
 {
@@ -147,6 +239,10 @@ static TiffSaveVals tsvals =
 static gchar       *image_comment = NULL;
 static GimpRunMode  run_mode      = GIMP_RUN_INTERACTIVE;
 
+/* libtiff messages from encoding threads wait here for the main thread */
+static GThread     *main_thread    = NULL;
+static gpointer     worker_message = NULL;
+
 
 MAIN ()
 
@@ -172,6 +268,15 @@ query (void)
     { GIMP_PDB_INT32, "save-transp-pixels", "Keep the color data masked by an alpha channel intact" }
   };
 
+  static const GimpParamDef save_args3[] =
+  {
+    COMMON_SAVE_ARGS,
+    { GIMP_PDB_INT32, "save-transp-pixels", "Keep the color data masked by an alpha channel intact" },
+    { GIMP_PDB_INT32, "rows-per-strip",     "Rows in each strip, 0 for the default" },
+    { GIMP_PDB_INT32, "tile-size",          "Width and height of the tiles (a multiple of 16), 0 to save strips" },
+    { GIMP_PDB_INT32, "bigtiff",            "Save in the BigTIFF format, for files larger than 4 GB" }
+  };
+
   gimp_install_procedure (SAVE_PROC,
                           "saves files in the tiff file format",
                           "Saves files in the Tagged Image File Format.  "
@@ -204,6 +309,24 @@ query (void)
                           save_args, NULL);
 
   gimp_register_file_handler_mime (SAVE2_PROC, "image/tiff");
+
+  gimp_install_procedure (SAVE3_PROC,
+                          "saves files in the tiff file format",
+                          "Saves files in the Tagged Image File Format, "
+                          "in strips or tiles of the given size.  Strips "
+                          "and tiles are compressed on several threads.  "
+                          "The value for the saved comment is taken "
+                          "from the 'gimp-comment' parasite.",
+                          "The GIMP Team",
+                          "The GIMP Team",
+                          "2026",
+                          N_("TIFF image"),
+                          "RGB*, GRAY*, INDEXED",
+                          GIMP_PLUGIN,
+                          G_N_ELEMENTS (save_args3), 0,
+                          save_args3, NULL);
+
+  gimp_register_file_handler_mime (SAVE3_PROC, "image/tiff");
 }
 
 static void
@@ -232,13 +355,16 @@ run (const gchar      *name,
   values[0].type          = GIMP_PDB_STATUS;
   values[0].data.d_status = GIMP_PDB_EXECUTION_ERROR;
 
+  main_thread = g_thread_self ();
+
   TIFFSetWarningHandler (tiff_warning);
   TIFFSetErrorHandler (tiff_error);
 
   if ((strcmp (name, SAVE_PROC) == 0) ||
-      (strcmp (name, SAVE2_PROC) == 0))
+      (strcmp (name, SAVE2_PROC) == 0) ||
+      (strcmp (name, SAVE3_PROC) == 0))
     {
-      /* Plug-in is either file_tiff_save or file_tiff_save2 */
+      /* Plug-in is file_tiff_save, file_tiff_save2 or file_tiff_save3 */
       image = orig_image = param[1].data.d_int32;
       drawable = param[2].data.d_int32;
 
@@ -298,7 +424,7 @@ run (const gchar      *name,
 
         case GIMP_RUN_NONINTERACTIVE:
           /*  Make sure all the arguments are there!  */
-          if (nparams == 6 || nparams == 7)
+          if (nparams == 6 || nparams == 7 || nparams == 10)
             {
               switch (param[5].data.d_int32)
                 {
@@ -312,10 +438,26 @@ run (const gchar      *name,
                 default: status = GIMP_PDB_CALLING_ERROR; break;
                 }
 
-              if (nparams == 7)
+              if (nparams >= 7)
                 tsvals.save_transp_pixels = param[6].data.d_int32;
               else
                 tsvals.save_transp_pixels = TRUE;
+
+              if (nparams == 10)
+                {
+                  tsvals.rows_per_strip = param[7].data.d_int32;
+                  tsvals.tile_size      = param[8].data.d_int32;
+                  tsvals.bigtiff        = param[9].data.d_int32;
+
+                  if (tsvals.rows_per_strip < 0 || tsvals.tile_size < 0)
+                    status = GIMP_PDB_CALLING_ERROR;
+                }
+              else
+                {
+                  tsvals.rows_per_strip = 0;
+                  tsvals.tile_size      = 0;
+                  tsvals.bigtiff        = FALSE;
+                }
             }
           else
             {
@@ -398,7 +540,7 @@ tiff_warning (const gchar *module,
         return;
     }
 
-  g_logv (G_LOG_DOMAIN, G_LOG_LEVEL_MESSAGE, fmt, ap);
+  tiff_report (fmt, ap);
 }
 
 static void
@@ -410,7 +552,31 @@ tiff_error (const gchar *module,
   /* Ignore the errors related to random access and JPEG compression */
   if (! strcmp (fmt, "Compression algorithm does not support random access"))
     return;
-  g_logv (G_LOG_DOMAIN, G_LOG_LEVEL_MESSAGE, fmt, ap);
+  tiff_report (fmt, ap);
+}
+
+static void
+tiff_report (const gchar *fmt,
+             va_list      ap)
+{
+  gchar *msg;
+
+  if (g_thread_self () == main_thread)
+    {
+      g_logv (G_LOG_DOMAIN, G_LOG_LEVEL_MESSAGE, fmt, ap);
+      return;
+    }
+
+  /* libgimp must only be called from the main thread: keep the first
+   * message for write_blocks() to show and send the others to the console.
+   */
+  msg = g_strdup_vprintf (fmt, ap);
+
+  if (! g_atomic_pointer_compare_and_exchange (&worker_message, NULL, msg))
+    {
+      g_printerr ("%s\n", msg);
+      g_free (msg);
+    }
 }
 
 static gboolean
@@ -638,8 +804,9 @@ save_image (const gchar  *filename,
   gushort        red[256];
   gushort        grn[256];
   gushort        blu[256];
-  gint           cols, col, rows, row, i;
-  glong          rowsperstrip;
+  gint           cols, rows, i;
+  gint           rowsperstrip;
+  gint           tile_size;
   gushort        compression;
   gushort        extra_samples[1];
   gboolean       alpha;
@@ -648,15 +815,14 @@ save_image (const gchar  *filename,
   gshort         samplesperpixel;
   gshort         bitspersample;
   gint           bytesperrow;
-  guchar        *t, *src, *data;
   guchar        *cmap;
   gint           num_colors;
   gint           success;
   GimpDrawable  *drawable;
   GimpImageType  drawable_type;
   GimpPixelRgn   pixel_rgn;
-  gint           tile_height;
-  gint           y, yend;
+  TiffEncodeJob  job;
+  const gchar   *mode     = "w";
   gint           fd;
   gboolean       is_bw    = FALSE;
   gboolean       invert   = TRUE;
@@ -673,8 +839,33 @@ save_image (const gchar  *filename,
 #endif
 
   predictor = 0;
-  tile_height = gimp_tile_height ();
-  rowsperstrip = tile_height;
+
+  rowsperstrip = tsvals.rows_per_strip;
+  if (rowsperstrip <= 0)
+    rowsperstrip = gimp_tile_height ();
+
+  /* JPEG strips must be made of whole 8x8 blocks.  The image is never
+   * written as YCbCr, so there is no vertical subsampling to allow for.
+   */
+  if (compression == COMPRESSION_JPEG)
+    rowsperstrip = (rowsperstrip + 7) & ~7;
+
+  /* Tile dimensions must be multiples of 16 */
+  tile_size = tsvals.tile_size;
+  if (tile_size > 0)
+    tile_size = MAX (16, (tile_size + 15) & ~15);
+
+  if (tsvals.bigtiff ||
+      (compression == COMPRESSION_NONE &&
+       (gdouble) gimp_drawable_width (layer) * gimp_drawable_height (layer) *
+       gimp_drawable_bpp (layer) > CLASSIC_TIFF_LIMIT))
+    {
+#ifdef TIFF_BIGTIFF_VERSION
+      mode = "w8";
+#else
+      g_message (_("This version of libtiff can not save BigTIFF files."));
+#endif
+    }
 
   fd = g_open (filename, O_CREAT | O_TRUNC | O_WRONLY | _O_BINARY, 0666);
 
@@ -686,7 +877,7 @@ save_image (const gchar  *filename,
       return FALSE;
     }
 
-  tif = TIFFFdOpen (fd, filename, "w");
+  tif = TIFFFdOpen (fd, filename, mode);
 
   TIFFSetWarningHandler (tiff_warning);
   TIFFSetErrorHandler (tiff_error);
@@ -826,7 +1017,17 @@ save_image (const gchar  *filename,
   TIFFSetField (tif, TIFFTAG_PHOTOMETRIC, photometric);
   TIFFSetField (tif, TIFFTAG_DOCUMENTNAME, filename);
   TIFFSetField (tif, TIFFTAG_SAMPLESPERPIXEL, samplesperpixel);
-  TIFFSetField (tif, TIFFTAG_ROWSPERSTRIP, rowsperstrip);
+
+  if (tile_size > 0)
+    {
+      TIFFSetField (tif, TIFFTAG_TILEWIDTH, tile_size);
+      TIFFSetField (tif, TIFFTAG_TILELENGTH, tile_size);
+    }
+  else
+    {
+      TIFFSetField (tif, TIFFTAG_ROWSPERSTRIP, MIN (rowsperstrip, rows));
+    }
+
   /* TIFFSetField( tif, TIFFTAG_STRIPBYTECOUNTS, rows / rowsperstrip ); */
   TIFFSetField (tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
 
@@ -936,112 +1137,546 @@ save_image (const gchar  *filename,
   if (!is_bw && drawable_type == GIMP_INDEXED_IMAGE)
     TIFFSetField (tif, TIFFTAG_COLORMAP, red, grn, blu);
 
-  /* array to rearrange data */
-  src = g_new (guchar, bytesperrow * tile_height);
-  data = g_new (guchar, bytesperrow);
-
   /* Now write the TIFF data. */
-  for (y = 0; y < rows; y = yend)
+  memset (&job, 0, sizeof (TiffEncodeJob));
+
+  job.drawable_type   = drawable_type;
+  job.bpp             = drawable->bpp;
+  job.samplesperpixel = samplesperpixel;
+  job.is_bw           = is_bw;
+  job.invert          = invert;
+  job.width           = cols;
+  job.height          = rows;
+
+  /* JPEG tables and uncompressed data are not worth the round trip */
+  job.direct = (compression == COMPRESSION_NONE ||
+                compression == COMPRESSION_JPEG);
+
+  if (tile_size > 0)
+    {
+      job.tiled       = TRUE;
+      job.unit_width  = tile_size;
+      job.unit_length = tile_size;
+      job.unit_size   = TIFFTileSize (tif);
+      job.row_size    = TIFFTileRowSize (tif);
+
+      gimp_tile_cache_ntiles ((cols / gimp_tile_width () + 2) *
+                              (tile_size / gimp_tile_height () + 2));
+    }
+  else
+    {
+      job.unit_width  = cols;
+      job.unit_length = MIN (rowsperstrip, rows);
+      job.unit_size   = TIFFStripSize (tif);
+      job.row_size    = TIFFScanlineSize (tif);
+    }
+
+  success = write_blocks (tif, &pixel_rgn, &job);
+
+  TIFFFlushData (tif);
+  TIFFClose (tif);
+  close (fd);
+
+  gimp_progress_update (1.0);
+
+  gimp_drawable_detach (drawable);
+
+  return success;
+}
+
+/* Reads the drawable a batch of strips or tiles at a time.  While the
+ * encoders compress one batch into memory the main thread appends the
+ * previous one to the file.
+ */
+static gboolean
+write_blocks (TIFF          *tif,
+              GimpPixelRgn  *pixel_rgn,
+              TiffEncodeJob *job)
+{
+  TiffSaveBlock *blocks;
+  TiffSaveBlock *batch;
+  gint           units_down;
+  gint           batch_size;
+  gsize          block_size;
+  gint           fetched = 0;
+  gint           written = 0;
+  gint           n;
+  gint           i, j;
+  gboolean       success = TRUE;
+
+  job->units_across = ((job->width + job->unit_width - 1) /
+                       job->unit_width);
+  units_down        = ((job->height + job->unit_length - 1) /
+                       job->unit_length);
+  job->n_units      = job->units_across * units_down;
+
+  job->n_threads = job->direct ? 1 : MIN (threads_get_count (), job->n_units);
+
+  if (job->n_threads == 1)
+    job->direct = TRUE;
+
+  for (i = 0; i < job->n_threads && ! job->direct; i++)
+    {
+      job->encoders[i].tif = open_scratch_tiff (tif, &job->encoders[i].file);
+
+      if (! job->encoders[i].tif)
+        {
+          job->n_threads = i;
+
+          if (i == 0)
+            job->direct = TRUE;
+        }
+    }
+
+  job->n_threads = MAX (job->n_threads, 1);
+
+  for (i = 0; i < job->n_threads; i++)
+    job->encoders[i].job = job;
+
+  block_size = ((gsize) job->unit_width * job->unit_length * job->bpp +
+                2 * job->unit_size);
+
+  batch_size = MAX (BATCH_SIZE / block_size, job->n_threads);
+  batch_size = MIN (batch_size, job->n_units);
+
+  /* Two batches: one being encoded, one being written */
+  blocks = g_new (TiffSaveBlock, 2 * batch_size);
+
+  for (j = 0; j < 2 * batch_size; j++)
+    {
+      blocks[j].pixels = g_new (guchar, ((gsize) job->unit_width *
+                                         job->unit_length * job->bpp));
+      blocks[j].data   = g_new0 (guchar, job->unit_size);
+      blocks[j].raw    = job->direct ? NULL : g_byte_array_new ();
+    }
+
+  batch = NULL;
+  n     = 0;
+
+  do
+    {
+      TiffSaveBlock *next   = (batch == blocks) ? blocks + batch_size : blocks;
+      gint           next_n = MIN (batch_size, job->n_units - fetched);
+
+      /* Fetch the next batch, and have it encoded while this one is saved */
+      for (j = 0; j < next_n; j++)
+        {
+          TiffSaveBlock *block = next + j;
+          gint           unit  = fetched + j;
+
+          block->x    = (unit % job->units_across) * job->unit_width;
+          block->y    = (unit / job->units_across) * job->unit_length;
+          block->cols = MIN (job->width - block->x, job->unit_width);
+          block->rows = MIN (job->height - block->y, job->unit_length);
+
+          gimp_pixel_rgn_get_rect (pixel_rgn, block->pixels,
+                                   block->x, block->y,
+                                   block->cols, block->rows);
+        }
+
+      fetched += next_n;
+
+      if (next_n > 0)
+        encode_start (job, next, next_n);
+
+      for (j = 0; j < n && success; j++)
+        success = write_block (tif, job, batch + j);
+
+      if (n > 0)
+        {
+          written += n;
+          gimp_progress_update ((gdouble) written / (gdouble) job->n_units);
+        }
+
+      if (next_n > 0)
+        encode_finish (job);
+
+      batch = next;
+      n     = next_n;
+    }
+  while (n > 0 && success);
+
+  if (worker_message)
+    {
+      g_message ("%s", (gchar *) worker_message);
+      g_free (worker_message);
+      worker_message = NULL;
+    }
+
+  for (j = 0; j < 2 * batch_size; j++)
+    {
+      g_free (blocks[j].pixels);
+      g_free (blocks[j].data);
+
+      if (blocks[j].raw)
+        g_byte_array_free (blocks[j].raw, TRUE);
+    }
+
+  g_free (blocks);
+
+  for (i = 0; i < job->n_threads; i++)
+    {
+      if (job->encoders[i].tif)
+        {
+          TIFFClose (job->encoders[i].tif);
+          g_byte_array_free (job->encoders[i].file.data, TRUE);
+        }
+    }
+
+  return success;
+}
+
+static gboolean
+write_block (TIFF          *tif,
+             TiffEncodeJob *job,
+             TiffSaveBlock *block)
+{
+  tsize_t  written;
+
+  if (job->tiled)
+    {
+      ttile_t tile = TIFFComputeTile (tif, block->x, block->y, 0, 0);
+
+      if (job->direct)
+        written = TIFFWriteEncodedTile (tif, tile,
+                                        block->data, job->unit_size);
+      else if (block->raw->len > 0)
+        written = TIFFWriteRawTile (tif, tile,
+                                    block->raw->data, block->raw->len);
+      else
+        written = -1;
+    }
+  else
+    {
+      tstrip_t strip = TIFFComputeStrip (tif, block->y, 0);
+
+      if (job->direct)
+        written = TIFFWriteEncodedStrip (tif, strip, block->data,
+                                         block->rows * job->row_size);
+      else if (block->raw->len > 0)
+        written = TIFFWriteRawStrip (tif, strip,
+                                     block->raw->data, block->raw->len);
+      else
+        written = -1;
+    }
+
+  if (written < 0)
+    {
+      g_message ("Failed a write at row %d, column %d", block->y, block->x);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static tsize_t
+mem_read (thandle_t handle,
+          tdata_t   buffer,
+          tsize_t   size)
+{
+  TiffMemFile *file = (TiffMemFile *) handle;
+
+  if (file->offset >= file->data->len)
+    return 0;
+
+  size = MIN (size, file->data->len - file->offset);
+  memcpy (buffer, file->data->data + file->offset, size);
+  file->offset += size;
+
+  return size;
+}
+
+static tsize_t
+mem_write (thandle_t handle,
+           tdata_t   buffer,
+           tsize_t   size)
+{
+  TiffMemFile *file = (TiffMemFile *) handle;
+
+  if (file->offset + size > file->data->len)
+    g_byte_array_set_size (file->data, file->offset + size);
+
+  memcpy (file->data->data + file->offset, buffer, size);
+  file->offset += size;
+
+  return size;
+}
+
+static toff_t
+mem_seek (thandle_t handle,
+          toff_t    offset,
+          gint      whence)
+{
+  TiffMemFile *file = (TiffMemFile *) handle;
+
+  switch (whence)
+    {
+    case SEEK_CUR:
+      offset += file->offset;
+      break;
+
+    case SEEK_END:
+      offset += file->data->len;
+      break;
+    }
+
+  file->offset = offset;
+
+  return file->offset;
+}
+
+static gint
+mem_close (thandle_t handle)
+{
+  return 0;
+}
+
+static toff_t
+mem_size (thandle_t handle)
+{
+  TiffMemFile *file = (TiffMemFile *) handle;
+
+  return file->data->len;
+}
+
+static gint
+mem_map (thandle_t  handle,
+         tdata_t   *base,
+         toff_t    *size)
+{
+  return 0;
+}
+
+static void
+mem_unmap (thandle_t handle,
+           tdata_t   base,
+           toff_t    size)
+{
+}
+
+/* Opens an in-memory file with the same layout as tif, for an encoding
+ * thread: whatever it writes for a strip or tile is the compressed data
+ * the real file needs.
+ */
+static TIFF *
+open_scratch_tiff (TIFF        *tif,
+                   TiffMemFile *file)
+{
+  TIFF   *scratch;
+  uint32  width, length, rowsperstrip, tile_width, tile_length;
+  uint16  bitspersample, samplesperpixel, compression, predictor;
+  uint16  photometric;
+
+  file->data   = g_byte_array_new ();
+  file->offset = 0;
+
+  scratch = TIFFClientOpen ("scratch", "w", (thandle_t) file,
+                            mem_read, mem_write, mem_seek, mem_close,
+                            mem_size, mem_map, mem_unmap);
+
+  if (! scratch)
+    {
+      g_byte_array_free (file->data, TRUE);
+      return NULL;
+    }
+
+  file->header = file->data->len;
+
+  TIFFGetField (tif, TIFFTAG_IMAGEWIDTH, &width);
+  TIFFGetField (tif, TIFFTAG_IMAGELENGTH, &length);
+  TIFFGetField (tif, TIFFTAG_BITSPERSAMPLE, &bitspersample);
+  TIFFGetField (tif, TIFFTAG_SAMPLESPERPIXEL, &samplesperpixel);
+  TIFFGetField (tif, TIFFTAG_COMPRESSION, &compression);
+  TIFFGetField (tif, TIFFTAG_PHOTOMETRIC, &photometric);
+
+  /* The encoders do not care about the palette, nor should we */
+  if (photometric == PHOTOMETRIC_PALETTE)
+    photometric = PHOTOMETRIC_MINISBLACK;
+
+  TIFFSetField (scratch, TIFFTAG_IMAGEWIDTH, width);
+  TIFFSetField (scratch, TIFFTAG_IMAGELENGTH, length);
+  TIFFSetField (scratch, TIFFTAG_BITSPERSAMPLE, bitspersample);
+  TIFFSetField (scratch, TIFFTAG_SAMPLESPERPIXEL, samplesperpixel);
+  TIFFSetField (scratch, TIFFTAG_COMPRESSION, compression);
+  TIFFSetField (scratch, TIFFTAG_PHOTOMETRIC, photometric);
+  TIFFSetField (scratch, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+
+  if (TIFFGetField (tif, TIFFTAG_PREDICTOR, &predictor))
+    TIFFSetField (scratch, TIFFTAG_PREDICTOR, predictor);
+
+  if (TIFFIsTiled (tif))
     {
-      yend = y + tile_height;
-      yend = MIN (yend, rows);
+      TIFFGetField (tif, TIFFTAG_TILEWIDTH, &tile_width);
+      TIFFGetField (tif, TIFFTAG_TILELENGTH, &tile_length);
+      TIFFSetField (scratch, TIFFTAG_TILEWIDTH, tile_width);
+      TIFFSetField (scratch, TIFFTAG_TILELENGTH, tile_length);
+    }
+  else
+    {
+      TIFFGetField (tif, TIFFTAG_ROWSPERSTRIP, &rowsperstrip);
+      TIFFSetField (scratch, TIFFTAG_ROWSPERSTRIP, rowsperstrip);
+    }
 
-      gimp_pixel_rgn_get_rect (&pixel_rgn, src, 0, y, cols, yend - y);
+  return scratch;
+}
 
-      for (row = y; row < yend; row++)
+/* Rearranges rows of drawable pixels as the TIFF file stores them */
+static void
+convert_rows (TiffEncodeJob *job,
+              const guchar  *src,
+              guchar        *dest,
+              gint           cols,
+              gint           rows)
+{
+  gint  samplesperpixel = job->samplesperpixel;
+  gint  row, col;
+
+  for (row = 0; row < rows; row++)
+    {
+      const guchar *t    = src + row * cols * job->bpp;
+      guchar       *data = dest + row * job->row_size;
+
+      switch (job->drawable_type)
         {
-          t = src + bytesperrow * (row - y);
+        case GIMP_INDEXED_IMAGE:
+          if (job->is_bw)
+            byte2bit (t, cols, data, job->invert);
+          else
+            memcpy (data, t, cols);
+          break;
 
-          switch (drawable_type)
+        case GIMP_GRAY_IMAGE:
+        case GIMP_RGB_IMAGE:
+          memcpy (data, t, cols * job->bpp);
+          break;
+
+        case GIMP_GRAYA_IMAGE:
+          for (col = 0; col < cols*samplesperpixel; col+=samplesperpixel)
             {
-            case GIMP_INDEXED_IMAGE:
-              if (is_bw)
+              if (tsvals.save_transp_pixels)
                 {
-                  byte2bit (t, bytesperrow, data, invert);
-                  success = (TIFFWriteScanline (tif, data, row, 0) >= 0);
+                  data[col + 0] = t[col + 0];
                 }
               else
                 {
-                  success = (TIFFWriteScanline (tif, t, row, 0) >= 0);
+                  /* pre-multiply gray by alpha */
+                  data[col + 0] = (t[col + 0] * t[col + 1]) / 255;
                 }
-              break;
 
-            case GIMP_GRAY_IMAGE:
-              success = (TIFFWriteScanline (tif, t, row, 0) >= 0);
-              break;
+              data[col + 1] = t[col + 1];  /* alpha channel */
+            }
+          break;
 
-            case GIMP_GRAYA_IMAGE:
-              for (col = 0; col < cols*samplesperpixel; col+=samplesperpixel)
+        case GIMP_RGBA_IMAGE:
+          for (col = 0; col < cols*samplesperpixel; col+=samplesperpixel)
+            {
+              if (tsvals.save_transp_pixels)
                 {
-                  if (tsvals.save_transp_pixels)
-                    {
-                      data[col + 0] = t[col + 0];
-                    }
-                  else
-                    {
-                      /* pre-multiply gray by alpha */
-                      data[col + 0] = (t[col + 0] * t[col + 1]) / 255;
-                    }
-
-                  data[col + 1] = t[col + 1];  /* alpha channel */
+                  data[col+0] = t[col + 0];
+                  data[col+1] = t[col + 1];
+                  data[col+2] = t[col + 2];
                 }
-
-              success = (TIFFWriteScanline (tif, data, row, 0) >= 0);
-              break;
-
-            case GIMP_RGB_IMAGE:
-              success = (TIFFWriteScanline (tif, t, row, 0) >= 0);
-              break;
-
-            case GIMP_RGBA_IMAGE:
-              for (col = 0; col < cols*samplesperpixel; col+=samplesperpixel)
+              else
                 {
-                  if (tsvals.save_transp_pixels)
-                    {
-                      data[col+0] = t[col + 0];
-                      data[col+1] = t[col + 1];
-                      data[col+2] = t[col + 2];
-                    }
-                  else
-                    {
-                      /* pre-multiply rgb by alpha */
-                      data[col+0] = t[col + 0] * t[col + 3] / 255;
-                      data[col+1] = t[col + 1] * t[col + 3] / 255;
-                      data[col+2] = t[col + 2] * t[col + 3] / 255;
-                    }
-
-                  data[col+3] = t[col + 3];  /* alpha channel */
+                  /* pre-multiply rgb by alpha */
+                  data[col+0] = t[col + 0] * t[col + 3] / 255;
+                  data[col+1] = t[col + 1] * t[col + 3] / 255;
+                  data[col+2] = t[col + 2] * t[col + 3] / 255;
                 }
 
-              success = (TIFFWriteScanline (tif, data, row, 0) >= 0);
-              break;
-
-            default:
-              success = FALSE;
-              break;
+              data[col+3] = t[col + 3];  /* alpha channel */
             }
+          break;
 
-          if (!success)
-            {
-              g_message ("Failed a scanline write on row %d", row);
-              return FALSE;
-            }
+        default:
+          break;
         }
-
-      if ((row % 32) == 0)
-        gimp_progress_update ((gdouble) row / (gdouble) rows);
     }
+}
 
-  TIFFFlushData (tif);
-  TIFFClose (tif);
-  close (fd);
+static void
+encode_unit (TiffEncoder   *encoder,
+             TiffSaveBlock *block)
+{
+  TiffEncodeJob *job  = encoder->job;
+  TiffMemFile   *file = &encoder->file;
+  tsize_t        encoded;
 
-  gimp_progress_update (1.0);
+  /* Tiles hanging over the edge of the image are padded with zeros */
+  if (job->tiled &&
+      (block->cols < job->unit_width || block->rows < job->unit_length))
+    memset (block->data, 0, job->unit_size);
 
-  gimp_drawable_detach (drawable);
-  g_free (data);
+  convert_rows (job, block->pixels, block->data, block->cols, block->rows);
 
-  return TRUE;
+  if (job->direct)
+    return;
+
+  /* Everything written past the header is the compressed strip or tile */
+  g_byte_array_set_size (file->data, file->header);
+
+  if (job->tiled)
+    encoded = TIFFWriteEncodedTile (encoder->tif,
+                                    TIFFComputeTile (encoder->tif,
+                                                     block->x, block->y,
+                                                     0, 0),
+                                    block->data, job->unit_size);
+  else
+    encoded = TIFFWriteEncodedStrip (encoder->tif,
+                                     TIFFComputeStrip (encoder->tif,
+                                                       block->y, 0),
+                                     block->data,
+                                     block->rows * job->row_size);
+
+  g_byte_array_set_size (block->raw, 0);
+
+  if (encoded >= 0)
+    g_byte_array_append (block->raw,
+                         file->data->data + file->header,
+                         file->data->len - file->header);
+}
+
+static gpointer
+encode_thread (gpointer data)
+{
+  TiffEncoder   *encoder = data;
+  TiffEncodeJob *job     = encoder->job;
+  gint           i;
+
+  while ((i = g_atomic_int_add (&job->next_unit, 1)) < job->n_batch)
+    encode_unit (encoder, job->batch + i);
+
+  return NULL;
+}
+
+static void
+encode_start (TiffEncodeJob *job,
+              TiffSaveBlock *batch,
+              gint           n_batch)
+{
+  gint  i;
+
+  job->batch     = batch;
+  job->n_batch   = n_batch;
+  job->next_unit = 0;
+  job->n_running = MIN (job->n_threads, n_batch);
+
+  for (i = 1; i < job->n_running; i++)
+    job->threads[i] = g_thread_create (encode_thread, &job->encoders[i],
+                                       TRUE, NULL);
+}
+
+static void
+encode_finish (TiffEncodeJob *job)
+{
+  gint  i;
+
+  /* Help the worker threads, then wait for them */
+  encode_thread (&job->encoders[0]);
+
+  for (i = 1; i < job->n_running; i++)
+    if (job->threads[i])
+      g_thread_join (job->threads[i]);
 }
 
 static gboolean
@@ -1110,6 +1745,29 @@ save_dialog (gboolean has_alpha,
                     G_CALLBACK (gimp_toggle_button_update),
                     &tsvals.save_transp_pixels);
 
+  /* Tiles and BigTIFF for very large images */
+  toggle = gtk_check_button_new_with_mnemonic (_("Save as _tiles"));
+  gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (toggle),
+                                tsvals.tile_size > 0);
+  gtk_box_pack_start (GTK_BOX (vbox), toggle, FALSE, FALSE, 0);
+  gtk_widget_show (toggle);
+
+  g_signal_connect (toggle, "toggled",
+                    G_CALLBACK (tiles_toggle_callback),
+                    NULL);
+
+  toggle = gtk_check_button_new_with_mnemonic (_("Use _BigTIFF format"));
+  gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (toggle), tsvals.bigtiff);
+#ifndef TIFF_BIGTIFF_VERSION
+  gtk_widget_set_sensitive (toggle, FALSE);
+#endif
+  gtk_box_pack_start (GTK_BOX (vbox), toggle, FALSE, FALSE, 0);
+  gtk_widget_show (toggle);
+
+  g_signal_connect (toggle, "toggled",
+                    G_CALLBACK (gimp_toggle_button_update),
+                    &tsvals.bigtiff);
+
   /* comment entry */
   hbox = gtk_box_new (GTK_ORIENTATION_HORIZONTAL, 6);
   gtk_box_pack_start (GTK_BOX (vbox), hbox, FALSE, FALSE, 0);
@@ -1150,6 +1808,16 @@ comment_entry_callback (GtkWidget *widget,
   image_comment = g_strdup (text);
 }
 
+static void
+tiles_toggle_callback (GtkWidget *widget,
+                       gpointer   data)
+{
+  if (gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (widget)))
+    tsvals.tile_size = DEFAULT_TILE_SIZE;
+  else
+    tsvals.tile_size = 0;
+}
+
 /* Convert n bytes of 0/1 to a line of bits */
 static void
 byte2bit (const guchar *byteline,
@@ -32,6 +32,8 @@
 
 #include "libgimp/stdplugins-intl.h"
 
+#include "resampler.h"
+
 
 #define PLUG_IN_PROC    "plug-in-illusion"
 #define PLUG_IN_BINARY  "illusion"
@@ -183,26 +185,25 @@ run (const gchar      *name,
 }
 
 typedef struct {
-  GimpPixelFetcher *pft;
   gdouble           center_x;
   gdouble           center_y;
   gdouble           scale;
   gdouble           offset;
+  gint              bpp;
   gboolean          has_alpha;
 } IllusionParam_t;
 
-static void
-illusion_func (gint          x,
-               gint          y,
-               const guchar *src,
-               guchar       *dest,
-               gint          bpp,
-               gpointer      data)
+/* Computes the source position (xx, yy) of pixel (x, y) and returns
+ * its weight relative to the original pixel.
+ */
+static gdouble
+illusion_displace (const IllusionParam_t *param,
+                   gint                   x,
+                   gint                   y,
+                   gint                  *xx,
+                   gint                  *yy)
 {
-  IllusionParam_t *param = (IllusionParam_t*) data;
-  gint             xx, yy, b;
-  gdouble          radius, cx, cy, angle;
-  guchar           pixel[4];
+  gdouble radius, cx, cy, angle;
 
   cy = ((gdouble) y - param->center_y) / param->scale;
   cx = ((gdouble) x - param->center_x) / param->scale;
@@ -213,16 +214,27 @@ illusion_func (gint          x,
 
   if (parameters.type1)
     {
-      xx = x - param->offset * cos (angle);
-      yy = y - param->offset * sin (angle);
+      *xx = x - param->offset * cos (angle);
+      *yy = y - param->offset * sin (angle);
     }
   else                          /* Type 2 */
     {
-      xx = x - param->offset * sin (angle);
-      yy = y - param->offset * cos (angle);
+      *xx = x - param->offset * sin (angle);
+      *yy = y - param->offset * cos (angle);
     }
 
-  gimp_pixel_fetcher_get_pixel (param->pft, xx, yy, pixel);
+  return radius;
+}
+
+static void
+illusion_blend (const IllusionParam_t *param,
+                gdouble                radius,
+                const guchar          *src,
+                const guchar          *pixel,
+                guchar                *dest)
+{
+  gint bpp = param->bpp;
+  gint b;
 
   if (param->has_alpha)
     {
@@ -245,62 +257,93 @@ illusion_func (gint          x,
 }
 
 static void
-illusion (GimpDrawable *drawable)
+illusion_row (const Resampler *resampler,
+              gint             x,
+              gint             y,
+              gint             width,
+              const guchar    *src,
+              guchar          *dest,
+              gpointer         data)
 {
-  IllusionParam_t  param;
-  GimpRgnIterator *iter;
-  gint             width, height;
-  gint             x1, y1, x2, y2;
+  const IllusionParam_t *param = data;
+  guchar                 pixel[4];
+  gint                   xx, yy;
+  gint                   col;
+  gdouble                radius;
+
+  for (col = x; col < x + width; col++)
+    {
+      radius = illusion_displace (param, col, y, &xx, &yy);
+
+      resampler_get_pixel (resampler, xx, yy, pixel);
+      illusion_blend (param, radius, src, pixel, dest);
+
+      src  += param->bpp;
+      dest += param->bpp;
+    }
+}
+
+static void
+illusion_init_param (IllusionParam_t *param,
+                     GimpDrawable    *drawable)
+{
+  gint width, height;
+  gint x1, y1, x2, y2;
 
   gimp_drawable_mask_bounds (drawable->drawable_id, &x1, &y1, &x2, &y2);
   width  = x2 - x1;
   height = y2 - y1;
 
-  param.pft = gimp_pixel_fetcher_new (drawable, FALSE);
-  gimp_pixel_fetcher_set_edge_mode (param.pft, GIMP_PIXEL_FETCHER_EDGE_SMEAR);
+  param->bpp       = drawable->bpp;
+  param->has_alpha = gimp_drawable_has_alpha (drawable->drawable_id);
+  param->center_x  = (x1 + x2) / 2.0;
+  param->center_y  = (y1 + y2) / 2.0;
+  param->scale     = sqrt (width * width + height * height) / 2;
+  param->offset    = (gint) (param->scale / 2);
+}
+
+static void
+illusion (GimpDrawable *drawable)
+{
+  IllusionParam_t  param;
+  Resampler       *resampler;
 
-  param.has_alpha = gimp_drawable_has_alpha (drawable->drawable_id);
-  param.center_x = (x1 + x2) / 2.0;
-  param.center_y = (y1 + y2) / 2.0;
-  param.scale = sqrt (width * width + height * height) / 2;
-  param.offset = (gint) (param.scale / 2);
+  illusion_init_param (&param, drawable);
 
-  iter = gimp_rgn_iterator_new (drawable, 0);
-  gimp_rgn_iterator_src_dest (iter, illusion_func, &param);
-  gimp_rgn_iterator_free (iter);
+  resampler = resampler_new (drawable);
+  resampler_set_edge_mode (resampler, GIMP_PIXEL_FETCHER_EDGE_SMEAR);
 
-  gimp_pixel_fetcher_destroy (param.pft);
+  resampler_render (resampler, drawable, illusion_row, &param);
+
+  resampler_free (resampler);
 }
 
+/* The zoom preview only looks at a handful of source pixels, so it
+ * keeps fetching them on demand instead of reading the whole drawable.
+ */
 static void
 illusion_preview (GimpPreview  *preview,
                   GimpDrawable *drawable)
 
 {
+  GimpPixelFetcher     *pft;
   gint                  x, y;
   gint                  sx, sy;
+  gint                  xx, yy;
   gint                  preview_width, preview_height;
   guchar               *src;
   guchar               *dest;
   guchar               *src_pixel;
   guchar               *dest_pixel;
+  guchar                pixel[4];
   gint                  bpp;
+  gdouble               radius;
   IllusionParam_t       param;
-  gint                  width, height;
-  gint                  x1, y1, x2, y2;
 
-  gimp_drawable_mask_bounds (drawable->drawable_id, &x1, &y1, &x2, &y2);
-  width  = x2 - x1;
-  height = y2 - y1;
-
-  param.pft = gimp_pixel_fetcher_new (drawable, FALSE);
-  gimp_pixel_fetcher_set_edge_mode (param.pft, GIMP_PIXEL_FETCHER_EDGE_SMEAR);
+  illusion_init_param (&param, drawable);
 
-  param.has_alpha = gimp_drawable_has_alpha (drawable->drawable_id);
-  param.center_x = (x1 + x2) / 2.0;
-  param.center_y = (y1 + y2) / 2.0;
-  param.scale = sqrt (width * width + height * height) / 2;
-  param.offset = (gint) (param.scale / 2);
+  pft = gimp_pixel_fetcher_new (drawable, FALSE);
+  gimp_pixel_fetcher_set_edge_mode (pft, GIMP_PIXEL_FETCHER_EDGE_SMEAR);
 
   src = gimp_zoom_preview_get_source (GIMP_ZOOM_PREVIEW (preview),
                                       &preview_width, &preview_height, &bpp);
@@ -315,17 +358,17 @@ illusion_preview (GimpPreview  *preview,
         {
           gimp_preview_untransform (preview, x, y, &sx, &sy);
 
-          illusion_func (sx, sy,
-                         src_pixel, dest_pixel,
-                         bpp,
-                         (gpointer) &param);
+          radius = illusion_displace (&param, sx, sy, &xx, &yy);
+
+          gimp_pixel_fetcher_get_pixel (pft, xx, yy, pixel);
+          illusion_blend (&param, radius, src_pixel, pixel, dest_pixel);
 
           src_pixel += bpp;
           dest_pixel += bpp;
         }
     }
 
-  gimp_pixel_fetcher_destroy (param.pft);
+  gimp_pixel_fetcher_destroy (pft);
 
   gimp_preview_draw_buffer (preview, dest, preview_width * bpp);
   g_free (dest);
@@ -30,6 +30,8 @@
 
 #include "libgimp/stdplugins-intl.h"
 
+#include "resampler.h"
+
 
 #define PLUG_IN_PROC     "plug-in-lens-distortion"
 #define PLUG_IN_BINARY   "lens-distortion"
@@ -310,6 +312,30 @@ lens_cubic_interpolate (const guchar *src,
     }
 }
 
+/* Finds the 4x4 source block for destination pixel (ix, iy): its
+ * upper left corner is (x_int - 1, y_int - 1).
+ */
+static void
+lens_source_block (gint     ix,
+                   gint     iy,
+                   gint    *x_int,
+                   gint    *y_int,
+                   gdouble *dx,
+                   gdouble *dy,
+                   gdouble *brighten)
+{
+  gdouble  src_x, src_y, mag;
+
+  lens_get_source_coords (ix, iy, &src_x, &src_y, &mag);
+
+  *brighten = 1.0 + mag * calc_vals.brighten;
+  *x_int = floor (src_x);
+  *dx = src_x - *x_int;
+
+  *y_int = floor (src_y);
+  *dy = src_y - *y_int;
+}
+
 static void
 lens_distort_func (gint              ix,
                    gint              iy,
@@ -317,7 +343,6 @@ lens_distort_func (gint              ix,
                    gint              bpp,
                    GimpPixelFetcher *pft)
 {
-  gdouble  src_x, src_y, mag;
   gdouble  brighten;
   guchar   pixel_buffer[16 * LENS_MAX_PIXEL_DEPTH];
   guchar  *pixel;
@@ -325,14 +350,7 @@ lens_distort_func (gint              ix,
   gint     x_int, y_int;
   gint     x, y;
 
-  lens_get_source_coords (ix, iy, &src_x, &src_y, &mag);
-
-  brighten = 1.0 + mag * calc_vals.brighten;
-  x_int = floor (src_x);
-  dx = src_x - x_int;
-
-  y_int = floor (src_y);
-  dy = src_y - y_int;
+  lens_source_block (ix, iy, &x_int, &y_int, &dx, &dy, &brighten);
 
   pixel = pixel_buffer;
   for (y = y_int - 1; y <= y_int + 2; y++)
@@ -361,28 +379,74 @@ lens_distort_func (gint              ix,
 }
 
 static void
-lens_distort (GimpDrawable *drawable)
+lens_distort_row (const Resampler *resampler,
+                  gint             x,
+                  gint             y,
+                  gint             width,
+                  const guchar    *src,
+                  guchar          *dest,
+                  gpointer         data)
 {
-  GimpRgnIterator  *iter;
-  GimpPixelFetcher *pft;
-  GimpRGB           background;
+  gint     bpp = GPOINTER_TO_INT (data);
+  gint     rowstride = resampler_get_rowstride (resampler);
+  guchar   pixel_buffer[16 * LENS_MAX_PIXEL_DEPTH];
+  guchar  *pixel;
+  gdouble  brighten;
+  gdouble  dx, dy;
+  gint     x_int, y_int;
+  gint     col, i, j, b;
 
-  lens_setup_calc (drawable->width, drawable->height);
+  for (col = x; col < x + width; col++, dest += bpp)
+    {
+      lens_source_block (col, y, &x_int, &y_int, &dx, &dy, &brighten);
 
-  pft = gimp_pixel_fetcher_new (drawable, FALSE);
+      /* Most blocks lie inside the drawable and are interpolated in
+       * place; only those crossing the edge are copied out.
+       */
+      if (x_int >= 1 && y_int >= 1 &&
+          x_int + 2 < drawable_width && y_int + 2 < drawable_height)
+        {
+          lens_cubic_interpolate (resampler_peek (resampler,
+                                                  x_int - 1, y_int - 1),
+                                  rowstride, bpp,
+                                  dest, bpp, dx, dy, brighten);
+          continue;
+        }
 
-  gimp_context_get_background (&background);
-  gimp_rgb_set_alpha (&background, 0.0);
-  gimp_pixel_fetcher_set_bg_color (pft, &background);
-  gimp_pixel_fetcher_set_edge_mode (pft, GIMP_PIXEL_FETCHER_EDGE_BACKGROUND);
+      pixel = pixel_buffer;
+      for (j = y_int - 1; j <= y_int + 2; j++)
+        {
+          for (i = x_int - 1; i <= x_int + 2; i++)
+            {
+              const guchar *p = resampler_peek (resampler, i, j);
+
+              for (b = 0; b < bpp; b++)
+                pixel[b] = p ? p[b] : background_color[b];
+
+              pixel += bpp;
+            }
+        }
+
+      lens_cubic_interpolate (pixel_buffer, bpp * 4, bpp,
+                              dest, bpp, dx, dy, brighten);
+    }
+}
+
+static void
+lens_distort (GimpDrawable *drawable)
+{
+  Resampler *resampler;
+
+  lens_setup_calc (drawable->width, drawable->height);
 
   gimp_progress_init (_("Lens distortion"));
 
-  iter = gimp_rgn_iterator_new (drawable, 0);
-  gimp_rgn_iterator_dest (iter, (GimpRgnFuncDest) lens_distort_func, pft);
-  gimp_rgn_iterator_free (iter);
+  resampler = resampler_new (drawable);
 
-  gimp_pixel_fetcher_destroy (pft);
+  resampler_render (resampler, drawable,
+                    lens_distort_row, GINT_TO_POINTER (drawable->bpp));
+
+  resampler_free (resampler);
 }
 
 static void
@@ -78,6 +78,10 @@ libgimpmodule = \$(top_builddir)/libgimpmodule/libgimpmodule-\$(GIMP_API_VERSION
 libgimpui = \$(top_builddir)/libgimp/libgimpui-\$(GIMP_API_VERSION).la
 libgimpwidgets = \$(top_builddir)/libgimpwidgets/libgimpwidgets-\$(GIMP_API_VERSION).la
 
+libbands = libbands.a
+libresampler = libresampler.a
+libthreads = libthreads.a
+
 
 AM_LDFLAGS = \$(mwindows)
 
@@ -94,6 +98,23 @@ INCLUDES = \\
 	\$(GEGL_CFLAGS)	\\
 	-I\$(includedir)
 
+noinst_LIBRARIES = \\
+	libbands.a	\\
+	libresampler.a	\\
+	libthreads.a
+
+libbands_a_SOURCES = \\
+	bands.c	\\
+	bands.h
+
+libresampler_a_SOURCES = \\
+	resampler.c	\\
+	resampler.h
+
+libthreads_a_SOURCES = \\
+	threads.c	\\
+	threads.h
+
 libexec_PROGRAMS = \\
 $bins
 
@@ -118,6 +139,9 @@ print IGNORE <<EOT;
 /.libs
 /Makefile
 /Makefile.in
+/libbands.a
+/libresampler.a
+/libthreads.a
 EOT
 
 foreach (sort keys %plugins) {
@@ -126,6 +150,18 @@ foreach (sort keys %plugins) {
 
     my $libgimp = "";
 
+    if (exists $plugins{$_}->{bands}) {
+	$libgimp .= "\$(libbands)\t\t\\\n\t";
+    }
+
+    if (exists $plugins{$_}->{resampler}) {
+	$libgimp .= "\$(libresampler)\t\t\\\n\t";
+    }
+
+    if (exists $plugins{$_}->{threads}) {
+	$libgimp .= "\$(libthreads)\t\t\\\n\t";
+    }
+
     if (exists $plugins{$_}->{ui}) {
         $libgimp .= "\$(libgimpui)";
         $libgimp .= "\t\t\\\n\t\$(libgimpwidgets)";
@@ -23,6 +23,8 @@
 
 #include "libgimp/stdplugins-intl.h"
 
+#include "resampler.h"
+
 
 #define PLUG_IN_PROC    "plug-in-spread"
 #define PLUG_IN_BINARY  "noise-spread"
@@ -202,12 +204,12 @@ run (const gchar      *name,
 
 typedef struct
 {
-  GimpPixelFetcher *pft;
-  GRand            *gr;
-  gint              x_amount;
-  gint              y_amount;
-  gint              width;
-  gint              height;
+  guint32  seed;
+  gint     x_amount;
+  gint     y_amount;
+  gint     width;
+  gint     height;
+  gint     bpp;
 } SpreadParam_t;
 
 /* Spread the image.  This is done by going through every pixel
@@ -226,25 +228,25 @@ typedef struct
 */
 
 static void
-spread_func (gint      x,
-             gint      y,
-             guchar   *dest,
-             gint      bpp,
-             gpointer  data)
+spread_func (const Resampler     *resampler,
+             gint                 x,
+             gint                 y,
+             guchar              *dest,
+             const SpreadParam_t *param,
+             GRand               *gr)
 {
-  SpreadParam_t *param = (SpreadParam_t*) data;
   gdouble        angle;
   gint           xdist, ydist;
   gint           xi, yi;
 
   /* get random angle, x distance, and y distance */
   xdist = (param->x_amount > 0
-           ? g_rand_int_range (param->gr, -param->x_amount, param->x_amount)
+           ? g_rand_int_range (gr, -param->x_amount, param->x_amount)
            : 0);
   ydist = (param->y_amount > 0
-           ? g_rand_int_range (param->gr, -param->y_amount, param->y_amount)
+           ? g_rand_int_range (gr, -param->y_amount, param->y_amount)
            : 0);
-  angle = g_rand_double_range (param->gr, -G_PI, G_PI);
+  angle = g_rand_double_range (gr, -G_PI, G_PI);
 
   xi = x + floor (sin (angle) * xdist);
   yi = y + floor (cos (angle) * ydist);
@@ -252,33 +254,58 @@ spread_func (gint      x,
   /* Only displace the pixel if it's within the bounds of the image. */
   if (xi >= 0 && xi < param->width && yi >= 0 && yi < param->height)
     {
-      gimp_pixel_fetcher_get_pixel (param->pft, xi, yi, dest);
+      resampler_get_pixel (resampler, xi, yi, dest);
     }
   else /* Else just copy it */
     {
-      gimp_pixel_fetcher_get_pixel (param->pft, x, y, dest);
+      resampler_get_pixel (resampler, x, y, dest);
     }
 }
 
+/* Each row of a tile gets its own random sequence, seeded from its
+ * position, so the result does not depend on how the tiles are
+ * spread over the threads.
+ */
+static void
+spread_row (const Resampler *resampler,
+            gint             x,
+            gint             y,
+            gint             width,
+            const guchar    *src,
+            guchar          *dest,
+            gpointer         data)
+{
+  const SpreadParam_t *param = data;
+  GRand               *gr;
+  gint                 col;
+
+  gr = g_rand_new_with_seed (param->seed + y * param->width + x);
+
+  for (col = x; col < x + width; col++, dest += param->bpp)
+    spread_func (resampler, col, y, dest, param, gr);
+
+  g_rand_free (gr);
+}
+
 static void
 spread (GimpDrawable *drawable)
 {
-  GimpRgnIterator *iter;
-  SpreadParam_t    param;
+  Resampler     *resampler;
+  SpreadParam_t  param;
 
-  param.pft      = gimp_pixel_fetcher_new (drawable, FALSE);
-  param.gr       = g_rand_new ();
+  resampler = resampler_new (drawable);
+  resampler_set_edge_mode (resampler, GIMP_PIXEL_FETCHER_EDGE_BLACK);
+
+  param.seed     = g_random_int ();
   param.x_amount = (spvals.spread_amount_x + 1) / 2;
   param.y_amount = (spvals.spread_amount_y + 1) / 2;
   param.width    = drawable->width;
   param.height   = drawable->height;
+  param.bpp      = drawable->bpp;
 
-  gimp_pixel_fetcher_set_edge_mode(param.pft, GIMP_PIXEL_FETCHER_EDGE_BLACK);
-  iter = gimp_rgn_iterator_new (drawable, 0);
-  gimp_rgn_iterator_dest (iter, spread_func, &param);
-  gimp_rgn_iterator_free (iter);
+  resampler_render (resampler, drawable, spread_row, &param);
 
-  g_rand_free (param.gr);
+  resampler_free (resampler);
 }
 
 static void
@@ -286,43 +313,44 @@ spread_preview_update (GimpPreview *preview,
                        GtkWidget   *size)
 {
   GimpDrawable   *drawable;
+  Resampler      *resampler;
   SpreadParam_t   param;
-  gint            x, y, bpp;
-  guchar         *buffer, *dest;
+  guchar         *buffer;
   gint            x_off, y_off;
   gint            width, height;
 
   drawable =
     gimp_drawable_preview_get_drawable (GIMP_DRAWABLE_PREVIEW (preview));
 
-  param.pft      = gimp_pixel_fetcher_new (drawable, FALSE);
-  param.gr       = g_rand_new ();
+  param.seed     = g_random_int ();
   param.x_amount = (gimp_size_entry_get_refval (GIMP_SIZE_ENTRY (size),
                                                 0) + 1) / 2;
   param.y_amount = (gimp_size_entry_get_refval (GIMP_SIZE_ENTRY (size),
                                                 1) + 1) / 2;
   param.width    = drawable->width;
   param.height   = drawable->height;
-  gimp_pixel_fetcher_set_edge_mode(param.pft, GIMP_PIXEL_FETCHER_EDGE_BLACK);
+  param.bpp      = drawable->bpp;
 
   gimp_preview_get_size (preview, &width, &height);
+  gimp_preview_get_position (preview, &x_off, &y_off);
 
-  bpp = drawable->bpp;
-  dest = buffer = g_new (guchar, width * height * bpp);
+  /*  a pixel moves at most x_amount, y_amount  */
+  resampler = resampler_new_area (drawable,
+                                  x_off - param.x_amount - 1,
+                                  y_off - param.y_amount - 1,
+                                  width  + 2 * (param.x_amount + 1),
+                                  height + 2 * (param.y_amount + 1));
+  resampler_set_edge_mode (resampler, GIMP_PIXEL_FETCHER_EDGE_BLACK);
 
-  gimp_preview_get_position (preview, &x_off, &y_off);
+  buffer = g_new (guchar, width * height * param.bpp);
 
-  for (y = 0 ; y < height ; y++)
-    for (x = 0 ; x < width ; x++)
-      {
-        spread_func (x + x_off, y + y_off, dest, bpp, &param);
-        dest += bpp;
-      }
+  resampler_render_buffer (resampler, x_off, y_off, width, height, buffer,
+                           spread_row, &param);
 
-  gimp_preview_draw_buffer (preview, buffer, width * bpp);
+  gimp_preview_draw_buffer (preview, buffer, width * param.bpp);
 
   g_free (buffer);
-  g_rand_free (param.gr);
+  resampler_free (resampler);
 }
 
 static gboolean
@@ -29,6 +29,8 @@
 
 #include "libgimp/stdplugins-intl.h"
 
+#include "threads.h"
+
 
 #define PLUG_IN_PROC          "plug-in-oilify"
 #define PLUG_IN_ENHANCED_PROC "plug-in-oilify-enhanced"
@@ -53,6 +55,24 @@ typedef struct
   gint     mode;
 } OilifyVals;
 
+typedef struct
+{
+  guchar       *src_buf;
+  guchar       *src_inten_buf;  /* NULL unless in intensity mode */
+  guchar       *msmap_buf;      /* NULL unless a mask-size map is used */
+  gint          msmap_bpp;
+  guchar       *emap_buf;       /* NULL unless an exponent map is used */
+  gint          emap_bpp;
+  guchar       *dest_buf;
+  gint          width;
+  gint          height;
+  gint          bpp;
+  gint         *half_widths;
+  gint          max_radius;
+  gint          next_row;
+  gint          rows_done;
+} OilifyJob;
+
 
 /* Declare local functions.
  */
@@ -293,37 +313,75 @@ get_map_value (const guchar *src,
  * This is a special-case form of the powf() function, limited to integer
  * exponents. It calculates e.g. x^13 as (x^8)*(x^4)*(x^1).
  *
- * x can be anything, y must be in [0,255]
+ * All HISTSIZE values of x are raised to the same power in place, one
+ * squaring at a time, so that the inner loops vectorize.
+ *
+ * y must be in [0,255]
  */
-static inline gfloat
-fast_powf (gfloat x, gint y)
+static inline void
+fast_powf (gfloat x[HISTSIZE], gint y)
 {
-  gfloat value;
-  gfloat x_pow[8];
+  gfloat x_pow[HISTSIZE];
   guint  y_uint = (guint) y;
   guint  bitmask;
   gint   i;
 
-  if (y_uint & 0x01)
-    value = x;
-  else
-    value = 1.0;
+  for (i = 0; i < HISTSIZE; i++)
+    x_pow[i] = x[i];
 
-  x_pow[0] = x;
+  if (! (y_uint & 0x01))
+    {
+      for (i = 0; i < HISTSIZE; i++)
+        x[i] = 1.0;
+    }
 
-  for (bitmask = 0x02, i = 1;
-       bitmask <= y_uint;
-       bitmask <<= 1, i++)
+  for (bitmask = 0x02; bitmask <= y_uint; bitmask <<= 1)
     {
-      /*  x_pow[i] == x_pow[i-1]^2 == x^(2^i)  */
+      /*  x_pow[] == x^bitmask  */
 
-      x_pow[i] = SQR (x_pow[i - 1]);
+      for (i = 0; i < HISTSIZE; i++)
+        x_pow[i] = SQR (x_pow[i]);
 
       if (y_uint & bitmask)
-        value *= x_pow[i];
+        {
+          for (i = 0; i < HISTSIZE; i++)
+            x[i] *= x_pow[i];
+        }
     }
+}
 
-  return value;
+/*
+ * Fill weight[] with (hist[i] / hist_max)^exponent, see below.
+ */
+static inline void
+histogram_weights (const gint  hist[HISTSIZE],
+                   gfloat      exponent,
+                   gfloat      weight[HISTSIZE])
+{
+  gint i;
+  gint hist_max = 1;
+  gint exponent_int = 0;
+
+  for (i = 0; i < HISTSIZE; i++)
+    hist_max = MAX (hist_max, hist[i]);
+
+  if ((exponent - floor (exponent)) < 0.001 && exponent <= 255.0)
+    exponent_int = (gint) exponent;
+
+  for (i = 0; i < HISTSIZE; i++)
+    weight[i] = (gfloat) hist[i] / (gfloat) hist_max;
+
+  if (exponent_int)
+    {
+      fast_powf (weight, exponent_int);
+    }
+  else
+    {
+      /*  the exponent is always positive, so empty bins stay zero  */
+      for (i = 0; i < HISTSIZE; i++)
+        if (hist[i] > 0)
+          weight[i] = pow (weight[i], exponent);
+    }
 }
 
 /*
@@ -342,30 +400,17 @@ static inline guchar
 weighted_average_value (gint hist[HISTSIZE], gfloat exponent)
 {
   gint   i;
-  gint   hist_max = 1;
-  gint   exponent_int = 0;
+  gfloat weight[HISTSIZE];
   gfloat sum = 0.0;
   gfloat div = 1.0e-6;
   gint   value;
 
-  for (i = 0; i < HISTSIZE; i++)
-    hist_max = MAX (hist_max, hist[i]);
-
-  if ((exponent - floor (exponent)) < 0.001 && exponent <= 255.0)
-    exponent_int = (gint) exponent;
+  histogram_weights (hist, exponent, weight);
 
   for (i = 0; i < HISTSIZE; i++)
     {
-      gfloat ratio = (gfloat) hist[i] / (gfloat) hist_max;
-      gfloat weight;
-
-      if (exponent_int)
-        weight = fast_powf (ratio, exponent_int);
-      else
-        weight = pow (ratio, exponent);
-
-      sum += weight * (gfloat) i;
-      div += weight;
+      sum += weight[i] * (gfloat) i;
+      div += weight[i];
     }
 
   value = (gint) (sum / div);
@@ -391,32 +436,19 @@ weighted_average_color (gint    hist[HISTSIZE],
                         gint    bpp)
 {
   gint   i, b;
-  gint   hist_max = 1;
-  gint   exponent_int = 0;
+  gfloat weight[HISTSIZE];
   gfloat div = 1.0e-6;
   gfloat color[4] = { 0.0, 0.0, 0.0, 0.0 };
 
-  for (i = 0; i < HISTSIZE; i++)
-    hist_max = MAX (hist_max, hist[i]);
-
-  if ((exponent - floor (exponent)) < 0.001 && exponent <= 255.0)
-    exponent_int = (gint) exponent;
+  histogram_weights (hist, exponent, weight);
 
   for (i = 0; i < HISTSIZE; i++)
     {
-      gfloat ratio = (gfloat) hist[i] / (gfloat) hist_max;
-      gfloat weight;
-
-      if (exponent_int)
-        weight = fast_powf (ratio, exponent_int);
-      else
-        weight = pow (ratio, exponent);
-
       if (hist[i] > 0)
         for (b = 0; b < bpp; b++)
-          color[b] += weight * (gfloat) hist_rgb[b][i] / (gfloat) hist[i];
+          color[b] += weight[i] * (gfloat) hist_rgb[b][i] / (gfloat) hist[i];
 
-      div += weight;
+      div += weight[i];
     }
 
   for (b = 0; b < bpp; b++)
@@ -427,6 +459,209 @@ weighted_average_color (gint    hist[HISTSIZE],
     }
 }
 
+/*
+ * Add (delta == 1) or remove (delta == -1) one source pixel to or from
+ * the histograms.
+ */
+static inline void
+histogram_update (OilifyJob    *job,
+                  gint          hist[HISTSIZE],
+                  gint          hist_rgb[4][HISTSIZE],
+                  gint          offset,
+                  gint          delta)
+{
+  const guchar *src = job->src_buf + offset * job->bpp;
+  gint          b;
+
+  if (job->src_inten_buf)
+    {
+      gint inten = job->src_inten_buf[offset];
+
+      hist[inten] += delta;
+      for (b = 0; b < job->bpp; b++)
+        hist_rgb[b][inten] += delta * src[b];
+    }
+  else
+    {
+      for (b = 0; b < job->bpp; b++)
+        hist_rgb[b][src[b]] += delta;
+    }
+}
+
+/*
+ * Replace each pixel of row y with a weighted average of the most
+ * frequently occurring values in a circle of mask_size diameter centered
+ * at it.
+ *
+ * The histograms of the circle are built once at the start of the row
+ * (and whenever the mask-size map changes the radius); moving one pixel
+ * to the right then only removes the leftmost pixel of each row of the
+ * circle and adds a new one on the right.
+ */
+static void
+oilify_row (OilifyJob *job,
+            gint       y,
+            gint       hist[HISTSIZE],
+            gint       hist_rgb[4][HISTSIZE])
+{
+  const gint  width       = job->width;
+  const gint  height      = job->height;
+  const gint  bpp         = job->bpp;
+  guchar     *dest        = job->dest_buf + y * width * bpp;
+  gint        prev_radius = -1;
+  gint        x;
+
+  for (x = 0; x < width; x++, dest += bpp)
+    {
+      const gint *half_width;
+      gint        radius;
+      gfloat      exponent;
+      gint        mask_y1, mask_y2;
+      gint        mask_y;
+
+      if (job->msmap_buf)
+        {
+          gfloat factor = get_map_value (job->msmap_buf +
+                                         (y * width + x) * job->msmap_bpp,
+                                         job->msmap_bpp);
+
+          radius = ROUND (factor * (0.5 * ovals.mask_size));
+        }
+      else
+        {
+          radius = (gint) ovals.mask_size / 2;
+        }
+
+      radius = MIN (radius, job->max_radius);
+
+      exponent = ovals.exponent;
+      if (job->emap_buf)
+        exponent *= get_map_value (job->emap_buf +
+                                   (y * width + x) * job->emap_bpp,
+                                   job->emap_bpp);
+
+      /*  half_width[dy] is the largest dx inside the circle  */
+      half_width = job->half_widths + radius * (job->max_radius + 1);
+
+      mask_y1 = MAX (y - radius, 0);
+      mask_y2 = MIN (y + radius + 1, height);
+
+      if (radius != prev_radius)
+        {
+          if (job->src_inten_buf)
+            memset (hist, 0, sizeof (gint) * HISTSIZE);
+
+          memset (hist_rgb, 0, sizeof (gint) * 4 * HISTSIZE);
+
+          for (mask_y = mask_y1; mask_y < mask_y2; mask_y++)
+            {
+              gint dx      = half_width[ABS (mask_y - y)];
+              gint mask_x1 = MAX (x - dx, 0);
+              gint mask_x2 = MIN (x + dx + 1, width);
+              gint mask_x;
+
+              for (mask_x = mask_x1; mask_x < mask_x2; mask_x++)
+                histogram_update (job, hist, hist_rgb,
+                                  mask_y * width + mask_x, 1);
+            }
+
+          prev_radius = radius;
+        }
+      else
+        {
+          for (mask_y = mask_y1; mask_y < mask_y2; mask_y++)
+            {
+              gint dx = half_width[ABS (mask_y - y)];
+
+              if (x - 1 - dx >= 0)
+                histogram_update (job, hist, hist_rgb,
+                                  mask_y * width + x - 1 - dx, -1);
+
+              if (x + dx < width)
+                histogram_update (job, hist, hist_rgb,
+                                  mask_y * width + x + dx, 1);
+            }
+        }
+
+      if (job->src_inten_buf)
+        {
+          weighted_average_color (hist, hist_rgb, exponent, dest, bpp);
+        }
+      else
+        {
+          gint b;
+
+          for (b = 0; b < bpp; b++)
+            dest[b] = weighted_average_value (hist_rgb[b], exponent);
+        }
+    }
+}
+
+/*
+ * Rows are handed out from a shared counter; only the main thread
+ * reports progress.
+ */
+static void
+oilify_process (OilifyJob *job,
+                gboolean   report_progress)
+{
+  gint hist[HISTSIZE];
+  gint hist_rgb[4][HISTSIZE];
+  gint y;
+
+  while ((y = g_atomic_int_add (&job->next_row, 1)) < job->height)
+    {
+      oilify_row (job, y, hist, hist_rgb);
+
+      g_atomic_int_add (&job->rows_done, 1);
+
+      if (report_progress && y % 16 == 0)
+        gimp_progress_update ((gdouble) g_atomic_int_get (&job->rows_done) /
+                              (gdouble) job->height);
+    }
+}
+
+static gpointer
+oilify_thread (gpointer data)
+{
+  oilify_process (data, FALSE);
+
+  return NULL;
+}
+
+/*
+ * Read a map drawable into memory, or return NULL if it is not used.
+ */
+static guchar *
+oilify_read_map (gboolean  use_map,
+                 gint32    map_id,
+                 gint      x1,
+                 gint      y1,
+                 gint      width,
+                 gint      height,
+                 gint     *bpp)
+{
+  GimpDrawable *map_drawable;
+  GimpPixelRgn  map_rgn;
+  guchar       *buf;
+
+  if (! use_map || map_id < 0)
+    return NULL;
+
+  map_drawable = gimp_drawable_get (map_id);
+  gimp_pixel_rgn_init (&map_rgn, map_drawable,
+                       x1, y1, width, height, FALSE, FALSE);
+
+  *bpp = map_drawable->bpp;
+
+  buf = g_new (guchar, width * height * *bpp);
+  gimp_pixel_rgn_get_rect (&map_rgn, buf, x1, y1, width, height);
+
+  gimp_drawable_detach (map_drawable);
+
+  return buf;
+}
+
 /*
  * For all x and y as requested, replace the pixel at (x,y)
  * with a weighted average of the most frequently occurring
@@ -436,32 +671,17 @@ static void
 oilify (GimpDrawable *drawable,
         GimpPreview  *preview)
 {
-  gboolean      use_inten;
-  gboolean      use_msmap = FALSE;
-  gboolean      use_emap = FALSE;
-  GimpDrawable *mask_size_map_drawable = NULL;
-  GimpDrawable *exponent_map_drawable = NULL;
-  GimpPixelRgn  mask_size_map_rgn;
-  GimpPixelRgn  exponent_map_rgn;
-  gint          msmap_bpp = 0;
-  gint          emap_bpp = 0;
+  OilifyJob     job = { 0, };
+  GimpPixelRgn  src_rgn;
   GimpPixelRgn  dest_rgn;
-  GimpPixelRgn *regions[3];
-  gint          n_regions;
-  gint          bpp;
-  gint         *sqr_lut;
+  GThread      *threads[THREADS_MAX];
+  gint          n_threads;
   gint          x1, y1, x2, y2;
   gint          width, height;
-  gint          Hist[HISTSIZE];
-  gint          Hist_rgb[4][HISTSIZE];
-  gpointer      pr;
-  gint          progress, max_progress;
-  guchar       *src_buf;
-  guchar       *src_inten_buf = NULL;
+  gint          bpp;
+  gint          r, dy;
   gint          i;
 
-  use_inten = (ovals.mode == MODE_INTEN);
-
   /*  Get the selection bounds  */
   if (preview)
     {
@@ -478,256 +698,94 @@ oilify (GimpDrawable *drawable,
       height = y2 - y1;
     }
 
-  progress = 0;
-  max_progress = width * height;
-
   bpp = drawable->bpp;
 
+  job.width  = width;
+  job.height = height;
+  job.bpp    = bpp;
+
   /*
-   * Look-up-table implementation of the square function, for use in the
-   * VERY TIGHT inner loops
+   * Half widths of the circular mask for every radius up to the
+   * largest one the mask-size map can ask for
    */
-  {
-    gint lut_size = (gint) ovals.mask_size / 2 + 1;
-
-    sqr_lut = g_new (gint, lut_size);
-
-    for (i = 0; i < lut_size; i++)
-      sqr_lut[i] = SQR (i);
-  }
+  job.max_radius  = (gint) ovals.mask_size / 2 + 1;
+  job.half_widths = g_new (gint, SQR (job.max_radius + 1));
 
-  /*  Get the map drawables, if applicable  */
-
-  if (ovals.use_mask_size_map && ovals.mask_size_map >= 0)
-    {
-      use_msmap = TRUE;
-
-      mask_size_map_drawable = gimp_drawable_get (ovals.mask_size_map);
-      gimp_pixel_rgn_init (&mask_size_map_rgn, mask_size_map_drawable,
-                           x1, y1, width, height, FALSE, FALSE);
-
-      msmap_bpp = mask_size_map_drawable->bpp;
-    }
-
-  if (ovals.use_exponent_map && ovals.exponent_map >= 0)
+  for (r = 0; r <= job.max_radius; r++)
     {
-      use_emap = TRUE;
+      gint *half_width = job.half_widths + r * (job.max_radius + 1);
+      gint  dx         = r;
 
-      exponent_map_drawable = gimp_drawable_get (ovals.exponent_map);
-      gimp_pixel_rgn_init (&exponent_map_rgn, exponent_map_drawable,
-                           x1, y1, width, height, FALSE, FALSE);
+      for (dy = 0; dy <= r; dy++)
+        {
+          while (SQR (dx) + SQR (dy) > SQR (r))
+            dx--;
 
-      emap_bpp = exponent_map_drawable->bpp;
+          half_width[dy] = dx;
+        }
     }
 
-  gimp_pixel_rgn_init (&dest_rgn, drawable,
-                       x1, y1, width, height, (preview == NULL), TRUE);
+  /*  Get the map drawables, if applicable  */
+  job.msmap_buf = oilify_read_map (ovals.use_mask_size_map,
+                                   ovals.mask_size_map,
+                                   x1, y1, width, height, &job.msmap_bpp);
+  job.emap_buf  = oilify_read_map (ovals.use_exponent_map,
+                                   ovals.exponent_map,
+                                   x1, y1, width, height, &job.emap_bpp);
 
-  {
-    GimpPixelRgn src_rgn;
+  gimp_pixel_rgn_init (&src_rgn, drawable,
+                       x1, y1, width, height, FALSE, FALSE);
+  job.src_buf = g_new (guchar, width * height * bpp);
+  gimp_pixel_rgn_get_rect (&src_rgn, job.src_buf, x1, y1, width, height);
 
-    gimp_pixel_rgn_init (&src_rgn, drawable,
-                         x1, y1, width, height, FALSE, FALSE);
-    src_buf = g_new (guchar, width * height * bpp);
-    gimp_pixel_rgn_get_rect (&src_rgn, src_buf, x1, y1, width, height);
-  }
+  job.dest_buf = g_new (guchar, width * height * bpp);
 
   /*
    * If we're working in intensity mode, then generate a separate intensity
    * map of the source image. This way, we can avoid calculating the
    * intensity of any given source pixel more than once.
    */
-  if (use_inten)
+  if (ovals.mode == MODE_INTEN)
     {
       guchar *src;
-      guchar *dest;
-
-      src_inten_buf = g_new (guchar, width * height);
-
-      for (i = 0,
-           src = src_buf,
-           dest = src_inten_buf
-           ;
-           i < (width * height)
-           ;
-           i++,
-           src += bpp,
-           dest++)
-        {
-          *dest = (guchar) GIMP_RGB_LUMINANCE (src[0], src[1], src[2]);
-        }
-    }
-
-  n_regions = 0;
-  regions[n_regions++] = &dest_rgn;
-  if (use_msmap)
-    regions[n_regions++] = &mask_size_map_rgn;
-  if (use_emap)
-    regions[n_regions++] = &exponent_map_rgn;
-
-  for (pr = gimp_pixel_rgns_register2 (n_regions, regions);
-       pr != NULL;
-       pr = gimp_pixel_rgns_process (pr))
-    {
-      gint    y;
-      guchar *dest_row;
-      guchar *src_msmap_row = NULL;
-      guchar *src_emap_row = NULL;
-
-      for (y = dest_rgn.y,
-           dest_row = dest_rgn.data,
-           src_msmap_row = mask_size_map_rgn.data,  /* valid iff use_msmap */
-           src_emap_row = exponent_map_rgn.data     /* valid iff use_emap */
-           ;
-           y < (gint) (dest_rgn.y + dest_rgn.h)
-           ;
-           y++,
-           dest_row += dest_rgn.rowstride,
-           src_msmap_row += mask_size_map_rgn.rowstride,  /* valid iff use_msmap */
-           src_emap_row += exponent_map_rgn.rowstride)    /* valid iff use_emap */
-        {
-          gint    x;
-          guchar *dest;
-          guchar *src_msmap = NULL;
-          guchar *src_emap = NULL;
-
-          for (x = dest_rgn.x,
-               dest = dest_row,
-               src_msmap = src_msmap_row,  /* valid iff use_msmap */
-               src_emap = src_emap_row     /* valid iff use_emap */
-               ;
-               x < (gint) (dest_rgn.x + dest_rgn.w)
-               ;
-               x++,
-               dest += bpp,
-               src_msmap += msmap_bpp,  /* valid iff use_msmap */
-               src_emap += emap_bpp)    /* valid iff use_emap */
-            {
-              gint    radius, radius_squared;
-              gfloat  exponent;
-              gint    mask_x1, mask_y1;
-              gint    mask_x2, mask_y2;
-              gint    mask_y;
-              gint    src_offset;
-              guchar *src_row;
-              guchar *src_inten_row = NULL;
-
-              if (use_msmap)
-                {
-                  gfloat factor = get_map_value (src_msmap, msmap_bpp);
-
-                  radius = ROUND (factor * (0.5 * ovals.mask_size));
-                }
-              else
-                {
-                  radius = (gint) ovals.mask_size / 2;
-                }
 
-              radius_squared = SQR (radius);
+      job.src_inten_buf = g_new (guchar, width * height);
 
-              exponent = ovals.exponent;
-              if (use_emap)
-                exponent *= get_map_value (src_emap, emap_bpp);
-
-              if (use_inten)
-                memset (Hist, 0, sizeof (Hist));
-
-              memset (Hist_rgb, 0, sizeof (Hist_rgb));
-
-              mask_x1 = CLAMP ((x - radius), x1, x2);
-              mask_y1 = CLAMP ((y - radius), y1, y2);
-              mask_x2 = CLAMP ((x + radius + 1), x1, x2);
-              mask_y2 = CLAMP ((y + radius + 1), y1, y2);
+      for (i = 0, src = job.src_buf; i < (width * height); i++, src += bpp)
+        job.src_inten_buf[i] = (guchar) GIMP_RGB_LUMINANCE (src[0],
+                                                            src[1],
+                                                            src[2]);
+    }
 
-              src_offset = (mask_y1 - y1) * width + (mask_x1 - x1);
+  n_threads = MIN (threads_get_count (), height);
 
-              for (mask_y = mask_y1,
-                   src_row = src_buf + src_offset * bpp,
-                   src_inten_row = src_inten_buf + src_offset  /* valid iff use_inten */
-                   ;
-                   mask_y < mask_y2
-                   ;
-                   mask_y++,
-                   src_row += width * bpp,
-                   src_inten_row += width)  /* valid iff use_inten */
-                {
-                  guchar *src;
-                  guchar *src_inten = NULL;
-                  gint    dy_squared = sqr_lut[ABS (mask_y - y)];
-                  gint    mask_x;
-
-                  for (mask_x = mask_x1,
-                       src = src_row,
-                       src_inten = src_inten_row  /* valid iff use_inten */
-                       ;
-                       mask_x < mask_x2
-                       ;
-                       mask_x++,
-                       src += bpp,
-                       src_inten++)  /* valid iff use_inten */
-                    {
-                      gint dx_squared = sqr_lut[ABS (mask_x - x)];
-                      gint b;
-
-                      /*  Stay inside a circular mask area  */
-                      if ((dx_squared + dy_squared) > radius_squared)
-                        continue;
-
-                      if (use_inten)
-                        {
-                          gint inten = *src_inten;
-                          ++Hist[inten];
-                          for (b = 0; b < bpp; b++)
-                            Hist_rgb[b][inten] += src[b];
-                        }
-                      else
-                        {
-                          for (b = 0; b < bpp; b++)
-                            ++Hist_rgb[b][src[b]];
-                        }
-
-                    } /* for mask_x */
-                } /* for mask_y */
-
-              if (use_inten)
-                {
-                  weighted_average_color (Hist, Hist_rgb, exponent, dest, bpp);
-                }
-              else
-                {
-                  gint b;
+  for (i = 1; i < n_threads; i++)
+    threads[i] = g_thread_create (oilify_thread, &job, TRUE, NULL);
 
-                  for (b = 0; b < bpp; b++)
-                    dest[b] = weighted_average_value (Hist_rgb[b], exponent);
-                }
+  oilify_process (&job, preview == NULL);
 
-            } /* for x */
-        } /* for y */
+  for (i = 1; i < n_threads; i++)
+    if (threads[i])
+      g_thread_join (threads[i]);
 
-      if (preview)
-        {
-          gimp_drawable_preview_draw_region (GIMP_DRAWABLE_PREVIEW (preview),
-                                             &dest_rgn);
-        }
-      else
-        {
-          progress += dest_rgn.w * dest_rgn.h;
-          gimp_progress_update ((gdouble) progress / (gdouble) max_progress);
-        }
-    } /* for pr */
-
-  /*  Detach from the map drawables  */
-  if (mask_size_map_drawable)
-    gimp_drawable_detach (mask_size_map_drawable);
-
-  if (exponent_map_drawable)
-    gimp_drawable_detach (exponent_map_drawable);
-
-  if (src_inten_buf)
-    g_free (src_inten_buf);
+  if (preview)
+    {
+      gimp_preview_draw_buffer (preview, job.dest_buf, width * bpp);
+    }
+  else
+    {
+      gimp_pixel_rgn_init (&dest_rgn, drawable,
+                           x1, y1, width, height, TRUE, TRUE);
+      gimp_pixel_rgn_set_rect (&dest_rgn, job.dest_buf,
+                               x1, y1, width, height);
+    }
 
-  g_free (src_buf);
-  g_free (sqr_lut);
+  g_free (job.src_inten_buf);
+  g_free (job.msmap_buf);
+  g_free (job.emap_buf);
+  g_free (job.src_buf);
+  g_free (job.dest_buf);
+  g_free (job.half_widths);
 
   if (!preview)
     {
@@ -7,8 +7,8 @@
     'apply-canvas' => { ui => 1 },
     'blinds' => { ui => 1 },
     'blur' => {},
-    'blur-gauss' => { ui => 1 },
-    'blur-gauss-selective' => { ui => 1, cflags => 'MMX_EXTRA_CFLAGS' },
+    'blur-gauss' => { ui => 1, bands => 1, threads => 1 },
+    'blur-gauss-selective' => { ui => 1, threads => 1 },
     'blur-motion' => { ui => 1 },
     'border-average' => { ui => 1 },
     'bump-map' => { ui => 1 },
@@ -23,7 +23,7 @@
     'colormap-remap' => { ui => 1 },
     'compose' => { ui => 1 },
     'contrast-normalize' => {},
-    'contrast-retinex' => { ui => 1 },
+    'contrast-retinex' => { ui => 1, threads => 1 },
     'contrast-stretch' => {},
     'contrast-stretch-hsv' => {},
     'convolution-matrix' => { ui => 1 },
@@ -34,12 +34,12 @@
     'decompose' => { ui => 1 },
     'deinterlace' => { ui => 1 },
     'depth-merge' => { ui => 1 },
-    'despeckle' => { ui => 1 },
+    'despeckle' => { ui => 1, threads => 1 },
     'destripe' => { ui => 1 },
     'diffraction' => { ui => 1 },
-    'displace' => { ui => 1 },
+    'displace' => { ui => 1, resampler => 1, threads => 1 },
     'edge' => { ui => 1 },
-    'edge-dog' => { ui => 1 },
+    'edge-dog' => { ui => 1, threads => 1 },
     'edge-laplace' => {},
     'edge-neon' => { ui => 1 },
     'edge-sobel' => { ui => 1 },
@@ -73,8 +73,8 @@
     'file-sunras' => { ui => 1 },
     'file-svg' => { ui => 1, optional => 1, libs => 'SVG_LIBS', cflags => 'SVG_CFLAGS' },
     'file-tga' => { ui => 1 },
-    'file-tiff-load' => { ui => 1, optional => 1, libs => 'TIFF_LIBS' },
-    'file-tiff-save' => { ui => 1, optional => 1, libs => 'TIFF_LIBS' },
+    'file-tiff-load' => { ui => 1, optional => 1, libs => 'TIFF_LIBS', threads => 1 },
+    'file-tiff-save' => { ui => 1, optional => 1, libs => 'TIFF_LIBS', threads => 1 },
     'file-wmf' => { ui => 1, optional => 1, libs => 'WMF_LIBS', cflags => 'WMF_CFLAGS' },
     'file-xbm' => { ui => 1 },
     'file-xmc' => { ui => 1, optional => 1, libs => 'XMC_LIBS' },
@@ -88,12 +88,12 @@
     'grid' => { ui => 1 },
     'guillotine' => {},
     'hot' => { ui => 1 },
-    'illusion' => { ui => 1 },
+    'illusion' => { ui => 1, resampler => 1, threads => 1 },
     'iwarp' => { ui => 1 },
     'jigsaw' => { ui => 1 },
     'lcms' => { ui => 1, optional => 1, libs => 'LCMS_LIBS', cflags => 'LCMS_CFLAGS' },
     'lens-apply' => { ui => 1 },
-    'lens-distortion' => { ui => 1 },
+    'lens-distortion' => { ui => 1, resampler => 1, threads => 1 },
     'lens-flare' => { ui => 1 },
     'mail' => { ui => 1, optional => 1 },
     'max-rgb' => { ui => 1 },
@@ -104,40 +104,40 @@
     'noise-randomize' => { ui => 1 },
     'noise-rgb' => { ui => 1 },
     'noise-solid' => { ui => 1 },
-    'noise-spread' => { ui => 1 },
+    'noise-spread' => { ui => 1, resampler => 1, threads => 1 },
     'nova' => { ui => 1 },
-    'oilify' => { ui => 1 },
+    'oilify' => { ui => 1, threads => 1 },
     'photocopy' => { ui => 1 },
     'plasma' => { ui => 1 },
     'plugin-browser' => { ui => 1 },
     'procedure-browser' => { ui => 1 },
     'qbist' => { ui => 1 },
     'red-eye-removal' => { ui => 1 },
-    'ripple' => { ui => 1 },
+    'ripple' => { ui => 1, resampler => 1, threads => 1 },
     'rotate' => {},
     'sample-colorize' => { ui => 1 },
     'screenshot' => { ui => 1, optional => 1, libs => 'SCREENSHOT_LIBS', cflags => 'XFIXES_CFLAGS' },
     'sharpen' => { ui => 1 },
-    'shift' => { ui => 1 },
+    'shift' => { ui => 1, resampler => 1, threads => 1 },
     'sinus' => { ui => 1 },
     'smooth-palette' => { ui => 1 },
     'softglow' => { ui => 1 },
     'sparkle' => { ui => 1 },
-    'sphere-designer' => { ui => 1 },
+    'sphere-designer' => { ui => 1, threads => 1 },
     'tile' => { ui => 1 },
     'tile-glass' => { ui => 1 },
     'tile-paper' => { ui => 1 },
     'tile-seamless' => {},
     'tile-small' => { ui => 1 },
     'unit-editor' => { ui => 1 },
-    'unsharp-mask' => { ui => 1 },
+    'unsharp-mask' => { ui => 1, bands => 1 },
     'value-propagate' => { ui => 1 },
-    'van-gogh-lic' => { ui => 1 },
+    'van-gogh-lic' => { ui => 1, threads => 1 },
     'video' => { ui => 1 },
     'warp' => { ui => 1 },
     'waves' => { ui => 1 },
     'web-browser' => { ui => 1 },
     'web-page' => { ui => 1, optional => 1, libs => 'WEBKIT_LIBS', cflags => 'WEBKIT_CFLAGS' },
-    'whirl-pinch' => { ui => 1 },
+    'whirl-pinch' => { ui => 1, resampler => 1, threads => 1 },
     'wind' => { ui => 1 }
 );
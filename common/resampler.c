@@ -0,0 +1,501 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * resampler.c
+ * Inverse-mapping helper for the geometric distortion plug-ins.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <libgimp/gimp.h>
+
+#include "resampler.h"
+#include "threads.h"
+
+
+struct _Resampler
+{
+  guchar                   *data;       /* the area, see resampler_new_area() */
+  gint                      area_x, area_y;
+  gint                      area_width, area_height;
+  GimpPixelFetcher         *fetcher;    /* for the rest, NULL if none       */
+  gint                      width;
+  gint                      height;
+  gint                      bpp;
+  gint                      rowstride;
+  gboolean                  has_alpha;
+  gint                      sel_x1, sel_y1, sel_x2, sel_y2;
+  GimpPixelFetcherEdgeMode  mode;
+  guchar                    bg_color[4];
+};
+
+typedef struct
+{
+  const Resampler  *resampler;
+  ResamplerRowFunc  func;
+  gpointer          data;
+  guchar           *dest;
+  gint              x, y;
+  gint              width, height;
+  gint              tile_width, tile_height;
+  gint              first_tile_x, first_tile_y;
+  gint              n_tiles_x;
+  gint              n_tiles;
+  gint              next_tile;
+  gint              tiles_done;
+} ResamplerJob;
+
+
+Resampler *
+resampler_new (GimpDrawable *drawable)
+{
+  return resampler_new_area (drawable,
+                             0, 0, drawable->width, drawable->height);
+}
+
+/*  Reads only the given area, clipped to the drawable, into memory.
+ *  Pixels outside of it are fetched from the drawable one at a time,
+ *  which can't be done from several threads; a resampler that doesn't
+ *  hold the whole drawable renders on the calling thread only.
+ */
+Resampler *
+resampler_new_area (GimpDrawable *drawable,
+                    gint          x,
+                    gint          y,
+                    gint          width,
+                    gint          height)
+{
+  Resampler    *resampler = g_slice_new0 (Resampler);
+  GimpPixelRgn  src_rgn;
+  gint          x2, y2;
+
+  x2 = CLAMP (x + width,  0, drawable->width);
+  y2 = CLAMP (y + height, 0, drawable->height);
+  x  = CLAMP (x, 0, x2);
+  y  = CLAMP (y, 0, y2);
+
+  resampler->area_x      = x;
+  resampler->area_y      = y;
+  resampler->area_width  = x2 - x;
+  resampler->area_height = y2 - y;
+  resampler->width       = drawable->width;
+  resampler->height      = drawable->height;
+  resampler->bpp         = drawable->bpp;
+  resampler->rowstride   = resampler->area_width * drawable->bpp;
+  resampler->has_alpha   = gimp_drawable_has_alpha (drawable->drawable_id);
+  resampler->mode        = GIMP_PIXEL_FETCHER_EDGE_NONE;
+
+  gimp_drawable_mask_bounds (drawable->drawable_id,
+                             &resampler->sel_x1, &resampler->sel_y1,
+                             &resampler->sel_x2, &resampler->sel_y2);
+
+  resampler->data = g_new (guchar,
+                           resampler->rowstride * resampler->area_height);
+
+  gimp_pixel_rgn_init (&src_rgn, drawable,
+                       x, y, resampler->area_width, resampler->area_height,
+                       FALSE, FALSE);
+  gimp_pixel_rgn_get_rect (&src_rgn, resampler->data,
+                           x, y, resampler->area_width, resampler->area_height);
+
+  if (resampler->area_width  < drawable->width ||
+      resampler->area_height < drawable->height)
+    resampler->fetcher = gimp_pixel_fetcher_new (drawable, FALSE);
+
+  return resampler;
+}
+
+void
+resampler_free (Resampler *resampler)
+{
+  g_return_if_fail (resampler != NULL);
+
+  if (resampler->fetcher)
+    gimp_pixel_fetcher_destroy (resampler->fetcher);
+
+  g_free (resampler->data);
+  g_slice_free (Resampler, resampler);
+}
+
+void
+resampler_set_edge_mode (Resampler                *resampler,
+                         GimpPixelFetcherEdgeMode  mode)
+{
+  g_return_if_fail (resampler != NULL);
+
+  resampler->mode = mode;
+}
+
+void
+resampler_set_bg_color (Resampler     *resampler,
+                        const GimpRGB *color)
+{
+  g_return_if_fail (resampler != NULL);
+  g_return_if_fail (color != NULL);
+
+  switch (resampler->bpp)
+    {
+    case 2:
+      resampler->bg_color[1] = ROUND (color->a * 255.0);
+    case 1:
+      resampler->bg_color[0] = gimp_rgb_luminance_uchar (color);
+      break;
+
+    case 4:
+      resampler->bg_color[3] = ROUND (color->a * 255.0);
+    case 3:
+      gimp_rgb_get_uchar (color,
+                          resampler->bg_color,
+                          resampler->bg_color + 1,
+                          resampler->bg_color + 2);
+      break;
+    }
+}
+
+gint
+resampler_get_rowstride (const Resampler *resampler)
+{
+  return resampler->rowstride;
+}
+
+/*  Returns the pixel at x, y in memory, or NULL if it is outside the
+ *  area that was read.
+ */
+const guchar *
+resampler_peek (const Resampler *resampler,
+                gint             x,
+                gint             y)
+{
+  x -= resampler->area_x;
+  y -= resampler->area_y;
+
+  if (x < 0 || x >= resampler->area_width ||
+      y < 0 || y >= resampler->area_height)
+    return NULL;
+
+  return resampler->data + y * resampler->rowstride + x * resampler->bpp;
+}
+
+/*  Same as gimp_pixel_fetcher_get_pixel().  */
+void
+resampler_get_pixel (const Resampler *resampler,
+                     gint             x,
+                     gint             y,
+                     guchar          *pixel)
+{
+  const guchar *p;
+  gint          i;
+
+  if (resampler->mode == GIMP_PIXEL_FETCHER_EDGE_NONE &&
+      (x < resampler->sel_x1 || x >= resampler->sel_x2 ||
+       y < resampler->sel_y1 || y >= resampler->sel_y2))
+    {
+      return;
+    }
+
+  if (x < 0 || x >= resampler->width ||
+      y < 0 || y >= resampler->height)
+    {
+      switch (resampler->mode)
+        {
+        case GIMP_PIXEL_FETCHER_EDGE_WRAP:
+          if (x < 0 || x >= resampler->width)
+            {
+              x %= resampler->width;
+              if (x < 0)
+                x += resampler->width;
+            }
+
+          if (y < 0 || y >= resampler->height)
+            {
+              y %= resampler->height;
+              if (y < 0)
+                y += resampler->height;
+            }
+          break;
+
+        case GIMP_PIXEL_FETCHER_EDGE_SMEAR:
+          x = CLAMP (x, 0, resampler->width - 1);
+          y = CLAMP (y, 0, resampler->height - 1);
+          break;
+
+        case GIMP_PIXEL_FETCHER_EDGE_BLACK:
+          for (i = 0; i < resampler->bpp; i++)
+            pixel[i] = 0;
+          return;
+
+        case GIMP_PIXEL_FETCHER_EDGE_BACKGROUND:
+          for (i = 0; i < resampler->bpp; i++)
+            pixel[i] = resampler->bg_color[i];
+          return;
+
+        default:
+          return;
+        }
+    }
+
+  p = resampler_peek (resampler, x, y);
+
+  if (! p)
+    {
+      gimp_pixel_fetcher_get_pixel (resampler->fetcher, x, y, pixel);
+      return;
+    }
+
+  for (i = 0; i < resampler->bpp; i++)
+    pixel[i] = p[i];
+}
+
+/*  Fills 'values' with the pixels at (x, y), (x + 1, y), (x, y + 1) and
+ *  (x + 1, y + 1), in the order gimp_bilinear_pixels_8() wants them.
+ *  Inside the drawable they point straight into memory; at the edges
+ *  the pixels are fetched into 'scratch', which must hold four pixels.
+ */
+void
+resampler_get_quad (const Resampler  *resampler,
+                    gint              x,
+                    gint              y,
+                    guchar          **values,
+                    guchar           *scratch)
+{
+  gint bpp = resampler->bpp;
+  gint x1  = resampler->area_x;
+  gint y1  = resampler->area_y;
+  gint x2  = resampler->area_x + resampler->area_width;
+  gint y2  = resampler->area_y + resampler->area_height;
+
+  if (resampler->mode == GIMP_PIXEL_FETCHER_EDGE_NONE)
+    {
+      x1 = MAX (x1, resampler->sel_x1);
+      y1 = MAX (y1, resampler->sel_y1);
+      x2 = MIN (x2, resampler->sel_x2);
+      y2 = MIN (y2, resampler->sel_y2);
+    }
+
+  if (x >= x1 && x + 1 < x2 &&
+      y >= y1 && y + 1 < y2)
+    {
+      guchar *p = (guchar *) resampler_peek (resampler, x, y);
+
+      values[0] = p;
+      values[1] = p + bpp;
+      values[2] = p + resampler->rowstride;
+      values[3] = p + resampler->rowstride + bpp;
+    }
+  else
+    {
+      gint i;
+
+      if (resampler->mode == GIMP_PIXEL_FETCHER_EDGE_NONE)
+        memset (scratch, 0, 4 * bpp);
+
+      for (i = 0; i < 4; i++)
+        {
+          values[i] = scratch + i * bpp;
+
+          resampler_get_pixel (resampler, x + (i & 1), y + (i >> 1),
+                               values[i]);
+        }
+    }
+}
+
+/*  Bilinear interpolation at x, y as done by the distortion plug-ins,
+ *  including their rounding of negative coordinates.
+ */
+void
+resampler_get_bilinear (const Resampler *resampler,
+                        gdouble          x,
+                        gdouble          y,
+                        guchar          *pixel)
+{
+  guchar *values[4];
+  guchar  scratch[4 * 4];
+  gint    ix, iy;
+
+  if (x >= 0.0)
+    ix = (gint) x;
+  else
+    ix = -((gint) -x + 1);
+
+  if (y >= 0.0)
+    iy = (gint) y;
+  else
+    iy = -((gint) -y + 1);
+
+  resampler_get_quad (resampler, ix, iy, values, scratch);
+
+  gimp_bilinear_pixels_8 (pixel, x, y,
+                          resampler->bpp, resampler->has_alpha, values);
+}
+
+static void
+resampler_process (ResamplerJob *job,
+                   gboolean      show_progress)
+{
+  const Resampler *resampler = job->resampler;
+  gint             bpp       = resampler->bpp;
+  gint             tile;
+
+  while ((tile = g_atomic_int_add (&job->next_tile, 1)) < job->n_tiles)
+    {
+      gint x1 = (job->first_tile_x + tile % job->n_tiles_x) * job->tile_width;
+      gint y1 = (job->first_tile_y + tile / job->n_tiles_x) * job->tile_height;
+      gint x2 = MIN (x1 + job->tile_width,  job->x + job->width);
+      gint y2 = MIN (y1 + job->tile_height, job->y + job->height);
+      gint y;
+
+      x1 = MAX (x1, job->x);
+      y1 = MAX (y1, job->y);
+
+      for (y = y1; y < y2; y++)
+        {
+          const guchar *src  = resampler_peek (resampler, x1, y);
+          guchar       *dest = (job->dest +
+                                ((y - job->y) * job->width +
+                                 (x1 - job->x)) * bpp);
+
+          job->func (resampler, x1, y, x2 - x1, src, dest, job->data);
+        }
+
+      g_atomic_int_add (&job->tiles_done, 1);
+
+      if (show_progress)
+        gimp_progress_update ((gdouble) g_atomic_int_get (&job->tiles_done) /
+                              (gdouble) job->n_tiles);
+    }
+}
+
+static gpointer
+resampler_thread (gpointer data)
+{
+  resampler_process (data, FALSE);
+
+  return NULL;
+}
+
+/*  Destination tiles follow the tile grid of the drawable and are
+ *  handed out to the threads from a shared counter; only the main
+ *  thread reports progress.
+ */
+static void
+resampler_run (const Resampler  *resampler,
+               gint              x,
+               gint              y,
+               gint              width,
+               gint              height,
+               guchar           *dest,
+               ResamplerRowFunc  func,
+               gpointer          data,
+               gboolean          show_progress)
+{
+  GThread      *threads[THREADS_MAX];
+  ResamplerJob  job;
+  gint          n_threads;
+  gint          i;
+
+  if (width < 1 || height < 1)
+    return;
+
+  job.resampler    = resampler;
+  job.func         = func;
+  job.data         = data;
+  job.dest         = dest;
+  job.x            = x;
+  job.y            = y;
+  job.width        = width;
+  job.height       = height;
+  job.tile_width   = gimp_tile_width ();
+  job.tile_height  = gimp_tile_height ();
+  job.first_tile_x = x / job.tile_width;
+  job.first_tile_y = y / job.tile_height;
+  job.n_tiles_x    = (x + width - 1) / job.tile_width - job.first_tile_x + 1;
+  job.n_tiles      = job.n_tiles_x *
+                     ((y + height - 1) / job.tile_height - job.first_tile_y + 1);
+  job.next_tile    = 0;
+  job.tiles_done   = 0;
+
+  if (resampler->fetcher)
+    n_threads = 1;
+  else
+    n_threads = MIN (threads_get_count (), job.n_tiles);
+
+  for (i = 1; i < n_threads; i++)
+    threads[i] = g_thread_create (resampler_thread, &job, TRUE, NULL);
+
+  resampler_process (&job, show_progress);
+
+  for (i = 1; i < n_threads; i++)
+    if (threads[i])
+      g_thread_join (threads[i]);
+}
+
+/*  Renders the selection bounds of 'drawable' (the drawable the
+ *  resampler was created for) through its shadow, like
+ *  gimp_rgn_iterator_dest() does.
+ */
+void
+resampler_render (const Resampler  *resampler,
+                  GimpDrawable     *drawable,
+                  ResamplerRowFunc  func,
+                  gpointer          data)
+{
+  GimpPixelRgn  dest_rgn;
+  guchar       *dest;
+  gint          x1, y1, x2, y2;
+
+  g_return_if_fail (resampler != NULL);
+  g_return_if_fail (resampler->fetcher == NULL);
+  g_return_if_fail (func != NULL);
+
+  gimp_drawable_mask_bounds (drawable->drawable_id, &x1, &y1, &x2, &y2);
+
+  dest = g_new0 (guchar, (x2 - x1) * (y2 - y1) * resampler->bpp);
+
+  resampler_run (resampler, x1, y1, x2 - x1, y2 - y1, dest, func, data, TRUE);
+
+  gimp_pixel_rgn_init (&dest_rgn, drawable,
+                       x1, y1, x2 - x1, y2 - y1, TRUE, TRUE);
+  gimp_pixel_rgn_set_rect (&dest_rgn, dest, x1, y1, x2 - x1, y2 - y1);
+
+  g_free (dest);
+
+  gimp_drawable_flush (drawable);
+  gimp_drawable_merge_shadow (drawable->drawable_id, TRUE);
+  gimp_drawable_update (drawable->drawable_id, x1, y1, x2 - x1, y2 - y1);
+}
+
+/*  Renders an area into 'dest', which has a rowstride of
+ *  width * bpp.  The area has to be inside the one the resampler has
+ *  read.  Used for previews, so no progress is shown.
+ */
+void
+resampler_render_buffer (const Resampler  *resampler,
+                         gint              x,
+                         gint              y,
+                         gint              width,
+                         gint              height,
+                         guchar           *dest,
+                         ResamplerRowFunc  func,
+                         gpointer          data)
+{
+  g_return_if_fail (resampler != NULL);
+  g_return_if_fail (dest != NULL);
+  g_return_if_fail (func != NULL);
+
+  resampler_run (resampler, x, y, width, height, dest, func, data, FALSE);
+}
@@ -0,0 +1,93 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * resampler.h
+ * Inverse-mapping helper for the geometric distortion plug-ins.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RESAMPLER_H__
+#define __RESAMPLER_H__
+
+
+/*  A Resampler is a replacement for GimpPixelFetcher for filters which
+ *  compute every destination pixel from source pixels elsewhere in the
+ *  drawable.  The source is read once, tile by tile, into memory; all
+ *  lookups after that are plain memory accesses and may be done from
+ *  several threads at once.
+ */
+
+typedef struct _Resampler Resampler;
+
+/*  Computes 'width' destination pixels of row 'y', starting at column
+ *  'x'.  'src' points to the source pixels at the same place.  It is
+ *  called from several threads at once and must not call into libgimp.
+ */
+typedef void (* ResamplerRowFunc) (const Resampler *resampler,
+                                   gint             x,
+                                   gint             y,
+                                   gint             width,
+                                   const guchar    *src,
+                                   guchar          *dest,
+                                   gpointer         data);
+
+
+Resampler    * resampler_new            (GimpDrawable             *drawable);
+Resampler    * resampler_new_area       (GimpDrawable             *drawable,
+                                         gint                      x,
+                                         gint                      y,
+                                         gint                      width,
+                                         gint                      height);
+void           resampler_free           (Resampler                *resampler);
+
+void           resampler_set_edge_mode  (Resampler                *resampler,
+                                         GimpPixelFetcherEdgeMode  mode);
+void           resampler_set_bg_color   (Resampler                *resampler,
+                                         const GimpRGB            *color);
+
+gint           resampler_get_rowstride  (const Resampler          *resampler);
+const guchar * resampler_peek           (const Resampler          *resampler,
+                                         gint                      x,
+                                         gint                      y);
+
+void           resampler_get_pixel      (const Resampler          *resampler,
+                                         gint                      x,
+                                         gint                      y,
+                                         guchar                   *pixel);
+void           resampler_get_quad       (const Resampler          *resampler,
+                                         gint                      x,
+                                         gint                      y,
+                                         guchar                  **values,
+                                         guchar                   *scratch);
+void           resampler_get_bilinear   (const Resampler          *resampler,
+                                         gdouble                   x,
+                                         gdouble                   y,
+                                         guchar                   *pixel);
+
+void           resampler_render         (const Resampler          *resampler,
+                                         GimpDrawable             *drawable,
+                                         ResamplerRowFunc          func,
+                                         gpointer                  data);
+void           resampler_render_buffer  (const Resampler          *resampler,
+                                         gint                      x,
+                                         gint                      y,
+                                         gint                      width,
+                                         gint                      height,
+                                         guchar                   *dest,
+                                         ResamplerRowFunc          func,
+                                         gpointer                  data);
+
+
+#endif /* __RESAMPLER_H__ */
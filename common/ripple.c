@@ -29,6 +29,8 @@
 
 #include "libgimp/stdplugins-intl.h"
 
+#include "resampler.h"
+
 
 /* Some useful macros */
 #define PLUG_IN_PROC    "plug-in-ripple"
@@ -248,22 +250,21 @@ run (const gchar      *name,
 
 typedef struct
 {
-  GimpPixelFetcher *pft;
-  gint              width;
-  gint              height;
-  gboolean          has_alpha;
+  gint      width;
+  gint      height;
+  gint      bpp;
+  gboolean  has_alpha;
 } RippleParam_t;
 
 static void
-ripple_vertical (gint      x,
-                 gint      y,
-                 guchar   *dest,
-                 gint      bpp,
-                 gpointer  data)
+ripple_vertical (const Resampler     *resampler,
+                 gint                 x,
+                 gint                 y,
+                 guchar              *dest,
+                 const RippleParam_t *param)
 {
-  RippleParam_t    *param  = data;
-  GimpPixelFetcher *pft    = param->pft;
   const gint        height = param->height;
+  const gint        bpp    = param->bpp;
   guchar            pixel[2][4];
   gdouble           needy;
   gint              yi, yi_a;
@@ -300,12 +301,12 @@ ripple_vertical (gint      x,
   if (rvals.antialias)
     {
       if (yi >= 0 && yi < height)
-        gimp_pixel_fetcher_get_pixel (pft, x, yi  , pixel[0]);
+        resampler_get_pixel (resampler, x, yi  , pixel[0]);
       else
         memset (pixel[0], 0, 4);
 
       if (yi_a >= 0 && yi_a < height)
-        gimp_pixel_fetcher_get_pixel (pft, x, yi_a, pixel[1]);
+        resampler_get_pixel (resampler, x, yi_a, pixel[1]);
       else
         memset (pixel[1], 0, 4);
 
@@ -314,22 +315,21 @@ ripple_vertical (gint      x,
   else
     {
       if (yi >= 0 && yi < height)
-        gimp_pixel_fetcher_get_pixel (pft, x, yi, dest);
+        resampler_get_pixel (resampler, x, yi, dest);
       else
         memset (dest, 0, bpp);
     }
 }
 
 static void
-ripple_horizontal (gint      x,
-                   gint      y,
-                   guchar   *dest,
-                   gint      bpp,
-                   gpointer  data)
+ripple_horizontal (const Resampler     *resampler,
+                   gint                 x,
+                   gint                 y,
+                   guchar              *dest,
+                   const RippleParam_t *param)
 {
-  RippleParam_t    *param = data;
-  GimpPixelFetcher *pft   = param->pft;
   const gint        width = param->width;
+  const gint        bpp   = param->bpp;
   guchar            pixel[2][4];
   gdouble           needx;
   gint              xi, xi_a;
@@ -366,12 +366,12 @@ ripple_horizontal (gint      x,
   if (rvals.antialias)
     {
       if (xi >= 0 && xi < width)
-        gimp_pixel_fetcher_get_pixel (pft, xi,   y, pixel[0]);
+        resampler_get_pixel (resampler, xi,   y, pixel[0]);
       else
         memset (pixel[0], 0, 4);
 
       if (xi_a >= 0 && xi_a < width)
-        gimp_pixel_fetcher_get_pixel (pft, xi_a, y, pixel[1]);
+        resampler_get_pixel (resampler, xi_a, y, pixel[1]);
       else
         memset (pixel[1], 0, 4);
 
@@ -381,24 +381,46 @@ ripple_horizontal (gint      x,
   else
     {
       if (xi >= 0 && xi < width)
-        gimp_pixel_fetcher_get_pixel (pft, xi, y, dest);
+        resampler_get_pixel (resampler, xi, y, dest);
       else
         memset (dest, 0, bpp);
     }
 }
 
+static void
+ripple_row (const Resampler *resampler,
+            gint             x,
+            gint             y,
+            gint             width,
+            const guchar    *src,
+            guchar          *dest,
+            gpointer         data)
+{
+  const RippleParam_t *param = data;
+  gint                 col;
+
+  for (col = x; col < x + width; col++, dest += param->bpp)
+    {
+      if (rvals.orientation == GIMP_ORIENTATION_VERTICAL)
+        ripple_vertical (resampler, col, y, dest, param);
+      else
+        ripple_horizontal (resampler, col, y, dest, param);
+    }
+}
+
 static void
 ripple (GimpDrawable *drawable,
         GimpPreview  *preview)
 {
-  RippleParam_t param;
-  gint          edges;
-  gint          period;
+  Resampler     *resampler;
+  RippleParam_t  param;
+  gint           edges;
+  gint           period;
 
-  param.pft       = gimp_pixel_fetcher_new (drawable, FALSE);
   param.has_alpha = gimp_drawable_has_alpha (drawable->drawable_id);
   param.width     = drawable->width;
   param.height    = drawable->height;
+  param.bpp       = drawable->bpp;
 
   edges  = rvals.edges;
   period = rvals.period;
@@ -414,50 +436,39 @@ ripple (GimpDrawable *drawable,
 
   if (preview)
     {
-      guchar *buffer, *d;
-      gint    bpp = gimp_drawable_bpp (drawable->drawable_id);
+      guchar *buffer;
       gint    width, height;
-      gint    x, y;
       gint    x1, y1;
 
       gimp_preview_get_position (preview, &x1, &y1);
       gimp_preview_get_size (preview, &width, &height);
 
-      d = buffer = g_new (guchar, width * height * bpp);
+      /*  only read what the wave can reach from the preview area  */
+      resampler = resampler_new_area (drawable,
+                                      x1 - rvals.amplitude - 1,
+                                      y1 - rvals.amplitude - 1,
+                                      width  + 2 * (rvals.amplitude + 1),
+                                      height + 2 * (rvals.amplitude + 1));
 
-      for (y = 0; y < height ; y++)
-        for (x = 0; x < width ; x++)
-          {
-            if (rvals.orientation == GIMP_ORIENTATION_VERTICAL)
-              ripple_vertical (x1 + x, y1 + y, d, bpp, &param);
-            else
-              ripple_horizontal (x1 + x, y1 + y, d, bpp, &param);
+      buffer = g_new (guchar, width * height * param.bpp);
 
-            d += bpp;
-          }
+      resampler_render_buffer (resampler, x1, y1, width, height, buffer,
+                               ripple_row, &param);
 
-      gimp_preview_draw_buffer (preview, buffer, width * bpp);
+      gimp_preview_draw_buffer (preview, buffer, width * param.bpp);
       g_free (buffer);
     }
   else
     {
-      GimpRgnIterator *iter;
-
-      iter = gimp_rgn_iterator_new (drawable, 0);
-
-      gimp_rgn_iterator_dest (iter,
-                              rvals.orientation == GIMP_ORIENTATION_VERTICAL ?
-                              ripple_vertical :
-                              ripple_horizontal,
-                              &param);
+      resampler = resampler_new (drawable);
 
-      gimp_rgn_iterator_free (iter);
+      resampler_render (resampler, drawable, ripple_row, &param);
     }
 
   rvals.edges  = edges;
   rvals.period = period;
 
-  gimp_pixel_fetcher_destroy (param.pft);
+  resampler_free (resampler);
 }
 
 static gboolean
@@ -28,6 +28,8 @@
 
 #include "libgimp/stdplugins-intl.h"
 
+#include "resampler.h"
+
 
 /* Some useful macros */
 
@@ -210,23 +212,52 @@ run (const gchar      *name,
   gimp_drawable_detach (drawable);
 }
 
+typedef struct
+{
+  const gint *offsets;
+  gint        x1, y1;
+  gint        bytes;
+} ShiftParam;
+
+static void
+shift_row (const Resampler *resampler,
+           gint             x,
+           gint             y,
+           gint             width,
+           const guchar    *src,
+           guchar          *dest,
+           gpointer         data)
+{
+  const ShiftParam *param = data;
+  gint              end   = x + width;
+
+  switch (shvals.orientation)
+    {
+    case HORIZONTAL:
+      for (; x < end; x++, dest += param->bytes)
+        resampler_get_pixel (resampler,
+                             x + param->offsets[y - param->y1], y, dest);
+      break;
+
+    case VERTICAL:
+      for (; x < end; x++, dest += param->bytes)
+        resampler_get_pixel (resampler,
+                             x, y + param->offsets[x - param->x1], dest);
+      break;
+    }
+}
+
 static void
 shift (GimpDrawable *drawable,
        GimpPreview  *preview)
 {
-  GimpPixelRgn      dest_rgn;
-  gpointer          pr;
-  GimpPixelFetcher *pft;
-  gint              width, height;
-  gint              bytes;
-  guchar           *destline;
-  guchar           *dest;
-  gint              x1, y1, x2, y2;
-  gint              x, y;
-  gint              progress, max_progress;
-  gint              i, n = 0;
-  gint             *offsets;
-  GRand            *gr;
+  Resampler  *resampler;
+  ShiftParam  param;
+  gint        width, height;
+  gint        x1, y1, x2, y2;
+  gint        i, n = 0;
+  gint       *offsets;
+  GRand      *gr;
 
   if (preview)
     {
@@ -240,11 +271,6 @@ shift (GimpDrawable *drawable,
       height = y2 - y1;
     }
 
-  bytes  = drawable->bpp;
-
-  progress     = 0;
-  max_progress = width * height;
-
   /* Shift the image.  It's a pretty simple algorithm.  If horizontal
      is selected, then every row is shifted a random number of pixels
      in the range of -shift_amount/2 to shift_amount/2.  The effect is
@@ -263,76 +289,37 @@ shift (GimpDrawable *drawable,
 
   g_rand_free (gr);
 
-  pft = gimp_pixel_fetcher_new (drawable, FALSE);
-  gimp_pixel_fetcher_set_edge_mode (pft, GIMP_PIXEL_FETCHER_EDGE_WRAP);
-
-  gimp_pixel_rgn_init (&dest_rgn, drawable,
-                       x1, y1, width, height, (preview == NULL), TRUE);
+  param.offsets = offsets;
+  param.x1      = x1;
+  param.y1      = y1;
+  param.bytes   = drawable->bpp;
 
-  for (pr = gimp_pixel_rgns_register (1, &dest_rgn);
-       pr != NULL;
-       pr = gimp_pixel_rgns_process (pr))
+  if (preview)
     {
-      destline = dest_rgn.data;
-
-      switch (shvals.orientation)
-        {
-        case HORIZONTAL:
-          for (y = dest_rgn.y; y < dest_rgn.y + dest_rgn.h; y++)
-            {
-              dest = destline;
-
-              for (x = dest_rgn.x; x < dest_rgn.x + dest_rgn.w; x++)
-                {
-                  gimp_pixel_fetcher_get_pixel (pft,
-                                                x + offsets[y - y1], y, dest);
-                  dest += bytes;
-                }
-
-              destline += dest_rgn.rowstride;
-            }
-          break;
-
-        case VERTICAL:
-          for (x = dest_rgn.x; x < dest_rgn.x + dest_rgn.w; x++)
-            {
-              dest = destline;
-
-              for (y = dest_rgn.y; y < dest_rgn.y + dest_rgn.h; y++)
-                {
-                  gimp_pixel_fetcher_get_pixel (pft,
-                                                x, y + offsets[x - x1], dest);
-                  dest += dest_rgn.rowstride;
-                }
-
-              destline += bytes;
-            }
-          break;
-        }
+      guchar *buffer = g_new (guchar, width * height * param.bytes);
+      gint    pad    = (shvals.shift_amount + 1) / 2 + 1;
 
-      if (preview)
-        {
-          gimp_drawable_preview_draw_region (GIMP_DRAWABLE_PREVIEW (preview),
-                                             &dest_rgn);
-        }
-      else
-        {
-          progress += dest_rgn.w * dest_rgn.h;
-          gimp_progress_update ((double) progress / (double) max_progress);
-        }
-    }
+      resampler = resampler_new_area (drawable,
+                                      x1 - pad, y1 - pad,
+                                      width + 2 * pad, height + 2 * pad);
+      resampler_set_edge_mode (resampler, GIMP_PIXEL_FETCHER_EDGE_WRAP);
 
-  gimp_pixel_fetcher_destroy (pft);
-  g_free (offsets);
+      resampler_render_buffer (resampler, x1, y1, width, height, buffer,
+                               shift_row, &param);
 
-  if (! preview)
+      gimp_preview_draw_buffer (preview, buffer, width * param.bytes);
+      g_free (buffer);
+    }
+  else
     {
-      gimp_progress_update (1.0);
-      /*  update the region  */
-      gimp_drawable_flush (drawable);
-      gimp_drawable_merge_shadow (drawable->drawable_id, TRUE);
-      gimp_drawable_update (drawable->drawable_id, x1, y1, width, height);
+      resampler = resampler_new (drawable);
+      resampler_set_edge_mode (resampler, GIMP_PIXEL_FETCHER_EDGE_WRAP);
+
+      resampler_render (resampler, drawable, shift_row, &param);
     }
+
+  resampler_free (resampler);
+  g_free (offsets);
 }
 
 static gboolean
@@ -47,6 +47,8 @@
 
 #include "libgimp/stdplugins-intl.h"
 
+#include "threads.h"
+
 
 #define PLUG_IN_PROC   "plug-in-spheredesigner"
 #define PLUG_IN_BINARY "sphere-designer"
@@ -248,6 +250,18 @@ typedef union
   cylinder cylinder;
 } object;
 
+/* The point where a ray hit an object.  Its color and normal are
+ * needed several times, and with noise textures they are expensive,
+ * so they are only worked out once; see hitcolor() and hitnormal().
+ */
+typedef struct
+{
+  common       *obj;
+  GimpVector4   p;
+  gboolean      have_color, have_normal;
+  GimpVector4   color, normal;
+} hit;
+
 
 struct world_t
 {
@@ -1309,8 +1323,30 @@ objnormal (GimpVector4 *res, common *obj, GimpVector4 *p)
    5 = Reflection + Refraction
  */
 
+static GimpVector4 *
+hitcolor (hit *h)
+{
+  if (!h->have_color)
+    {
+      objcolor (&h->color, &h->p, h->obj);
+      h->have_color = TRUE;
+    }
+  return &h->color;
+}
+
+static GimpVector4 *
+hitnormal (hit *h)
+{
+  if (!h->have_normal)
+    {
+      objnormal (&h->normal, h->obj, &h->p);
+      h->have_normal = TRUE;
+    }
+  return &h->normal;
+}
+
 static void
-calclight (GimpVector4 * col, GimpVector4 * point, common * obj)
+calclight (GimpVector4 * col, hit * h)
 {
   gint i, j;
   ray r;
@@ -1318,10 +1354,12 @@ calclight (GimpVector4 * col, GimpVector4 * point, common * obj)
   GimpVector4 lcol;
   GimpVector4 norm;
   GimpVector4 pcol;
+  GimpVector4 *point = &h->p;
+  common *obj = h->obj;
 
   vcset (col, 0, 0, 0, 0);
 
-  objcolor (&pcol, point, obj);
+  vcopy (&pcol, hitcolor (h));
   a = pcol.w;
 
   if (world.quality < 2)
@@ -1347,7 +1385,7 @@ calclight (GimpVector4 * col, GimpVector4 * point, common * obj)
       vadd (col, &lcol);
     }
 
-  objnormal (&norm, obj, point);
+  vcopy (&norm, hitnormal (h));
   vnorm (&norm, 1.0);
 
   r.inside = -1;
@@ -1450,6 +1488,7 @@ traceray (ray * r, GimpVector4 * col, gint level, gdouble imp)
   common  *obj, *bobj = NULL;
   gint     hits = 0;
   GimpVector4   p;
+  hit      h;
 
   if ((level == 0) || (imp < 0.005))
     {
@@ -1506,13 +1545,17 @@ traceray (ray * r, GimpVector4 * col, gint level, gdouble imp)
       p.y = r->v1.y + (r->v2.y - r->v1.y) * min;
       p.z = r->v1.z + (r->v2.z - r->v1.z) * min;
 
-      calclight (col, &p, bobj);
+      h.obj = bobj;
+      h.p = p;
+      h.have_color = h.have_normal = FALSE;
+
+      calclight (col, &h);
 
       if (world.flags & SMARTAMBIENT)
         {
           gdouble ambient = 0.3 * exp (-min / world.smartambient);
           GimpVector4 lcol;
-          objcolor (&lcol, &p, bobj);
+          vcopy (&lcol, hitcolor (&h));
           vmul (&lcol, ambient);
           vadd (col, &lcol);
         }
@@ -1528,7 +1571,7 @@ traceray (ray * r, GimpVector4 * col, gint level, gdouble imp)
               GimpVector4 refcol, norm, ocol;
               ray ref;
 
-              objcolor (&ocol, &p, bobj);
+              vcopy (&ocol, hitcolor (&h));
 
               vcopy (&ref.v1, &p);
               vcopy (&ref.v2, &r->v1);
@@ -1538,7 +1581,7 @@ traceray (ray * r, GimpVector4 * col, gint level, gdouble imp)
               vmix (&ref.v1, &ref.v1, &ref.v2, 0.9999); /* push it a tad */
 
               vsub (&ref.v2, &p);
-              objnormal (&norm, bobj, &p);
+              vcopy (&norm, hitnormal (&h));
               vnorm (&norm, 1.0);
               vrotate (&norm, 180.0, &ref.v2);
 
@@ -1616,7 +1659,7 @@ traceray (ray * r, GimpVector4 * col, gint level, gdouble imp)
               vnorm (&ref.v2, 1.0);
               vadd (&ref.v2, &p);
 
-              objnormal (&norm, bobj, &p);
+              vcopy (&norm, hitnormal (&h));
               vcopy (&raydir, &r->v2);
               vsub (&raydir, &r->v1);
               vnorm (&raydir, 1.0);
@@ -1643,7 +1686,7 @@ traceray (ray * r, GimpVector4 * col, gint level, gdouble imp)
               vmix (&ref.v1, &ref.v1, &ref.v2, 0.999);  /* push it a tad */
 
               vsub (&ref.v2, &p);
-              objnormal (&norm, bobj, &p);
+              vcopy (&norm, hitnormal (&h));
 
               if (r->inside == b)
                 {
@@ -2942,23 +2985,101 @@ render (void)
   return FALSE;
 }
 
+/* realrender() traces a batch of rows at a time: the main thread reads
+ * them from the drawable, several threads trace a band of them each and
+ * blend the sphere in, and the main thread writes them back.  traceray()
+ * only reads the world, so it can run on several threads at once.
+ */
+
+typedef struct
+{
+  guchar        *buffer;     /* the rows of the batch, bpp bytes a pixel */
+  gint           tx, ty;     /* size of the area */
+  gint           bpp;
+  gint           first_row;  /* of the batch, from the top of the area */
+  gint           n_rows;
+  gint           band_height;
+  volatile gint  next_band;
+} renderjob;
+
+static gpointer
+realrender_thread (gpointer data)
+{
+  renderjob   *job = data;
+  ray          r;
+  GimpVector4  rcol;
+  guchar      *dest;
+  gint         band;
+
+  dest = g_malloc (job->tx * 4);
+
+  r.v1.z = -10.0;
+  r.v2.z = 0.0;
+
+  while ((band = g_atomic_int_add (&job->next_band, 1)) * job->band_height <
+         job->n_rows)
+    {
+      gint first = band * job->band_height;
+      gint rows  = MIN (job->band_height, job->n_rows - first);
+      gint x, y;
+
+      for (y = job->first_row + first;
+           y < job->first_row + first + rows;
+           y++)
+        {
+          guchar *row = job->buffer + (y - job->first_row) * job->tx * job->bpp;
+          guchar *d   = dest;
+
+          for (x = 0; x < job->tx; x++)
+            {
+              r.v1.x = r.v2.x = 8.1 * (x / (float) (job->tx - 1) - 0.5);
+              r.v1.y = r.v2.y = 8.1 * (y / (float) (job->ty - 1) - 0.5);
+
+              traceray (&r, &rcol, 10, 1.0);
+              d[0] = pixelval (255 * rcol.x);
+              d[1] = pixelval (255 * rcol.y);
+              d[2] = pixelval (255 * rcol.z);
+              d[3] = pixelval (255 * rcol.w);
+              d += 4;
+            }
+
+          for (x = 0; x < job->tx; x++)
+            {
+              gint   k, dx = x * 4, sx = x * job->bpp;
+              gfloat a     = dest[dx + 3] / 255.0;
+
+              for (k = 0; k < job->bpp; k++)
+                {
+                  row[sx + k] =
+                    dest[dx + k] * a + row[sx + k] * (1.0 - a);
+                }
+            }
+        }
+    }
+
+  g_free (dest);
+
+  return NULL;
+}
+
 static void
 realrender (GimpDrawable *drawable)
 {
-  gint          x, y;
-  ray           r;
-  GimpVector4   rcol;
-  gint          tx, ty;
+  renderjob     job;
+  GThread      *threads[THREADS_MAX];
+  gint          n_threads;
+  gint          i;
   gint          x1, y1, x2, y2;
-  guchar       *dest;
-  gint          bpp;
   GimpPixelRgn  pr, dpr;
-  guchar       *buffer, *ibuffer;
 
   initworld ();
 
-  r.v1.z = -10.0;
-  r.v2.z = 0.0;
+  /* noise3() would set up its tables on first use, from any thread */
+  if (start)
+    {
+      start = FALSE;
+      init ();
+    }
 
   gimp_pixel_rgn_init (&pr, drawable, 0, 0,
                        gimp_drawable_width (drawable->drawable_id),
@@ -2969,48 +3090,42 @@ realrender (GimpDrawable *drawable)
                        gimp_drawable_height (drawable->drawable_id), TRUE,
                        TRUE);
   gimp_drawable_mask_bounds (drawable->drawable_id, &x1, &y1, &x2, &y2);
-  bpp = gimp_drawable_bpp (drawable->drawable_id);
-  buffer = g_malloc ((x2 - x1) * 4);
-  ibuffer = g_malloc ((x2 - x1) * 4);
 
-  tx = x2 - x1;
-  ty = y2 - y1;
+  n_threads = threads_get_count ();
+
+  job.bpp         = gimp_drawable_bpp (drawable->drawable_id);
+  job.tx          = x2 - x1;
+  job.ty          = y2 - y1;
+  job.band_height = gimp_tile_height ();
+  job.buffer      = g_malloc (n_threads * job.band_height * job.tx * job.bpp);
 
   gimp_progress_init (_("Rendering sphere"));
 
-  for (y = 0; y < ty; y++)
+  for (job.first_row = 0; job.first_row < job.ty; job.first_row += job.n_rows)
     {
-      dest = buffer;
-      for (x = 0; x < tx; x++)
-        {
-          r.v1.x = r.v2.x = 8.1 * (x / (float) (tx - 1) - 0.5);
-          r.v1.y = r.v2.y = 8.1 * (y / (float) (ty - 1) - 0.5);
-
-          traceray (&r, &rcol, 10, 1.0);
-          dest[0] = pixelval (255 * rcol.x);
-          dest[1] = pixelval (255 * rcol.y);
-          dest[2] = pixelval (255 * rcol.z);
-          dest[3] = pixelval (255 * rcol.w);
-          dest += 4;
-        }
-      gimp_pixel_rgn_get_row (&pr, ibuffer, x1, y1 + y, x2 - x1);
-      for (x = 0; x < (x2 - x1); x++)
-        {
-          gint   k, dx = x * 4, sx = x * bpp;
-          gfloat a     = buffer[dx + 3] / 255.0;
+      job.n_rows    = MIN (n_threads * job.band_height,
+                           job.ty - job.first_row);
+      job.next_band = 0;
 
-          for (k = 0; k < bpp; k++)
-            {
-              ibuffer[sx + k] =
-                buffer[dx + k] * a + ibuffer[sx + k] * (1.0 - a);
-            }
-        }
-      gimp_pixel_rgn_set_row (&dpr, ibuffer, x1, y1 + y, x2 - x1);
-      gimp_progress_update ((gdouble) y / (gdouble) ty);
+      gimp_pixel_rgn_get_rect (&pr, job.buffer,
+                               x1, y1 + job.first_row, job.tx, job.n_rows);
+
+      for (i = 1; i < n_threads; i++)
+        threads[i] = g_thread_create (realrender_thread, &job, TRUE, NULL);
+
+      realrender_thread (&job);
+
+      for (i = 1; i < n_threads; i++)
+        if (threads[i])
+          g_thread_join (threads[i]);
+
+      gimp_pixel_rgn_set_rect (&dpr, job.buffer,
+                               x1, y1 + job.first_row, job.tx, job.n_rows);
+      gimp_progress_update ((gdouble) (job.first_row + job.n_rows) /
+                            (gdouble) job.ty);
     }
   gimp_progress_update (1.0);
-  g_free (buffer);
-  g_free (ibuffer);
+  g_free (job.buffer);
   gimp_drawable_flush (drawable);
   gimp_drawable_merge_shadow (drawable->drawable_id, TRUE);
   gimp_drawable_update (drawable->drawable_id, x1, y1, x2 - x1, y2 - y1);
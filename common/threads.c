@@ -0,0 +1,48 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * threads.c
+ * Thread count helper for the threaded plug-ins.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+
+#include <libgimp/gimp.h>
+
+#include "threads.h"
+
+
+gint
+threads_get_count (void)
+{
+  static gint n_threads = 0;
+
+  if (n_threads == 0)
+    {
+      /*  the core sets "num-processors" to the number of online CPUs,
+       *  the user can override it in the preferences
+       */
+      gchar *str = gimp_gimprc_query ("num-processors");
+
+      n_threads = str ? atoi (str) : 1;
+      n_threads = CLAMP (n_threads, 1, THREADS_MAX);
+      g_free (str);
+    }
+
+  return n_threads;
+}
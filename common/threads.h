@@ -0,0 +1,36 @@
+/* GIMP - The GNU Image Manipulation Program
+ * Copyright (C) 1995 Spencer Kimball and Peter Mattis
+ *
+ * threads.h
+ * Thread count helper for the threaded plug-ins.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __THREADS_H__
+#define __THREADS_H__
+
+
+/*  The most threads a plug-in runs at once, for sizing arrays  */
+#define THREADS_MAX 16
+
+
+/*  Returns the number of threads to use, from the "num-processors"
+ *  gimprc setting, between 1 and THREADS_MAX.  The first call queries
+ *  the core, so it has to be made from the main thread.
+ */
+gint   threads_get_count (void);
+
+
+#endif /* __THREADS_H__ */
@@ -26,6 +26,8 @@
 
 #include "libgimp/stdplugins-intl.h"
 
+#include "bands.h"
+
 
 #define PLUG_IN_PROC    "plug-in-unsharp-mask"
 #define PLUG_IN_BINARY  "unsharp-mask"
@@ -73,6 +75,13 @@ static void      box_blur_line       (const gint      box_width,
                                       guchar         *dest,
                                       const gint      len,
                                       const gint      bpp);
+static void      blur_line           (const gdouble  *cmatrix,
+                                      const gint      cmatrix_length,
+                                      const gint      box_width,
+                                      guchar         *src,
+                                      guchar         *dest,
+                                      const gint      len,
+                                      const gint      bpp);
 static gint      gen_convolve_matrix (gdouble         std_dev,
                                       gdouble       **cmatrix);
 static void      unsharp_region      (GimpPixelRgn   *srcPTR,
@@ -523,6 +532,50 @@ gaussian_blur_line (const gdouble *cmatrix,
     }
 }
 
+/* Blur one line with either the gaussian kernel or, if box_width is
+ * non-zero, three passes of a box blur.  The box blur swaps back and
+ * forth between the buffers, so src is clobbered.
+ */
+static void
+blur_line (const gdouble *cmatrix,
+           const gint     cmatrix_length,
+           const gint     box_width,
+           guchar        *src,
+           guchar        *dest,
+           const gint     len,
+           const gint     bpp)
+{
+  if (box_width)
+    {
+      /* Odd-width box blur: repeat 3 times, centered on output pixel.
+       * Swap back and forth between the buffers. */
+      if (box_width % 2)
+        {
+          box_blur_line (box_width, 0, src, dest, len, bpp);
+          box_blur_line (box_width, 0, dest, src, len, bpp);
+          box_blur_line (box_width, 0, src, dest, len, bpp);
+        }
+      /* Even-width box blur:
+       * This method is suggested by the specification for SVG.
+       * One pass with width n, centered between output and right pixel
+       * One pass with width n, centered between output and left pixel
+       * One pass with width n+1, centered on output pixel
+       * Swap back and forth between buffers.
+       */
+      else
+        {
+          box_blur_line (box_width,  -1, src, dest, len, bpp);
+          box_blur_line (box_width,   1, dest, src, len, bpp);
+          box_blur_line (box_width+1, 0, src, dest, len, bpp);
+        }
+    }
+  else
+    {
+      /* Gaussian blur */
+      gaussian_blur_line (cmatrix, cmatrix_length, src, dest, len, bpp);
+    }
+}
+
 static void
 unsharp_mask (GimpDrawable *drawable,
               gdouble       radius,
@@ -574,9 +627,9 @@ unsharp_region (GimpPixelRgn *srcPR,
   gint        cmatrix_length = 0;
   gint        row, col;           /* Row, column counters                  */
   const gint  threshold = unsharp_params.threshold;
-  gboolean    box_blur;           /* If we want to use a three pass box
-                                     blur instead of a gaussian blur       */
-  gint        box_width = 0;
+  gint        box_width = 0;      /* Non-zero if we want to use a three
+                                     pass box blur instead of a gaussian
+                                     blur                                  */
 
   if (show_progress)
     gimp_progress_init (_("Blurring"));
@@ -589,14 +642,12 @@ unsharp_region (GimpPixelRgn *srcPR,
    */
   if (radius < 10)
     {
-      box_blur = FALSE;
       /* If true gaussian, generate convolution matrix
          and make sure it's smaller than each dimension */
       cmatrix_length = gen_convolve_matrix (radius, &cmatrix);
     }
   else
     {
-      box_blur = TRUE;
       /* Three box blurs of this width approximate a gaussian */
       box_width = ROUND (radius * 3 * sqrt (2 * G_PI) / 4);
     }
@@ -610,35 +661,7 @@ unsharp_region (GimpPixelRgn *srcPR,
     {
       gimp_pixel_rgn_get_row (srcPR, src, x1, y1 + row, width);
 
-      if (box_blur)
-        {
-          /* Odd-width box blur: repeat 3 times, centered on output pixel.
-           * Swap back and forth between the buffers. */
-          if (box_width % 2)
-            {
-              box_blur_line (box_width, 0, src, dest, width, bpp);
-              box_blur_line (box_width, 0, dest, src, width, bpp);
-              box_blur_line (box_width, 0, src, dest, width, bpp);
-            }
-          /* Even-width box blur:
-           * This method is suggested by the specification for SVG.
-           * One pass with width n, centered between output and right pixel
-           * One pass with width n, centered between output and left pixel
-           * One pass with width n+1, centered on output pixel
-           * Swap back and forth between buffers.
-           */
-          else
-            {
-              box_blur_line (box_width,  -1, src, dest, width, bpp);
-              box_blur_line (box_width,   1, dest, src, width, bpp);
-              box_blur_line (box_width+1, 0, src, dest, width, bpp);
-            }
-        }
-      else
-        {
-          /* Gaussian blur */
-          gaussian_blur_line (cmatrix, cmatrix_length, src, dest, width, bpp);
-        }
+      blur_line (cmatrix, cmatrix_length, box_width, src, dest, width, bpp);
 
       gimp_pixel_rgn_set_row (destPR, dest, x1, y1 + row, width);
 
@@ -646,39 +669,46 @@ unsharp_region (GimpPixelRgn *srcPR,
         gimp_progress_update ((gdouble) row / (3 * height));
     }
 
-  /* Blur the cols. Essentially same as above. */
-  for (col = 0; col < width; col++)
-    {
-      gimp_pixel_rgn_get_col (destPR, src, x1 + col, y1, height);
-
-      if (box_blur)
-        {
-          /* Odd-width box blur */
-          if (box_width % 2)
-            {
-              box_blur_line (box_width, 0, src, dest, height, bpp);
-              box_blur_line (box_width, 0, dest, src, height, bpp);
-              box_blur_line (box_width, 0, src, dest, height, bpp);
-            }
-          /* Even-width box blur */
-          else
-            {
-              box_blur_line (box_width,  -1, src, dest, height, bpp);
-              box_blur_line (box_width,   1, dest, src, height, bpp);
-              box_blur_line (box_width+1, 0, src, dest, height, bpp);
-            }
-        }
-      else
-        {
-          /* Gaussian blur */
-          gaussian_blur_line (cmatrix, cmatrix_length, src, dest,height, bpp);
-        }
-
-      gimp_pixel_rgn_set_col (destPR, dest, x1 + col, y1, height);
-
-      if (show_progress && col % 64 == 0)
-        gimp_progress_update ((gdouble) col / (3 * width) + 0.33);
-    }
+  /* Blur the cols.  Rather than fetching one column at a time, which
+   * would touch every tile of that column for each pixel column,
+   * read a band of one tile width at a time and transpose it, so the
+   * columns become contiguous lines just like the rows above.
+   */
+  {
+    const gint  tile_width  = gimp_tile_width ();
+    const gint  tile_height = gimp_tile_height ();
+    guchar     *band_src    = g_new (guchar, tile_width * height * bpp);
+    guchar     *band_dest   = g_new (guchar, tile_width * height * bpp);
+    guchar     *tile_buf    = g_new (guchar, tile_width * tile_height * bpp);
+    gint        bw;
+
+    for (col = 0; col < width; col += bw)
+      {
+        gint x = x1 + col;
+        gint i;
+
+        bw = MIN ((x / tile_width + 1) * tile_width, x2) - x;
+
+        bands_transfer (destPR, band_src, tile_buf,
+                        x, y1, bw, height, bpp, FALSE);
+
+        for (i = 0; i < bw; i++)
+          blur_line (cmatrix, cmatrix_length, box_width,
+                     band_src  + i * height * bpp,
+                     band_dest + i * height * bpp,
+                     height, bpp);
+
+        bands_transfer (destPR, band_dest, tile_buf,
+                        x, y1, bw, height, bpp, TRUE);
+
+        if (show_progress)
+          gimp_progress_update ((gdouble) (col + bw) / (3 * width) + 0.33);
+      }
+
+    g_free (tile_buf);
+    g_free (band_dest);
+    g_free (band_src);
+  }
 
   if (show_progress)
     gimp_progress_set_text (_("Merging"));
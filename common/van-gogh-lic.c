@@ -37,11 +37,15 @@
 
 #include "config.h"
 
+#include <string.h>
+
 #include <libgimp/gimp.h>
 #include <libgimp/gimpui.h>
 
 #include "libgimp/stdplugins-intl.h"
 
+#include "threads.h"
+
 
 /************/
 /* Typedefs */
@@ -50,6 +54,8 @@
 #define numx    40              /* Pseudo-random vector grid size */
 #define numy    40
 
+#define TILE_SIZE   64          /* Tiles handed out to the threads */
+
 #define PLUG_IN_PROC   "plug-in-lic"
 #define PLUG_IN_BINARY "van-gogh-lic"
 #define PLUG_IN_ROLE   "gimp-van-gogh-lic"
@@ -61,6 +67,23 @@ typedef enum
   LIC_BRIGHTNESS
 } LICEffectChannel;
 
+typedef struct
+{
+  guchar  *src_buf;
+  guchar  *dest_buf;
+  gfloat  *field;         /* Normalized vectors, two floats per pixel */
+  gdouble *offsets;       /* Sample positions along the line */
+  gdouble *weights;       /* Filter weight at each sample */
+  gint     n_samples;
+  gint     width;
+  gint     height;
+  gint     bpp;
+  gint     n_tiles_x;
+  gint     n_tiles;
+  gint     next_tile;
+  gint     tiles_done;
+} LicJob;
+
 
 /*****************************/
 /* Global variables and such */
@@ -102,43 +125,27 @@ static GtkWidget *dialog;
 /************************/
 
 static void
-peek (GimpPixelRgn *src_rgn,
+peek (const LicJob *job,
       gint          x,
       gint          y,
       GimpRGB      *color)
 {
-  static guchar data[4] = { 0, };
+  const guchar *data = job->src_buf + (y * job->width + x) * job->bpp;
 
-  gimp_pixel_rgn_get_pixel (src_rgn, data, x, y);
-  gimp_rgba_set_uchar (color, data[0], data[1], data[2], data[3]);
+  gimp_rgba_set_uchar (color, data[0], data[1], data[2],
+                       job->bpp == 4 ? data[3] : 255);
 }
 
 static void
-poke (GimpPixelRgn *dest_rgn,
+poke (const LicJob *job,
       gint          x,
       gint          y,
       GimpRGB      *color)
 {
-  static guchar data[4];
+  guchar data[4];
 
   gimp_rgba_get_uchar (color, &data[0], &data[1], &data[2], &data[3]);
-  gimp_pixel_rgn_set_pixel (dest_rgn, data, x, y);
-}
-
-static gint
-peekmap (const guchar *image,
-         gint          x,
-         gint          y)
-{
-  while (x < 0)
-    x += effect_width;
-  x %= effect_width;
-
-  while (y < 0)
-    y += effect_height;
-  y %= effect_height;
-
-  return (gint) image[x + effect_width * y];
+  memcpy (job->dest_buf + (y * job->width + x) * job->bpp, data, job->bpp);
 }
 
 /*************/
@@ -152,43 +159,82 @@ peekmap (const guchar *image,
 /* DX: |2 0 -2| DY: |  0   0   0|                  */
 /*     |1 0 -1|     | -1  -2  -1|                  */
 /* (It's a varation of the Sobel kernels, really)  */
+/*                                                 */
+/* The effect map wraps around at its edges. The   */
+/* normalized (and possibly rotated) vectors are   */
+/* stored as float pairs, once for the whole area. */
 /***************************************************/
 
 static gint
-gradx (const guchar *image,
-       gint          x,
-       gint          y)
+wrap (gint i,
+      gint size)
 {
-  gint val = 0;
+  i %= size;
 
-  val = val +     peekmap (image, x-1, y-1);
-  val = val -     peekmap (image, x+1, y-1);
+  return (i < 0) ? i + size : i;
+}
 
-  val = val + 2 * peekmap (image, x-1, y);
-  val = val - 2 * peekmap (image, x+1, y);
+static gfloat *
+compute_field (const guchar *image,
+               gint          width,
+               gint          height,
+               gboolean      rotate)
+{
+  gfloat *field = g_new (gfloat, 2 * width * height);
+  gfloat *v     = field;
+  gint   *col_l = g_new (gint, width);
+  gint   *col_c = g_new (gint, width);
+  gint   *col_r = g_new (gint, width);
+  gint    x, y;
+
+  for (x = 0; x < width; x++)
+    {
+      col_l[x] = wrap (x - 1, effect_width);
+      col_c[x] = wrap (x,     effect_width);
+      col_r[x] = wrap (x + 1, effect_width);
+    }
 
-  val = val +     peekmap (image, x-1, y+1);
-  val = val -     peekmap (image, x+1, y+1);
+  for (y = 0; y < height; y++)
+    {
+      const guchar *above = image + effect_width * wrap (y - 1, effect_height);
+      const guchar *below = image + effect_width * wrap (y + 1, effect_height);
+      const guchar *row   = image + effect_width * wrap (y,     effect_height);
 
-  return val;
-}
+      for (x = 0; x < width; x++)
+        {
+          gdouble vx, vy, tmp;
 
-static gint
-grady (const guchar *image,
-       gint          x,
-       gint          y)
-{
-  gint val = 0;
+          vx = (above[col_l[x]] + 2 * row[col_l[x]] + below[col_l[x]]) -
+               (above[col_r[x]] + 2 * row[col_r[x]] + below[col_r[x]]);
+          vy = (above[col_l[x]] + 2 * above[col_c[x]] + above[col_r[x]]) -
+               (below[col_l[x]] + 2 * below[col_c[x]] + below[col_r[x]]);
 
-  val = val +     peekmap (image, x-1, y-1);
-  val = val + 2 * peekmap (image, x,   y-1);
-  val = val +     peekmap (image, x+1, y-1);
+          /* Rotate if needed */
+          if (rotate)
+            {
+              tmp = vy;
+              vy = -vx;
+              vx = tmp;
+            }
 
-  val = val -     peekmap (image, x-1, y+1);
-  val = val - 2 * peekmap (image, x,   y+1);
-  val = val -     peekmap (image, x+1, y+1);
+          tmp = sqrt (vx * vx + vy * vy);
+          if (tmp >= 0.000001)
+            {
+              tmp = 1.0 / tmp;
+              vx *= tmp;
+              vy *= tmp;
+            }
+
+          *v++ = vx;
+          *v++ = vy;
+        }
+    }
+
+  g_free (col_l);
+  g_free (col_c);
+  g_free (col_r);
 
-  return val;
+  return field;
 }
 
 /************************************/
@@ -283,36 +329,68 @@ filter (gdouble u)
   return (f < 0.0) ? 0.0 : f;
 }
 
+/*******************************************************/
+/* Sample positions along the line and their weights.  */
+/* They are the same for every pixel, so they are set  */
+/* up once; samples the filter gives no weight are     */
+/* skipped altogether when integrating.                */
+/*******************************************************/
+
+static void
+compute_samples (LicJob *job)
+{
+  gdouble u, step = 2.0 * l / isteps;
+  gint    n = 1;
+
+  for (u = -l + step; u <= l; u += step)
+    n++;
+
+  job->n_samples = n;
+  job->offsets   = g_new (gdouble, n);
+  job->weights   = g_new (gdouble, n);
+
+  job->offsets[0] = -l;
+  job->weights[0] = filter (-l);
+
+  for (n = 1, u = -l + step; u <= l; u += step, n++)
+    {
+      job->offsets[n] = u;
+      job->weights[n] = filter (u);
+    }
+}
+
 /******************************************************/
 /* Compute the Line Integral Convolution (LIC) at x,y */
 /******************************************************/
 
 static gdouble
-lic_noise (gint    x,
-           gint    y,
-           gdouble vx,
-           gdouble vy)
+lic_noise (const LicJob *job,
+           gint          x,
+           gint          y,
+           gdouble       vx,
+           gdouble       vy)
 {
   gdouble i = 0.0;
   gdouble f1 = 0.0, f2 = 0.0;
-  gdouble u, step = 2.0 * l / isteps;
+  gdouble step = 2.0 * l / isteps;
   gdouble xx = (gdouble) x, yy = (gdouble) y;
-  gdouble c, s;
-
-  /* Get vector at x,y */
-  /* ================= */
-
-  c = vx;
-  s = vy;
+  gint    k;
 
   /* Calculate integral numerically */
   /* ============================== */
 
-  f1 = filter (-l) * noise (xx + l * c , yy + l * s);
+  if (job->weights[0] != 0.0)
+    f1 = job->weights[0] * noise (xx - job->offsets[0] * vx,
+                                  yy - job->offsets[0] * vy);
 
-  for (u = -l + step; u <= l; u += step)
+  for (k = 1; k < job->n_samples; k++)
     {
-      f2 = filter (u) * noise ( xx - u * c , yy - u * s);
+      gdouble u = job->offsets[k];
+
+      f2 = 0.0;
+      if (job->weights[k] != 0.0)
+        f2 = job->weights[k] * noise (xx - u * vx, yy - u * vy);
+
       i += (f1 + f2) * 0.5 * step;
       f1 = f2;
     }
@@ -327,38 +405,38 @@ lic_noise (gint    x,
 }
 
 static void
-getpixel (GimpPixelRgn *src_rgn,
+getpixel (const LicJob *job,
           GimpRGB      *p,
           gdouble       u,
           gdouble       v)
 {
   register gint x1, y1, x2, y2;
   gint width, height;
-  static GimpRGB pp[4];
+  GimpRGB pp[4];
 
-  width = src_rgn->w;
-  height = src_rgn->h;
+  width = job->width;
+  height = job->height;
 
   x1 = (gint)u;
   y1 = (gint)v;
 
   if (x1 < 0)
-    x1 = width - (-x1 % width);
+    x1 = (width - (-x1 % width)) % width;
   else
     x1 = x1 % width;
 
   if (y1 < 0)
-    y1 = height - (-y1 % height);
+    y1 = (height - (-y1 % height)) % height;
   else
     y1 = y1 % height;
 
   x2 = (x1 + 1) % width;
   y2 = (y1 + 1) % height;
 
-  peek (src_rgn, x1, y1, &pp[0]);
-  peek (src_rgn, x2, y1, &pp[1]);
-  peek (src_rgn, x1, y2, &pp[2]);
-  peek (src_rgn, x2, y2, &pp[3]);
+  peek (job, x1, y1, &pp[0]);
+  peek (job, x2, y1, &pp[1]);
+  peek (job, x1, y2, &pp[2]);
+  peek (job, x2, y2, &pp[3]);
 
   if (source_drw_has_alpha)
     *p = gimp_bilinear_rgba (u, v, pp);
@@ -367,40 +445,49 @@ getpixel (GimpPixelRgn *src_rgn,
 }
 
 static void
-lic_image (GimpPixelRgn *src_rgn,
+lic_image (const LicJob *job,
            gint          x,
            gint          y,
            gdouble       vx,
            gdouble       vy,
            GimpRGB      *color)
 {
-  gdouble u, step = 2.0 * l / isteps;
+  gdouble step = 2.0 * l / isteps;
   gdouble xx = (gdouble) x, yy = (gdouble) y;
-  gdouble c, s;
   GimpRGB col = { 0, 0, 0, 0 };
-  GimpRGB col1, col2, col3;
-
-  /* Get vector at x,y */
-  /* ================= */
-
-  c = vx;
-  s = vy;
+  GimpRGB col1 = { 0, 0, 0, 0 };
+  GimpRGB col2, col3;
+  gint    k;
 
   /* Calculate integral numerically */
   /* ============================== */
 
-  getpixel (src_rgn, &col1, xx + l * c, yy + l * s);
-  if (source_drw_has_alpha)
-    gimp_rgba_multiply (&col1, filter (-l));
-  else
-    gimp_rgb_multiply (&col1, filter (-l));
+  if (job->weights[0] != 0.0)
+    {
+      getpixel (job, &col1,
+                xx - job->offsets[0] * vx, yy - job->offsets[0] * vy);
+      if (source_drw_has_alpha)
+        gimp_rgba_multiply (&col1, job->weights[0]);
+      else
+        gimp_rgb_multiply (&col1, job->weights[0]);
+    }
 
-  for (u = -l + step; u <= l; u += step)
+  for (k = 1; k < job->n_samples; k++)
     {
-      getpixel (src_rgn, &col2, xx - u * c, yy - u * s);
+      gdouble u = job->offsets[k];
+
+      if (job->weights[k] != 0.0)
+        {
+          getpixel (job, &col2, xx - u * vx, yy - u * vy);
+        }
+      else
+        {
+          gimp_rgba_set (&col2, 0.0, 0.0, 0.0, 0.0);
+        }
+
       if (source_drw_has_alpha)
         {
-          gimp_rgba_multiply (&col2, filter (u));
+          gimp_rgba_multiply (&col2, job->weights[k]);
 
           col3 = col1;
           gimp_rgba_add (&col3, &col2);
@@ -409,7 +496,7 @@ lic_image (GimpPixelRgn *src_rgn,
         }
       else
         {
-          gimp_rgb_multiply (&col2, filter (u));
+          gimp_rgb_multiply (&col2, job->weights[k]);
 
           col3 = col1;
           gimp_rgb_add (&col3, &col2);
@@ -485,59 +572,38 @@ rgb_to_hsl (GimpDrawable     *drawable,
 }
 
 
+/*****************************************************/
+/* The image is convolved in tiles which are handed  */
+/* out to the threads from a shared counter. Only    */
+/* the main thread reports progress.                 */
+/*****************************************************/
+
 static void
-compute_lic (GimpDrawable *drawable,
-             const guchar *scalarfield,
-             gboolean      rotate)
+lic_tile (const LicJob *job,
+          gint          tile)
 {
+  gint x0 = (tile % job->n_tiles_x) * TILE_SIZE;
+  gint y0 = (tile / job->n_tiles_x) * TILE_SIZE;
+  gint x1 = MIN (x0 + TILE_SIZE, job->width);
+  gint y1 = MIN (y0 + TILE_SIZE, job->height);
   gint xcount, ycount;
-  GimpRGB color;
-  gdouble vx, vy, tmp;
-  GimpPixelRgn src_rgn, dest_rgn;
-
-  gimp_pixel_rgn_init (&src_rgn, drawable,
-                       border_x1, border_y1,
-                       border_x2 - border_x1,
-                       border_y2 - border_y1, FALSE, FALSE);
 
-  gimp_pixel_rgn_init (&dest_rgn, drawable,
-                       border_x1, border_y1,
-                       border_x2 - border_x1,
-                       border_y2 - border_y1, TRUE, TRUE);
-
-  for (ycount = 0; ycount < src_rgn.h; ycount++)
+  for (ycount = y0; ycount < y1; ycount++)
     {
-      for (xcount = 0; xcount < src_rgn.w; xcount++)
-        {
-          /* Get derivative at (x,y) and normalize it */
-          /* ============================================================== */
+      const gfloat *v = job->field + 2 * (ycount * job->width + x0);
 
-          vx = gradx (scalarfield, xcount, ycount);
-          vy = grady (scalarfield, xcount, ycount);
-
-          /* Rotate if needed */
-          if (rotate)
-            {
-              tmp = vy;
-              vy = -vx;
-              vx = tmp;
-            }
-
-          tmp = sqrt (vx * vx + vy * vy);
-          if (tmp >= 0.000001)
-            {
-              tmp = 1.0 / tmp;
-              vx *= tmp;
-              vy *= tmp;
-            }
+      for (xcount = x0; xcount < x1; xcount++, v += 2)
+        {
+          GimpRGB color;
+          gdouble tmp;
 
           /* Convolve with the LIC at (x,y) */
           /* ============================== */
 
           if (licvals.effect_convolve == 0)
             {
-              peek (&src_rgn, xcount, ycount, &color);
-              tmp = lic_noise (xcount, ycount, vx, vy);
+              peek (job, xcount, ycount, &color);
+              tmp = lic_noise (job, xcount, ycount, v[0], v[1]);
               if (source_drw_has_alpha)
                 gimp_rgba_multiply (&color, tmp);
               else
@@ -545,13 +611,93 @@ compute_lic (GimpDrawable *drawable,
             }
           else
             {
-              lic_image (&src_rgn, xcount, ycount, vx, vy, &color);
+              lic_image (job, xcount, ycount, v[0], v[1], &color);
             }
-          poke (&dest_rgn, xcount, ycount, &color);
+          poke (job, xcount, ycount, &color);
         }
+    }
+}
 
-      gimp_progress_update ((gfloat) ycount / (gfloat) src_rgn.h);
+static void
+lic_process (LicJob   *job,
+             gboolean  report_progress)
+{
+  gint tile;
+
+  while ((tile = g_atomic_int_add (&job->next_tile, 1)) < job->n_tiles)
+    {
+      lic_tile (job, tile);
+
+      g_atomic_int_add (&job->tiles_done, 1);
+
+      if (report_progress)
+        gimp_progress_update ((gdouble) g_atomic_int_get (&job->tiles_done) /
+                              (gdouble) job->n_tiles);
     }
+}
+
+static gpointer
+lic_thread (gpointer data)
+{
+  lic_process (data, FALSE);
+
+  return NULL;
+}
+
+static void
+compute_lic (GimpDrawable *drawable,
+             const guchar *scalarfield,
+             gboolean      rotate)
+{
+  GimpPixelRgn  src_rgn, dest_rgn;
+  GThread      *threads[THREADS_MAX];
+  LicJob        job;
+  gint          width  = border_x2 - border_x1;
+  gint          height = border_y2 - border_y1;
+  gint          n_threads;
+  gint          i;
+
+  job.width      = width;
+  job.height     = height;
+  job.bpp        = drawable->bpp;
+  job.n_tiles_x  = (width  + TILE_SIZE - 1) / TILE_SIZE;
+  job.n_tiles    = job.n_tiles_x * ((height + TILE_SIZE - 1) / TILE_SIZE);
+  job.next_tile  = 0;
+  job.tiles_done = 0;
+
+  job.src_buf  = g_new (guchar, width * height * job.bpp);
+  job.dest_buf = g_new (guchar, width * height * job.bpp);
+
+  gimp_pixel_rgn_init (&src_rgn, drawable,
+                       border_x1, border_y1, width, height, FALSE, FALSE);
+  gimp_pixel_rgn_get_rect (&src_rgn, job.src_buf,
+                           border_x1, border_y1, width, height);
+
+  job.field = compute_field (scalarfield, width, height, rotate);
+  compute_samples (&job);
+
+  n_threads = MIN (threads_get_count (), job.n_tiles);
+
+  for (i = 1; i < n_threads; i++)
+    threads[i] = g_thread_create (lic_thread, &job, TRUE, NULL);
+
+  lic_process (&job, TRUE);
+
+  for (i = 1; i < n_threads; i++)
+    if (threads[i])
+      g_thread_join (threads[i]);
+
+  gimp_pixel_rgn_init (&dest_rgn, drawable,
+                       border_x1, border_y1, width, height, TRUE, TRUE);
+  gimp_pixel_rgn_set_rect (&dest_rgn, job.dest_buf,
+                           border_x1, border_y1, width, height);
+
+  g_free (job.src_buf);
+  g_free (job.dest_buf);
+  g_free (job.field);
+  g_free (job.offsets);
+  g_free (job.weights);
+
   gimp_progress_update (1.0);
 }
 
@@ -51,6 +51,8 @@
 
 #include "libgimp/stdplugins-intl.h"
 
+#include "resampler.h"
+
 
 #define PLUG_IN_PROC    "plug-in-whirl-pinch"
 #define PLUG_IN_BINARY  "whirl-pinch"
@@ -290,167 +292,106 @@ run (const gchar      *name,
   gimp_drawable_detach (drawable);
 }
 
+/* The selection is computed from its top half: the undistorted
+ * coordinates of a pixel, mirrored about the center, give those of
+ * the mirrored pixel in the bottom half.  Rows that both halves cover
+ * take the value the bottom half would have painted last.  Define
+ * WHIRL_PINCH_DEBUG to compare the mirrored coordinates with the ones
+ * computed directly.
+ */
 static void
-whirl_pinch (GimpDrawable *drawable)
+whirl_pinch_row (const Resampler *resampler,
+                 gint             x,
+                 gint             y,
+                 gint             width,
+                 const guchar    *src,
+                 guchar          *dest,
+                 gpointer         data)
 {
-  GimpPixelRgn      dest_rgn;
-  gint              progress, max_progress;
-  guchar           *top_row, *bot_row;
-  guchar           *top_p, *bot_p;
-  gint              row, col;
-  guchar          **pixel;
-  gdouble           whirl;
-  gdouble           cx, cy;
-  gint              ix, iy;
-  gint              i;
-  GimpPixelFetcher *pft, *pfb;
-  GimpRGB           background;
-
-  /* Initialize rows */
-  top_row = g_new (guchar, img_bpp * sel_width);
-  bot_row = g_new (guchar, img_bpp * sel_width);
-  pixel = g_new (guchar *, 4);
-  for (i = 0; i < 4; i++)
-    pixel[i] = g_new (guchar, 4);
-
-  /* Initialize pixel region */
-  gimp_pixel_rgn_init (&dest_rgn, drawable,
-                       sel_x1, sel_y1, sel_width, sel_height, TRUE, TRUE);
-
-  pft = gimp_pixel_fetcher_new (drawable, FALSE);
-  pfb = gimp_pixel_fetcher_new (drawable, FALSE);
-
-  gimp_context_get_background (&background);
-  gimp_pixel_fetcher_set_bg_color (pft, &background);
-  gimp_pixel_fetcher_set_bg_color (pfb, &background);
-
-  if (gimp_drawable_has_alpha (drawable->drawable_id))
-    {
-      gimp_pixel_fetcher_set_edge_mode (pft, GIMP_PIXEL_FETCHER_EDGE_BLACK);
-      gimp_pixel_fetcher_set_edge_mode (pfb, GIMP_PIXEL_FETCHER_EDGE_BLACK);
-    }
-  else
-    {
-      gimp_pixel_fetcher_set_edge_mode (pft, GIMP_PIXEL_FETCHER_EDGE_BACKGROUND);
-      gimp_pixel_fetcher_set_edge_mode (pfb, GIMP_PIXEL_FETCHER_EDGE_BACKGROUND);
-    }
+  const gdouble *whirl      = data;
+  gint           mirror_row = (sel_y2 - 1) - (y - sel_y1);
+  gint           mid        = (sel_y1 + sel_y2) / 2;
+  gboolean       bottom;
+  gint           col;
 
-  progress     = 0;
-  max_progress = sel_width * sel_height;
-
-  gimp_progress_init (_("Whirling and pinching"));
-
-  whirl   = wpvals.whirl * G_PI / 180;
-  radius2 = radius * radius * wpvals.radius;
+  bottom = (mirror_row <= mid && (y > mid || mirror_row >= y));
 
-  for (row = sel_y1; row <= ((sel_y1 + sel_y2) / 2); row++)
+  for (col = x; col < x + width; col++, dest += img_bpp)
     {
-      top_p = top_row;
-      bot_p = bot_row + img_bpp * (sel_width - 1);
+      gdouble cx, cy;
+      gint    src_col = col;
+      gint    src_row = y;
 
-      for (col = sel_x1; col < sel_x2; col++)
+      if (bottom)
         {
-          if (calc_undistorted_coords (col, row, whirl, wpvals.pinch, &cx, &cy))
-            {
-              /* We are inside the distortion area */
-
-              /* Top */
-
-              if (cx >= 0.0)
-                ix = (int) cx;
-              else
-                ix = -((int) -cx + 1);
-
-              if (cy >= 0.0)
-                iy = (int) cy;
-              else
-                iy = -((int) -cy + 1);
-
-              gimp_pixel_fetcher_get_pixel (pft, ix,     iy,     pixel[0]);
-              gimp_pixel_fetcher_get_pixel (pft, ix + 1, iy,     pixel[1]);
-              gimp_pixel_fetcher_get_pixel (pft, ix,     iy + 1, pixel[2]);
-              gimp_pixel_fetcher_get_pixel (pft, ix + 1, iy + 1, pixel[3]);
+          src_col = (sel_x2 - 1) - (col - sel_x1);
+          src_row = mirror_row;
+        }
 
-              gimp_bilinear_pixels_8 (top_p, cx, cy, img_bpp, img_has_alpha,
-                                      pixel);
-              top_p += img_bpp;
-              /* Bottom */
+      if (calc_undistorted_coords (src_col, src_row,
+                                   *whirl, wpvals.pinch, &cx, &cy))
+        {
+          /* We are inside the distortion area */
 
+          if (bottom)
+            {
               cx = cen_x + (cen_x - cx);
               cy = cen_y + (cen_y - cy);
 
-              if (cx >= 0.0)
-                ix = (int) cx;
-              else
-                ix = -((int) -cx + 1);
+#ifdef WHIRL_PINCH_DEBUG
+              {
+                gdouble dx, dy;
 
-              if (cy >= 0.0)
-                iy = (int) cy;
-              else
-                iy = -((int) -cy + 1);
+                calc_undistorted_coords (col, y,
+                                         *whirl, wpvals.pinch, &dx, &dy);
 
-              gimp_pixel_fetcher_get_pixel (pfb, ix,     iy,     pixel[0]);
-              gimp_pixel_fetcher_get_pixel (pfb, ix + 1, iy,     pixel[1]);
-              gimp_pixel_fetcher_get_pixel (pfb, ix,     iy + 1, pixel[2]);
-              gimp_pixel_fetcher_get_pixel (pfb, ix + 1, iy + 1, pixel[3]);
-
-              gimp_bilinear_pixels_8 (bot_p, cx, cy, img_bpp, img_has_alpha,
-                                      pixel);
-              bot_p -= img_bpp;
+                if (fabs (dx - cx) > 1e-6 || fabs (dy - cy) > 1e-6)
+                  g_printerr ("whirl-pinch: mirrored (%g, %g) != (%g, %g) "
+                              "at %d, %d\n", cx, cy, dx, dy, col, y);
+              }
+#endif
             }
-          else
-            {
-              /*  We are outside the distortion area;
-               *  just copy the source pixels
-               */
 
-              /* Top */
-
-              gimp_pixel_fetcher_get_pixel (pft, col, row, pixel[0]);
-
-              for (i = 0; i < img_bpp; i++)
-                *top_p++ = pixel[0][i];
+          resampler_get_bilinear (resampler, cx, cy, dest);
+        }
+      else
+        {
+          /*  We are outside the distortion area;
+           *  just copy the source pixels
+           */
 
-              /* Bottom */
+          resampler_get_pixel (resampler, col, y, dest);
+        }
+    }
+}
 
-              gimp_pixel_fetcher_get_pixel (pfb,
-                                       (sel_x2 - 1) - (col - sel_x1),
-                                       (sel_y2 - 1) - (row - sel_y1),
-                                       pixel[0]);
+static void
+whirl_pinch (GimpDrawable *drawable)
+{
+  Resampler *resampler;
+  GimpRGB    background;
+  gdouble    whirl;
 
-              for (i = 0; i < img_bpp; i++)
-                *bot_p++ = pixel[0][i];
+  resampler = resampler_new (drawable);
 
-              bot_p -= 2 * img_bpp; /* We move backwards! */
-            }
-        }
+  gimp_context_get_background (&background);
+  resampler_set_bg_color (resampler, &background);
 
-      /* Paint rows to image */
+  if (gimp_drawable_has_alpha (drawable->drawable_id))
+    resampler_set_edge_mode (resampler, GIMP_PIXEL_FETCHER_EDGE_BLACK);
+  else
+    resampler_set_edge_mode (resampler, GIMP_PIXEL_FETCHER_EDGE_BACKGROUND);
 
-      gimp_pixel_rgn_set_row (&dest_rgn, top_row, sel_x1, row, sel_width);
-      gimp_pixel_rgn_set_row (&dest_rgn, bot_row,
-                              sel_x1, (sel_y2 - 1) - (row - sel_y1), sel_width);
+  gimp_progress_init (_("Whirling and pinching"));
 
-      /* Update progress */
+  whirl   = wpvals.whirl * G_PI / 180;
+  radius2 = radius * radius * wpvals.radius;
 
-      progress += sel_width * 2;
-      gimp_progress_update ((double) progress / max_progress);
-    }
+  resampler_render (resampler, drawable, whirl_pinch_row, &whirl);
 
   gimp_progress_update (1.0);
-  gimp_pixel_fetcher_destroy (pft);
-  gimp_pixel_fetcher_destroy (pfb);
-
-  for (i = 0; i < 4; i++)
-    g_free (pixel[i]);
-  g_free (pixel);
-  g_free (top_row);
-  g_free (bot_row);
-
-  gimp_drawable_flush (drawable);
-  gimp_drawable_merge_shadow (drawable->drawable_id, TRUE);
-  gimp_drawable_update (drawable->drawable_id,
-                        sel_x1, sel_y1, sel_width, sel_height);
+
+  resampler_free (resampler);
 }
 
 static gint
@@ -34,9 +34,66 @@
 
 #include "libgimp/stdplugins-intl.h"
 
+#include "plug-ins/common/threads.h"
+
 
 #define COMP_MODE_SIZE sizeof(guint16)
 
+#define DECODE_BAND_ROWS 64                     /* Rows per unit of decode work */
+#define LAYER_BATCH_SIZE (64 * 1024 * 1024)     /* Decoded bytes read ahead */
+
+
+/* Channel data as read from the file, decoded later straight into place */
+typedef struct
+{
+  guint32       rows;                   /* Channel rows */
+  guint32       columns;                /* Channel columns */
+  guint16       bps;                    /* Bits per sample */
+  guint16       compression;            /* Raw or RLE */
+  guint32       readline_len;           /* Bytes per stored row */
+  gchar        *data;                   /* Raw rows or packed scanlines */
+  gsize        *row_start;              /* Packed scanline offsets, rows + 1 */
+  guchar       *dest;                   /* First decoded pixel */
+  gint          dest_step;              /* Distance between decoded pixels */
+} PSDchannelblock;
+
+/* Layer read from the file, waiting to be decoded and added to the image */
+typedef struct
+{
+  PSDlayer             *layer;                  /* Layer record */
+  PSDchannelblock      *chn_block;              /* One per layer channel */
+  guint16               num_channels;           /* Number of channels */
+  guint16               channel_idx[MAX_CHANNELS];
+  guint16               layer_channels;         /* Channels in pixels */
+  guint16               user_mask_chn;          /* Layer mask channel */
+  gboolean              alpha;                  /* Layer has alpha */
+  gboolean              user_mask;              /* Layer has a layer mask */
+  gboolean              empty;                  /* Layer has no pixels */
+  gboolean              empty_mask;             /* Layer mask has no pixels */
+  guchar               *pixels;                 /* Interleaved layer pixels */
+  guchar               *mask;                   /* Layer mask pixels */
+} PSDlayerblock;
+
+/* Channels decoded in bands of rows by a pool of threads */
+typedef struct
+{
+  PSDchannelblock     **channels;
+  gint                  n_channels;
+  gint                 *first_band;             /* n_channels + 1 entries */
+  gint                  next_band;
+  guint32               scratch_len;            /* Unpacked row buffer size */
+  gint                  n_threads;
+  GThread              *threads[THREADS_MAX];
+} PSDdecodejob;
+
+/* Layers read ahead of those being added to the image */
+typedef struct
+{
+  GArray               *layers;                 /* PSDlayerblock */
+  GPtrArray            *channels;               /* Channels to decode */
+  PSDdecodejob          job;
+} PSDlayerbatch;
+
 
 /*  Local function prototypes  */
 static gint             read_header_block          (PSDimage     *img_a,
@@ -81,6 +138,27 @@ static gint             add_merged_image           (const gint32  image_id,
                                                     FILE         *f,
                                                     GError      **error);
 
+static gint             read_layer                 (PSDimage       *img_a,
+                                                    PSDlayer       *lyr,
+                                                    PSDlayerblock  *lyr_blk,
+                                                    GPtrArray      *channels,
+                                                    gsize          *size,
+                                                    FILE           *f,
+                                                    GError        **error);
+
+static PSDlayerbatch  * read_layer_batch           (PSDimage       *img_a,
+                                                    PSDlayer      **lyr_a,
+                                                    gint           *lidx,
+                                                    FILE           *f,
+                                                    GError        **error);
+
+static void             free_layer_batch           (PSDlayerbatch  *batch);
+
+static void             add_layer                  (const gint32    image_id,
+                                                    PSDimage       *img_a,
+                                                    PSDlayerblock  *lyr_blk,
+                                                    GArray         *parent_group_stack);
+
 /*  Local utility function prototypes  */
 static gchar          * get_psd_color_mode_name    (PSDColorMode  mode);
 
@@ -89,21 +167,32 @@ static void             psd_to_gimp_color_map      (guchar       *map256);
 static GimpImageType    get_gimp_image_type        (const GimpImageBaseType image_base_type,
                                                     const gboolean          alpha);
 
-static gint             read_channel_data          (PSDchannel     *channel,
-                                                    const guint16   bps,
-                                                    const guint16   compression,
-                                                    const guint16  *rle_pack_len,
+static gint             read_rle_pack_len          (guint16        *rle_pack_len,
+                                                    const guint32   rows,
                                                     FILE           *f,
                                                     GError        **error);
 
-static void             convert_16_bit             (const gchar *src,
-                                                    gchar       *dst,
-                                                    guint32      len);
+static gint             read_channel_block         (PSDchannelblock *block,
+                                                    const guint32    rows,
+                                                    const guint32    columns,
+                                                    const guint16    bps,
+                                                    const guint16    compression,
+                                                    const guint16   *rle_pack_len,
+                                                    FILE            *f,
+                                                    GError         **error);
+
+static void             free_channel_block         (PSDchannelblock *block);
 
-static void             convert_1_bit              (const gchar *src,
-                                                    gchar       *dst,
-                                                    guint32      rows,
-                                                    guint32      columns);
+static void             decode_channel_rows        (PSDchannelblock *block,
+                                                    const guint32    first_row,
+                                                    const guint32    n_rows,
+                                                    gchar           *scratch);
+
+static void             decode_start               (PSDdecodejob     *job,
+                                                    PSDchannelblock **channels,
+                                                    gint              n_channels);
+
+static void             decode_finish              (PSDdecodejob     *job);
 
 
 /* Main file load function */
@@ -1012,39 +1101,12 @@ add_layers (const gint32  image_id,
             FILE         *f,
             GError      **error)
 {
-  PSDchannel          **lyr_chn;
+  PSDlayerbatch        *batch = NULL;
+  PSDlayerbatch        *next_batch;
   GArray               *parent_group_stack;
   gint32                parent_group_id = -1;
-  guchar               *pixels;
-  guint16               alpha_chn;
-  guint16               user_mask_chn;
-  guint16               layer_channels;
-  guint16               channel_idx[MAX_CHANNELS];
-  guint16              *rle_pack_len;
-  gint32                l_x;                   /* Layer x */
-  gint32                l_y;                   /* Layer y */
-  gint32                l_w;                   /* Layer width */
-  gint32                l_h;                   /* Layer height */
-  gint32                lm_x;                  /* Layer mask x */
-  gint32                lm_y;                  /* Layer mask y */
-  gint32                lm_w;                  /* Layer mask width */
-  gint32                lm_h;                  /* Layer mask height */
-  gint32                layer_size;
-  gint32                layer_id = -1;
-  gint32                mask_id = -1;
-  gint                  lidx;                  /* Layer index */
-  gint                  cidx;                  /* Channel index */
-  gint                  rowi;                  /* Row index */
-  gint                  coli;                  /* Column index */
+  gint                  lidx = 0;              /* Layer index */
   gint                  i;
-  gboolean              alpha;
-  gboolean              user_mask;
-  gboolean              empty;
-  gboolean              empty_mask;
-  GimpDrawable         *drawable;
-  GimpPixelRgn          pixel_rgn;
-  GimpImageType         image_type;
-  GimpLayerModeEffects  layer_mode;
 
 
   IFDBG(2) g_debug ("Number of layers: %d", img_a->num_layers);
@@ -1066,421 +1128,582 @@ add_layers (const gint32  image_id,
   parent_group_stack = g_array_new (FALSE, FALSE, sizeof(gint32));
   g_array_append_val (parent_group_stack, parent_group_id);
 
-  for (lidx = 0; lidx < img_a->num_layers; ++lidx)
+  /* Layers are read in batches.  While the layers of one batch are
+     added to the image, worker threads decode the channels of the next */
+  do
     {
-      IFDBG(2) g_debug ("Process Layer No %d.", lidx);
+      next_batch = NULL;
 
-      if (lyr_a[lidx]->drop)
+      if (lidx < img_a->num_layers)
         {
-          IFDBG(2) g_debug ("Drop layer %d", lidx);
+          next_batch = read_layer_batch (img_a, lyr_a, &lidx, f, error);
+          if (! next_batch)
+            {
+              if (batch)
+                free_layer_batch (batch);
+              g_array_free (parent_group_stack, FALSE);
+              return -1;
+            }
+
+          decode_start (&next_batch->job,
+                        (PSDchannelblock **) next_batch->channels->pdata,
+                        next_batch->channels->len);
+        }
+
+      if (batch)
+        {
+          for (i = 0; i < batch->layers->len; ++i)
+            add_layer (image_id, img_a,
+                       &g_array_index (batch->layers, PSDlayerblock, i),
+                       parent_group_stack);
+          free_layer_batch (batch);
+        }
+
+      if (next_batch)
+        {
+          decode_finish (&next_batch->job);
+
+          /* Only the decoded pixels are needed from here on */
+          for (i = 0; i < next_batch->channels->len; ++i)
+            free_channel_block (g_ptr_array_index (next_batch->channels, i));
+        }
+
+      batch = next_batch;
+    }
+  while (batch);
+
+  g_free (lyr_a);
+  g_array_free (parent_group_stack, FALSE);
+
+  return 0;
+}
+
+static PSDlayerbatch *
+read_layer_batch (PSDimage   *img_a,
+                  PSDlayer  **lyr_a,
+                  gint       *lidx,
+                  FILE       *f,
+                  GError    **error)
+{
+  PSDlayerbatch        *batch;
+  PSDlayerblock        *lyr_blk;
+  gsize                 batch_size = 0;
+  gint                  cidx;                  /* Channel index */
+
+  batch = g_new0 (PSDlayerbatch, 1);
+  batch->layers = g_array_new (FALSE, TRUE, sizeof (PSDlayerblock));
+  batch->channels = g_ptr_array_new ();
+
+  /* Read at least one layer, and more while they are small */
+  for (; *lidx < img_a->num_layers && batch_size < LAYER_BATCH_SIZE; ++(*lidx))
+    {
+      IFDBG(2) g_debug ("Process Layer No %d.", *lidx);
+
+      if (lyr_a[*lidx]->drop)
+        {
+          IFDBG(2) g_debug ("Drop layer %d", *lidx);
 
           /* Step past layer data */
-          for (cidx = 0; cidx < lyr_a[lidx]->num_channels; ++cidx)
+          for (cidx = 0; cidx < lyr_a[*lidx]->num_channels; ++cidx)
             {
-              if (fseek (f, lyr_a[lidx]->chn_info[cidx].data_len, SEEK_CUR) < 0)
+              if (fseek (f, lyr_a[*lidx]->chn_info[cidx].data_len, SEEK_CUR) < 0)
                 {
                   psd_set_error (feof (f), errno, error);
-                  return -1;
+                  free_layer_batch (batch);
+                  return NULL;
                 }
             }
-          g_free (lyr_a[lidx]->chn_info);
-          g_free (lyr_a[lidx]->name);
+          g_free (lyr_a[*lidx]->chn_info);
+          g_free (lyr_a[*lidx]->name);
+          g_free (lyr_a[*lidx]);
+          continue;
         }
-      else
+
+      g_array_set_size (batch->layers, batch->layers->len + 1);
+      lyr_blk = &g_array_index (batch->layers, PSDlayerblock,
+                                batch->layers->len - 1);
+
+      if (read_layer (img_a, lyr_a[*lidx], lyr_blk, batch->channels,
+                      &batch_size, f, error) < 0)
         {
-          if (lyr_a[lidx]->group_type != 0)
-            {
-              if (lyr_a[lidx]->group_type == 3)
-                {
-                  /* the </Layer group> marker layers are used to
-                     assemble the layer structure in a single pass */
-                  layer_id = gimp_layer_group_new (image_id);
-                }
-              else /* group-type == 1 || group_type == 2 */
-                {
-                  layer_id = g_array_index (parent_group_stack, gint32,
-                                            parent_group_stack->len-1);
-                  /* since the layers are stored in reverse, the group
-                     layer start marker actually means we're done with
-                     that layer group */
-                  g_array_remove_index (parent_group_stack,
-                                        parent_group_stack->len-1);
-                }
-            }
+          free_layer_batch (batch);
+          return NULL;
+        }
+    }
 
-          /* Empty layer */
-          if (lyr_a[lidx]->bottom - lyr_a[lidx]->top == 0
-              || lyr_a[lidx]->right - lyr_a[lidx]->left == 0)
-              empty = TRUE;
-          else
-              empty = FALSE;
+  return batch;
+}
 
-          /* Empty mask */
-          if (lyr_a[lidx]->layer_mask.bottom - lyr_a[lidx]->layer_mask.top == 0
-              || lyr_a[lidx]->layer_mask.right - lyr_a[lidx]->layer_mask.left == 0)
-              empty_mask = TRUE;
-          else
-              empty_mask = FALSE;
+static void
+free_layer_batch (PSDlayerbatch *batch)
+{
+  PSDlayerblock        *lyr_blk;
+  gint                  lidx;
+  gint                  cidx;
 
-          IFDBG(3) g_debug ("Empty mask %d, size %d %d", empty_mask,
-                            lyr_a[lidx]->layer_mask.bottom - lyr_a[lidx]->layer_mask.top,
-                            lyr_a[lidx]->layer_mask.right - lyr_a[lidx]->layer_mask.left);
+  for (lidx = 0; lidx < batch->layers->len; ++lidx)
+    {
+      lyr_blk = &g_array_index (batch->layers, PSDlayerblock, lidx);
 
-          /* Load layer channel data */
-          IFDBG(2) g_debug ("Number of channels: %d", lyr_a[lidx]->num_channels);
-          /* Create pointer array for the channel records */
-          lyr_chn = g_new (PSDchannel *, lyr_a[lidx]->num_channels);
-          for (cidx = 0; cidx < lyr_a[lidx]->num_channels; ++cidx)
-            {
-              guint16 comp_mode = PSD_COMP_RAW;
+      if (lyr_blk->chn_block)
+        {
+          for (cidx = 0; cidx < lyr_blk->num_channels; ++cidx)
+            free_channel_block (&lyr_blk->chn_block[cidx]);
+          g_free (lyr_blk->chn_block);
+        }
+      g_free (lyr_blk->pixels);
+      g_free (lyr_blk->mask);
+    }
 
-              /* Allocate channel record */
-              lyr_chn[cidx] = g_malloc (sizeof (PSDchannel) );
+  g_array_free (batch->layers, TRUE);
+  g_ptr_array_free (batch->channels, TRUE);
+  g_free (batch);
+}
 
-              lyr_chn[cidx]->id = lyr_a[lidx]->chn_info[cidx].channel_id;
-              lyr_chn[cidx]->rows = lyr_a[lidx]->bottom - lyr_a[lidx]->top;
-              lyr_chn[cidx]->columns = lyr_a[lidx]->right - lyr_a[lidx]->left;
+static gint
+read_layer (PSDimage       *img_a,
+            PSDlayer       *lyr,
+            PSDlayerblock  *lyr_blk,
+            GPtrArray      *channels,
+            gsize          *size,
+            FILE           *f,
+            GError        **error)
+{
+  PSDchannelblock      *block;
+  guint16               alpha_chn = 0;
+  guint16              *rle_pack_len;
+  guint32               rows;
+  guint32               columns;
+  gsize                 pixels_size;
+  gint                  cidx;                  /* Channel index */
 
-              if (lyr_chn[cidx]->id == PSD_CHANNEL_MASK)
-                {
-                  /* Works around a bug in panotools psd files where the layer mask
-                     size is given as 0 but data exists. Set mask size to layer size.
-                  */
-                  if (empty_mask && lyr_a[lidx]->chn_info[cidx].data_len - 2 > 0)
-                    {
-                      empty_mask = FALSE;
-                      if (lyr_a[lidx]->layer_mask.top == lyr_a[lidx]->layer_mask.bottom)
-                        {
-                          lyr_a[lidx]->layer_mask.top = lyr_a[lidx]->top;
-                          lyr_a[lidx]->layer_mask.bottom = lyr_a[lidx]->bottom;
-                        }
-                      if (lyr_a[lidx]->layer_mask.right == lyr_a[lidx]->layer_mask.left)
-                        {
-                          lyr_a[lidx]->layer_mask.right = lyr_a[lidx]->right;
-                          lyr_a[lidx]->layer_mask.left = lyr_a[lidx]->left;
-                        }
-                    }
-                  lyr_chn[cidx]->rows = (lyr_a[lidx]->layer_mask.bottom -
-                                        lyr_a[lidx]->layer_mask.top);
-                  lyr_chn[cidx]->columns = (lyr_a[lidx]->layer_mask.right -
-                                           lyr_a[lidx]->layer_mask.left);
-                }
+  lyr_blk->layer = lyr;
 
-              IFDBG(3) g_debug ("Channel id %d, %dx%d",
-                                lyr_chn[cidx]->id,
-                                lyr_chn[cidx]->columns,
-                                lyr_chn[cidx]->rows);
+  /* Empty layer */
+  if (lyr->bottom - lyr->top == 0
+      || lyr->right - lyr->left == 0)
+      lyr_blk->empty = TRUE;
+  else
+      lyr_blk->empty = FALSE;
 
-              /* Only read channel data if there is any channel
-               * data. Note that the channel data can contain a
-               * compression method but no actual data.
-               */
-              if (lyr_a[lidx]->chn_info[cidx].data_len >= COMP_MODE_SIZE)
-                {
-                  if (fread (&comp_mode, COMP_MODE_SIZE, 1, f) < 1)
-                    {
-                      psd_set_error (feof (f), errno, error);
-                      return -1;
-                    }
-                  comp_mode = GUINT16_FROM_BE (comp_mode);
-                  IFDBG(3) g_debug ("Compression mode: %d", comp_mode);
-                }
-              if (lyr_a[lidx]->chn_info[cidx].data_len > COMP_MODE_SIZE)
-                {
-                  switch (comp_mode)
-                    {
-                      case PSD_COMP_RAW:        /* Planar raw data */
-                        IFDBG(3) g_debug ("Raw data length: %d",
-                                          lyr_a[lidx]->chn_info[cidx].data_len - 2);
-                        if (read_channel_data (lyr_chn[cidx], img_a->bps,
-                            PSD_COMP_RAW, NULL, f, error) < 1)
-                          return -1;
-                        break;
-
-                      case PSD_COMP_RLE:        /* Packbits */
-                        IFDBG(3) g_debug ("RLE channel length %d, RLE length data: %d, "
-                                          "RLE data block: %d",
-                                          lyr_a[lidx]->chn_info[cidx].data_len - 2,
-                                          lyr_chn[cidx]->rows * 2,
-                                          (lyr_a[lidx]->chn_info[cidx].data_len - 2 -
-                                           lyr_chn[cidx]->rows * 2));
-                        rle_pack_len = g_malloc (lyr_chn[cidx]->rows * 2);
-                        for (rowi = 0; rowi < lyr_chn[cidx]->rows; ++rowi)
-                          {
-                            if (fread (&rle_pack_len[rowi], 2, 1, f) < 1)
-                              {
-                                psd_set_error (feof (f), errno, error);
-                                g_free (rle_pack_len);
-                                return -1;
-                              }
-                            rle_pack_len[rowi] = GUINT16_FROM_BE (rle_pack_len[rowi]);
-                          }
-
-                        IFDBG(3) g_debug ("RLE decode - data");
-                        if (read_channel_data (lyr_chn[cidx], img_a->bps,
-                            PSD_COMP_RLE, rle_pack_len, f, error) < 1)
-                          return -1;
-
-                        g_free (rle_pack_len);
-                        break;
-
-                      case PSD_COMP_ZIP:                 /* ? */
-                      case PSD_COMP_ZIP_PRED:
-                      default:
-                        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
-                                    _("Unsupported compression mode: %d"), comp_mode);
-                        return -1;
-                        break;
-                    }
-                }
-            }
-          g_free (lyr_a[lidx]->chn_info);
-
-          /* Draw layer */
-
-          alpha = FALSE;
-          alpha_chn = -1;
-          user_mask = FALSE;
-          user_mask_chn = -1;
-          layer_channels = 0;
-          l_x = 0;
-          l_y = 0;
-          l_w = img_a->columns;
-          l_h = img_a->rows;
-          parent_group_id = g_array_index (parent_group_stack, gint32,
-                                           parent_group_stack->len-1);
-
-          IFDBG(3) g_debug ("Re-hash channel indices");
-          for (cidx = 0; cidx < lyr_a[lidx]->num_channels; ++cidx)
+  /* Empty mask */
+  if (lyr->layer_mask.bottom - lyr->layer_mask.top == 0
+      || lyr->layer_mask.right - lyr->layer_mask.left == 0)
+      lyr_blk->empty_mask = TRUE;
+  else
+      lyr_blk->empty_mask = FALSE;
+
+  IFDBG(3) g_debug ("Empty mask %d, size %d %d", lyr_blk->empty_mask,
+                    lyr->layer_mask.bottom - lyr->layer_mask.top,
+                    lyr->layer_mask.right - lyr->layer_mask.left);
+
+  /* Load layer channel data */
+  IFDBG(2) g_debug ("Number of channels: %d", lyr->num_channels);
+  lyr_blk->chn_block = g_new0 (PSDchannelblock, lyr->num_channels);
+  lyr_blk->num_channels = lyr->num_channels;
+  for (cidx = 0; cidx < lyr->num_channels; ++cidx)
+    {
+      guint16 comp_mode = PSD_COMP_RAW;
+
+      block = &lyr_blk->chn_block[cidx];
+      rows = lyr->bottom - lyr->top;
+      columns = lyr->right - lyr->left;
+
+      if (lyr->chn_info[cidx].channel_id == PSD_CHANNEL_MASK)
+        {
+          /* Works around a bug in panotools psd files where the layer mask
+             size is given as 0 but data exists. Set mask size to layer size.
+          */
+          if (lyr_blk->empty_mask && lyr->chn_info[cidx].data_len - 2 > 0)
             {
-              if (lyr_chn[cidx]->id == PSD_CHANNEL_MASK)
-                {
-                  user_mask = TRUE;
-                  user_mask_chn = cidx;
-                }
-              else if (lyr_chn[cidx]->id == PSD_CHANNEL_ALPHA)
+              lyr_blk->empty_mask = FALSE;
+              if (lyr->layer_mask.top == lyr->layer_mask.bottom)
                 {
-                  alpha = TRUE;
-                  alpha_chn = cidx;
+                  lyr->layer_mask.top = lyr->top;
+                  lyr->layer_mask.bottom = lyr->bottom;
                 }
-              else
+              if (lyr->layer_mask.right == lyr->layer_mask.left)
                 {
-                  channel_idx[layer_channels] = cidx;   /* Assumes in sane order */
-                  layer_channels++;                     /* RGB, Lab, CMYK etc.   */
+                  lyr->layer_mask.right = lyr->right;
+                  lyr->layer_mask.left = lyr->left;
                 }
             }
-          if (alpha)
+          rows = lyr->layer_mask.bottom - lyr->layer_mask.top;
+          columns = lyr->layer_mask.right - lyr->layer_mask.left;
+        }
+
+      IFDBG(3) g_debug ("Channel id %d, %dx%d",
+                        lyr->chn_info[cidx].channel_id, columns, rows);
+
+      /* Only read channel data if there is any channel
+       * data. Note that the channel data can contain a
+       * compression method but no actual data.
+       */
+      if (lyr->chn_info[cidx].data_len >= COMP_MODE_SIZE)
+        {
+          if (fread (&comp_mode, COMP_MODE_SIZE, 1, f) < 1)
             {
-              channel_idx[layer_channels] = alpha_chn;
-              layer_channels++;
+              psd_set_error (feof (f), errno, error);
+              return -1;
             }
-
-          if (lyr_a[lidx]->group_type != 0)
+          comp_mode = GUINT16_FROM_BE (comp_mode);
+          IFDBG(3) g_debug ("Compression mode: %d", comp_mode);
+        }
+      if (lyr->chn_info[cidx].data_len > COMP_MODE_SIZE)
+        {
+          switch (comp_mode)
             {
-              if (lyr_a[lidx]->group_type == 3)
-                {
-                  IFDBG(2) g_debug ("Create placeholder group layer");
-                  g_free (lyr_a[lidx]->name);
-                  gimp_image_insert_layer (image_id, layer_id, parent_group_id, 0);
-                  /* add this group layer as the new parent */
-                  g_array_append_val (parent_group_stack, layer_id);
-                }
-              else
-                {
-                  IFDBG(2) g_debug ("End group layer id %d.", layer_id);
-                  drawable = gimp_drawable_get (layer_id);
-                  layer_mode = psd_to_gimp_blend_mode (lyr_a[lidx]->blend_mode);
-                  gimp_layer_set_mode (layer_id, layer_mode);
-                  gimp_layer_set_opacity (layer_id, 
-                                          lyr_a[lidx]->opacity * 100 / 255);
-                  gimp_item_set_name (drawable->drawable_id, lyr_a[lidx]->name);
-                  g_free (lyr_a[lidx]->name);
-                  gimp_item_set_visible (drawable->drawable_id,
-                                         lyr_a[lidx]->layer_flags.visible);
-                  if (lyr_a[lidx]->id)
-                    gimp_item_set_tattoo (drawable->drawable_id,
-                                          lyr_a[lidx]->id);
-                  gimp_drawable_flush (drawable);
-                  gimp_drawable_detach (drawable);
-                }
+              case PSD_COMP_RAW:        /* Planar raw data */
+                IFDBG(3) g_debug ("Raw data length: %d",
+                                  lyr->chn_info[cidx].data_len - 2);
+                if (read_channel_block (block, rows, columns, img_a->bps,
+                    PSD_COMP_RAW, NULL, f, error) < 1)
+                  return -1;
+                break;
+
+              case PSD_COMP_RLE:        /* Packbits */
+                IFDBG(3) g_debug ("RLE channel length %d, RLE length data: %d, "
+                                  "RLE data block: %d",
+                                  lyr->chn_info[cidx].data_len - 2,
+                                  rows * 2,
+                                  (lyr->chn_info[cidx].data_len - 2 -
+                                   rows * 2));
+                rle_pack_len = g_new (guint16, rows);
+                if (read_rle_pack_len (rle_pack_len, rows, f, error) < 0)
+                  {
+                    g_free (rle_pack_len);
+                    return -1;
+                  }
+
+                IFDBG(3) g_debug ("RLE decode - data");
+                if (read_channel_block (block, rows, columns, img_a->bps,
+                    PSD_COMP_RLE, rle_pack_len, f, error) < 1)
+                  {
+                    g_free (rle_pack_len);
+                    return -1;
+                  }
+
+                g_free (rle_pack_len);
+                break;
+
+              case PSD_COMP_ZIP:                 /* ? */
+              case PSD_COMP_ZIP_PRED:
+              default:
+                g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                            _("Unsupported compression mode: %d"), comp_mode);
+                return -1;
+                break;
             }
-          else if (empty)
+        }
+    }
+
+  IFDBG(3) g_debug ("Re-hash channel indices");
+  for (cidx = 0; cidx < lyr->num_channels; ++cidx)
+    {
+      if (lyr->chn_info[cidx].channel_id == PSD_CHANNEL_MASK)
+        {
+          lyr_blk->user_mask = TRUE;
+          lyr_blk->user_mask_chn = cidx;
+        }
+      else if (lyr->chn_info[cidx].channel_id == PSD_CHANNEL_ALPHA)
+        {
+          lyr_blk->alpha = TRUE;
+          alpha_chn = cidx;
+        }
+      else
+        {
+          lyr_blk->channel_idx[lyr_blk->layer_channels] = cidx;   /* Assumes in sane order */
+          lyr_blk->layer_channels++;                              /* RGB, Lab, CMYK etc.   */
+        }
+    }
+  if (lyr_blk->alpha)
+    {
+      lyr_blk->channel_idx[lyr_blk->layer_channels] = alpha_chn;
+      lyr_blk->layer_channels++;
+    }
+  g_free (lyr->chn_info);
+
+  /* Channels decode straight into the buffers handed to GIMP, the
+     colour channels interleaved into the layer pixels */
+  if (lyr->group_type == 0 && ! lyr_blk->empty)
+    {
+      pixels_size = ((gsize) (lyr->right - lyr->left) *
+                     (lyr->bottom - lyr->top) * lyr_blk->layer_channels);
+      lyr_blk->pixels = g_malloc0 (pixels_size);
+      *size += pixels_size;
+
+      for (cidx = 0; cidx < lyr_blk->layer_channels; ++cidx)
+        {
+          block = &lyr_blk->chn_block[lyr_blk->channel_idx[cidx]];
+          block->dest = lyr_blk->pixels + cidx;
+          block->dest_step = lyr_blk->layer_channels;
+        }
+    }
+
+  if (lyr->group_type == 0 && lyr_blk->user_mask && ! lyr_blk->empty_mask)
+    {
+      pixels_size = ((gsize) (lyr->layer_mask.right - lyr->layer_mask.left) *
+                     (lyr->layer_mask.bottom - lyr->layer_mask.top));
+      lyr_blk->mask = g_malloc0 (pixels_size);
+      *size += pixels_size;
+
+      block = &lyr_blk->chn_block[lyr_blk->user_mask_chn];
+      block->dest = lyr_blk->mask;
+      block->dest_step = 1;
+    }
+
+  /* Queue the channels that are drawn, drop the others */
+  for (cidx = 0; cidx < lyr->num_channels; ++cidx)
+    {
+      block = &lyr_blk->chn_block[cidx];
+
+      if (block->data && block->dest)
+        g_ptr_array_add (channels, block);
+      else
+        free_channel_block (block);
+    }
+
+  return 0;
+}
+
+static void
+add_layer (const gint32    image_id,
+           PSDimage       *img_a,
+           PSDlayerblock  *lyr_blk,
+           GArray         *parent_group_stack)
+{
+  PSDlayer             *lyr = lyr_blk->layer;
+  gint32                parent_group_id;
+  guchar               *pixels;
+  gint32                l_x;                   /* Layer x */
+  gint32                l_y;                   /* Layer y */
+  gint32                l_w;                   /* Layer width */
+  gint32                l_h;                   /* Layer height */
+  gint32                lm_x;                  /* Layer mask x */
+  gint32                lm_y;                  /* Layer mask y */
+  gint32                lm_w;                  /* Layer mask width */
+  gint32                lm_h;                  /* Layer mask height */
+  gint32                layer_id = -1;
+  gint32                mask_id = -1;
+  gint                  rowi;                  /* Row index */
+  gint                  coli;                  /* Column index */
+  gint                  i;
+  GimpDrawable         *drawable;
+  GimpPixelRgn          pixel_rgn;
+  GimpImageType         image_type;
+  GimpLayerModeEffects  layer_mode;
+
+  if (lyr->group_type != 0)
+    {
+      if (lyr->group_type == 3)
+        {
+          /* the </Layer group> marker layers are used to
+             assemble the layer structure in a single pass */
+          layer_id = gimp_layer_group_new (image_id);
+        }
+      else /* group-type == 1 || group_type == 2 */
+        {
+          layer_id = g_array_index (parent_group_stack, gint32,
+                                    parent_group_stack->len-1);
+          /* since the layers are stored in reverse, the group
+             layer start marker actually means we're done with
+             that layer group */
+          g_array_remove_index (parent_group_stack,
+                                parent_group_stack->len-1);
+        }
+    }
+
+  /* Draw layer */
+
+  l_x = 0;
+  l_y = 0;
+  l_w = img_a->columns;
+  l_h = img_a->rows;
+  parent_group_id = g_array_index (parent_group_stack, gint32,
+                                   parent_group_stack->len-1);
+
+  if (lyr->group_type != 0)
+    {
+      if (lyr->group_type == 3)
+        {
+          IFDBG(2) g_debug ("Create placeholder group layer");
+          g_free (lyr->name);
+          gimp_image_insert_layer (image_id, layer_id, parent_group_id, 0);
+          /* add this group layer as the new parent */
+          g_array_append_val (parent_group_stack, layer_id);
+        }
+      else
+        {
+          IFDBG(2) g_debug ("End group layer id %d.", layer_id);
+          drawable = gimp_drawable_get (layer_id);
+          layer_mode = psd_to_gimp_blend_mode (lyr->blend_mode);
+          gimp_layer_set_mode (layer_id, layer_mode);
+          gimp_layer_set_opacity (layer_id,
+                                  lyr->opacity * 100 / 255);
+          gimp_item_set_name (drawable->drawable_id, lyr->name);
+          g_free (lyr->name);
+          gimp_item_set_visible (drawable->drawable_id,
+                                 lyr->layer_flags.visible);
+          if (lyr->id)
+            gimp_item_set_tattoo (drawable->drawable_id,
+                                  lyr->id);
+          gimp_drawable_flush (drawable);
+          gimp_drawable_detach (drawable);
+        }
+    }
+  else if (lyr_blk->empty)
+    {
+      IFDBG(2) g_debug ("Create blank layer");
+      image_type = get_gimp_image_type (img_a->base_type, TRUE);
+      layer_id = gimp_layer_new (image_id, lyr->name,
+                                 img_a->columns, img_a->rows,
+                                 image_type, 0, GIMP_NORMAL_MODE);
+      g_free (lyr->name);
+      gimp_image_insert_layer (image_id, layer_id, parent_group_id, -1);
+      drawable = gimp_drawable_get (layer_id);
+      gimp_drawable_fill (drawable->drawable_id, GIMP_TRANSPARENT_FILL);
+      gimp_item_set_visible (drawable->drawable_id, lyr->layer_flags.visible);
+      if (lyr->id)
+        gimp_item_set_tattoo (drawable->drawable_id, lyr->id);
+      if (lyr->layer_flags.irrelevant)
+        gimp_item_set_visible (drawable->drawable_id, FALSE);
+      gimp_drawable_flush (drawable);
+      gimp_drawable_detach (drawable);
+    }
+  else
+    {
+      l_x = lyr->left;
+      l_y = lyr->top;
+      l_w = lyr->right - lyr->left;
+      l_h = lyr->bottom - lyr->top;
+
+      IFDBG(3) g_debug ("Draw layer");
+      image_type = get_gimp_image_type (img_a->base_type, lyr_blk->alpha);
+      IFDBG(3) g_debug ("Layer type %d", image_type);
+
+      layer_mode = psd_to_gimp_blend_mode (lyr->blend_mode);
+      layer_id = gimp_layer_new (image_id, lyr->name, l_w, l_h,
+                                 image_type, lyr->opacity * 100 / 255,
+                                 layer_mode);
+      IFDBG(3) g_debug ("Layer tattoo: %d", layer_id);
+      g_free (lyr->name);
+      gimp_image_insert_layer (image_id, layer_id, parent_group_id, -1);
+      gimp_layer_set_offsets (layer_id, l_x, l_y);
+      gimp_layer_set_lock_alpha  (layer_id, lyr->layer_flags.trans_prot);
+      drawable = gimp_drawable_get (layer_id);
+      gimp_pixel_rgn_init (&pixel_rgn, drawable, 0, 0,
+                           drawable->width, drawable->height, TRUE, FALSE);
+      gimp_pixel_rgn_set_rect (&pixel_rgn, lyr_blk->pixels,
+                               0, 0, drawable->width, drawable->height);
+      gimp_item_set_visible (drawable->drawable_id, lyr->layer_flags.visible);
+      if (lyr->id)
+        gimp_item_set_tattoo (drawable->drawable_id, lyr->id);
+      gimp_drawable_flush (drawable);
+      gimp_drawable_detach (drawable);
+    }
+
+  /* Layer mask */
+  if (lyr_blk->user_mask && lyr->group_type == 0)
+    {
+      if (lyr_blk->empty_mask)
+        {
+          IFDBG(3) g_debug ("Create empty mask");
+          if (lyr->layer_mask.def_color == 255)
+            mask_id = gimp_layer_create_mask (layer_id, GIMP_ADD_WHITE_MASK);
+          else
+            mask_id = gimp_layer_create_mask (layer_id, GIMP_ADD_BLACK_MASK);
+          gimp_layer_add_mask (layer_id, mask_id);
+          gimp_layer_set_apply_mask (layer_id,
+            ! lyr->layer_mask.mask_flags.disabled);
+        }
+      else
+        {
+          /* Load layer mask data */
+          if (lyr->layer_mask.mask_flags.relative_pos)
             {
-              IFDBG(2) g_debug ("Create blank layer");
-              image_type = get_gimp_image_type (img_a->base_type, TRUE);
-              layer_id = gimp_layer_new (image_id, lyr_a[lidx]->name,
-                                         img_a->columns, img_a->rows,
-                                         image_type, 0, GIMP_NORMAL_MODE);
-              g_free (lyr_a[lidx]->name);
-              gimp_image_insert_layer (image_id, layer_id, parent_group_id, -1);
-              drawable = gimp_drawable_get (layer_id);
-              gimp_drawable_fill (drawable->drawable_id, GIMP_TRANSPARENT_FILL);
-              gimp_item_set_visible (drawable->drawable_id, lyr_a[lidx]->layer_flags.visible);
-              if (lyr_a[lidx]->id)
-                gimp_item_set_tattoo (drawable->drawable_id, lyr_a[lidx]->id);
-              if (lyr_a[lidx]->layer_flags.irrelevant)
-                gimp_item_set_visible (drawable->drawable_id, FALSE);
-              gimp_drawable_flush (drawable);
-              gimp_drawable_detach (drawable);
+              lm_x = lyr->layer_mask.left;
+              lm_y = lyr->layer_mask.top;
+              lm_w = lyr->layer_mask.right - lyr->layer_mask.left;
+              lm_h = lyr->layer_mask.bottom - lyr->layer_mask.top;
             }
           else
             {
-              l_x = lyr_a[lidx]->left;
-              l_y = lyr_a[lidx]->top;
-              l_w = lyr_a[lidx]->right - lyr_a[lidx]->left;
-              l_h = lyr_a[lidx]->bottom - lyr_a[lidx]->top;
-
-              IFDBG(3) g_debug ("Draw layer");
-              image_type = get_gimp_image_type (img_a->base_type, alpha);
-              IFDBG(3) g_debug ("Layer type %d", image_type);
-              layer_size = l_w * l_h;
-              pixels = g_malloc (layer_size * layer_channels);
-              for (cidx = 0; cidx < layer_channels; ++cidx)
-                {
-                  IFDBG(3) g_debug ("Start channel %d", channel_idx[cidx]);
-                  for (i = 0; i < layer_size; ++i)
-                    pixels[(i * layer_channels) + cidx] = lyr_chn[channel_idx[cidx]]->data[i];
-                  g_free (lyr_chn[channel_idx[cidx]]->data);
-                }
-
-              layer_mode = psd_to_gimp_blend_mode (lyr_a[lidx]->blend_mode);
-              layer_id = gimp_layer_new (image_id, lyr_a[lidx]->name, l_w, l_h,
-                                         image_type, lyr_a[lidx]->opacity * 100 / 255,
-                                         layer_mode);
-              IFDBG(3) g_debug ("Layer tattoo: %d", layer_id);
-              g_free (lyr_a[lidx]->name);
-              gimp_image_insert_layer (image_id, layer_id, parent_group_id, -1);
-              gimp_layer_set_offsets (layer_id, l_x, l_y);
-              gimp_layer_set_lock_alpha  (layer_id, lyr_a[lidx]->layer_flags.trans_prot);
-              drawable = gimp_drawable_get (layer_id);
-              gimp_pixel_rgn_init (&pixel_rgn, drawable, 0, 0,
-                                   drawable->width, drawable->height, TRUE, FALSE);
-              gimp_pixel_rgn_set_rect (&pixel_rgn, pixels,
-                                       0, 0, drawable->width, drawable->height);
-              gimp_item_set_visible (drawable->drawable_id, lyr_a[lidx]->layer_flags.visible);
-              if (lyr_a[lidx]->id)
-                gimp_item_set_tattoo (drawable->drawable_id, lyr_a[lidx]->id);
-              gimp_drawable_flush (drawable);
-              gimp_drawable_detach (drawable);
-              g_free (pixels);
+              lm_x = lyr->layer_mask.left - l_x;
+              lm_y = lyr->layer_mask.top - l_y;
+              lm_w = lyr->layer_mask.right - lyr->layer_mask.left;
+              lm_h = lyr->layer_mask.bottom - lyr->layer_mask.top;
             }
-
-          /* Layer mask */
-          if (user_mask && lyr_a[lidx]->group_type == 0)
+          IFDBG(3) g_debug ("Mask channel index %d", lyr_blk->user_mask_chn);
+          IFDBG(3) g_debug ("Relative pos %d",
+                            lyr->layer_mask.mask_flags.relative_pos);
+          pixels = lyr_blk->mask;
+          /* Crop mask at layer boundry */
+          IFDBG(3) g_debug ("Original Mask %d %d %d %d", lm_x, lm_y, lm_w, lm_h);
+          if (lm_x < 0
+              || lm_y < 0
+              || lm_w + lm_x > l_w
+              || lm_h + lm_y > l_h)
             {
-              if (empty_mask)
+              if (CONVERSION_WARNINGS)
+                g_message ("Warning\n"
+                           "The layer mask is partly outside the "
+                           "layer boundary. The mask will be "
+                           "cropped which may result in data loss.");
+              /* The cropped mask is packed in place, it never gets
+                 ahead of the rows it is read from */
+              i = 0;
+              for (rowi = 0; rowi < lm_h; ++rowi)
                 {
-                  IFDBG(3) g_debug ("Create empty mask");
-                  if (lyr_a[lidx]->layer_mask.def_color == 255)
-                    mask_id = gimp_layer_create_mask (layer_id, GIMP_ADD_WHITE_MASK);
-                  else
-                    mask_id = gimp_layer_create_mask (layer_id, GIMP_ADD_BLACK_MASK);
-                  gimp_layer_add_mask (layer_id, mask_id);
-                  gimp_layer_set_apply_mask (layer_id,
-                    ! lyr_a[lidx]->layer_mask.mask_flags.disabled);
-                }
-              else
-                {
-                  /* Load layer mask data */
-                  if (lyr_a[lidx]->layer_mask.mask_flags.relative_pos)
-                    {
-                      lm_x = lyr_a[lidx]->layer_mask.left;
-                      lm_y = lyr_a[lidx]->layer_mask.top;
-                      lm_w = lyr_a[lidx]->layer_mask.right - lyr_a[lidx]->layer_mask.left;
-                      lm_h = lyr_a[lidx]->layer_mask.bottom - lyr_a[lidx]->layer_mask.top;
-                    }
-                  else
+                  if (rowi + lm_y >= 0 && rowi + lm_y < l_h)
                     {
-                      lm_x = lyr_a[lidx]->layer_mask.left - l_x;
-                      lm_y = lyr_a[lidx]->layer_mask.top - l_y;
-                      lm_w = lyr_a[lidx]->layer_mask.right - lyr_a[lidx]->layer_mask.left;
-                      lm_h = lyr_a[lidx]->layer_mask.bottom - lyr_a[lidx]->layer_mask.top;
-                    }
-                  IFDBG(3) g_debug ("Mask channel index %d", user_mask_chn);
-                  IFDBG(3) g_debug ("Relative pos %d",
-                                    lyr_a[lidx]->layer_mask.mask_flags.relative_pos);
-                  layer_size = lm_w * lm_h;
-                  pixels = g_malloc (layer_size);
-                  IFDBG(3) g_debug ("Allocate Pixels %d", layer_size);
-                  /* Crop mask at layer boundry */
-                  IFDBG(3) g_debug ("Original Mask %d %d %d %d", lm_x, lm_y, lm_w, lm_h);
-                  if (lm_x < 0
-                      || lm_y < 0
-                      || lm_w + lm_x > l_w
-                      || lm_h + lm_y > l_h)
-                    {
-                      if (CONVERSION_WARNINGS)
-                        g_message ("Warning\n"
-                                   "The layer mask is partly outside the "
-                                   "layer boundary. The mask will be "
-                                   "cropped which may result in data loss.");
-                      i = 0;
-                      for (rowi = 0; rowi < lm_h; ++rowi)
+                      for (coli = 0; coli < lm_w; ++coli)
                         {
-                          if (rowi + lm_y >= 0 && rowi + lm_y < l_h)
+                          if (coli + lm_x >= 0 && coli + lm_x < l_w)
                             {
-                              for (coli = 0; coli < lm_w; ++coli)
-                                {
-                                  if (coli + lm_x >= 0 && coli + lm_x < l_w)
-                                    {
-                                      pixels[i] =
-                                        lyr_chn[user_mask_chn]->data[(rowi * lm_w) + coli];
-                                      i++;
-                                    }
-                                }
+                              pixels[i] = pixels[(rowi * lm_w) + coli];
+                              i++;
                             }
                         }
-                      if (lm_x < 0)
-                        {
-                          lm_w += lm_x;
-                          lm_x = 0;
-                        }
-                      if (lm_y < 0)
-                        {
-                          lm_h += lm_y;
-                          lm_y = 0;
-                        }
-                      if (lm_w + lm_x > l_w)
-                        lm_w = l_w - lm_x;
-                      if (lm_h + lm_y > l_h)
-                        lm_h = l_h - lm_y;
                     }
-                  else
-                    memcpy (pixels, lyr_chn[user_mask_chn]->data, layer_size);
-                  g_free (lyr_chn[user_mask_chn]->data);
-                  /* Draw layer mask data */
-                  IFDBG(3) g_debug ("Layer %d %d %d %d", l_x, l_y, l_w, l_h);
-                  IFDBG(3) g_debug ("Mask %d %d %d %d", lm_x, lm_y, lm_w, lm_h);
-
-                  if (lyr_a[lidx]->layer_mask.def_color == 255)
-                    mask_id = gimp_layer_create_mask (layer_id, GIMP_ADD_WHITE_MASK);
-                  else
-                    mask_id = gimp_layer_create_mask (layer_id, GIMP_ADD_BLACK_MASK);
-
-                  IFDBG(3) g_debug ("New layer mask %d", mask_id);
-                  gimp_layer_add_mask (layer_id, mask_id);
-                  drawable = gimp_drawable_get (mask_id);
-                  gimp_pixel_rgn_init (&pixel_rgn, drawable, 0 , 0,
-                                       drawable->width, drawable->height, TRUE, FALSE);
-                  gimp_pixel_rgn_set_rect (&pixel_rgn, pixels, lm_x, lm_y, lm_w, lm_h);
-                  gimp_drawable_flush (drawable);
-                  gimp_drawable_detach (drawable);
-                  gimp_layer_set_apply_mask (layer_id,
-                    ! lyr_a[lidx]->layer_mask.mask_flags.disabled);
-                  g_free (pixels);
                 }
+              if (lm_x < 0)
+                {
+                  lm_w += lm_x;
+                  lm_x = 0;
+                }
+              if (lm_y < 0)
+                {
+                  lm_h += lm_y;
+                  lm_y = 0;
+                }
+              if (lm_w + lm_x > l_w)
+                lm_w = l_w - lm_x;
+              if (lm_h + lm_y > l_h)
+                lm_h = l_h - lm_y;
             }
-          for (cidx = 0; cidx < lyr_a[lidx]->num_channels; ++cidx)
-            if (lyr_chn[cidx])
-              g_free (lyr_chn[cidx]);
-          g_free (lyr_chn);
+          /* Draw layer mask data */
+          IFDBG(3) g_debug ("Layer %d %d %d %d", l_x, l_y, l_w, l_h);
+          IFDBG(3) g_debug ("Mask %d %d %d %d", lm_x, lm_y, lm_w, lm_h);
+
+          if (lyr->layer_mask.def_color == 255)
+            mask_id = gimp_layer_create_mask (layer_id, GIMP_ADD_WHITE_MASK);
+          else
+            mask_id = gimp_layer_create_mask (layer_id, GIMP_ADD_BLACK_MASK);
+
+          IFDBG(3) g_debug ("New layer mask %d", mask_id);
+          gimp_layer_add_mask (layer_id, mask_id);
+          drawable = gimp_drawable_get (mask_id);
+          gimp_pixel_rgn_init (&pixel_rgn, drawable, 0 , 0,
+                               drawable->width, drawable->height, TRUE, FALSE);
+          gimp_pixel_rgn_set_rect (&pixel_rgn, pixels, lm_x, lm_y, lm_w, lm_h);
+          gimp_drawable_flush (drawable);
+          gimp_drawable_detach (drawable);
+          gimp_layer_set_apply_mask (layer_id,
+            ! lyr->layer_mask.mask_flags.disabled);
         }
-      g_free (lyr_a[lidx]);
     }
-  g_free (lyr_a);
-  g_array_free (parent_group_stack, FALSE);
 
-  return 0;
+  g_free (lyr);
 }
 
 static gint
@@ -1490,6 +1713,9 @@ add_merged_image (const gint32  image_id,
                   GError      **error)
 {
   PSDchannel            chn_a[MAX_CHANNELS];
+  PSDchannelblock       chn_block[MAX_CHANNELS];
+  PSDchannelblock      *decode_chn[MAX_CHANNELS];
+  PSDdecodejob          job;
   gchar                *alpha_name;
   guchar               *pixels;
   guint16               comp_mode;
@@ -1505,7 +1731,6 @@ add_merged_image (const gint32  image_id,
   gint16                alpha_opacity;
   gint                 *lyr_lst;
   gint                  cidx;                  /* Channel index */
-  gint                  rowi;                  /* Row index */
   gint                  lyr_count;
   gint                  offset;
   gint                  i;
@@ -1568,8 +1793,9 @@ add_merged_image (const gint32  image_id,
               {
                 chn_a[cidx].columns = img_a->columns;
                 chn_a[cidx].rows = img_a->rows;
-                if (read_channel_data (&chn_a[cidx], img_a->bps,
-                    PSD_COMP_RAW, NULL, f, error) < 1)
+                if (read_channel_block (&chn_block[cidx], img_a->rows,
+                    img_a->columns, img_a->bps, PSD_COMP_RAW, NULL, f,
+                    error) < 1)
                   return -1;
               }
             break;
@@ -1584,23 +1810,18 @@ add_merged_image (const gint32  image_id,
               {
                 chn_a[cidx].columns = img_a->columns;
                 chn_a[cidx].rows = img_a->rows;
-                rle_pack_len[cidx] = g_malloc (img_a->rows * 2);
-                for (rowi = 0; rowi < img_a->rows; ++rowi)
-                  {
-                    if (fread (&rle_pack_len[cidx][rowi], 2, 1, f) < 1)
-                      {
-                        psd_set_error (feof (f), errno, error);
-                        return -1;
-                      }
-                    rle_pack_len[cidx][rowi] = GUINT16_FROM_BE (rle_pack_len[cidx][rowi]);
-                  }
+                rle_pack_len[cidx] = g_new (guint16, img_a->rows);
+                if (read_rle_pack_len (rle_pack_len[cidx], img_a->rows,
+                                       f, error) < 0)
+                  return -1;
               }
 
             IFDBG(3) g_debug ("RLE decode - data");
             for (cidx = 0; cidx < total_channels; ++cidx)
               {
-                if (read_channel_data (&chn_a[cidx], img_a->bps,
-                    PSD_COMP_RLE, rle_pack_len[cidx], f, error) < 1)
+                if (read_channel_block (&chn_block[cidx], img_a->rows,
+                    img_a->columns, img_a->bps, PSD_COMP_RLE,
+                    rle_pack_len[cidx], f, error) < 1)
                   return -1;
                 g_free (rle_pack_len[cidx]);
               }
@@ -1614,6 +1835,31 @@ add_merged_image (const gint32  image_id,
             return -1;
             break;
         }
+
+      /* Decode all channels together, skipping the merged image
+         of a layered image */
+      for (cidx = 0; cidx < total_channels; ++cidx)
+        {
+          if (img_a->num_layers == 0 || cidx >= base_channels)
+            {
+              chn_a[cidx].data = g_malloc (img_a->columns * img_a->rows);
+              chn_block[cidx].dest = (guchar *) chn_a[cidx].data;
+            }
+          else
+            {
+              chn_a[cidx].data = NULL;
+            }
+        }
+
+      for (cidx = 0, i = 0; cidx < total_channels; ++cidx)
+        if (chn_a[cidx].data)
+          decode_chn[i++] = &chn_block[cidx];
+
+      decode_start (&job, decode_chn, i);
+      decode_finish (&job);
+
+      for (cidx = 0; cidx < total_channels; ++cidx)
+        free_channel_block (&chn_block[cidx]);
     }
 
   /* ----- Draw merged image ----- */
@@ -1852,149 +2098,249 @@ get_gimp_image_type (const GimpImageBaseType image_base_type,
 }
 
 static gint
-read_channel_data (PSDchannel     *channel,
-                   const guint16   bps,
-                   const guint16   compression,
-                   const guint16  *rle_pack_len,
+read_rle_pack_len (guint16        *rle_pack_len,
+                   const guint32   rows,
                    FILE           *f,
                    GError        **error)
 {
-  gchar    *raw_data;
-  gchar    *src;
-  gchar    *dst;
-  guint32   readline_len;
-  gint      i;
+  guint32   i;
+
+  if (fread (rle_pack_len, 2, rows, f) < rows)
+    {
+      psd_set_error (feof (f), errno, error);
+      return -1;
+    }
+
+  for (i = 0; i < rows; ++i)
+    rle_pack_len[i] = GUINT16_FROM_BE (rle_pack_len[i]);
+
+  return 0;
+}
+
+static gint
+read_channel_block (PSDchannelblock *block,
+                    const guint32    rows,
+                    const guint32    columns,
+                    const guint16    bps,
+                    const guint16    compression,
+                    const guint16   *rle_pack_len,
+                    FILE            *f,
+                    GError         **error)
+{
+  gsize     data_len = 0;
+  guint32   i;
+
+  block->rows = rows;
+  block->columns = columns;
+  block->bps = bps;
+  block->compression = compression;
+  block->data = NULL;
+  block->row_start = NULL;
+  block->dest = NULL;
+  block->dest_step = 1;
 
   if (bps == 1)
-    readline_len = ((channel->columns + 7) >> 3);
+    block->readline_len = ((columns + 7) >> 3);
   else
-    readline_len = (channel->columns * bps >> 3);
+    block->readline_len = (columns * bps >> 3);
 
-  IFDBG(3) g_debug ("raw data size %d x %d = %d", readline_len,
-                    channel->rows, readline_len * channel->rows);
+  IFDBG(3) g_debug ("raw data size %d x %d = %d", block->readline_len,
+                    rows, block->readline_len * rows);
 
   /* sanity check, int overflow check (avoid divisions by zero) */
-  if ((channel->rows == 0) || (channel->columns == 0) ||
-      (channel->rows > G_MAXINT32 / channel->columns / MAX (bps >> 3, 1)))
+  if ((rows == 0) || (columns == 0) ||
+      (rows > G_MAXINT32 / columns / MAX (bps >> 3, 1)))
     {
       g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
                    _("Unsupported or invalid channel size"));
       return -1;
     }
 
-  raw_data = g_malloc (readline_len * channel->rows);
   switch (compression)
     {
       case PSD_COMP_RAW:
-        if (fread (raw_data, readline_len, channel->rows, f) < 1)
-          {
-            psd_set_error (feof (f), errno, error);
-            return -1;
-          }
+        data_len = (gsize) block->readline_len * rows;
         break;
 
       case PSD_COMP_RLE:
-        for (i = 0; i < channel->rows; ++i)
-          {
-            src = g_malloc (rle_pack_len[i]);
-            dst = g_malloc (readline_len);
-/*      FIXME check for over-run
-            if (ftell (f) + rle_pack_len[i] > block_end)
-              {
-                psd_set_error (TRUE, errno, error);
-                return -1;
-              }
-*/
-            if (fread (src, rle_pack_len[i], 1, f) < 1)
-              {
-                psd_set_error (feof (f), errno, error);
-                g_free (src);
-                g_free (dst);
-                return -1;
-              }
-            /* FIXME check for errors returned from decode packbits */
-            decode_packbits (src, dst, rle_pack_len[i], readline_len);
-            g_free (src);
-            memcpy (raw_data + i * readline_len, dst, readline_len);
-            g_free (dst);
-          }
+        /* The packed scanlines are read in one go, their offsets
+           let them be unpacked in any order */
+        block->row_start = g_new (gsize, rows + 1);
+        block->row_start[0] = 0;
+        for (i = 0; i < rows; ++i)
+          block->row_start[i + 1] = block->row_start[i] + rle_pack_len[i];
+        data_len = block->row_start[rows];
         break;
     }
 
-  /* Convert channel data to GIMP format */
-  switch (bps)
+  block->data = g_try_malloc (data_len);
+  if (data_len > 0 && ! block->data)
     {
-      case 16:
-        channel->data = (gchar *) g_malloc (channel->rows * channel->columns);
-        convert_16_bit (raw_data, channel->data, (channel->rows * channel->columns) << 1);
-        break;
-
-      case 8:
-        channel->data = (gchar *) g_malloc (channel->rows * channel->columns);
-        memcpy (channel->data, raw_data, (channel->rows * channel->columns));
-        break;
-
-      case 1:
-        channel->data = (gchar *) g_malloc (channel->rows * channel->columns);
-        convert_1_bit (raw_data, channel->data, channel->rows, channel->columns);
-        break;
+      psd_set_error (FALSE, ENOMEM, error);
+      free_channel_block (block);
+      return -1;
     }
 
-  g_free (raw_data);
+  /* FIXME check for over-run of the layer block */
+  if (data_len > 0 && fread (block->data, data_len, 1, f) < 1)
+    {
+      psd_set_error (feof (f), errno, error);
+      free_channel_block (block);
+      return -1;
+    }
 
   return 1;
 }
 
 static void
-convert_16_bit (const gchar *src,
-                gchar       *dst,
-                guint32     len)
+free_channel_block (PSDchannelblock *block)
 {
-/* Convert 16 bit to 8 bit dropping low byte
-*/
-  gint      i;
+  g_free (block->data);
+  g_free (block->row_start);
+  block->data = NULL;
+  block->row_start = NULL;
+}
 
-  IFDBG(3)  g_debug ("Start 16 bit conversion");
+static void
+decode_channel_rows (PSDchannelblock *block,
+                     const guint32    first_row,
+                     const guint32    n_rows,
+                     gchar           *scratch)
+{
+  const guchar *src;
+  guchar       *dst;
+  gint          step = block->dest_step;
+  guint32       row;
+  guint32       i;
 
-  for (i = 0; i < len >> 1; ++i)
+  for (row = first_row; row < first_row + n_rows; ++row)
     {
-      *dst = *src;
-      dst++;
-      src += 2;
+      dst = block->dest + (gsize) row * block->columns * step;
+
+      if (block->compression == PSD_COMP_RLE)
+        {
+          const gchar *packed     = block->data + block->row_start[row];
+          guint16      packed_len = (block->row_start[row + 1] -
+                                     block->row_start[row]);
+
+          /* FIXME check for errors returned from decode packbits */
+          if (block->bps == 8 && step == 1)
+            {
+              /* Unpack straight into place */
+              decode_packbits (packed, (gchar *) dst,
+                               packed_len, block->readline_len);
+              continue;
+            }
+
+          decode_packbits (packed, scratch, packed_len, block->readline_len);
+          src = (const guchar *) scratch;
+        }
+      else
+        {
+          src = ((const guchar *) block->data +
+                 (gsize) row * block->readline_len);
+        }
+
+      /* Convert row to GIMP format */
+      switch (block->bps)
+        {
+          case 16:              /* Drop the low byte */
+            for (i = 0; i < block->columns; ++i)
+              dst[i * step] = src[i << 1];
+            break;
+
+          case 8:
+            if (step == 1)
+              memcpy (dst, src, block->columns);
+            else
+              for (i = 0; i < block->columns; ++i)
+                dst[i * step] = src[i];
+            break;
+
+          case 1:               /* Set bits are black */
+            for (i = 0; i < block->columns; ++i)
+              dst[i * step] = (src[i >> 3] & (0x80 >> (i & 7))) ? 0 : 1;
+            break;
+        }
     }
+}
+
+static gpointer
+decode_thread (gpointer data)
+{
+  PSDdecodejob    *job     = data;
+  PSDchannelblock *block;
+  gchar           *scratch = NULL;
+  guint32          first_row;
+  gint             cidx    = 0;
+  gint             band;
+
+  if (job->scratch_len)
+    scratch = g_malloc (job->scratch_len);
+
+  /* Each thread gets its bands in increasing order, so the channel it
+     works on only ever moves forward */
+  while ((band = g_atomic_int_add (&job->next_band, 1)) <
+         job->first_band[job->n_channels])
+    {
+      while (job->first_band[cidx + 1] <= band)
+        cidx++;
 
-  IFDBG(3)  g_debug ("End 16 bit conversion");
+      block     = job->channels[cidx];
+      first_row = (band - job->first_band[cidx]) * DECODE_BAND_ROWS;
+
+      decode_channel_rows (block, first_row,
+                           MIN (DECODE_BAND_ROWS, block->rows - first_row),
+                           scratch);
+    }
+
+  g_free (scratch);
+
+  return NULL;
 }
 
 static void
-convert_1_bit (const gchar *src,
-               gchar       *dst,
-               guint32      rows,
-               guint32      columns)
+decode_start (PSDdecodejob     *job,
+              PSDchannelblock **channels,
+              gint              n_channels)
 {
-/* Convert bits to bytes left to right by row.
-   Rows are padded out to a byte boundry.
-*/
-  guint32 row_pos = 0;
-  gint    i, j;
+  gint  cidx;
+  gint  i;
 
-  IFDBG(3)  g_debug ("Start 1 bit conversion");
+  job->channels    = channels;
+  job->n_channels  = n_channels;
+  job->first_band  = g_new (gint, n_channels + 1);
+  job->next_band   = 0;
+  job->scratch_len = 0;
 
-  for (i = 0; i < rows * ((columns + 7) >> 3); ++i)
+  job->first_band[0] = 0;
+  for (cidx = 0; cidx < n_channels; ++cidx)
     {
-      guchar    mask = 0x80;
-      for (j = 0; j < 8 && row_pos < columns; ++j)
-        {
-          *dst = (*src & mask) ? 0 : 1;
-          IFDBG(3) g_debug ("byte %d, bit %d, offset %d, src %d, dst %d",
-            i , j, row_pos, *src, *dst);
-          dst++;
-          mask >>= 1;
-          row_pos++;
-        }
-      if (row_pos >= columns)
-        row_pos = 0;
-      src++;
+      job->first_band[cidx + 1] = (job->first_band[cidx] +
+                                   (channels[cidx]->rows + DECODE_BAND_ROWS - 1) /
+                                   DECODE_BAND_ROWS);
+
+      if (channels[cidx]->compression == PSD_COMP_RLE)
+        job->scratch_len = MAX (job->scratch_len, channels[cidx]->readline_len);
     }
-  IFDBG(3)  g_debug ("End 1 bit conversion");
+
+  job->n_threads = MIN (threads_get_count (), job->first_band[n_channels]);
+
+  for (i = 1; i < job->n_threads; i++)
+    job->threads[i] = g_thread_create (decode_thread, job, TRUE, NULL);
+}
+
+static void
+decode_finish (PSDdecodejob *job)
+{
+  gint  i;
+
+  /* Help the worker threads, then wait for them */
+  decode_thread (job);
+
+  for (i = 1; i < job->n_threads; i++)
+    if (job->threads[i])
+      g_thread_join (job->threads[i]);
+
+  g_free (job->first_band);
 }
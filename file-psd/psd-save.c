@@ -75,6 +75,8 @@
 
 #include "libgimp/stdplugins-intl.h"
 
+#include "plug-ins/common/threads.h"
+
 
 /* *** DEFINES *** */
 
@@ -95,6 +97,9 @@
 #define PSD_UNIT_INCH 1
 #define PSD_UNIT_CM   2
 
+#define MAX_PACK_CHANNELS 5                   /* Colours, alpha and mask */
+#define PACK_BAND_SIZE    (8 * 1024 * 1024)   /* Pixel bytes packed at once */
+
 /* *** END OF DEFINES *** */
 
 
@@ -122,6 +127,7 @@ typedef struct PsdImageData
 
   gint32               merged_layer;/* Merged image,
                                        to be used for the image data section */
+  gboolean             merged_alpha;/* Merged image has transparent pixels */
 
   gint                 nChannels;   /* Number of user channels in the image */
   gint32              *lChannels;   /* User channels in the image */
@@ -132,6 +138,29 @@ typedef struct PsdImageData
 
 } PSD_Image_Data;
 
+
+/* A band of rows of a drawable, PackBits compressed a tile row of one
+ * channel at a time by a pool of threads.
+ */
+typedef struct PsdPackJob
+{
+  guchar  *src[MAX_PACK_CHANNELS];      /* First pixel of each channel */
+  gint     stride[MAX_PACK_CHANNELS];   /* Distance between its pixels */
+  gint16  *lengths[MAX_PACK_CHANNELS];  /* Packed row lengths of the band */
+  gint     n_channels;
+
+  gint32   width;
+  gint32   n_rows;                      /* Rows in the band */
+  gint32   chunk_rows;                  /* Rows per unit of work */
+  gint     n_chunks;                    /* Units per channel */
+
+  gint32   max_row_len;                 /* Worst case packed row length */
+  guchar  *rledata;                     /* Packed rows, max_row_len apart */
+  gint32  *chunk_len;                   /* Packed length of each unit */
+  gint     next_unit;
+} PSD_Pack_Job;
+
+
 static PSD_Image_Data PSDImageData;
 
 
@@ -190,6 +219,8 @@ static void   write_pixel_data     (FILE          *fd,
                                     glong         *ChanLenPosition,
                                     gint32         rowlenOffset);
 
+static void   pack_band            (PSD_Pack_Job  *job);
+
 static gint32 create_merged_image  (gint32         imageID);
 
 
@@ -455,19 +486,11 @@ write_gchar (FILE        *fd,
              guchar       val,
              const gchar *why)
 {
-  guchar b[2];
-  glong  pos;
-
-  b[0] = val;
-  b[1] = 0;
-
-  pos = ftell (fd);
-  if (fwrite (&b, 1, 2, fd) == 0)
+  if (fwrite (&val, 1, 1, fd) == 0)
     {
       g_printerr ("%s: Error while writing '%s'\n", G_STRFUNC, why);
       gimp_quit ();
     }
-  fseek (fd, pos + 1, SEEK_SET);
 }
 
 
@@ -705,7 +728,7 @@ save_header (FILE   *fd,
   write_gint16 (fd, 0, "reserved 1");      /* and 2 bytes for a short */
   write_gint16 (fd, (PSDImageData.nChannels +
                      nChansLayer (PSDImageData.baseType,
-                     gimp_drawable_has_alpha (PSDImageData.merged_layer), 0)),
+                     PSDImageData.merged_alpha, 0)),
                 "channels");
   write_gint32 (fd, PSDImageData.image_height, "rows");
   write_gint32 (fd, PSDImageData.image_width, "columns");
@@ -835,7 +858,7 @@ save_resources (FILE   *fd,
   /* --------------- Write Channel names --------------- */
 
   if (PSDImageData.nChannels > 0 ||
-      gimp_drawable_has_alpha (PSDImageData.merged_layer))
+      PSDImageData.merged_alpha)
     {
       xfwrite (fd, "8BIM", 4, "imageresources signature");
       write_gint16 (fd, 0x03EE, "0x03EE Id"); /* 1006 */
@@ -850,7 +873,7 @@ save_resources (FILE   *fd,
     /* Write all strings */
 
     /* if the merged_image contains transparency, write a name for it first */
-    if (gimp_drawable_has_alpha (PSDImageData.merged_layer))
+    if (PSDImageData.merged_alpha)
       write_string (fd, "Transparency", "channel name");
 
     for (i = PSDImageData.nChannels - 1; i >= 0; i--)
@@ -1036,6 +1059,59 @@ get_compress_channel_data (guchar  *channel_data,
 }
 
 
+static gpointer
+pack_thread (gpointer data)
+{
+  PSD_Pack_Job *job = data;
+  gint          unit;
+
+  while ((unit = g_atomic_int_add (&job->next_unit, 1)) <
+         job->n_channels * job->n_chunks)
+    {
+      gint    chan  = unit / job->n_chunks;
+      gint32  first = (unit % job->n_chunks) * job->chunk_rows;
+      gint32  rows  = MIN (job->chunk_rows, job->n_rows - first);
+
+      job->chunk_len[unit] =
+        get_compress_channel_data (job->src[chan] + ((gsize) first *
+                                                     job->width *
+                                                     job->stride[chan]),
+                                   job->width,
+                                   rows,
+                                   job->stride[chan],
+                                   &job->lengths[chan][first],
+                                   job->rledata + ((gsize) (chan * job->n_rows +
+                                                            first) *
+                                                   job->max_row_len));
+    }
+
+  return NULL;
+}
+
+
+static void
+pack_band (PSD_Pack_Job *job)
+{
+  GThread *threads[THREADS_MAX];
+  gint     n_threads;
+  gint     i;
+
+  job->n_chunks  = (job->n_rows + job->chunk_rows - 1) / job->chunk_rows;
+  job->next_unit = 0;
+
+  n_threads = MIN (threads_get_count (), job->n_channels * job->n_chunks);
+
+  for (i = 1; i < n_threads; i++)
+    threads[i] = g_thread_create (pack_thread, job, TRUE, NULL);
+
+  pack_thread (job);
+
+  for (i = 1; i < n_threads; i++)
+    if (threads[i])
+      g_thread_join (threads[i]);
+}
+
+
 static void
 save_layer_and_mask (FILE   *fd,
                      gint32  image_id)
@@ -1079,7 +1155,7 @@ save_layer_and_mask (FILE   *fd,
 
   /* Layer structure section */
 
-  if (gimp_drawable_has_alpha (PSDImageData.merged_layer))
+  if (PSDImageData.merged_alpha)
     write_gint16 (fd, -PSDImageData.nLayers, "Layer structure count");
   else
     write_gint16 (fd, PSDImageData.nLayers, "Layer structure count");
@@ -1265,22 +1341,30 @@ write_pixel_data (FILE   *fd,
                   gint32  ltable_offset)
 {
   GimpPixelRgn region;      /* Image region */
+  GimpPixelRgn mregion;     /* Layer mask region */
   guchar *data;             /* Temporary copy of pixel data */
+  guchar *mdata = NULL;     /* Temporary copy of layer mask data */
 
   gint32 tile_height = gimp_tile_height();
 
   GimpDrawable *drawable = gimp_drawable_get (drawableID);
+  GimpDrawable *mdrawable = NULL;
 
   gint32 height = drawable->height;
   gint32 width  = drawable->width;
   gint32 bytes  = drawable->bpp;
   gint32 colors = bytes;    /* fixed up down below */
+  gint32 chans  = bytes;    /* channels written, besides the mask */
+  gint32 band_height;       /* rows read and compressed at a time */
   gint32 y;
 
-  gint32   len;                  /* Length of compressed data */
-  gint16 *LengthsTable;         /* Lengths of every compressed row */
-  guchar *rledata;              /* Compressed data from a region */
-  glong  length_table_pos;      /* position in file of the length table */
+  gint32      len;                              /* Length of channel data */
+  gint16     *LengthsTable[MAX_PACK_CHANNELS];  /* Lengths of every compressed row */
+  GByteArray *rledata[MAX_PACK_CHANNELS];       /* Compressed data of a channel */
+  guchar     *ltable;                           /* Lengths table as written */
+  glong       length_table_pos;                 /* position in file of the length table */
+  gboolean    blend = FALSE;
+  PSD_Pack_Job job;
   int i, j;
 
   IFDBG printf (" Function: write_pixel_data, drw %d, lto %d\n",
@@ -1290,23 +1374,48 @@ write_pixel_data (FILE   *fd,
       !gimp_drawable_is_indexed (drawableID))
     colors -= 1;
 
+  /* The merged image is blended against white as it is written,
+     photoshop does this.  Without any transparency it has no alpha. */
+  if (drawableID == PSDImageData.merged_layer && bytes != colors)
+    {
+      if (PSDImageData.merged_alpha)
+        blend = TRUE;
+      else
+        chans = colors;
+    }
+
+  /* Write layer mask, as last channel, id -2 */
+  if (gimp_item_is_layer (drawableID))
+    {
+      gint32 maskID = gimp_layer_get_mask (drawableID);
+
+      if (maskID != -1)
+        mdrawable = gimp_drawable_get (maskID);
+    }
+
+  /* The whole drawable is read once, a band of rows at a time.  Each
+     channel of the band is compressed a tile row at a time, in
+     parallel, and kept until the channel is written in one go. */
+  band_height = MIN (threads_get_count (),
+                     PACK_BAND_SIZE / (tile_height * width * bytes));
+  band_height = MIN (MAX (band_height, 1) * tile_height, height);
+
   gimp_tile_cache_ntiles (2* (drawable->width / gimp_tile_width () + 1));
 
-  LengthsTable = g_new (gint16, height);
-  rledata = g_new (guchar, (MIN (height, tile_height) *
-                            (width + 10 + (width / 100))));
+  job.n_channels  = 0;
+  job.width       = width;
+  job.chunk_rows  = tile_height;
+  job.max_row_len = width + 10 + (width / 100);
 
-  data = g_new (guchar, MIN(height, tile_height) * width * bytes);
+  data = g_new (guchar, band_height * width * bytes);
 
   gimp_pixel_rgn_init (&region, drawable, 0, 0,
                        width, height, FALSE, FALSE);
 
-  for (i = 0; i < bytes; i++)
+  for (i = 0; i < chans; i++)
     {
       gint chan;
 
-      len = 0;
-
       if (bytes != colors && ltable_offset == 0) /* Need to write alpha channel first, except in image data section */
         {
           if (i == 0)
@@ -1323,137 +1432,145 @@ write_pixel_data (FILE   *fd,
           chan = i;
         }
 
+      job.src[job.n_channels]    = data + chan;
+      job.stride[job.n_channels] = bytes;
+      job.n_channels++;
+    }
+
+  if (mdrawable)
+    {
+      mdata = g_new (guchar, band_height * width);
+
+      gimp_pixel_rgn_init (&mregion, mdrawable, 0, 0,
+                           width, height, FALSE, FALSE);
+
+      job.src[job.n_channels]    = mdata;
+      job.stride[job.n_channels] = 1;
+      job.n_channels++;
+    }
+
+  for (i = 0; i < job.n_channels; i++)
+    {
+      LengthsTable[i] = g_new (gint16, height);
+      rledata[i]      = g_byte_array_new ();
+    }
+
+  job.rledata   = g_new (guchar,
+                         job.n_channels * band_height * job.max_row_len);
+  job.chunk_len = g_new (gint32,
+                         job.n_channels *
+                         ((band_height + tile_height - 1) / tile_height));
+
+  for (y = 0; y < height; y += band_height)
+    {
+      job.n_rows = MIN (height - y, band_height);
+
+      gimp_pixel_rgn_get_rect (&region, data, 0, y, width, job.n_rows);
+
+      if (mdrawable)
+        gimp_pixel_rgn_get_rect (&mregion, mdata, 0, y, width, job.n_rows);
+
+      if (blend)
+        {
+          guchar *d = data;
+
+          for (j = 0; j < width * job.n_rows; j++)
+            {
+              guint32 alpha = d[bytes - 1];
+
+              if (alpha < 255)
+                {
+                  gint b;
+
+                  for (b = 0; b < bytes - 1; b++)
+                    d[b] = ((guint32) d[b] * alpha) / 255 + 255 - alpha;
+                }
+
+              d += bytes;
+            }
+        }
+
+      for (i = 0; i < job.n_channels; i++)
+        job.lengths[i] = &LengthsTable[i][y];
+
+      pack_band (&job);
+
+      for (i = 0; i < job.n_channels; i++)
+        for (j = 0; j < job.n_chunks; j++)
+          g_byte_array_append (rledata[i],
+                               job.rledata + ((gsize) (i * job.n_rows +
+                                                       j * job.chunk_rows) *
+                                              job.max_row_len),
+                               job.chunk_len[i * job.n_chunks + j]);
+
+      IF_DEEP_DBG printf ("\t\t\t\t. Compressed rows %d to %d\n",
+                          y, y + job.n_rows);
+    }
+
+  ltable = g_new (guchar, height * sizeof (gint16));
+
+  for (i = 0; i < job.n_channels; i++)
+    {
+      len = 0;
+
       if (ChanLenPosition)
         {
           write_gint16 (fd, 1, "Compression type (RLE)");
           len += 2;
         }
 
+      for (j = 0; j < height; j++)
+        {
+          ltable[j * 2]     = (LengthsTable[i][j] >> 8) & 255;
+          ltable[j * 2 + 1] = LengthsTable[i][j] & 255;
+        }
+
+      /* Write compressed lengths table */
       if (ltable_offset > 0)
         {
-          length_table_pos = ltable_offset + 2 * chan * height;
+          length_table_pos = ltable_offset + 2 * i * height;
+
+          fseek (fd, length_table_pos, SEEK_SET);
+          xfwrite (fd, ltable, height * sizeof (gint16), "RLE length");
+          fseek (fd, 0, SEEK_END);
         }
       else
         {
           length_table_pos = ftell(fd);
 
-          xfwrite (fd, LengthsTable, height * sizeof(gint16),
-                   "Dummy RLE length");
-          len += height * sizeof(gint16);
-          IF_DEEP_DBG printf ("\t\t\t\t. ltable, pos %ld len %d\n", length_table_pos, len);
+          xfwrite (fd, ltable, height * sizeof (gint16), "RLE length");
+          len += height * sizeof (gint16);
         }
+      IF_DEEP_DBG printf ("\t\t\t\t. ltable, pos %ld len %d\n", length_table_pos, len);
 
-      for (y = 0; y < height; y += tile_height)
-        {
-          int tlen;
-            gimp_pixel_rgn_get_rect (&region, data, 0, y,
-                                   width, MIN(height - y, tile_height));
-          tlen = get_compress_channel_data (&data[chan],
-                                             width,
-                                             MIN(height - y, tile_height),
-                                             bytes,
-                                             &LengthsTable[y],
-                                             rledata);
-          len += tlen;
-          xfwrite (fd, rledata, tlen, "Compressed pixel data");
-          IF_DEEP_DBG printf ("\t\t\t\t. Writing compressed pixels, stream of %d\n", tlen);
-        }
-
-      /* Write compressed lengths table */
-      fseek (fd, length_table_pos, SEEK_SET);
-      for (j = 0; j < height; j++) /* write real length table */
-        write_gint16 (fd, LengthsTable[j], "RLE length");
+      xfwrite (fd, rledata[i]->data, rledata[i]->len, "Compressed pixel data");
+      len += rledata[i]->len;
+      IF_DEEP_DBG printf ("\t\t\t\t. Writing compressed pixels, stream of %d\n",
+                          rledata[i]->len);
 
       if (ChanLenPosition)    /* Update total compressed length */
         {
           fseek (fd, ChanLenPosition[i], SEEK_SET);
           write_gint32 (fd, len, "channel data length");
           IFDBG printf ("\t\tUpdating data len to %d\n", len);
+          fseek (fd, 0, SEEK_END);
         }
-      fseek (fd, 0, SEEK_END);
       IF_DEEP_DBG printf ("\t\t\t\t. Cur pos %ld\n", ftell(fd));
-    }
-
-  /* Write layer mask, as last channel, id -2 */
-  if (gimp_item_is_layer (drawableID))
-    {
-      gint32 maskID = gimp_layer_get_mask (drawableID);
-
-      if (maskID != -1)
-        {
-          GimpDrawable *mdrawable = gimp_drawable_get (maskID);
-          len = 0;
-
-          gimp_pixel_rgn_init (&region, mdrawable, 0, 0,
-                               width, height, FALSE, FALSE);
 
-          if (ChanLenPosition)
-            {
-              write_gint16 (fd, 1, "Compression type (RLE)");
-              len += 2;
-              IF_DEEP_DBG printf ("\t\t\t\t. ChanLenPos, len %d\n", len);
-            }
-
-          if (ltable_offset > 0)
-            {
-              length_table_pos = ltable_offset + 2 * (bytes+1) * height;
-              IF_DEEP_DBG printf ("\t\t\t\t. ltable, pos %ld\n",
-                                  length_table_pos);
-            }
-          else
-            {
-              length_table_pos = ftell(fd);
-
-              xfwrite (fd, LengthsTable, height * sizeof(gint16),
-                       "Dummy RLE length");
-              len += height * sizeof(gint16);
-              IF_DEEP_DBG printf ("\t\t\t\t. ltable, pos %ld len %d\n",
-                                  length_table_pos, len);
-            }
-
-          for (y = 0; y < height; y += tile_height)
-            {
-              int tlen;
-              gimp_pixel_rgn_get_rect (&region, data, 0, y,
-                                       width, MIN(height - y, tile_height));
-              tlen = get_compress_channel_data (&data[0],
-                                                width,
-                                                MIN(height - y, tile_height),
-                                                1,
-                                                &LengthsTable[y],
-                                                rledata);
-              len += tlen;
-              xfwrite (fd, rledata, tlen, "Compressed mask data");
-              IF_DEEP_DBG printf ("\t\t\t\t. Writing compressed mask, stream of %d\n", tlen);
-            }
-
-          /* Write compressed lengths table */
-          fseek (fd, length_table_pos, SEEK_SET); /*POS WHERE???*/
-          for (j = 0; j < height; j++) /* write real length table */
-            {
-              write_gint16 (fd, LengthsTable[j], "RLE length");
-              IF_DEEP_DBG printf ("\t\t\t\t. Updating RLE len %d\n",
-                                  LengthsTable[j]);
-            }
-
-          if (ChanLenPosition)    /* Update total compressed length */
-            {
-              fseek (fd, ChanLenPosition[bytes], SEEK_SET); /*+bytes OR SOMETHING*/
-              write_gint32 (fd, len, "channel data length");
-              IFDBG printf ("\t\tUpdating data len to %d, at %ld\n", len, ftell(fd));
-            }
-          fseek (fd, 0, SEEK_END);
-          IF_DEEP_DBG printf ("\t\t\t\t. Cur pos %ld\n", ftell(fd));
-
-          gimp_drawable_detach (mdrawable);
-        }
+      g_byte_array_free (rledata[i], TRUE);
+      g_free (LengthsTable[i]);
     }
 
+  if (mdrawable)
+    gimp_drawable_detach (mdrawable);
+
   gimp_drawable_detach (drawable);
 
   g_free (data);
-  g_free (rledata);
-  g_free (LengthsTable);
+  g_free (mdata);
+  g_free (ltable);
+  g_free (job.rledata);
+  g_free (job.chunk_len);
 }
 
 
@@ -1463,7 +1580,8 @@ save_data (FILE   *fd,
            gint32  image_id)
 {
   gint ChanCount;
-  gint i, j;
+  gint i;
+  guchar *junk;                         /* zeroed line lengths */
   gint32 imageHeight;                   /* Height of image */
   glong offset;                         /* offset in file of rle lengths */
   gint chan;
@@ -1472,7 +1590,7 @@ save_data (FILE   *fd,
 
   ChanCount = (PSDImageData.nChannels +
                nChansLayer (PSDImageData.baseType,
-                            gimp_drawable_has_alpha (PSDImageData.merged_layer),
+                            PSDImageData.merged_alpha,
                             0));
 
   imageHeight = gimp_image_height (image_id);
@@ -1483,16 +1601,17 @@ save_data (FILE   *fd,
 
   offset = ftell(fd); /* Offset in file of line lengths */
 
-  for (i = 0; i < ChanCount; i++)
-    for (j = 0; j < imageHeight; j++)
-      write_gint16 (fd, 0, "junk line lengths");
+  junk = g_new0 (guchar, ChanCount * imageHeight * sizeof (gint16));
+  xfwrite (fd, junk, ChanCount * imageHeight * sizeof (gint16),
+           "junk line lengths");
+  g_free (junk);
 
   IFDBG printf ("\t\tWriting compressed image data\n");
   write_pixel_data (fd, PSDImageData.merged_layer,
                     NULL, offset);
 
   chan = nChansLayer (PSDImageData.baseType,
-                      gimp_drawable_has_alpha(PSDImageData.merged_layer), 0);
+                      PSDImageData.merged_alpha, 0);
 
   for (i = PSDImageData.nChannels - 1; i >= 0; i--)
     {
@@ -1511,55 +1630,52 @@ create_merged_image (gint32 image_id)
 
   projection = gimp_layer_new_from_visible (image_id, image_id, SAVE_PROC);
 
+  PSDImageData.merged_alpha = FALSE;
+
   if (gimp_image_base_type (image_id) != GIMP_INDEXED)
     {
-      GimpDrawable *drawable = gimp_drawable_get (projection);
-      GimpPixelRgn  region;
-      gboolean      transparency_found = FALSE;
-      gpointer      pr;
-
-      gimp_pixel_rgn_init (&region, drawable,
-                           0, 0, drawable->width, drawable->height,
-                           TRUE, FALSE);
-
-      for (pr = gimp_pixel_rgns_register (1, &region);
-           pr != NULL;
-           pr = gimp_pixel_rgns_process (pr))
+      /* Only look for transparency here, the pixels are blended
+         against white when they are written */
+      if (gimp_drawable_has_alpha (projection))
         {
-          guchar *data = region.data;
-          gint    y;
+          GimpDrawable *drawable = gimp_drawable_get (projection);
+          GimpPixelRgn  region;
+          guchar       *data;
+          gint32        tile_height = gimp_tile_height ();
+          gint32        y;
 
-          for (y = 0; y < region.h; y++)
-            {
-              guchar *d = data;
-              gint    x;
+          gimp_pixel_rgn_init (&region, drawable,
+                               0, 0, drawable->width, drawable->height,
+                               FALSE, FALSE);
 
-              for (x = 0; x < region.w; x++)
-                {
-                  guint32 alpha = d[region.bpp - 1];
+          data = g_new (guchar, tile_height * drawable->width * drawable->bpp);
 
-                  if (alpha < 255)
-                    {
-                      gint i;
+          for (y = 0;
+               y < drawable->height && ! PSDImageData.merged_alpha;
+               y += tile_height)
+            {
+              gint32  rows = MIN (drawable->height - y, tile_height);
+              guchar *d    = data + drawable->bpp - 1;
+              gint    i;
 
-                      transparency_found = TRUE;
+              gimp_pixel_rgn_get_rect (&region, data,
+                                       0, y, drawable->width, rows);
 
-                      /* blend against white, photoshop does this. */
-                      for (i = 0; i < region.bpp - 1; i++)
-                        d[i] = ((guint32) d[i] * alpha) / 255 + 255 - alpha;
+              for (i = 0; i < drawable->width * rows; i++)
+                {
+                  if (*d < 255)
+                    {
+                      PSDImageData.merged_alpha = TRUE;
+                      break;
                     }
 
-                  d += region.bpp;
+                  d += drawable->bpp;
                 }
-
-              data += region.rowstride;
             }
-        }
 
-      gimp_drawable_detach (drawable);
-
-      if (! transparency_found)
-        gimp_layer_flatten (projection);
+          g_free (data);
+          gimp_drawable_detach (drawable);
+        }
     }
   else
     {
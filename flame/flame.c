@@ -33,8 +33,11 @@
 
 #include "libgimp/stdplugins-intl.h"
 
+#include "plug-ins/common/threads.h"
+
 
 #define PLUG_IN_PROC      "plug-in-flame"
+#define ANIMATION_PROC    "plug-in-flame-animation"
 #define PLUG_IN_BINARY    "flame"
 #define PLUG_IN_ROLE      "gimp-flame"
 
@@ -70,6 +73,12 @@ static void      run               (const gchar      *name,
                                     gint             *nreturn_vals,
                                     GimpParam       **return_vals);
 static void      flame             (GimpDrawable     *drawable);
+static gint32    flame_animation   (const gchar      *filename,
+                                    gint              width,
+                                    gint              height,
+                                    gint              n_frames,
+                                    gboolean          loop,
+                                    gdouble           motion_blur);
 
 static gboolean  flame_dialog      (void);
 static void      set_flame_preview (void);
@@ -125,6 +134,22 @@ query (void)
     { GIMP_PDB_DRAWABLE, "drawable", "Input drawable"               }
   };
 
+  static const GimpParamDef animation_args[] =
+  {
+    { GIMP_PDB_INT32,  "run-mode",    "The run mode { RUN-NONINTERACTIVE (1) }" },
+    { GIMP_PDB_STRING, "filename",    "File with the control points"           },
+    { GIMP_PDB_INT32,  "width",       "Width of the frames"                    },
+    { GIMP_PDB_INT32,  "height",      "Height of the frames"                   },
+    { GIMP_PDB_INT32,  "n-frames",    "Number of frames to render"             },
+    { GIMP_PDB_INT32,  "loop",        "Interpolate from the last control point back to the first { TRUE, FALSE }" },
+    { GIMP_PDB_FLOAT,  "motion-blur", "Temporal filter radius, in units of the control point times" }
+  };
+
+  static const GimpParamDef animation_return_vals[] =
+  {
+    { GIMP_PDB_IMAGE, "image", "The animation, one layer per frame" }
+  };
+
   gimp_install_procedure (PLUG_IN_PROC,
                           N_("Create cosmic recursive fractal flames"),
                           "Create cosmic recursive fractal flames",
@@ -138,6 +163,27 @@ query (void)
                           args, NULL);
 
   gimp_plugin_menu_register (PLUG_IN_PROC, "<Image>/Filters/Render/Nature");
+
+  gimp_install_procedure (ANIMATION_PROC,
+                          "Render an animation of cosmic recursive fractal "
+                          "flames",
+                          "Reads control points, as written by the Save "
+                          "button of the Flame dialog, from a file and "
+                          "renders a new image with one layer per frame, "
+                          "interpolating between the control points in the "
+                          "order of their 'time' fields.  Frames are "
+                          "rendered concurrently.  Motion blur only has an "
+                          "effect when the control points use more than "
+                          "one batch.",
+                          "The GIMP Team",
+                          "The GIMP Team",
+                          "2026",
+                          NULL,
+                          NULL,
+                          GIMP_PLUGIN,
+                          G_N_ELEMENTS (animation_args),
+                          G_N_ELEMENTS (animation_return_vals),
+                          animation_args, animation_return_vals);
 }
 
 static void
@@ -177,7 +223,7 @@ run (const gchar      *name,
      gint             *nreturn_vals,
      GimpParam       **return_vals)
 {
-  static GimpParam  values[1];
+  static GimpParam  values[2];
   GimpDrawable     *drawable = NULL;
   GimpRunMode       run_mode;
   GimpPDBStatusType status = GIMP_PDB_SUCCESS;
@@ -189,6 +235,53 @@ run (const gchar      *name,
 
   INIT_I18N ();
 
+  if (strcmp (name, ANIMATION_PROC) == 0)
+    {
+      gint32 image_ID = -1;
+
+      if (n_params != 7             ||
+          param[2].data.d_int32 < 1 ||
+          param[3].data.d_int32 < 1 ||
+          param[4].data.d_int32 < 1)
+        {
+          status = GIMP_PDB_CALLING_ERROR;
+        }
+      else if (! param[1].data.d_string || ! *param[1].data.d_string)
+        {
+          *nreturn_vals = 2;
+
+          values[1].type          = GIMP_PDB_STRING;
+          values[1].data.d_string = _("No control point file was given.");
+
+          status = GIMP_PDB_CALLING_ERROR;
+        }
+      else
+        {
+          image_ID = flame_animation (param[1].data.d_string,
+                                      param[2].data.d_int32,
+                                      param[3].data.d_int32,
+                                      param[4].data.d_int32,
+                                      param[5].data.d_int32,
+                                      param[6].data.d_float);
+
+          if (image_ID == -1)
+            status = GIMP_PDB_EXECUTION_ERROR;
+        }
+
+      values[0].type          = GIMP_PDB_STATUS;
+      values[0].data.d_status = status;
+
+      if (status == GIMP_PDB_SUCCESS)
+        {
+          *nreturn_vals = 2;
+
+          values[1].type         = GIMP_PDB_IMAGE;
+          values[1].data.d_image = image_ID;
+        }
+
+      return;
+    }
+
   if (run_mode == GIMP_RUN_NONINTERACTIVE)
     {
       status = GIMP_PDB_CALLING_ERROR;
@@ -381,6 +474,245 @@ flame (GimpDrawable *drawable)
   gimp_drawable_update (drawable->drawable_id, 0, 0, width, height);
 }
 
+/* Animations */
+
+typedef struct
+{
+  control_point *cps;
+  gint           ncps;
+  gdouble        motion_blur;
+  gint           width;
+  gint           height;
+  gint           n_frames;
+  gdouble        start_time;
+  gdouble        frame_time;
+  gint           threads_per_frame;
+  guchar       **frames;
+  GAsyncQueue   *done;
+  volatile gint  next_frame;
+} FlameAnimation;
+
+static gint
+compare_control_points (gconstpointer a,
+                        gconstpointer b)
+{
+  const control_point *cp_a = a;
+  const control_point *cp_b = b;
+
+  if (cp_a->time < cp_b->time)
+    return -1;
+  if (cp_a->time > cp_b->time)
+    return 1;
+  return 0;
+}
+
+/* Reads all the control points from a file, sorted by time.  One
+ * extra slot is allocated at the end for closing a loop.
+ */
+static control_point *
+load_control_points (const gchar  *filename,
+                     gint         *ncps,
+                     GError      **error)
+{
+  control_point *cps = NULL;
+  gchar         *contents;
+  gchar         *ss;
+  gint           i;
+
+  *ncps = 0;
+
+  if (! g_file_get_contents (filename, &contents, NULL, error))
+    return NULL;
+
+  for (ss = contents; strchr (ss, ';'); (*ncps)++)
+    {
+      cps = g_renew (control_point, cps, *ncps + 2);
+      parse_control_point (&ss, &cps[*ncps]);
+    }
+
+  g_free (contents);
+
+  if (*ncps == 0)
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+                   _("No control points found in '%s'"),
+                   gimp_filename_to_utf8 (filename));
+      return NULL;
+    }
+
+  qsort (cps, *ncps, sizeof (control_point), compare_control_points);
+
+  /* control points saved from the dialog all have the same time */
+  if (*ncps > 1 && cps[*ncps - 1].time <= cps[0].time)
+    for (i = 0; i < *ncps; i++)
+      cps[i].time = i;
+
+  return cps;
+}
+
+static gpointer
+flame_animation_thread (gpointer data)
+{
+  FlameAnimation *anim = data;
+  flame_renderer *renderer;
+  gint            frame;
+
+  renderer = flame_renderer_new (anim->threads_per_frame);
+
+  while ((frame = g_atomic_int_add (&anim->next_frame, 1)) < anim->n_frames)
+    {
+      frame_spec  spec;
+      guchar     *pixels = g_new (guchar, anim->width * anim->height * 4);
+
+      spec.temporal_filter_radius = anim->motion_blur;
+      spec.cps                    = anim->cps;
+      spec.ncps                   = anim->ncps;
+      spec.time                   = (anim->start_time +
+                                     frame * anim->frame_time);
+
+      flame_renderer_render (renderer, &spec, pixels, anim->width,
+                             field_both, 4, NULL);
+
+      anim->frames[frame] = pixels;
+      g_async_queue_push (anim->done, GINT_TO_POINTER (frame + 1));
+    }
+
+  flame_renderer_free (renderer);
+
+  return NULL;
+}
+
+/* The frames are rendered by a pool of threads, each with its own
+ * renderer so buffers and filter kernels are reused from one frame to
+ * the next.  Only this thread talks to the core; it adds the frames to
+ * the image in order as they come in.
+ */
+static gint32
+flame_animation (const gchar *filename,
+                 gint         width,
+                 gint         height,
+                 gint         n_frames,
+                 gboolean     loop,
+                 gdouble      motion_blur)
+{
+  FlameAnimation  anim;
+  GThread       **threads;
+  gboolean       *ready;
+  GError         *error = NULL;
+  gint32          image_ID;
+  gint            n_threads;
+  gint            next_layer;
+  gint            i;
+
+  anim.cps = load_control_points (filename, &anim.ncps, &error);
+
+  if (! anim.cps)
+    {
+      g_message (_("Could not read '%s': %s"),
+                 gimp_filename_to_utf8 (filename), error->message);
+      g_error_free (error);
+      return -1;
+    }
+
+  for (i = 0; i < anim.ncps; i++)
+    {
+      anim.cps[i].width  = width;
+      anim.cps[i].height = height;
+    }
+
+  if (loop)
+    {
+      gdouble spacing = 1.0;
+
+      if (anim.ncps > 1)
+        spacing = ((anim.cps[anim.ncps - 1].time - anim.cps[0].time) /
+                   (anim.ncps - 1));
+
+      anim.cps[anim.ncps]       = anim.cps[0];
+      anim.cps[anim.ncps].time  = anim.cps[anim.ncps - 1].time + spacing;
+      anim.ncps++;
+    }
+
+  anim.motion_blur = motion_blur;
+  anim.width       = width;
+  anim.height      = height;
+  anim.n_frames    = n_frames;
+  anim.start_time  = anim.cps[0].time;
+  anim.frame_time  = ((anim.cps[anim.ncps - 1].time - anim.start_time) /
+                      (loop ? n_frames : MAX (n_frames - 1, 1)));
+  anim.frames      = g_new0 (guchar *, n_frames);
+  anim.done        = g_async_queue_new ();
+  anim.next_frame  = 0;
+
+  n_threads = MIN (threads_get_count (), n_frames);
+  threads   = g_new (GThread *, n_threads);
+
+  anim.threads_per_frame = MAX (1, threads_get_count () / n_threads);
+
+  image_ID = gimp_image_new (width, height, GIMP_RGB);
+  gimp_image_undo_disable (image_ID);
+
+  gimp_progress_init (_("Drawing flame"));
+
+  for (i = 0; i < n_threads; i++)
+    threads[i] = g_thread_create (flame_animation_thread, &anim, TRUE, NULL);
+
+  /* without any threads, render everything here */
+  if (! threads[0])
+    flame_animation_thread (&anim);
+
+  ready = g_new0 (gboolean, n_frames);
+
+  for (i = 0, next_layer = 0; i < n_frames; i++)
+    {
+      ready[GPOINTER_TO_INT (g_async_queue_pop (anim.done)) - 1] = TRUE;
+
+      while (next_layer < n_frames && ready[next_layer])
+        {
+          GimpDrawable *drawable;
+          GimpPixelRgn  pr;
+          gchar        *name;
+          gint32        layer_ID;
+
+          name = g_strdup_printf (_("Frame %d"), next_layer + 1);
+          layer_ID = gimp_layer_new (image_ID, name, width, height,
+                                     GIMP_RGBA_IMAGE, 100, GIMP_NORMAL_MODE);
+          g_free (name);
+
+          gimp_image_insert_layer (image_ID, layer_ID, -1, 0);
+
+          drawable = gimp_drawable_get (layer_ID);
+          gimp_pixel_rgn_init (&pr, drawable, 0, 0, width, height,
+                               TRUE, FALSE);
+          gimp_pixel_rgn_set_rect (&pr, anim.frames[next_layer],
+                                   0, 0, width, height);
+          gimp_drawable_flush (drawable);
+          gimp_drawable_detach (drawable);
+
+          g_free (anim.frames[next_layer]);
+          anim.frames[next_layer] = NULL;
+
+          next_layer++;
+        }
+
+      gimp_progress_update ((gdouble) (i + 1) / n_frames);
+    }
+
+  for (i = 0; i < n_threads; i++)
+    if (threads[i])
+      g_thread_join (threads[i]);
+
+  g_free (threads);
+  g_free (ready);
+  g_free (anim.frames);
+  g_async_queue_unref (anim.done);
+  g_free (anim.cps);
+
+  gimp_image_undo_enable (image_ID);
+
+  return image_ID;
+}
+
 static void
 file_response_callback (GtkFileChooser *chooser,
                         gint            response_id,
@@ -16,17 +16,22 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-#include "rect.h"
-
 #include <string.h>
 
+#include "libgimp/gimp.h"
+
+#include "plug-ins/common/threads.h"
+
+#include "rect.h"
+
 
 /* for batch
  *   interpolate
  *   compute colormap
- *   for subbatch
+ *   for subbatch (spread over the threads)
  *     compute samples
- *     buckets += cmap[samples]
+ *     thread_buckets += cmap[samples]
+ *   buckets = sum(thread_buckets)
  *   accum += time_filter[batch] * log(buckets)
  * image = filter(accum)
  */
@@ -34,6 +39,8 @@
 
 typedef short bucket[4];
 
+/* at most this many threads run the chaos game */
+
 /* if you use longs instead of shorts, you
    get higher quality, and spend more memory */
 
@@ -49,6 +56,27 @@ typedef long accum_t;
 
 typedef accum_t abucket[4];
 
+/* state that is kept from one frame to the next */
+struct flame_renderer {
+   int      n_threads;
+   /* histogram and accumulation buffer */
+   char    *block;
+   int      block_size;
+   /* private histograms and sample buffers of the threads */
+   bucket  *thread_buckets[THREADS_MAX];
+   int      thread_nbuckets;
+   point   *points[THREADS_MAX];
+   /* spatial filter, rebuilt when its size or the field changes */
+   double  *filter;
+   int      filter_width;
+   int      filter_field;
+   /* temporal filter, rebuilt when the batches or the radius change */
+   double  *temporal_filter;
+   double  *temporal_deltas;
+   int      temporal_nbatches;
+   double   temporal_radius;
+};
+
 
 
 /* allow this many iterations for settling into attractor */
@@ -61,11 +89,37 @@ typedef accum_t abucket[4];
 #define PREFILTER_WHITE (MAXBUCKET>>4)
 
 
+/* and their private histograms may use at most this much memory */
+#define MAX_THREAD_BUCKET_MEMORY (256 << 20)
+
+
 #define bump_no_overflow(dest, delta, type) { \
    type tt_ = dest + delta;            \
    if (tt_ > dest) dest = tt_;                 \
 }
 
+
+/* one batch of the chaos game, shared by all the threads */
+typedef struct {
+   control_point *cp;
+   bucket        *cmap;
+   double         bounds[4];
+   double         size[2];
+   int            width, height;
+   int            n_sub_batches;
+   volatile gint  next_sub_batch;
+   volatile gint  sub_batches_done;
+} chaos_job;
+
+/* each thread iterates its own stream of points into its own
+   histogram, so the threads never touch shared state */
+typedef struct {
+   chaos_job *job;
+   bucket    *buckets;
+   point     *points;
+   GRand     *gr;
+} chaos_worker;
+
 /* sum of entries of vector to 1 */
 static void
 normalize_vector(double *v,
@@ -80,18 +134,114 @@ normalize_vector(double *v,
     v[i] *= t;
 }
 
+flame_renderer *
+flame_renderer_new (int n_threads)
+{
+  flame_renderer *renderer = g_new0 (flame_renderer, 1);
+
+  renderer->n_threads = CLAMP (n_threads, 1, THREADS_MAX);
+
+  return renderer;
+}
+
 void
-render_rectangle (frame_spec    *spec,
-                  unsigned char *out,
-                  int            out_width,
-                  int            field,
-                  int            nchan,
-                  int progress(double))
+flame_renderer_free (flame_renderer *renderer)
+{
+  int i;
+
+  for (i = 0; i < THREADS_MAX; i++)
+    {
+      g_free (renderer->thread_buckets[i]);
+      g_free (renderer->points[i]);
+    }
+
+  free (renderer->block);
+  free (renderer->filter);
+  free (renderer->temporal_filter);
+  free (renderer->temporal_deltas);
+  g_free (renderer);
+}
+
+static void
+chaos_game (chaos_worker *worker,
+            int           progress(double))
+{
+  chaos_job *job = worker->job;
+  int        sub_batch;
+
+  while ((sub_batch = g_atomic_int_add (&job->next_sub_batch, 1)) <
+         job->n_sub_batches)
+    {
+      point *points = worker->points;
+      int    j;
+
+      if (progress && (sub_batch % 32) == 0)
+        (*progress)(0.5 * g_atomic_int_get (&job->sub_batches_done) /
+                    (double) job->n_sub_batches);
+
+      /* generate a sub_batch_size worth of samples */
+      points[0][0] = g_rand_double_range (worker->gr, -1, 1);
+      points[0][1] = g_rand_double_range (worker->gr, -1, 1);
+      points[0][2] = g_rand_double (worker->gr);
+      iterate (job->cp, SUB_BATCH_SIZE, FUSE, points, worker->gr);
+
+      /* merge them into buckets, looking up colors */
+      for (j = 0; j < SUB_BATCH_SIZE; j++)
+        {
+          int k, color_index;
+          double *p = points[j];
+          bucket *b;
+
+          /* Note that we must test if p[0] and p[1] is "within"
+           * the valid bounds rather than "not outside", because
+           * p[0] and p[1] might be NaN.
+           */
+          if (p[0] >= job->bounds[0] &&
+              p[1] >= job->bounds[1] &&
+              p[0] <= job->bounds[2] &&
+              p[1] <= job->bounds[3])
+            {
+              color_index = (int) (p[2] * CMAP_SIZE);
+
+              if (color_index < 0)
+                color_index = 0;
+              else if (color_index > CMAP_SIZE - 1)
+                color_index = CMAP_SIZE - 1;
+
+              b = worker->buckets +
+                  (int) (job->width * (p[0] - job->bounds[0]) * job->size[0]) +
+                  job->width * (int) (job->height * (p[1] - job->bounds[1]) *
+                                      job->size[1]);
+
+              for (k = 0; k < 4; k++)
+                bump_no_overflow(b[0][k], job->cmap[color_index][k], short);
+            }
+        }
+
+      g_atomic_int_inc (&job->sub_batches_done);
+    }
+}
+
+static gpointer
+chaos_thread (gpointer data)
+{
+  chaos_game (data, NULL);
+
+  return NULL;
+}
+
+void
+flame_renderer_render (flame_renderer *renderer,
+                       frame_spec     *spec,
+                       unsigned char  *out,
+                       int             out_width,
+                       int             field,
+                       int             nchan,
+                       int progress(double))
 {
-  int      i, j, k, nsamples, nbuckets, batch_size, batch_num, sub_batch;
+  int      i, j, k, nsamples, nbuckets, batch_size, batch_num;
   bucket  *buckets;
   abucket *accumulate;
-  point   *points;
   double  *filter, *temporal_filter, *temporal_deltas;
   double   bounds[4], size[2], ppux, ppuy;
   int      image_width, image_height;    /* size of the image to produce */
@@ -101,7 +251,10 @@ render_rectangle (frame_spec    *spec,
   int      nbatches = spec->cps[0].nbatches;
   bucket   cmap[CMAP_SIZE];
   int      gutter_width;
-  int      sbc;
+  int      n_threads;
+  chaos_job    job;
+  chaos_worker workers[THREADS_MAX];
+  GThread     *threads[THREADS_MAX];
 
   image_width = spec->cps[0].width;
   if (field)
@@ -122,38 +275,65 @@ render_rectangle (frame_spec    *spec,
       if ((filter_width ^ oversample) & 1)
         filter_width++;
 
-      filter = malloc (sizeof (double) * filter_width * filter_width);
-      /* fill in the coefs */
-      for (i = 0; i < filter_width; i++)
-        for (j = 0; j < filter_width; j++)
-          {
-            double ii = ((2.0 * i + 1.0) / filter_width - 1.0) * FILTER_CUTOFF;
-            double jj = ((2.0 * j + 1.0) / filter_width - 1.0) * FILTER_CUTOFF;
-            if (field)
-              jj *= 2.0;
-            filter[i + j * filter_width] = exp(-2.0 * (ii * ii + jj * jj));
-          }
-      normalize_vector(filter, filter_width * filter_width);
-    }
-  temporal_filter = malloc (sizeof (double) * nbatches);
-  temporal_deltas = malloc (sizeof (double) * nbatches);
-  if (nbatches > 1)
-    {
-      double t;
-      /* fill in the coefs */
-      for (i = 0; i < nbatches; i++)
+      if (renderer->filter == NULL ||
+          renderer->filter_width != filter_width ||
+          renderer->filter_field != field)
         {
-          t = temporal_deltas[i] = (2.0 * ((double) i / (nbatches - 1)) - 1.0)
-                                   * spec->temporal_filter_radius;
-          temporal_filter[i] = exp(-2.0 * t * t);
+          free (renderer->filter);
+          filter = malloc (sizeof (double) * filter_width * filter_width);
+          /* fill in the coefs */
+          for (i = 0; i < filter_width; i++)
+            for (j = 0; j < filter_width; j++)
+              {
+                double ii = (((2.0 * i + 1.0) / filter_width - 1.0) *
+                             FILTER_CUTOFF);
+                double jj = (((2.0 * j + 1.0) / filter_width - 1.0) *
+                             FILTER_CUTOFF);
+                if (field)
+                  jj *= 2.0;
+                filter[i + j * filter_width] = exp(-2.0 * (ii * ii + jj * jj));
+              }
+          normalize_vector(filter, filter_width * filter_width);
+
+          renderer->filter       = filter;
+          renderer->filter_width = filter_width;
+          renderer->filter_field = field;
         }
-      normalize_vector(temporal_filter, nbatches);
+      filter = renderer->filter;
     }
-  else
+  if (renderer->temporal_filter == NULL ||
+      renderer->temporal_nbatches != nbatches ||
+      renderer->temporal_radius != spec->temporal_filter_radius)
     {
-      temporal_filter[0] = 1.0;
-      temporal_deltas[0] = 0.0;
+      free (renderer->temporal_filter);
+      free (renderer->temporal_deltas);
+      temporal_filter = malloc (sizeof (double) * nbatches);
+      temporal_deltas = malloc (sizeof (double) * nbatches);
+      if (nbatches > 1)
+        {
+          double t;
+          /* fill in the coefs */
+          for (i = 0; i < nbatches; i++)
+            {
+              t = temporal_deltas[i] = ((2.0 * ((double) i / (nbatches - 1)) -
+                                         1.0) * spec->temporal_filter_radius);
+              temporal_filter[i] = exp(-2.0 * t * t);
+            }
+          normalize_vector(temporal_filter, nbatches);
+        }
+      else
+        {
+          temporal_filter[0] = 1.0;
+          temporal_deltas[0] = 0.0;
+        }
+
+      renderer->temporal_filter   = temporal_filter;
+      renderer->temporal_deltas   = temporal_deltas;
+      renderer->temporal_nbatches = nbatches;
+      renderer->temporal_radius   = spec->temporal_filter_radius;
     }
+  temporal_filter = renderer->temporal_filter;
+  temporal_deltas = renderer->temporal_deltas;
 
   /* the number of additional rows of buckets we put at the edge so
      that the filter doesn't go off the edge */
@@ -164,27 +344,51 @@ render_rectangle (frame_spec    *spec,
   nbuckets = width * height;
   if (1)
     {
-      static char *last_block = NULL;
-      static int   last_block_size = 0;
       int memory_rqd = (sizeof (bucket) * nbuckets +
-                        sizeof (abucket) * nbuckets +
-                        sizeof (point) * SUB_BATCH_SIZE);
-      if (memory_rqd > last_block_size)
+                        sizeof (abucket) * nbuckets);
+      if (memory_rqd > renderer->block_size)
         {
-          if (last_block != NULL)
-            free (last_block);
-          last_block = malloc (memory_rqd);
-          if (last_block == NULL)
+          if (renderer->block != NULL)
+            free (renderer->block);
+          renderer->block = malloc (memory_rqd);
+          if (renderer->block == NULL)
             {
               fprintf (stderr, "render_rectangle: cannot malloc %d bytes.\n",
                        memory_rqd);
               exit (1);
             }
-          last_block_size = memory_rqd;
+          renderer->block_size = memory_rqd;
+        }
+      buckets = (bucket *) renderer->block;
+      accumulate = (abucket *) (renderer->block + sizeof (bucket) * nbuckets);
+    }
+
+  /* the first worker runs on this thread and fills in buckets
+     directly; the others get private histograms, as many as fit */
+  n_threads = MIN (renderer->n_threads,
+                   1 + MAX_THREAD_BUCKET_MEMORY / (sizeof (bucket) * nbuckets));
+
+  if (nbuckets > renderer->thread_nbuckets)
+    {
+      for (i = 0; i < THREADS_MAX; i++)
+        {
+          g_free (renderer->thread_buckets[i]);
+          renderer->thread_buckets[i] = NULL;
         }
-      buckets = (bucket *) last_block;
-      accumulate = (abucket *) (last_block + sizeof (bucket) * nbuckets);
-      points = (point *)  (last_block + (sizeof (bucket) + sizeof (abucket)) * nbuckets);
+      renderer->thread_nbuckets = nbuckets;
+    }
+
+  for (i = 0; i < n_threads; i++)
+    {
+      if (i > 0 && renderer->thread_buckets[i] == NULL)
+        renderer->thread_buckets[i] = g_new (bucket, renderer->thread_nbuckets);
+      if (renderer->points[i] == NULL)
+        renderer->points[i] = g_new (point, SUB_BATCH_SIZE);
+
+      workers[i].job     = &job;
+      workers[i].buckets = (i == 0) ? buckets : renderer->thread_buckets[i];
+      workers[i].points  = renderer->points[i];
+      workers[i].gr      = g_rand_new_with_seed (g_random_int ());
     }
 
   memset ((char *) accumulate, 0, sizeof (abucket) * nbuckets);
@@ -193,7 +397,8 @@ render_rectangle (frame_spec    *spec,
       double        batch_time;
       double        sample_density;
       control_point cp;
-      memset ((char *) buckets, 0, sizeof (bucket) * nbuckets);
+      for (i = 0; i < n_threads; i++)
+        memset ((char *) workers[i].buckets, 0, sizeof (bucket) * nbuckets);
       batch_time = spec->time + temporal_deltas[batch_num];
 
       /* interpolate and get a control point */
@@ -254,50 +459,39 @@ render_rectangle (frame_spec    *spec,
                         (oversample * oversample));
       batch_size = nsamples / cp.nbatches;
 
-      sbc = 0;
-      for (sub_batch = 0;
-           sub_batch < batch_size;
-           sub_batch += SUB_BATCH_SIZE)
+      job.cp               = &cp;
+      job.cmap             = cmap;
+      job.bounds[0]        = bounds[0];
+      job.bounds[1]        = bounds[1];
+      job.bounds[2]        = bounds[2];
+      job.bounds[3]        = bounds[3];
+      job.size[0]          = size[0];
+      job.size[1]          = size[1];
+      job.width            = width;
+      job.height           = height;
+      job.n_sub_batches    = (batch_size + SUB_BATCH_SIZE - 1) / SUB_BATCH_SIZE;
+      job.next_sub_batch   = 0;
+      job.sub_batches_done = 0;
+
+      for (i = 1; i < n_threads; i++)
+        threads[i] = g_thread_create (chaos_thread, &workers[i], TRUE, NULL);
+
+      chaos_game (&workers[0], progress);
+
+      for (i = 1; i < n_threads; i++)
+        if (threads[i])
+          g_thread_join (threads[i]);
+
+      /* add the private histograms into buckets, saturating like a
+       * single histogram would
+       */
+      for (i = 1; i < n_threads; i++)
         {
-          if (progress && (sbc++ % 32) == 0)
-              (*progress)(0.5 * sub_batch / (double) batch_size);
-          /* generate a sub_batch_size worth of samples */
-          points[0][0] = random_uniform11 ();
-          points[0][1] = random_uniform11 ();
-          points[0][2] = random_uniform01 ();
-          iterate (&cp, SUB_BATCH_SIZE, FUSE, points);
-
-          /* merge them into buckets, looking up colors */
-          for (j = 0; j < SUB_BATCH_SIZE; j++)
-            {
-              int k, color_index;
-              double *p = points[j];
-              bucket *b;
-
-              /* Note that we must test if p[0] and p[1] is "within"
-               * the valid bounds rather than "not outside", because
-               * p[0] and p[1] might be NaN.
-               */
-              if (p[0] >= bounds[0] &&
-                  p[1] >= bounds[1] &&
-                  p[0] <= bounds[2] &&
-                  p[1] <= bounds[3])
-                {
-                  color_index = (int) (p[2] * CMAP_SIZE);
-
-                  if (color_index < 0)
-                    color_index = 0;
-                  else if (color_index > CMAP_SIZE - 1)
-                    color_index = CMAP_SIZE - 1;
+          bucket *b = workers[i].buckets;
 
-                  b = buckets +
-                      (int) (width * (p[0] - bounds[0]) * size[0]) +
-                      width * (int) (height * (p[1] - bounds[1]) * size[1]);
-
-                  for (k = 0; k < 4; k++)
-                    bump_no_overflow(b[0][k], cmap[color_index][k], short);
-                }
-            }
+          for (j = 0; j < nbuckets; j++)
+            for (k = 0; k < 4; k++)
+              buckets[j][k] = MIN ((gint) buckets[j][k] + b[j][k], G_MAXSHORT);
         }
 
       if (1)
@@ -391,6 +585,23 @@ render_rectangle (frame_spec    *spec,
         }
     }
 
-  free (filter);
-  free (temporal_filter);
+  for (i = 0; i < n_threads; i++)
+    g_rand_free (workers[i].gr);
+}
+
+void
+render_rectangle (frame_spec    *spec,
+                  unsigned char *out,
+                  int            out_width,
+                  int            field,
+                  int            nchan,
+                  int progress(double))
+{
+  static flame_renderer *renderer = NULL;
+
+  if (renderer == NULL)
+    renderer = flame_renderer_new (threads_get_count ());
+
+  flame_renderer_render (renderer, spec, out, out_width, field, nchan,
+                         progress);
 }
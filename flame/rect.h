@@ -35,6 +35,16 @@ typedef struct {
 #define field_odd   2
 
 
+/* keeps buffers and filter kernels from one frame to the next.  each
+   renderer may be used by one thread at a time. */
+typedef struct flame_renderer flame_renderer;
+
+
+extern flame_renderer *flame_renderer_new(int n_threads);
+extern void flame_renderer_free(flame_renderer *renderer);
+extern void flame_renderer_render(flame_renderer *renderer, frame_spec *spec,
+                                  unsigned char *out, int out_width,
+                                  int field, int nchan, int progress(double));
 extern void render_rectangle(frame_spec *spec, unsigned char *out,
                              int out_width, int field, int nchan,
                              int progress(double));
@@ -1223,14 +1223,13 @@ explorer_dialog (void)
 void
 dialog_update_preview (void)
 {
-  gint     ycoord;
-  guchar  *p_ul;
-
   if (NULL == wint.preview)
     return;
 
   if (ready_now && wvals.alwayspreview)
     {
+      ExplorerKernel *kernel;
+
       xmin = wvals.xmin;
       xmax = wvals.xmax;
       ymin = wvals.ymin;
@@ -1240,17 +1239,16 @@ dialog_update_preview (void)
       xdiff = (xmax - xmin) / xbild;
       ydiff = (ymax - ymin) / ybild;
 
-      p_ul = wint.wimage;
+      kernel = explorer_kernel_new ();
 
-      for (ycoord = 0; ycoord < preview_height; ycoord++)
-        {
-          explorer_render_row (NULL,
-                               p_ul,
-                               ycoord,
-                               preview_width,
-                               3);
-          p_ul += preview_width * 3;
-        }
+      explorer_render_rows (kernel,
+                            wint.wimage,
+                            0,
+                            preview_height,
+                            preview_width,
+                            3);
+
+      explorer_kernel_free (kernel);
 
       preview_redraw ();
     }
@@ -69,6 +69,8 @@
 
 #include "libgimp/stdplugins-intl.h"
 
+#include "plug-ins/common/threads.h"
+
 
 /**********************************************************************
   Global variables
@@ -397,18 +399,18 @@ run (const gchar      *name,
 static void
 explorer (GimpDrawable * drawable)
 {
-  GimpPixelRgn  srcPR;
-  GimpPixelRgn  destPR;
-  gint          width;
-  gint          height;
-  gint          bpp;
-  gint          row;
-  gint          x1;
-  gint          y1;
-  gint          x2;
-  gint          y2;
-  guchar       *src_row;
-  guchar       *dest_row;
+  GimpPixelRgn    destPR;
+  gint            width;
+  gint            height;
+  gint            bpp;
+  gint            row;
+  gint            band_height;
+  gint            x1;
+  gint            y1;
+  gint            x2;
+  gint            y2;
+  guchar         *dest_band;
+  ExplorerKernel *kernel;
 
   /* Get the input area. This is the bounding box of the selection in
    *  the image (or the entire image if there is no selection). Only
@@ -425,12 +427,11 @@ explorer (GimpDrawable * drawable)
   height = drawable->height;
   bpp  = drawable->bpp;
 
-  /*  allocate row buffers  */
-  src_row  = g_new (guchar, bpp * (x2 - x1));
-  dest_row = g_new (guchar, bpp * (x2 - x1));
+  /*  the rows of a band are rendered in parallel, then stored  */
+  band_height = gimp_tile_height ();
+  dest_band   = g_new (guchar, bpp * (x2 - x1) * band_height);
 
-  /*  initialize the pixel regions  */
-  gimp_pixel_rgn_init (&srcPR, drawable, 0, 0, width, height, FALSE, FALSE);
+  /*  initialize the pixel region  */
   gimp_pixel_rgn_init (&destPR, drawable, 0, 0, width, height, TRUE, TRUE);
 
   xbild = width;
@@ -448,43 +449,421 @@ explorer (GimpDrawable * drawable)
                                             colormap[i].b);
     }
 
-  for (row = y1; row < y2; row++)
+  kernel = explorer_kernel_new ();
+
+  for (row = y1; row < y2; row += band_height)
     {
-      gimp_pixel_rgn_get_row (&srcPR, src_row, x1, row, (x2 - x1));
+      gint n_rows = MIN (band_height, y2 - row);
 
-      explorer_render_row (src_row,
-                           dest_row,
-                           row,
-                           (x2 - x1),
-                           bpp);
+      explorer_render_rows (kernel,
+                            dest_band,
+                            row,
+                            n_rows,
+                            (x2 - x1),
+                            bpp);
 
       /*  store the dest  */
-      gimp_pixel_rgn_set_row (&destPR, dest_row, x1, row, (x2 - x1));
+      gimp_pixel_rgn_set_rect (&destPR, dest_band, x1, row, (x2 - x1), n_rows);
 
-      if ((row % 10) == 0)
-        gimp_progress_update ((double) row / (double) (y2 - y1));
+      gimp_progress_update ((double) (row + n_rows - y1) / (double) (y2 - y1));
     }
   gimp_progress_update (1.0);
 
+  explorer_kernel_free (kernel);
+
   /*  update the processed region  */
   gimp_drawable_flush (drawable);
   gimp_drawable_merge_shadow (drawable->drawable_id, TRUE);
   gimp_drawable_update (drawable->drawable_id, x1, y1, (x2 - x1), (y2 - y1));
 
-  g_free (src_row);
-  g_free (dest_row);
+  g_free (dest_band);
 }
 
 /**********************************************************************
- FUNCTION: explorer_render_row
+ Rendering
+
+ The rows are computed by several threads.  The fractal type is
+ dispatched once per row to a kernel that is specialized for it;
+ Mandelbrot and Julia sets are iterated LANES pixels at a time, which
+ the compiler can keep in vector registers.  When the pixels get so
+ close together that doubles can no longer tell them apart, those two
+ types switch to perturbation: a single reference orbit is computed in
+ extended precision and every pixel only iterates its (small) distance
+ from it, after skipping the first iterations with a series
+ approximation.
  *********************************************************************/
 
+#define LANES                  4
+/* perturb when the pixel spacing is below this, relative to the
+ * coordinates
+ */
+#define PERTURBATION_THRESHOLD 1e-12
+
+/* the series approximation is used as long as each term is this much
+ * smaller than the one before
+ */
+#define SERIES_TOLERANCE       1e-3
+
+struct _ExplorerKernel
+{
+  gint      type;
+  gint      iteration;
+  gdouble   cx;
+  gdouble   cy;
+
+  /* the reference orbit, for perturbation */
+  gboolean  perturb;
+  gdouble   center_x;      /* offset of the reference from xmin, ymin */
+  gdouble   center_y;
+  gdouble  *orbit;         /* x, y pairs */
+  gint      orbit_length;
+
+  /* series approximation at iteration 'skip' */
+  gint      skip;
+  gdouble   series[6];     /* A, B, C as x, y pairs */
+};
+
+typedef struct
+{
+  const ExplorerKernel *kernel;
+  guchar               *dest;
+  gint                  first_row;
+  gint                  n_rows;
+  gint                  row_width;
+  gint                  bpp;
+  volatile gint         next_row;
+} ExplorerJob;
+
+/*  Computes the reference orbit through the middle of the view and
+ *  finds how many iterations the series approximation can skip for
+ *  every pixel in it.
+ */
+static void
+explorer_kernel_init_perturbation (ExplorerKernel *kernel)
+{
+  gboolean    julia = (kernel->type == TYPE_JULIA);
+  long double zx, zy, ax, ay;
+  gdouble     delta, delta2, delta3;
+  gdouble     A[2], B[2], C[2];
+  gint        n;
+
+  /* the middle of the view, as an exact offset from its corner */
+  kernel->center_x = (xmax - xmin) / 2.0;
+  kernel->center_y = (ymax - ymin) / 2.0;
+
+  if (julia)
+    {
+      zx = (long double) xmin + kernel->center_x;
+      zy = (long double) ymin + kernel->center_y;
+      ax = kernel->cx;
+      ay = kernel->cy;
+    }
+  else
+    {
+      zx = 0.0;
+      zy = 0.0;
+      ax = (long double) xmin + kernel->center_x;
+      ay = (long double) ymin + kernel->center_y;
+    }
+
+  kernel->orbit = g_new (gdouble, 2 * (kernel->iteration + 1));
+  kernel->orbit[0] = zx;
+  kernel->orbit[1] = zy;
+
+  for (n = 0; n < kernel->iteration; n++)
+    {
+      long double xx = zx * zx - zy * zy + ax;
+
+      zy = 2.0 * zx * zy + ay;
+      zx = xx;
+
+      kernel->orbit[2 * (n + 1) + 0] = zx;
+      kernel->orbit[2 * (n + 1) + 1] = zy;
+
+      if (zx * zx + zy * zy >= 4.0)
+        {
+          n++;
+          break;
+        }
+    }
+
+  kernel->orbit_length = n;
+
+  /*  delta_n ~= A_n d + B_n d^2 + C_n d^3, where d is the distance of
+   *  the pixel from the reference (in z for Julia sets, in c for the
+   *  Mandelbrot set)
+   */
+  delta  = sqrt (kernel->center_x * kernel->center_x +
+                 kernel->center_y * kernel->center_y);
+  delta2 = delta * delta;
+  delta3 = delta2 * delta;
+
+  A[0] = julia ? 1.0 : 0.0;
+  A[1] = 0.0;
+  B[0] = B[1] = 0.0;
+  C[0] = C[1] = 0.0;
+
+  kernel->skip = 0;
+
+  for (n = 0; n < kernel->orbit_length; n++)
+    {
+      gdouble zx2 = 2.0 * kernel->orbit[2 * n + 0];
+      gdouble zy2 = 2.0 * kernel->orbit[2 * n + 1];
+      gdouble nA[2], nB[2], nC[2];
+      gdouble a, b, c, z;
+
+      nA[0] = zx2 * A[0] - zy2 * A[1] + (julia ? 0.0 : 1.0);
+      nA[1] = zx2 * A[1] + zy2 * A[0];
+      nB[0] = zx2 * B[0] - zy2 * B[1] + A[0] * A[0] - A[1] * A[1];
+      nB[1] = zx2 * B[1] + zy2 * B[0] + 2.0 * A[0] * A[1];
+      nC[0] = (zx2 * C[0] - zy2 * C[1] +
+               2.0 * (A[0] * B[0] - A[1] * B[1]));
+      nC[1] = (zx2 * C[1] + zy2 * C[0] +
+               2.0 * (A[0] * B[1] + A[1] * B[0]));
+
+      a = sqrt (nA[0] * nA[0] + nA[1] * nA[1]) * delta;
+      b = sqrt (nB[0] * nB[0] + nB[1] * nB[1]) * delta2;
+      c = sqrt (nC[0] * nC[0] + nC[1] * nC[1]) * delta3;
+      z = sqrt (kernel->orbit[2 * (n + 1) + 0] * kernel->orbit[2 * (n + 1) + 0] +
+                kernel->orbit[2 * (n + 1) + 1] * kernel->orbit[2 * (n + 1) + 1]);
+
+      /* stop when the series diverges, or some pixel might escape */
+      if (b > SERIES_TOLERANCE * a ||
+          c > SERIES_TOLERANCE * b ||
+          z + a + b + c >= 2.0)
+        break;
+
+      A[0] = nA[0]; A[1] = nA[1];
+      B[0] = nB[0]; B[1] = nB[1];
+      C[0] = nC[0]; C[1] = nC[1];
+
+      kernel->skip = n + 1;
+    }
+
+  kernel->series[0] = A[0];
+  kernel->series[1] = A[1];
+  kernel->series[2] = B[0];
+  kernel->series[3] = B[1];
+  kernel->series[4] = C[0];
+  kernel->series[5] = C[1];
+}
+
+/*  Sets up the kernel for the current values and view.  It is meant
+ *  to be created once per render, since the reference orbit can take
+ *  as long as a row of pixels.
+ */
+ExplorerKernel *
+explorer_kernel_new (void)
+{
+  ExplorerKernel *kernel = g_new0 (ExplorerKernel, 1);
+  gdouble         scale  = MAX (MAX (fabs (xmin), fabs (xmax)),
+                                MAX (fabs (ymin), fabs (ymax)));
+
+  kernel->type      = wvals.fractaltype;
+  kernel->iteration = wvals.iter;
+  kernel->cx        = wvals.cx;
+  kernel->cy        = wvals.cy;
+  kernel->orbit     = NULL;
+
+  kernel->perturb = ((kernel->type == TYPE_MANDELBROT ||
+                      kernel->type == TYPE_JULIA) &&
+                     (fabs (xdiff) < PERTURBATION_THRESHOLD * scale ||
+                      fabs (ydiff) < PERTURBATION_THRESHOLD * scale));
+
+  if (kernel->perturb)
+    explorer_kernel_init_perturbation (kernel);
+
+  return kernel;
+}
+
 void
-explorer_render_row (const guchar *src_row,
-                     guchar       *dest_row,
-                     gint          row,
-                     gint          row_width,
-                     gint          bpp)
+explorer_kernel_free (ExplorerKernel *kernel)
+{
+  g_free (kernel->orbit);
+  g_free (kernel);
+}
+
+/*  Mandelbrot and Julia sets, LANES pixels at a time.  Lanes that have
+ *  escaped are masked out and keep their last values; the group stops
+ *  when all of them have escaped.
+ */
+static void
+explorer_iterate_quadratic (const ExplorerKernel *kernel,
+                            gint                  row,
+                            gint                  row_width,
+                            gint                 *counters,
+                            gdouble              *xs,
+                            gdouble              *ys)
+{
+  gboolean julia = (kernel->type == TYPE_JULIA);
+  gdouble  b     = ymin + (double) row * ydiff;
+  gint     col;
+
+  for (col = 0; col < row_width; col += LANES)
+    {
+      gdouble x[LANES], y[LANES];
+      gdouble ca[LANES], cb[LANES];
+      gint    count[LANES];
+      gint    active[LANES];
+      gint    n_active;
+      gint    counter;
+      gint    l;
+
+      for (l = 0; l < LANES; l++)
+        {
+          gdouble a = xmin + (double) (col + l) * xdiff;
+
+          x[l]      = julia ? a : 0.0;
+          y[l]      = julia ? b : 0.0;
+          ca[l]     = julia ? kernel->cx : a;
+          cb[l]     = julia ? kernel->cy : b;
+          count[l]  = 0;
+          active[l] = (col + l < row_width);
+        }
+
+      for (counter = 0, n_active = 1;
+           counter < kernel->iteration && n_active;
+           counter++)
+        {
+          n_active = 0;
+
+          for (l = 0; l < LANES; l++)
+            {
+              gdouble xx = x[l] * x[l] - y[l] * y[l] + ca[l];
+              gdouble yy = 2.0 * x[l] * y[l] + cb[l];
+
+              x[l] = active[l] ? xx : x[l];
+              y[l] = active[l] ? yy : y[l];
+
+              active[l] &= ! ((xx * xx + yy * yy) >= 4.0);
+              count[l]  += active[l];
+              n_active  += active[l];
+            }
+        }
+
+      for (l = 0; l < LANES && col + l < row_width; l++)
+        {
+          counters[col + l] = count[l];
+          xs[col + l]       = x[l];
+          ys[col + l]       = y[l];
+        }
+    }
+}
+
+/*  Mandelbrot and Julia sets by perturbation of the reference orbit.
+ *  When a pixel's orbit gets closer to zero than to the reference (a
+ *  glitch), or the reference escapes first, Mandelbrot pixels restart
+ *  from the beginning of the reference orbit and Julia pixels carry on
+ *  in plain doubles.
+ */
+static void
+explorer_iterate_perturbed (const ExplorerKernel *kernel,
+                            gint                  row,
+                            gint                  row_width,
+                            gint                 *counters,
+                            gdouble              *xs,
+                            gdouble              *ys)
+{
+  gboolean       julia = (kernel->type == TYPE_JULIA);
+  const gdouble *orbit = kernel->orbit;
+  const gdouble *s     = kernel->series;
+  gdouble        db    = (double) row * ydiff - kernel->center_y;
+  gint           col;
+
+  for (col = 0; col < row_width; col++)
+    {
+      gdouble da = (double) col * xdiff - kernel->center_x;
+      gdouble ea = julia ? 0.0 : da;
+      gdouble eb = julia ? 0.0 : db;
+      gdouble d2a, d2b, d3a, d3b;
+      gdouble dx, dy;
+      gdouble x, y;
+      gint    counter;
+      gint    n;
+
+      /* skip ahead with the series approximation */
+      d2a = da * da - db * db;
+      d2b = 2.0 * da * db;
+      d3a = d2a * da - d2b * db;
+      d3b = d2a * db + d2b * da;
+
+      dx = (s[0] * da  - s[1] * db  +
+            s[2] * d2a - s[3] * d2b +
+            s[4] * d3a - s[5] * d3b);
+      dy = (s[0] * db  + s[1] * da  +
+            s[2] * d2b + s[3] * d2a +
+            s[4] * d3b + s[5] * d3a);
+
+      n = kernel->skip;
+      x = orbit[2 * n + 0] + dx;
+      y = orbit[2 * n + 1] + dy;
+
+      for (counter = kernel->skip; counter < kernel->iteration; counter++)
+        {
+          gdouble zx = orbit[2 * n + 0];
+          gdouble zy = orbit[2 * n + 1];
+          gdouble xx;
+
+          if (n == kernel->orbit_length ||
+              x * x + y * y < dx * dx + dy * dy)
+            {
+              if (julia)
+                break;
+
+              /* rebase, orbit[0] is zero */
+              dx = x;
+              dy = y;
+              n  = 0;
+              zx = 0.0;
+              zy = 0.0;
+            }
+
+          xx = 2.0 * (zx * dx - zy * dy) + dx * dx - dy * dy + ea;
+          dy = 2.0 * (zx * dy + zy * dx) + 2.0 * dx * dy + eb;
+          dx = xx;
+          n++;
+
+          x = orbit[2 * n + 0] + dx;
+          y = orbit[2 * n + 1] + dy;
+
+          if (((x * x) + (y * y)) >= 4.0)
+            break;
+        }
+
+      /* Julia pixels that left the reference */
+      if (julia && counter < kernel->iteration &&
+          ((x * x) + (y * y)) < 4.0)
+        {
+          for (; counter < kernel->iteration; counter++)
+            {
+              gdouble xx = x * x - y * y + kernel->cx;
+
+              y = 2.0 * x * y + kernel->cy;
+              x = xx;
+
+              if (((x * x) + (y * y)) >= 4.0)
+                break;
+            }
+        }
+
+      counters[col] = counter;
+      xs[col]       = x;
+      ys[col]       = y;
+    }
+}
+
+/*  All the other types, one pixel at a time.  It is inlined into
+ *  explorer_iterate_row() once per type, so the switch is resolved at
+ *  compile time.
+ */
+static inline void
+explorer_iterate_generic (const ExplorerKernel *kernel,
+                          gint                  type,
+                          gint                  row,
+                          gint                  row_width,
+                          gint                 *counters,
+                          gdouble              *xs,
+                          gdouble              *ys)
 {
   gint    col;
   gdouble a;
@@ -502,53 +881,25 @@ explorer_render_row (const guchar *src_row,
   gdouble foldyinitx;
   gdouble foldyinity;
   gdouble xx = 0;
-  gdouble adjust;
-  gdouble cx;
-  gdouble cy;
+  gdouble cx = kernel->cx;
+  gdouble cy = kernel->cy;
   gint    counter;
-  gint    color;
-  gint    iteration;
-  gint    useloglog;
-  gdouble log2;
-
-  cx = wvals.cx;
-  cy = wvals.cy;
-  useloglog = wvals.useloglog;
-  iteration = wvals.iter;
-  log2 = log (2.0);
 
   for (col = 0; col < row_width; col++)
     {
       a = xmin + (double) col * xdiff;
       b = ymin + (double) row * ydiff;
-      if (wvals.fractaltype != 0)
-        {
-          tmpx = x = a;
-          tmpy = y = b;
-        }
-      else
-        {
-          x = 0;
-          y = 0;
-        }
 
-      for (counter = 0; counter < iteration; counter++)
+      tmpx = x = a;
+      tmpy = y = b;
+
+      for (counter = 0; counter < kernel->iteration; counter++)
         {
           oldx=x;
           oldy=y;
 
-          switch (wvals.fractaltype)
+          switch (type)
             {
-            case TYPE_MANDELBROT:
-              xx = x * x - y * y + a;
-              y = 2.0 * x * y + b;
-              break;
-
-            case TYPE_JULIA:
-              xx = x * x - y * y + cx;
-              y = 2.0 * x * y + cy;
-              break;
-
             case TYPE_BARNSLEY_1:
               foldxinitx = oldx * cx;
               foldyinity = oldy * cy;
@@ -647,7 +998,75 @@ explorer_render_row (const guchar *src_row,
             break;
         }
 
-      if (useloglog)
+      counters[col] = counter;
+      xs[col]       = x;
+      ys[col]       = y;
+    }
+}
+
+static void
+explorer_iterate_row (const ExplorerKernel *kernel,
+                      gint                  row,
+                      gint                  row_width,
+                      gint                 *counters,
+                      gdouble              *xs,
+                      gdouble              *ys)
+{
+  switch (kernel->type)
+    {
+    case TYPE_MANDELBROT:
+    case TYPE_JULIA:
+      if (kernel->perturb)
+        explorer_iterate_perturbed (kernel, row, row_width,
+                                    counters, xs, ys);
+      else
+        explorer_iterate_quadratic (kernel, row, row_width,
+                                    counters, xs, ys);
+      break;
+
+#define GENERIC(type)                                           \
+    case type:                                                  \
+      explorer_iterate_generic (kernel, type, row, row_width,   \
+                                counters, xs, ys);              \
+      break
+
+    GENERIC (TYPE_BARNSLEY_1);
+    GENERIC (TYPE_BARNSLEY_2);
+    GENERIC (TYPE_BARNSLEY_3);
+    GENERIC (TYPE_SPIDER);
+    GENERIC (TYPE_MAN_O_WAR);
+    GENERIC (TYPE_LAMBDA);
+    GENERIC (TYPE_SIERPINSKI);
+
+#undef GENERIC
+
+    default:
+      explorer_iterate_generic (kernel, -1, row, row_width,
+                                counters, xs, ys);
+      break;
+    }
+}
+
+static void
+explorer_color_row (const ExplorerKernel *kernel,
+                    const gint           *counters,
+                    const gdouble        *xs,
+                    const gdouble        *ys,
+                    guchar               *dest_row,
+                    gint                  row_width,
+                    gint                  bpp)
+{
+  gint    col;
+  gdouble log2 = log (2.0);
+
+  for (col = 0; col < row_width; col++)
+    {
+      gdouble x = xs[col];
+      gdouble y = ys[col];
+      gdouble adjust;
+      gint    color;
+
+      if (wvals.useloglog)
         {
           gdouble modulus_square = (x * x) + (y * y);
 
@@ -661,7 +1080,8 @@ explorer_render_row (const guchar *src_row,
           adjust = 0.0;
         }
 
-      color = (int) (((counter - adjust) * (wvals.ncolors - 1)) / iteration);
+      color = (int) (((counters[col] - adjust) * (wvals.ncolors - 1)) /
+                     kernel->iteration);
       if (bpp >= 3)
         {
           dest_row[col * bpp + 0] = colormap[color].r;
@@ -673,8 +1093,73 @@ explorer_render_row (const guchar *src_row,
 
       if (! ( bpp % 2))
         dest_row [col * bpp + bpp - 1] = 255;
+    }
+}
+
+static gpointer
+explorer_render_thread (gpointer data)
+{
+  ExplorerJob *job = data;
+  gint        *counters;
+  gdouble     *xs;
+  gdouble     *ys;
+  gint         row;
 
+  counters = g_new (gint,    job->row_width);
+  xs       = g_new (gdouble, job->row_width);
+  ys       = g_new (gdouble, job->row_width);
+
+  while ((row = g_atomic_int_add (&job->next_row, 1)) < job->n_rows)
+    {
+      explorer_iterate_row (job->kernel, job->first_row + row, job->row_width,
+                            counters, xs, ys);
+      explorer_color_row (job->kernel, counters, xs, ys,
+                          job->dest + row * job->row_width * job->bpp,
+                          job->row_width, job->bpp);
     }
+
+  g_free (counters);
+  g_free (xs);
+  g_free (ys);
+
+  return NULL;
+}
+
+/**********************************************************************
+ FUNCTION: explorer_render_rows
+ *********************************************************************/
+
+void
+explorer_render_rows (const ExplorerKernel *kernel,
+                      guchar               *dest,
+                      gint                  first_row,
+                      gint                  n_rows,
+                      gint                  row_width,
+                      gint                  bpp)
+{
+  ExplorerJob  job;
+  GThread     *threads[THREADS_MAX];
+  gint         n_threads;
+  gint         i;
+
+  job.kernel    = kernel;
+  job.dest      = dest;
+  job.first_row = first_row;
+  job.n_rows    = n_rows;
+  job.row_width = row_width;
+  job.bpp       = bpp;
+  job.next_row  = 0;
+
+  n_threads = MIN (threads_get_count (), n_rows);
+
+  for (i = 1; i < n_threads; i++)
+    threads[i] = g_thread_create (explorer_render_thread, &job, TRUE, NULL);
+
+  explorer_render_thread (&job);
+
+  for (i = 1; i < n_threads; i++)
+    if (threads[i])
+      g_thread_join (threads[i]);
 }
 
 static void
@@ -98,6 +98,8 @@ typedef struct
 
 typedef struct _DialogElements DialogElements;
 
+typedef struct _ExplorerKernel ExplorerKernel;
+
 struct _DialogElements
 {
   GtkWidget  *type[NUM_TYPES];
@@ -208,9 +210,13 @@ extern GimpDrawable   *drawable;
   Global functions
  *********************************************************************/
 
-void explorer_render_row (const guchar *src_row,
-                          guchar       *dest_row,
-                          gint          row,
-                          gint          row_width,
-                          gint          bpp);
+ExplorerKernel * explorer_kernel_new  (void);
+void             explorer_kernel_free (ExplorerKernel       *kernel);
+
+void             explorer_render_rows (const ExplorerKernel *kernel,
+                                       guchar               *dest,
+                                       gint                  first_row,
+                                       gint                  n_rows,
+                                       gint                  row_width,
+                                       gint                  bpp);
 #endif
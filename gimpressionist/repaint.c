@@ -36,8 +36,85 @@
 
 #include <libgimp/stdplugins-intl.h>
 
+#include "plug-ins/common/threads.h"
+
+#define STROKE_CHUNK 32   /* strokes a thread takes from the list at a time */
+
+/* The pixels a brush covers, listed once so that the color and
+ * deviation sums don't have to test every pixel of the brush box.
+ * The offsets are in bytes from the brush's top left corner, in the
+ * (edge padded) source image.
+ */
+typedef struct
+{
+  int     n;
+  int    *offset;
+  double *weight;   /* coverage, 0.0 - 1.0 */
+} brush_mask_t;
+
+/* Everything a stroke needs from the random number generator is drawn
+ * up front, in order, by the main thread; brush and color are then
+ * worked out on several threads and the strokes are finally painted
+ * in their original order.
+ */
+typedef struct
+{
+  int    tx, ty;    /* center first, top left corner once placed */
+  int    on, sn;
+  double pick;      /* breaks ties between equally good brushes */
+  double noise[3];
+  int    n;         /* the brush */
+  int    r, g, b;
+} stroke_t;
+
+typedef struct
+{
+  ppm_t          *p, *a;
+  ppm_t          *brushes;
+  brush_mask_t   *masks;
+  double         *brushes_sum;
+  int             num_brushes;
+  int             maxbrushwidth, maxbrushheight;
+
+  stroke_t       *strokes;
+  int             num_strokes;
+  volatile gint   next_stroke;
+} place_job_t;
+
+typedef struct
+{
+  ppm_t          *tmp, *atmp;
+  ppm_t          *brushes, *shadows;
+  int             maxbrushwidth, maxbrushheight;
+
+  stroke_t       *strokes;
+  int             num_strokes;
+  int             band_height;
+  int             num_bands;
+  volatile gint   next_band;
+} paint_job_t;
+
 static gimpressionist_vals_t runningvals;
 
+static void
+show_progress (double fraction)
+{
+  if (runningvals.run)
+    {
+      gimp_progress_update (0.8 * fraction);
+    }
+  else
+    {
+      char tmps[40];
+
+      g_snprintf (tmps, sizeof (tmps), "%.1f %%", 100 * fraction);
+      preview_set_button_label (tmps);
+
+      while (gtk_events_pending ())
+        gtk_main_iteration ();
+    }
+}
+
 static double
 get_siz_from_pcvals (double x, double y)
 {
@@ -123,112 +200,126 @@ get_hue (guchar *rgb)
   return h * 255.0 / 6.0;
 }
 
+static void
+brush_mask_init (brush_mask_t *mask, ppm_t *brush, int rowstride)
+{
+  int x, y, n = 0;
+
+  mask->offset = g_new (int, brush->width * brush->height);
+  mask->weight = g_new (double, brush->width * brush->height);
+
+  for (y = 0; y < brush->height; y++)
+    {
+      for (x = 0; x < brush->width; x++)
+        {
+          int h = brush->col[y * brush->width * 3 + x * 3];
+
+          if (h)
+            {
+              mask->offset[n] = y * rowstride + x * 3;
+              mask->weight[n] = h / 255.0;
+              n++;
+            }
+        }
+    }
+  mask->n = n;
+}
+
+static void
+brush_mask_free (brush_mask_t *mask)
+{
+  g_free (mask->offset);
+  g_free (mask->weight);
+}
+
 static int
 choose_best_brush (ppm_t *p, ppm_t *a, int tx, int ty,
-                   ppm_t *brushes, int num_brushes,
-                   double *brushes_sum, int start, int step)
+                   brush_mask_t *masks, int num_brushes,
+                   double *brushes_sum, int start, int step,
+                   double pick)
 {
-  double dev, thissum;
-  double bestdev = 0.0;
-  double r, g, b;
-  int    best = -1;
-  int    x, y, h;
-  long   i;
-  GList *brlist = NULL;
+  const guchar *src = p->col + ty * p->width * 3 + tx * 3;
+  const guchar *alpha = NULL;
+  double        bestdev = 0.0;
+  int           best = -1;
+  int          *ties;
+  int           num_ties = 0;
+  int           i, j;
+
+  if (img_has_alpha)
+    alpha = a->col + ty * a->width * 3 + tx * 3;
+
+  ties = g_newa (int, num_brushes);
 
   for (i = start; i < num_brushes; i += step)
     {
-      ppm_t *brush = &brushes[i];
-#if 0
-      thissum = 0.0;
-#endif
-      thissum = brushes_sum[i];
+      const brush_mask_t *mask = &masks[i];
+      double              thissum = brushes_sum[i];
+      double              dev, r, g, b;
 
-/* TODO: Pointer-arithmeticize this code */
       r = g = b = 0.0;
-      for (y = 0; y < brush->height; y++)
+      for (j = 0; j < mask->n; j++)
         {
-          guchar *row = p->col + (ty + y) * p->width * 3;
+          const guchar *s = src + mask->offset[j];
+          double        v = mask->weight[j];
 
-          for (x = 0; x < brush->width; x++)
-            {
-              int    k = (tx + x) * 3;
-              double v;
-
-              if ((h = brush->col[(y * brush->width * 3) + x * 3]))
-                {
-#if 0
-                  thissum += h;
-#endif
-                  v = h / 255.0;
-                  r += row[k+0] * v;
-                  g += row[k+1] * v;
-                  b += row[k+2] * v;
-                }
-            }
+          r += s[0] * v;
+          g += s[1] * v;
+          b += s[2] * v;
         }
       r = r * 255.0 / thissum;
       g = g * 255.0 / thissum;
       b = b * 255.0 / thissum;
 
       dev = 0.0;
-      for (y = 0; y < brush->height; y++)
+      for (j = 0; j < mask->n; j++)
         {
-          guchar *row = p->col + (ty + y) * p->width * 3;
-
-          for (x = 0; x < brush->width; x++)
-            {
-              int    k = (tx + x) * 3;
-              double v;
-
-              if ((h = brush->col[(y * brush->width * 3) + x * 3]))
-                {
-                  v = h / 255.0;
-                  dev += abs (row[k+0] - r) * v;
-                  dev += abs (row[k+1] - g) * v;
-                  dev += abs (row[k+2] - b) * v;
-                  if (img_has_alpha)
-                    dev += a->col[(ty + y) * a->width * 3 + (tx + x) * 3] * v;
-                }
-            }
+          const guchar *s = src + mask->offset[j];
+          double        v = mask->weight[j];
+
+          dev += abs (s[0] - r) * v;
+          dev += abs (s[1] - g) * v;
+          dev += abs (s[2] - b) * v;
+          if (alpha)
+            dev += alpha[mask->offset[j]] * v;
         }
       dev /= thissum;
 
       if ((best == -1) || (dev < bestdev))
-        {
-          if (brlist)
-            g_list_free (brlist);
-          brlist = NULL;
-        }
+        num_ties = 0;
 
       if (dev <= bestdev || best < 0)
         {
           best = i;
           bestdev = dev;
-          brlist = g_list_append (brlist, (void *)i);
+          ties[num_ties++] = i;
         }
       if (dev < runningvals.devthresh)
         break;
     }
 
-  if (!brlist)
+  if (!num_ties)
     {
       g_printerr("What!? No brushes?!\n");
       return 0;
     }
 
-  i = g_rand_int_range (random_generator, 0, g_list_length (brlist));
-  best = (long)((g_list_nth (brlist,i))->data);
-  g_list_free (brlist);
+  i = pick * num_ties;
+  if (i >= num_ties)
+    i = num_ties - 1;
 
-  return best;
+  return ties[i];
 }
 
+/* Only rows y1 to y2 - 1 of p and a are touched, so that several
+ * threads can paint the same stroke into different bands.
+ */
 static void
 apply_brush (ppm_t *brush,
              ppm_t *shadow,
              ppm_t *p, ppm_t *a,
-             int tx, int ty, int r, int g, int b)
+             int tx, int ty, int r, int g, int b,
+             int y1, int y2)
 {
   ppm_t  tmp;
   ppm_t  atmp;
@@ -251,13 +342,13 @@ apply_brush (ppm_t *brush,
       int sx = tx + shadowdepth - shadowblur * 2;
       int sy = ty + shadowdepth - shadowblur * 2;
 
-      for (y = 0; y < shadow->height; y++)
+      for (y = MAX (0, y1 - sy); y < shadow->height; y++)
         {
           guchar *row, *arow = NULL;
 
           if ((sy + y) < 0)
             continue;
-          if ((sy + y) >= tmp.height)
+          if ((sy + y) >= tmp.height || (sy + y) >= y2)
             break;
           row = tmp.col + (sy + y) * tmp.width * 3;
 
@@ -288,7 +379,7 @@ apply_brush (ppm_t *brush,
         }
     }
 
-  for (y = 0; y < brush->height; y++)
+  for (y = MAX (0, y1 - ty); y < brush->height && ty + y < y2; y++)
     {
       guchar *row = tmp.col + (ty + y) * tmp.width * 3;
       guchar *arow = NULL;
@@ -327,7 +418,7 @@ apply_brush (ppm_t *brush,
 
   if (relief > 0.001)
     {
-      for (y = 1; y < brush->height; y++)
+      for (y = MAX (1, y1 - ty); y < brush->height && ty + y < y2; y++)
         {
           guchar *row = tmp.col + (ty + y) * tmp.width * 3;
 
@@ -346,6 +437,233 @@ apply_brush (ppm_t *brush,
     }
 }
 
+/* Picks the brush and color of a stroke.  This only reads the source
+ * image and may run on several strokes at once.
+ */
+static void
+place_stroke (place_job_t *job, stroke_t *stroke)
+{
+  ppm_t *p = job->p;
+  int    tx = stroke->tx - job->maxbrushwidth / 2;
+  int    ty = stroke->ty - job->maxbrushheight / 2;
+  int    on = stroke->on;
+  int    sn = stroke->sn;
+  int    n, r, g, b;
+
+  /* Handle Adaptive selections */
+  if (runningvals.orient_type == ORIENTATION_ADAPTIVE)
+    {
+      if (runningvals.size_type == SIZE_TYPE_ADAPTIVE)
+        n = choose_best_brush (p, job->a, tx, ty, job->masks,
+                               job->num_brushes, job->brushes_sum, 0, 1,
+                               stroke->pick);
+      else
+        {
+          int st = sn * runningvals.orient_num;
+          n = choose_best_brush (p, job->a, tx, ty, job->masks,
+                                 st+runningvals.orient_num, job->brushes_sum,
+                                 st, 1, stroke->pick);
+        }
+    }
+  else
+    {
+      if (runningvals.size_type == SIZE_TYPE_ADAPTIVE)
+        n = choose_best_brush (p, job->a, tx, ty, job->masks,
+                               job->num_brushes, job->brushes_sum,
+                               on, runningvals.orient_num, stroke->pick);
+      else
+        n = sn * runningvals.orient_num + on;
+    }
+  /* Should never happen, but hey... */
+  if (n < 0)
+    n = 0;
+  else if (n >= job->num_brushes)
+    n = job->num_brushes - 1;
+
+  /* Calculate color - avg. of in-brush pixels */
+  if (runningvals.color_type == 0)
+    {
+      const brush_mask_t *mask = &job->masks[n];
+      const guchar       *src = p->col + ty * p->width * 3 + tx * 3;
+      double              thissum = job->brushes_sum[n];
+      int                 j;
+
+      r = g = b = 0;
+      for (j = 0; j < mask->n; j++)
+        {
+          const guchar *s = src + mask->offset[j];
+          double        v = mask->weight[j];
+
+          r += s[0] * v;
+          g += s[1] * v;
+          b += s[2] * v;
+        }
+      r = r * 255.0 / thissum;
+      g = g * 255.0 / thissum;
+      b = b * 255.0 / thissum;
+    }
+  else if (runningvals.color_type == 1)
+    {
+      guchar *pixel;
+      int     x, y;
+
+      y = ty + (job->brushes[n].height / 2);
+      x = tx + (job->brushes[n].width / 2);
+      pixel = &p->col[y*p->width * 3 + x * 3];
+      r = pixel[0];
+      g = pixel[1];
+      b = pixel[2];
+    }
+  else
+    {
+      /* No such color_type! */
+      r = g = b = 0;
+    }
+  if (runningvals.color_noise > 0.0)
+    {
+#define BOUNDS(a) (((a) < 0) ? (a) : ((a) > 255) ? 255 : (a))
+#define MYASSIGN(a, noise) \
+    { \
+        a = a + (noise);      \
+        a = BOUNDS(a) ;       \
+    }
+      MYASSIGN (r, stroke->noise[0]);
+      MYASSIGN (g, stroke->noise[1]);
+      MYASSIGN (b, stroke->noise[2]);
+#undef BOUNDS
+#undef MYASSIGN
+    }
+
+  stroke->tx = tx;
+  stroke->ty = ty;
+  stroke->n  = n;
+  stroke->r  = r;
+  stroke->g  = g;
+  stroke->b  = b;
+}
+
+static void
+place_strokes (place_job_t *job, gboolean main_thread)
+{
+  int progstep = MAX (job->num_strokes / 30, STROKE_CHUNK);
+  int next_progress = progstep;
+  int first;
+
+  while ((first = g_atomic_int_add (&job->next_stroke, STROKE_CHUNK)) <
+         job->num_strokes)
+    {
+      int last = MIN (first + STROKE_CHUNK, job->num_strokes);
+      int i;
+
+      for (i = first; i < last; i++)
+        place_stroke (job, &job->strokes[i]);
+
+      if (main_thread && last >= next_progress)
+        {
+          show_progress (0.5 * last / job->num_strokes);
+          next_progress = last + progstep;
+        }
+    }
+}
+
+static gpointer
+place_thread (gpointer data)
+{
+  place_strokes (data, FALSE);
+
+  return NULL;
+}
+
+/* Paints a stroke, and the copies that make the result tileable,
+ * into rows y1 to y2 - 1 of the canvas.
+ */
+static void
+paint_stroke (paint_job_t *job, stroke_t *stroke, int y1, int y2)
+{
+  ppm_t *tmp = job->tmp;
+  ppm_t *atmp = job->atmp;
+  ppm_t *brush = &job->brushes[stroke->n];
+  ppm_t *shadow = job->shadows ? &job->shadows[stroke->n] : NULL;
+  int    tx = stroke->tx;
+  int    ty = stroke->ty;
+  int    r = stroke->r, g = stroke->g, b = stroke->b;
+
+  apply_brush (brush, shadow, tmp, atmp, tx,ty, r,g,b, y1,y2);
+
+  if (runningvals.general_tileable && runningvals.general_paint_edges)
+    {
+      int orig_width = tmp->width - 2 * job->maxbrushwidth;
+      int orig_height = tmp->height - 2 * job->maxbrushheight;
+      int dox = 0, doy = 0;
+
+      if (tx < job->maxbrushwidth)
+        {
+          apply_brush (brush, shadow, tmp, atmp, tx+orig_width,ty, r,g,b,
+                       y1,y2);
+          dox = -1;
+        }
+      else if (tx > orig_width)
+        {
+          apply_brush (brush, shadow, tmp, atmp, tx-orig_width,ty, r,g,b,
+                       y1,y2);
+          dox = 1;
+        }
+      if (ty < job->maxbrushheight)
+        {
+          apply_brush (brush, shadow, tmp, atmp, tx,ty+orig_height, r,g,b,
+                       y1,y2);
+          doy = 1;
+        }
+      else if (ty > orig_height)
+        {
+          apply_brush (brush, shadow, tmp, atmp, tx,ty-orig_height, r,g,b,
+                       y1,y2);
+          doy = -1;
+        }
+      if (doy)
+        {
+          if (dox < 0)
+            apply_brush (brush, shadow, tmp, atmp,
+                         tx+orig_width, ty + doy * orig_height, r, g, b,
+                         y1, y2);
+          if (dox > 0)
+            apply_brush (brush, shadow, tmp, atmp,
+                         tx-orig_width, ty + doy * orig_height, r, g, b,
+                         y1, y2);
+        }
+    }
+}
+
+/* Every band gets all strokes in order, so overlapping strokes end
+ * up exactly as if they had been painted one after the other.
+ */
+static void
+paint_strokes (paint_job_t *job, gboolean main_thread)
+{
+  int band;
+
+  while ((band = g_atomic_int_add (&job->next_band, 1)) < job->num_bands)
+    {
+      int y1 = band * job->band_height;
+      int y2 = MIN (y1 + job->band_height, job->tmp->height);
+      int i;
+
+      for (i = 0; i < job->num_strokes; i++)
+        paint_stroke (job, &job->strokes[i], y1, y2);
+
+      if (main_thread)
+        show_progress (0.5 + 0.5 * (band + 1) / job->num_bands);
+    }
+}
+
+static gpointer
+paint_thread (gpointer data)
+{
+  paint_strokes (data, FALSE);
+
+  return NULL;
+}
+
 void
 repaint (ppm_t *p, ppm_t *a)
 {
@@ -353,20 +671,24 @@ repaint (ppm_t *p, ppm_t *a)
   int         tx = 0, ty = 0;
   ppm_t       tmp = {0, 0, NULL};
   ppm_t       atmp = {0, 0, NULL};
-  int         r, g, b, h, i, j, on, sn;
+  int         h, i, j, on, sn;
   int         num_brushes, maxbrushwidth, maxbrushheight;
   guchar      back[3] = {0, 0, 0};
   ppm_t      *brushes, *shadows;
-  ppm_t      *brush, *shadow = NULL;
   double     *brushes_sum;
+  brush_mask_t *masks;
   int         cx, cy, maxdist;
   double      scale, relief, startangle, anglespan, density, bgamma;
-  int         max_progress;
   ppm_t       paper_ppm = {0, 0, NULL};
   ppm_t       dirmap = {0, 0, NULL};
   ppm_t       sizmap = {0, 0, NULL};
   int        *xpos = NULL, *ypos = NULL;
-  int         progstep;
+  stroke_t   *strokes;
+  int         num_strokes;
+  place_job_t place_job;
+  paint_job_t paint_job;
+  GThread    *threads[THREADS_MAX];
+  int         n_threads;
   static int  running = 0;
 
   int dropshadow = pcvals.general_drop_shadow;
@@ -463,8 +785,6 @@ repaint (ppm_t *p, ppm_t *a)
       brushes_sum[i] = sum_brush (&brushes[i]);
     }
 
-  brush = &brushes[0];
-
   maxbrushwidth = maxbrushheight = 0;
   for (i = 0; i < num_brushes; i++)
     {
@@ -522,6 +842,10 @@ repaint (ppm_t *p, ppm_t *a)
                  maxbrushheight, maxbrushheight);
     }
 
+  masks = g_new (brush_mask_t, num_brushes);
+  for (i = 0; i < num_brushes; i++)
+    brush_mask_init (&masks[i], &brushes[i], p->width * 3);
+
   if (img_has_alpha)
     {
     /* Initially fully transparent */
@@ -794,11 +1118,6 @@ repaint (ppm_t *p, ppm_t *a)
   if (i < 1)
     i = 1;
 
-  max_progress = i;
-  progstep = max_progress / 30;
-  if (progstep < 10)
-    progstep = 10;
-
   if (runningvals.place_type == PLACEMENT_TYPE_EVEN_DIST)
     {
       int j;
@@ -824,29 +1143,12 @@ repaint (ppm_t *p, ppm_t *a)
         }
     }
 
+  strokes = g_new (stroke_t, i);
+  num_strokes = 0;
+
   for (; i; i--)
     {
-      int n;
-      double thissum;
-
-      if (i % progstep == 0)
-        {
-          if(runningvals.run)
-            {
-              gimp_progress_update (0.8 - 0.8 * ((double)i / max_progress));
-            }
-          else
-            {
-              char tmps[40];
-
-              g_snprintf (tmps, sizeof (tmps),
-                          "%.1f %%", 100 * (1.0 - ((double)i / max_progress)));
-              preview_set_button_label (tmps);
-
-              while(gtk_events_pending())
-                gtk_main_iteration();
-            }
-        }
+      stroke_t *stroke;
 
       if (runningvals.place_type == PLACEMENT_TYPE_RANDOM)
         {
@@ -903,7 +1205,7 @@ repaint (ppm_t *p, ppm_t *a)
           break;
 
         case ORIENTATION_ADAPTIVE:
-          break; /* Handled below */
+          break; /* Handled in place_stroke() */
 
         default:
           g_printerr ("Internal error; Unknown orientationtype\n");
@@ -927,7 +1229,7 @@ repaint (ppm_t *p, ppm_t *a)
           break;
 
         case SIZE_TYPE_ADAPTIVE:
-          break; /* Handled below */
+          break; /* Handled in place_stroke() */
 
         default:
           g_printerr ("Internal error; Unknown size_type\n");
@@ -935,143 +1237,83 @@ repaint (ppm_t *p, ppm_t *a)
           break;
       }
 
-      /* Handle Adaptive selections */
-      if (runningvals.orient_type == ORIENTATION_ADAPTIVE)
-        {
-          if (runningvals.size_type == SIZE_TYPE_ADAPTIVE)
-            n = choose_best_brush (p, a, tx-maxbrushwidth/2,
-                                  ty-maxbrushheight/2, brushes,
-                                  num_brushes, brushes_sum, 0, 1);
-          else
-            {
-              int st = sn * runningvals.orient_num;
-              n = choose_best_brush (p, a, tx-maxbrushwidth/2,
-                                    ty-maxbrushheight/2, brushes,
-                                    st+runningvals.orient_num, brushes_sum,
-                                    st, 1);
-            }
-        }
-      else
-        {
-          if (runningvals.size_type == SIZE_TYPE_ADAPTIVE)
-            n = choose_best_brush (p, a, tx-maxbrushwidth/2,
-                                    ty-maxbrushheight/2, brushes,
-                                    num_brushes, brushes_sum,
-                                    on, runningvals.orient_num);
-          else
-            n = sn * runningvals.orient_num + on;
-        }
-      /* Should never happen, but hey... */
-      if (n < 0)
-        n = 0;
-      else if (n >= num_brushes)
-        n = num_brushes - 1;
-
-      tx -= maxbrushwidth/2;
-      ty -= maxbrushheight/2;
-
-      brush = &brushes[n];
-      if (dropshadow)
-        shadow = &shadows[n];
-      thissum = brushes_sum[n];
-
-      /* Calculate color - avg. of in-brush pixels */
-      if (runningvals.color_type == 0)
-        {
-          r = g = b = 0;
-          for (y = 0; y < brush->height; y++)
-            {
-              guchar *row = &p->col[(ty + y) * p->width * 3];
+      stroke = &strokes[num_strokes++];
+
+      stroke->tx = tx;
+      stroke->ty = ty;
+      stroke->on = on;
+      stroke->sn = sn;
+
+      stroke->pick = 0.0;
+      if (runningvals.orient_type == ORIENTATION_ADAPTIVE ||
+          runningvals.size_type == SIZE_TYPE_ADAPTIVE)
+        stroke->pick = g_rand_double (random_generator);
 
-              for (x = 0; x < brush->width; x++)
-                {
-                  int k = (tx + x) * 3;
-                  double v;
-
-                  if ((h = brush->col[y * brush->width * 3 + x * 3]))
-                    {
-                      v = h / 255.0;
-                      r += row[k+0] * v;
-                      g += row[k+1] * v;
-                      b += row[k+2] * v;
-                    }
-                }
-            }
-          r = r * 255.0 / thissum;
-          g = g * 255.0 / thissum;
-          b = b * 255.0 / thissum;
-        }
-      else if (runningvals.color_type == 1)
-        {
-          guchar *pixel;
-
-          y = ty + (brush->height / 2);
-          x = tx + (brush->width / 2);
-          pixel = &p->col[y*p->width * 3 + x * 3];
-          r = pixel[0];
-          g = pixel[1];
-          b = pixel[2];
-        }
-      else
-        {
-          /* No such color_type! */
-          r = g = b = 0;
-        }
       if (runningvals.color_noise > 0.0)
         {
           double v = runningvals.color_noise;
-#define BOUNDS(a) (((a) < 0) ? (a) : ((a) > 255) ? 255 : (a))
-#define MYASSIGN(a) \
-    { \
-        a = a + g_rand_double_range (random_generator, -v/2.0, v/2.0); \
-        a = BOUNDS(a) ;       \
-    }
-          MYASSIGN (r);
-          MYASSIGN (g);
-          MYASSIGN (b);
-#undef BOUNDS
-#undef MYASSIGN
+
+          for (j = 0; j < 3; j++)
+            stroke->noise[j] = g_rand_double_range (random_generator,
+                                                    -v/2.0, v/2.0);
         }
+    }
 
-      apply_brush (brush, shadow, &tmp, &atmp, tx,ty, r,g,b);
+  n_threads = threads_get_count ();
+
+  /* Choose brushes and colors... */
+  place_job.p              = p;
+  place_job.a              = a;
+  place_job.brushes        = brushes;
+  place_job.masks          = masks;
+  place_job.brushes_sum    = brushes_sum;
+  place_job.num_brushes    = num_brushes;
+  place_job.maxbrushwidth  = maxbrushwidth;
+  place_job.maxbrushheight = maxbrushheight;
+  place_job.strokes        = strokes;
+  place_job.num_strokes    = num_strokes;
+  place_job.next_stroke    = 0;
+
+  for (j = 1; j < n_threads; j++)
+    threads[j] = g_thread_create (place_thread, &place_job, TRUE, NULL);
+
+  place_strokes (&place_job, TRUE);
+
+  for (j = 1; j < n_threads; j++)
+    if (threads[j])
+      g_thread_join (threads[j]);
+
+  /* ...then paint the strokes, a band of the canvas per thread */
+  paint_job.tmp            = &tmp;
+  paint_job.atmp           = &atmp;
+  paint_job.brushes        = brushes;
+  paint_job.shadows        = shadows;
+  paint_job.maxbrushwidth  = maxbrushwidth;
+  paint_job.maxbrushheight = maxbrushheight;
+  paint_job.strokes        = strokes;
+  paint_job.num_strokes    = num_strokes;
+  paint_job.num_bands      = MIN (4 * n_threads, tmp.height);
+  paint_job.band_height    = (tmp.height + paint_job.num_bands - 1) /
+                             paint_job.num_bands;
+  paint_job.num_bands      = (tmp.height + paint_job.band_height - 1) /
+                             paint_job.band_height;
+  paint_job.next_band      = 0;
+
+  for (j = 1; j < n_threads; j++)
+    threads[j] = g_thread_create (paint_thread, &paint_job, TRUE, NULL);
+
+  paint_strokes (&paint_job, TRUE);
+
+  for (j = 1; j < n_threads; j++)
+    if (threads[j])
+      g_thread_join (threads[j]);
+
+  g_free (strokes);
 
-      if (runningvals.general_tileable && runningvals.general_paint_edges)
-        {
-          int orig_width = tmp.width - 2 * maxbrushwidth;
-          int orig_height = tmp.height - 2 * maxbrushheight;
-          int dox = 0, doy = 0;
+  for (i = 0; i < num_brushes; i++)
+    brush_mask_free (&masks[i]);
+  g_free (masks);
 
-          if (tx < maxbrushwidth)
-            {
-              apply_brush (brush, shadow, &tmp, &atmp, tx+orig_width,ty, r,g,b);
-              dox = -1;
-            }
-          else if (tx > orig_width)
-            {
-              apply_brush (brush, shadow, &tmp, &atmp, tx-orig_width,ty, r,g,b);
-              dox = 1;
-            }
-          if (ty < maxbrushheight)
-            {
-              apply_brush (brush, shadow, &tmp, &atmp, tx,ty+orig_height, r,g,b);
-              doy = 1;
-            }
-          else if (ty > orig_height)
-            {
-              apply_brush (brush, shadow, &tmp, &atmp, tx,ty-orig_height, r,g,b);
-              doy = -1;
-            }
-          if (doy)
-            {
-              if (dox < 0)
-                apply_brush (brush, shadow, &tmp, &atmp,
-                             tx+orig_width, ty + doy * orig_height, r, g, b);
-              if (dox > 0)
-                apply_brush (brush, shadow, &tmp, &atmp,
-                             tx-orig_width, ty + doy * orig_height, r, g, b);
-            }
-        }
-    }
   for (i = 0; i < num_brushes; i++)
     {
       ppm_kill (&brushes[i]);
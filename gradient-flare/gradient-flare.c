@@ -49,6 +49,8 @@
 
 #include "libgimp/stdplugins-intl.h"
 
+#include "plug-ins/common/threads.h"
+
 /* #define DEBUG */
 
 #ifdef DEBUG
@@ -278,6 +280,15 @@ typedef struct
   CalcBounds bounds;
 } CalcSFlare;
 
+typedef struct
+{
+  gdouble     y;
+  gboolean    glow;
+  gboolean    rays;
+  gint        n_sflares;
+  CalcSFlare *sflares[SFLARE_NUM];      /* the ones which reach row y */
+} CalcRow;
+
 typedef struct
 {
   gint is_color;
@@ -287,6 +298,28 @@ typedef struct
   /* these values don't belong to drawable, though. */
 } DrawableInfo;
 
+typedef struct
+{
+  guchar        *src;          /* only used with adaptive supersampling */
+  gint           src_width;
+  gint           src_height;
+  guchar        *dest;
+  gint           width;
+  gint           bpp;
+  gint           first_row;    /* of the batch, from the top of the area */
+  gint           n_rows;
+  gint           band_height;
+  volatile gint  next_band;
+} RenderJob;
+
+typedef struct
+{
+  RenderJob     *job;
+  guchar        *band;         /* where the first row of the band goes */
+  gint           band_row;     /* and which row of the image that is */
+  CalcRow        calc_row;
+} RenderWorker;
+
 typedef struct _GradientMenu GradientMenu;
 typedef void (* GradientMenuCallback) (const gchar *gradient_name,
                                        gpointer     data);
@@ -418,9 +451,11 @@ static void     calc_sflare_pix    (guchar  *dest_pix,
                                     gdouble  x,
                                     gdouble  y,
                                     guchar  *src_pix);
-static void     calc_gflare_pix    (guchar  *dest_pix,
+static void     calc_row_init      (CalcRow *row,
+                                    gdouble  y);
+static void     calc_row_pix       (CalcRow *row,
+                                    guchar  *dest_pix,
                                     gdouble  x,
-                                    gdouble  y,
                                     guchar  *src_pix);
 
 static gboolean    dlg_run                 (void);
@@ -557,8 +592,6 @@ static const gchar *gflare_menu_modes[] =
 static gint32              image_ID;
 static GimpDrawable       *drawable;
 static DrawableInfo        dinfo;
-static GimpPixelFetcher   *tk_read;
-static GimpPixelFetcher   *tk_write;
 static GFlareDialog       *dlg = NULL;
 static GFlareEditor       *ed = NULL;
 static GList              *gflares_list = NULL;
@@ -591,6 +624,7 @@ static void plugin_do                   (void);
 
 static void plugin_do_non_asupsample    (void);
 static void plugin_do_asupsample        (void);
+static gpointer plugin_render_thread    (gpointer      data);
 static void plugin_render_func          (gdouble       x,
                                          gdouble       y,
                                          GimpRGB      *color,
@@ -599,10 +633,6 @@ static void plugin_put_pixel_func       (gint          ix,
                                          gint          iy,
                                          GimpRGB      *color,
                                          gpointer      data);
-static void plugin_progress_func        (gint          y1,
-                                         gint          y2,
-                                         gint          curr_y,
-                                         gpointer      data);
 
 static GFlare * gflare_new              (void);
 static void gflare_free                 (GFlare       *gflare);
@@ -624,6 +654,16 @@ static void calc_place_sflare           (void);
 static void calc_get_gradient           (guchar       *pix,
                                          guchar       *gradient,
                                          gdouble       pos);
+static void calc_glow_polar_pix         (guchar       *dest_pix,
+                                         gdouble       dist,
+                                         gdouble       theta);
+static void calc_rays_polar_pix         (guchar       *dest_pix,
+                                         gdouble       dist,
+                                         gdouble       theta);
+static void calc_sflare_one_pix         (guchar       *dest_pix,
+                                         gdouble       x,
+                                         gdouble       y,
+                                         CalcSFlare   *sflare);
 static gdouble fmod_positive            (gdouble       x,
                                          gdouble       m);
 static void calc_paint_func             (guchar       *dest,
@@ -1011,101 +1051,203 @@ plugin_do (void)
                         (dinfo.x2 - dinfo.x1), (dinfo.y2 - dinfo.y1));
 }
 
-/* these routines should be almost rewritten anyway */
+/*
+ *  The flare is rendered a batch of rows at a time: the main thread
+ *  reads the rows, several threads render a band of them each, and
+ *  the main thread writes them back.  calc_*_pix () only read calc
+ *  and the gradient samples, which don't change while rendering, so
+ *  they can be used from several threads at once.
+ */
 
 static void
-plugin_do_non_asupsample (void)
+plugin_get_src_pix (guchar       *src_pix,
+                    const guchar *src,
+                    gint          bpp)
+{
+  gint b;
+
+  for (b = 0; b < 3; b++)
+    src_pix[b] = dinfo.is_color ? src[b] : src[0];
+
+  src_pix[3] = dinfo.has_alpha ? src[bpp - 1] : OPAQUE;
+}
+
+static void
+plugin_render_row (guchar *row,
+                   gint    y,
+                   gint    width,
+                   gint    bpp)
+{
+  CalcRow  calc_row;
+  gint     x;
+
+  calc_row_init (&calc_row, y);
+
+  for (x = dinfo.x1; x < dinfo.x1 + width; x++)
+    {
+      guchar  src_pix[4];
+      guchar  dest_pix[4];
+      gint    b;
+
+      plugin_get_src_pix (src_pix, row, bpp);
+
+      calc_row_pix (&calc_row, dest_pix, x, src_pix);
+
+      if (dinfo.is_color)
+        {
+          for (b = 0; b < 3; b++)
+            row[b] = dest_pix[b];
+        }
+      else
+        {
+          row[0] = LUMINOSITY (dest_pix);
+        }
+
+      if (dinfo.has_alpha)
+        row[bpp - 1] = dest_pix[3];
+
+      row += bpp;
+    }
+}
+
+static gpointer
+plugin_render_thread (gpointer data)
+{
+  RenderJob    *job = data;
+  RenderWorker  worker;
+  gint          band;
+
+  worker.job        = job;
+  worker.calc_row.y = -G_MAXDOUBLE;
+
+  while ((band = g_atomic_int_add (&job->next_band, 1)) * job->band_height <
+         job->n_rows)
+    {
+      gint first = band * job->band_height;
+      gint rows  = MIN (job->band_height, job->n_rows - first);
+      gint y;
+
+      worker.band     = job->dest + first * job->width * job->bpp;
+      worker.band_row = dinfo.y1 + job->first_row + first;
+
+      if (! pvals.use_asupsample)
+        {
+          for (y = 0; y < rows; y++)
+            plugin_render_row (worker.band + y * job->width * job->bpp,
+                               worker.band_row + y, job->width, job->bpp);
+        }
+      else
+        {
+          gimp_adaptive_supersample_area (dinfo.x1, worker.band_row,
+                                          dinfo.x2 - 1,
+                                          worker.band_row + rows - 1,
+                                          pvals.asupsample_max_depth,
+                                          pvals.asupsample_threshold,
+                                          plugin_render_func,
+                                          &worker,
+                                          plugin_put_pixel_func,
+                                          &worker,
+                                          NULL,
+                                          NULL);
+        }
+    }
+
+  return NULL;
+}
+
+static void
+plugin_render (RenderJob *job)
 {
   GimpPixelRgn  src_rgn, dest_rgn;
-  gpointer      pr;
-  gint          width, height;
-  gint          progress, max_progress;
+  GThread      *threads[THREADS_MAX];
+  gint          height;
+  gint          n_threads;
+  gint          i;
 
-  width  = dinfo.x2 - dinfo.x1;
   height = dinfo.y2 - dinfo.y1;
 
-  progress = 0;
-  max_progress = width * height;
-
   gimp_pixel_rgn_init (&src_rgn, drawable,
-                       dinfo.x1, dinfo.y1, width, height, FALSE, FALSE);
+                       dinfo.x1, dinfo.y1, job->width, height, FALSE, FALSE);
   gimp_pixel_rgn_init (&dest_rgn, drawable,
-                       dinfo.x1, dinfo.y1, width, height, TRUE, TRUE);
+                       dinfo.x1, dinfo.y1, job->width, height, TRUE, TRUE);
+
+  n_threads = threads_get_count ();
+
+  job->bpp         = drawable->bpp;
+  job->band_height = dinfo.tile_height;
+  job->dest        = g_new (guchar,
+                            n_threads * job->band_height * job->width * job->bpp);
 
-  for (pr = gimp_pixel_rgns_register (2, &src_rgn, &dest_rgn);
-       pr != NULL; pr = gimp_pixel_rgns_process (pr))
+  for (job->first_row = 0;
+       job->first_row < height;
+       job->first_row += job->n_rows)
     {
-      const guchar *src_row  = src_rgn.data;
-      guchar       *dest_row = dest_rgn.data;
-      gint          row, y;
+      job->n_rows    = MIN (n_threads * job->band_height,
+                            height - job->first_row);
+      job->next_band = 0;
 
-      for (row = 0, y = src_rgn.y; row < src_rgn.h; row++, y++)
-        {
-          const guchar *src  = src_row;
-          guchar       *dest = dest_row;
-          gint          col, x;
+      /* without supersampling, the rows are rendered in place */
+      if (! pvals.use_asupsample)
+        gimp_pixel_rgn_get_rect (&src_rgn, job->dest,
+                                 dinfo.x1, dinfo.y1 + job->first_row,
+                                 job->width, job->n_rows);
 
-          for (col = 0, x = src_rgn.x; col < src_rgn.w; col++, x++)
-            {
-              guchar  src_pix[4];
-              guchar  dest_pix[4];
-              gint    b;
+      for (i = 1; i < n_threads; i++)
+        threads[i] = g_thread_create (plugin_render_thread, job, TRUE, NULL);
 
-              for (b = 0; b < 3; b++)
-                src_pix[b] = dinfo.is_color ? src[b] : src[0];
+      plugin_render_thread (job);
 
-              src_pix[3] = dinfo.has_alpha ? src[src_rgn.bpp - 1] : OPAQUE;
+      for (i = 1; i < n_threads; i++)
+        if (threads[i])
+          g_thread_join (threads[i]);
 
-              calc_gflare_pix (dest_pix, x, y, src_pix);
+      gimp_pixel_rgn_set_rect (&dest_rgn, job->dest,
+                               dinfo.x1, dinfo.y1 + job->first_row,
+                               job->width, job->n_rows);
 
-              if (dinfo.is_color)
-                {
-                  for (b = 0; b < 3; b++)
-                    dest[b] = dest_pix[b];
-                }
-              else
-                {
-                  dest[0] = LUMINOSITY (dest_pix);
-                }
+      gimp_progress_update ((gdouble) (job->first_row + job->n_rows) /
+                            (gdouble) height);
+    }
 
-              if (dinfo.has_alpha)
-                dest[src_rgn.bpp - 1] = dest_pix[3];
+  g_free (job->dest);
+}
 
-              src  += src_rgn.bpp;
-              dest += dest_rgn.bpp;
-            }
+static void
+plugin_do_non_asupsample (void)
+{
+  RenderJob job;
 
-          src_row  += src_rgn.rowstride;
-          dest_row += dest_rgn.rowstride;
-        }
+  job.width = dinfo.x2 - dinfo.x1;
+  job.src   = NULL;
 
-      /* Update progress */
-      progress += src_rgn.w * src_rgn.h;
-      gimp_progress_update ((double) progress / (double) max_progress);
-    }
+  plugin_render (&job);
 }
 
 static void
 plugin_do_asupsample (void)
 {
-  tk_read  = gimp_pixel_fetcher_new (drawable, FALSE);
-  gimp_pixel_fetcher_set_edge_mode (tk_read, GIMP_PIXEL_FETCHER_EDGE_BLACK);
+  GimpPixelRgn  src_rgn;
+  RenderJob     job;
+
+  job.width = dinfo.x2 - dinfo.x1;
 
-  tk_write = gimp_pixel_fetcher_new (drawable, TRUE);
+  /* The samples at the right and bottom edges of the area are taken
+   * from the pixels just outside of it, or are black at the edges of
+   * the drawable.
+   */
+  job.src_width  = MIN (dinfo.x2 + 1, drawable->width)  - dinfo.x1;
+  job.src_height = MIN (dinfo.y2 + 1, drawable->height) - dinfo.y1;
+  job.src        = g_new (guchar,
+                          job.src_width * job.src_height * drawable->bpp);
 
-  gimp_adaptive_supersample_area (dinfo.x1, dinfo.y1,
-                                  dinfo.x2 - 1, dinfo.y2 - 1,
-                                  pvals.asupsample_max_depth,
-                                  pvals.asupsample_threshold,
-                                  plugin_render_func,
-                                  NULL,
-                                  plugin_put_pixel_func,
-                                  NULL,
-                                  plugin_progress_func,
-                                  NULL);
+  gimp_pixel_rgn_init (&src_rgn, drawable, dinfo.x1, dinfo.y1,
+                       job.src_width, job.src_height, FALSE, FALSE);
+  gimp_pixel_rgn_get_rect (&src_rgn, job.src, dinfo.x1, dinfo.y1,
+                           job.src_width, job.src_height);
 
-  gimp_pixel_fetcher_destroy (tk_write);
-  gimp_pixel_fetcher_destroy (tk_read);
+  plugin_render (&job);
+
+  g_free (job.src);
 }
 
 /*
@@ -1121,24 +1263,35 @@ plugin_render_func (gdouble   x,
                     GimpRGB  *color,
                     gpointer  data)
 {
+  RenderWorker *worker = data;
+  RenderJob    *job    = worker->job;
   guchar        src_pix[4];
   guchar        flare_pix[4];
-  guchar        src[4];
-  gint          b;
   gint          ix, iy;
 
   /* translate (0.5, 0.5) before convert to `int' so that it can surely
      point the center of pixel */
-  ix = floor (x + 0.5);
-  iy = floor (y + 0.5);
+  ix = floor (x + 0.5) - dinfo.x1;
+  iy = floor (y + 0.5) - dinfo.y1;
 
-  gimp_pixel_fetcher_get_pixel (tk_read, ix, iy, src);
+  if (ix >= 0 && ix < job->src_width && iy >= 0 && iy < job->src_height)
+    {
+      plugin_get_src_pix (src_pix,
+                          job->src + (iy * job->src_width + ix) * job->bpp,
+                          job->bpp);
+    }
+  else
+    {
+      static const guchar black[4] = { 0, 0, 0, 0 };
 
-  for (b = 0; b < 3; b++)
-    src_pix[b] = dinfo.is_color ? src[b] : src[0];
-  src_pix[3] = dinfo.has_alpha ? src[drawable->bpp - 1] : OPAQUE;
+      plugin_get_src_pix (src_pix, black, job->bpp);
+    }
 
-  calc_gflare_pix (flare_pix, x, y, src_pix);
+  /* the supersampler goes along rows, so most samples share a row */
+  if (y != worker->calc_row.y)
+    calc_row_init (&worker->calc_row, y);
+
+  calc_row_pix (&worker->calc_row, flare_pix, x, src_pix);
 
   color->r = flare_pix[0] / 255.0;
   color->g = flare_pix[1] / 255.0;
@@ -1152,7 +1305,12 @@ plugin_put_pixel_func (gint      ix,
                        GimpRGB  *color,
                        gpointer  data)
 {
-  guchar dest[4];
+  RenderWorker *worker = data;
+  RenderJob    *job    = worker->job;
+  guchar       *dest;
+
+  dest = worker->band + ((iy - worker->band_row) * job->width +
+                         ix - dinfo.x1) * job->bpp;
 
   if (dinfo.is_color)
     {
@@ -1166,18 +1324,7 @@ plugin_put_pixel_func (gint      ix,
     }
 
   if (dinfo.has_alpha)
-    dest[drawable->bpp - 1] = color->a * 255;
-
-  gimp_pixel_fetcher_put_pixel (tk_write, ix, iy, dest);
-}
-
-static void
-plugin_progress_func (gint     y1,
-                      gint     y2,
-                      gint     curr_y,
-                      gpointer data)
-{
-  gimp_progress_update ((double) curr_y / (double) (y2 - y1));
+    dest[job->bpp - 1] = color->a * 255;
 }
 
 /*************************************************************************/
@@ -2038,11 +2185,6 @@ fmod_positive (gdouble x, gdouble m)
 static void
 calc_glow_pix (guchar *dest_pix, gdouble x, gdouble y)
 {
-  gdouble radius, angle;
-  gdouble angular_size;
-  guchar  radial_pix[4], angular_pix[4], size_pix[4];
-  gint    i;
-
   if ((calc.type & CALC_GLOW) == 0
       || x < calc.glow_bounds.x0 || x > calc.glow_bounds.x1
       || y < calc.glow_bounds.y0 || y > calc.glow_bounds.y1)
@@ -2053,8 +2195,24 @@ calc_glow_pix (guchar *dest_pix, gdouble x, gdouble y)
 
   x -= calc.xcenter;
   y -= calc.ycenter;
-  radius = sqrt (x*x + y*y) / calc.glow_radius;
-  angle = (atan2 (-y, x) + calc.glow_rotation ) / (2 * G_PI);
+  calc_glow_polar_pix (dest_pix, sqrt (x*x + y*y), atan2 (-y, x));
+}
+
+/*
+ *  The same, from the distance to the center of the flare and the
+ *  angle (atan2 (-y, x)) at which the pixel is seen from it.  These
+ *  are shared with calc_rays_polar_pix () by calc_row_pix ().
+ */
+static void
+calc_glow_polar_pix (guchar *dest_pix, gdouble dist, gdouble theta)
+{
+  gdouble radius, angle;
+  gdouble angular_size;
+  guchar  radial_pix[4], angular_pix[4], size_pix[4];
+  gint    i;
+
+  radius = dist / calc.glow_radius;
+  angle = (theta + calc.glow_rotation ) / (2 * G_PI);
   angle = fmod_positive (angle, 1.0);
 
   calc_get_gradient (size_pix, calc.glow_angular_size, angle);
@@ -2081,12 +2239,6 @@ calc_glow_pix (guchar *dest_pix, gdouble x, gdouble y)
 static void
 calc_rays_pix (guchar *dest_pix, gdouble x, gdouble y)
 {
-  gdouble radius, angle;
-  gdouble angular_size;
-  gdouble spike_frac, spike_inten, spike_angle;
-  guchar  radial_pix[4], angular_pix[4], size_pix[4];
-  gint    i;
-
   if ((calc.type & CALC_RAYS) == 0
       || x < calc.rays_bounds.x0 || x > calc.rays_bounds.x1
       || y < calc.rays_bounds.y0 || y > calc.rays_bounds.y1)
@@ -2097,16 +2249,26 @@ calc_rays_pix (guchar *dest_pix, gdouble x, gdouble y)
 
   x -= calc.xcenter;
   y -= calc.ycenter;
-  radius = sqrt (x*x + y*y) / calc.rays_radius;
-  angle = (atan2 (-y, x) + calc.rays_rotation ) / (2 * G_PI);
+  calc_rays_polar_pix (dest_pix, sqrt (x*x + y*y), atan2 (-y, x));
+}
+
+static void
+calc_rays_polar_pix (guchar *dest_pix, gdouble dist, gdouble theta)
+{
+  gdouble radius, angle;
+  gdouble angular_size;
+  gdouble spike_frac, spike_inten, spike_angle;
+  guchar  radial_pix[4], angular_pix[4], size_pix[4];
+  gint    i;
+
+  radius = dist / calc.rays_radius;
+  angle = (theta + calc.rays_rotation ) / (2 * G_PI);
   angle = fmod_positive (angle, 1.0);   /* make sure 0 <= angle < 1.0 */
   spike_frac = fmod (angle, calc.rays_spike_mod * 2);
   spike_angle = angle - spike_frac + calc.rays_spike_mod;
   spike_frac = (angle - spike_angle) / calc.rays_spike_mod;
   /* spike_frac is between -1.0 and 1.0 here (except round error...) */
 
-  spike_inten = pow (1.0 - fabs (spike_frac), calc.rays_thinness);
-
   calc_get_gradient (size_pix, calc.rays_angular_size, spike_angle);
   /* angular_size gradient was grayfied already */
   angular_size = size_pix[0] / 255.0;
@@ -2122,6 +2284,15 @@ calc_rays_pix (guchar *dest_pix, gdouble x, gdouble y)
 
   for (i = 0; i < 3; i++)
     dest_pix[i] =  radial_pix[i] * angular_pix[i] / 255;
+
+  /* pow () is only worth calling when the ray is visible at all */
+  if (radial_pix[3] == 0 || angular_pix[3] == 0)
+    {
+      dest_pix[3] = 0;
+      return;
+    }
+
+  spike_inten = pow (1.0 - fabs (spike_frac), calc.rays_thinness);
   dest_pix[3] = spike_inten * radial_pix[3] * angular_pix[3] / 255;
 }
 
@@ -2142,72 +2313,125 @@ void
 calc_sflare_pix (guchar *dest_pix, gdouble x, gdouble y, guchar *src_pix)
 {
   GList         *list;
-  CalcSFlare    *sflare;
+
+  memcpy (dest_pix, src_pix, 4);
+
+  if ((calc.type & CALC_SFLARE) == 0)
+    return;
+
+  for (list = calc.sflare_list; list; list = list->next)
+    calc_sflare_one_pix (dest_pix, x, y, list->data);
+}
+
+/*
+ *  Paints one of the sflares onto dest_pix, if it covers (x, y)
+ */
+static void
+calc_sflare_one_pix (guchar *dest_pix, gdouble x, gdouble y,
+                     CalcSFlare *sflare)
+{
   gdouble       sx, sy, th;
   gdouble       radius, angle;
   guchar        radial_pix[4], tmp_pix[4];
 
-  memcpy (dest_pix, src_pix, 4);
+  if (x < sflare->bounds.x0 || x > sflare->bounds.x1
+      || y < sflare->bounds.y0 || y > sflare->bounds.y1)
+    return;
+  sx = x - sflare->xcenter;
+  sy = y - sflare->ycenter;
+  radius = sqrt (sx * sx + sy * sy) / sflare->radius;
+  if (calc.sflare_shape == GF_POLYGON)
+    {
+      angle = atan2 (-sy, sx) - calc.vangle + calc.sflare_rotation;
+      th = fmod_positive (angle, calc.sflare_angle * 2) - calc.sflare_angle;
+      radius *= cos (th) * calc.sflare_factor;
+    }
+  if (radius < 0 || radius > 1)
+    return;
+
+  calc_get_gradient (radial_pix, calc.sflare_radial, radius);
+  memcpy (tmp_pix, dest_pix, 4);
+  calc_paint_func (dest_pix, tmp_pix, radial_pix,
+                   calc.sflare_opacity, calc.gflare->sflare_mode);
+}
+
+/*
+ *  Calc gflare's pixel (RGBA) values, a row at a time
+ *
+ *  calc_row_init () finds out which parts of the flare reach the row
+ *  at y, so that calc_row_pix () can skip all others for every pixel
+ *  of it.  The glow, the rays and then each sflare are painted onto
+ *  src_pix, in that order.
+ */
+static void
+calc_row_init (CalcRow *row, gdouble y)
+{
+  GList         *list;
+
+  row->y    = y;
+  row->glow = ((calc.type & CALC_GLOW) &&
+               y >= calc.glow_bounds.y0 && y <= calc.glow_bounds.y1);
+  row->rays = ((calc.type & CALC_RAYS) &&
+               y >= calc.rays_bounds.y0 && y <= calc.rays_bounds.y1);
+
+  row->n_sflares = 0;
 
   if ((calc.type & CALC_SFLARE) == 0)
     return;
 
-  list = calc.sflare_list;
-  while (list)
+  for (list = calc.sflare_list; list; list = list->next)
     {
-      sflare = list->data;
-      list = list->next;
-
-      if (x < sflare->bounds.x0 || x > sflare->bounds.x1
-          || y < sflare->bounds.y0 || y > sflare->bounds.y1)
-        continue;
-      sx = x - sflare->xcenter;
-      sy = y - sflare->ycenter;
-      radius = sqrt (sx * sx + sy * sy) / sflare->radius;
-      if (calc.sflare_shape == GF_POLYGON)
-        {
-          angle = atan2 (-sy, sx) - calc.vangle + calc.sflare_rotation;
-          th = fmod_positive (angle, calc.sflare_angle * 2) - calc.sflare_angle;
-          radius *= cos (th) * calc.sflare_factor;
-        }
-      if (radius < 0 || radius > 1)
-        continue;
+      CalcSFlare *sflare = list->data;
 
-      calc_get_gradient (radial_pix, calc.sflare_radial, radius);
-      memcpy (tmp_pix, dest_pix, 4);
-      calc_paint_func (dest_pix, tmp_pix, radial_pix,
-                       calc.sflare_opacity, calc.gflare->sflare_mode);
+      if (y >= sflare->bounds.y0 && y <= sflare->bounds.y1)
+        row->sflares[row->n_sflares++] = sflare;
     }
 }
 
 static void
-calc_gflare_pix (guchar *dest_pix, gdouble x, gdouble y, guchar *src_pix)
+calc_row_pix (CalcRow *row, guchar *dest_pix, gdouble x, guchar *src_pix)
 {
   GFlare        *gflare = calc.gflare;
-  guchar        glow_pix[4], rays_pix[4];
-  guchar        tmp_pix[4];
+  gdouble        y = row->y;
+  gboolean       glow, rays;
+  gdouble        dist = 0.0, theta = 0.0;
+  guchar         glow_pix[4], rays_pix[4];
+  guchar         tmp_pix[4];
+  gint           i;
 
   memcpy (dest_pix, src_pix, 4);
 
-  if (calc.type & CALC_GLOW)
+  glow = (row->glow &&
+          x >= calc.glow_bounds.x0 && x <= calc.glow_bounds.x1);
+  rays = (row->rays &&
+          x >= calc.rays_bounds.x0 && x <= calc.rays_bounds.x1);
+
+  if (glow || rays)
+    {
+      gdouble dx = x - calc.xcenter;
+      gdouble dy = y - calc.ycenter;
+
+      dist  = sqrt (dx*dx + dy*dy);
+      theta = atan2 (-dy, dx);
+    }
+
+  /* outside of its bounds, a part's alpha is 0 and leaves dest_pix be */
+  if (glow)
     {
       memcpy (tmp_pix, dest_pix, 4);
-      calc_glow_pix (glow_pix, x, y);
+      calc_glow_polar_pix (glow_pix, dist, theta);
       calc_paint_func (dest_pix, tmp_pix, glow_pix,
                        calc.glow_opacity, gflare->glow_mode);
     }
-  if (calc.type & CALC_RAYS)
+  if (rays)
     {
       memcpy (tmp_pix, dest_pix, 4);
-      calc_rays_pix (rays_pix, x, y);
+      calc_rays_polar_pix (rays_pix, dist, theta);
       calc_paint_func (dest_pix, tmp_pix, rays_pix,
                        calc.rays_opacity, gflare->rays_mode);
     }
-  if (calc.type & CALC_SFLARE)
-    {
-      memcpy (tmp_pix, dest_pix, 4);
-      calc_sflare_pix (dest_pix, x, y, tmp_pix);
-    }
+  for (i = 0; i < row->n_sflares; i++)
+    calc_sflare_one_pix (dest_pix, x, y, row->sflares[i]);
 }
 
 /*
@@ -2630,6 +2854,7 @@ dlg_preview_render_func (Preview  *preview,
   gint          dx, dy;         /* drawable x, y */
   guchar       *src_row, *src;
   guchar        src_pix[4], dest_pix[4];
+  CalcRow       calc_row;
   gint          b;
 
   dy = (dlg->pwin.y0 +
@@ -2646,6 +2871,8 @@ dlg_preview_render_func (Preview  *preview,
                        0, 0, drawable->width, drawable->height, FALSE, FALSE);
   gimp_pixel_rgn_get_row (&srcPR, src_row, 0, dy, drawable->width);
 
+  calc_row_init (&calc_row, dy);
+
   for (x = 0; x < DLG_PREVIEW_HEIGHT; x++)
     {
       dx = (dlg->pwin.x0 +
@@ -2667,7 +2894,7 @@ dlg_preview_render_func (Preview  *preview,
 
       /* Get GFlare pix value */
 
-      calc_gflare_pix (dest_pix, dx, dy, src_pix);
+      calc_row_pix (&calc_row, dest_pix, dx, src_pix);
 
       /* Draw gray check if needed */
       preview_rgba_to_rgb (dest, x, y, dest_pix);
@@ -4141,10 +4368,13 @@ ed_preview_render_general (guchar *buffer, gint y)
   guchar        gflare_pix[4];
   static guchar src_pix[4] = {0, 0, 0, OPAQUE};
   int           gflare_a;
+  CalcRow       calc_row;
+
+  calc_row_init (&calc_row, y);
 
   for (x = 0; x < ED_PREVIEW_WIDTH; x++)
     {
-      calc_gflare_pix (gflare_pix, x, y, src_pix);
+      calc_row_pix (&calc_row, gflare_pix, x, src_pix);
       gflare_a = gflare_pix[3];
 
       for (i = 0; i < 3; i++)
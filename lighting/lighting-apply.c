@@ -15,6 +15,133 @@
 
 #include "libgimp/stdplugins-intl.h"
 
+#include "plug-ins/common/threads.h"
+
+
+typedef struct
+{
+  get_ray_func  ray_func;
+  guchar       *dest;
+  gint          first_row;
+  gint          n_rows;
+  gint          band_height;
+  gint          bpp;
+  gboolean      has_alpha;
+  volatile gint next_band;
+} RenderJob;
+
+typedef struct
+{
+  RenderJob    *job;
+  ShadeContext *context;
+  guchar       *band;      /* where the first row of the band goes */
+  gint          band_row;  /* and which row that is */
+} RenderWorker;
+
+static void
+put_color (guchar        *dest,
+           const GimpRGB *color,
+           gboolean       has_alpha)
+{
+  dest[0] = (guchar) (color->r * 255.0);
+  dest[1] = (guchar) (color->g * 255.0);
+  dest[2] = (guchar) (color->b * 255.0);
+
+  if (has_alpha)
+    dest[3] = (guchar) (color->a * 255.0);
+}
+
+/* Callbacks for gimp_adaptive_supersample_area () */
+
+static void
+render (gdouble   x,
+        gdouble   y,
+        GimpRGB  *col,
+        gpointer  data)
+{
+  RenderWorker *worker = data;
+  GimpVector3   pos;
+
+  shade_context_set_row (worker->context, RINT (y));
+
+  pos = int_to_posf (x, y);
+  *col = (* worker->job->ray_func) (worker->context, &pos);
+}
+
+static void
+put_pixel (gint      x,
+           gint      y,
+           GimpRGB  *color,
+           gpointer  data)
+{
+  RenderWorker *worker = data;
+  RenderJob    *job    = worker->job;
+
+  put_color (worker->band + ((y - worker->band_row) * width + x) * job->bpp,
+             color, job->has_alpha);
+}
+
+/* Renders bands of rows, until there are none left.  Only touches
+ * memory, so that it can run on several threads at once.
+ */
+
+static gpointer
+render_thread (gpointer data)
+{
+  RenderJob    *job = data;
+  RenderWorker  worker;
+  gint          band;
+
+  worker.job     = job;
+  worker.context = shade_context_new (width, height);
+
+  while ((band = g_atomic_int_add (&job->next_band, 1)) * job->band_height <
+         job->n_rows)
+    {
+      gint first = band * job->band_height;
+      gint rows  = MIN (job->band_height, job->n_rows - first);
+      gint x, y;
+
+      worker.band     = job->dest + first * width * job->bpp;
+      worker.band_row = job->first_row + first;
+
+      if (mapvals.antialiasing == FALSE)
+        {
+          for (y = 0; y < rows; y++)
+            {
+              guchar *row = worker.band + y * width * job->bpp;
+
+              shade_context_set_row (worker.context, worker.band_row + y);
+
+              for (x = 0; x < width; x++)
+                {
+                  GimpVector3 p     = int_to_pos (x, worker.band_row + y);
+                  GimpRGB     color = (* job->ray_func) (worker.context, &p);
+
+                  put_color (row + x * job->bpp, &color, job->has_alpha);
+                }
+            }
+        }
+      else
+        {
+          gimp_adaptive_supersample_area (0, worker.band_row,
+                                          width - 1,
+                                          worker.band_row + rows - 1,
+                                          mapvals.max_depth,
+                                          mapvals.pixel_treshold,
+                                          render,
+                                          &worker,
+                                          put_pixel,
+                                          &worker,
+                                          NULL,
+                                          NULL);
+        }
+    }
+
+  shade_context_free (worker.context);
+
+  return NULL;
+}
 
 /*************/
 /* Main loop */
@@ -23,17 +150,13 @@
 void
 compute_image (void)
 {
-  gint         xcount, ycount;
-  GimpRGB       color;
-  glong        progress_counter = 0;
-  GimpVector3  p;
   gint32       new_image_id = -1;
   gint32       new_layer_id = -1;
-  gint32       index;
-  guchar      *row = NULL;
-  guchar       obpp;
-  gboolean     has_alpha;
-  get_ray_func ray_func;
+  guchar      *buffer;
+  RenderJob    job;
+  GThread     *threads[THREADS_MAX];
+  gint         n_threads;
+  gint         i;
 
 
 
@@ -73,70 +196,55 @@ compute_image (void)
       output_drawable = gimp_drawable_get (new_layer_id);
     }
 
-  if (mapvals.bump_mapped == TRUE && mapvals.bumpmap_id != -1)
-    {
-      gimp_pixel_rgn_init (&bump_region, gimp_drawable_get (mapvals.bumpmap_id),
-			   0, 0, width, height, FALSE, FALSE);
-    }
-
-  precompute_init (width, height);
+  image_load_maps ();
 
   if (!mapvals.env_mapped || mapvals.envmap_id == -1)
-    {
-      ray_func = get_ray_color;
-    }
+    job.ray_func = get_ray_color;
   else
-    {
-      env_width = gimp_drawable_width (mapvals.envmap_id);
-      env_height = gimp_drawable_height (mapvals.envmap_id);
-      gimp_pixel_rgn_init (&env_region, gimp_drawable_get (mapvals.envmap_id),
-			   0, 0, env_width, env_height, FALSE, FALSE);
-      ray_func = get_ray_color_ref;
-    }
+    job.ray_func = get_ray_color_ref;
 
   gimp_pixel_rgn_init (&dest_region, output_drawable,
 		       0, 0, width, height, TRUE, TRUE);
 
-  obpp = gimp_drawable_bpp (output_drawable->drawable_id);
-  has_alpha = gimp_drawable_has_alpha (output_drawable->drawable_id);
+  job.bpp         = gimp_drawable_bpp (output_drawable->drawable_id);
+  job.has_alpha   = gimp_drawable_has_alpha (output_drawable->drawable_id);
+  job.band_height = gimp_tile_height ();
 
-  row = g_new (guchar, obpp * width);
+  n_threads = threads_get_count ();
 
-  gimp_progress_init (_("Lighting Effects"));
+  /* Every thread gets a band of a tile's height at a time; the main
+   * thread writes them out a batch at a time.
+   */
+  buffer = g_new (guchar, n_threads * job.band_height * width * job.bpp);
 
-/*  if (mapvals.antialiasing==FALSE)
-    { */
+  gimp_progress_init (_("Lighting Effects"));
 
-  for (ycount = 0; ycount < height; ycount++)
+  for (job.first_row = 0; job.first_row < height; job.first_row += job.n_rows)
     {
-      if (mapvals.bump_mapped == TRUE && mapvals.bumpmap_id != -1)
-	precompute_normals (0, width, ycount);
-
-      index = 0;
+      job.dest      = buffer;
+      job.n_rows    = MIN (n_threads * job.band_height,
+                           height - job.first_row);
+      job.next_band = 0;
 
-      for (xcount = 0; xcount < width; xcount++)
-	{
-	  p = int_to_pos (xcount, ycount);
-	  color = (* ray_func) (&p);
+      for (i = 1; i < n_threads; i++)
+        threads[i] = g_thread_create (render_thread, &job, TRUE, NULL);
 
-	  row[index++] = (guchar) (color.r * 255.0);
-	  row[index++] = (guchar) (color.g * 255.0);
-	  row[index++] = (guchar) (color.b * 255.0);
+      render_thread (&job);
 
-	  if (has_alpha)
-	    row[index++] = (guchar) (color.a * 255.0);
+      for (i = 1; i < n_threads; i++)
+        if (threads[i])
+          g_thread_join (threads[i]);
 
-	  if ((progress_counter++ % width) == 0)
-	    gimp_progress_update ((gdouble) progress_counter /
-				  (gdouble) maxcounter);
-	}
+      gimp_pixel_rgn_set_rect (&dest_region, buffer,
+                               0, job.first_row, width, job.n_rows);
 
-      gimp_pixel_rgn_set_row (&dest_region, row, 0, ycount, width);
+      gimp_progress_update ((gdouble) (job.first_row + job.n_rows) /
+                            (gdouble) height);
     }
 
   gimp_progress_update (1.0);
 
-  g_free (row);
+  g_free (buffer);
 
   /* Update image */
   /* ============ */
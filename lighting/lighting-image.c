@@ -15,13 +15,18 @@
 
 
 GimpDrawable *input_drawable,*output_drawable;
-GimpPixelRgn  source_region, dest_region;
+GimpPixelRgn  dest_region;
 
-GimpDrawable *bump_drawable = NULL;
-GimpPixelRgn  bump_region;
+/* In-memory copies of the drawables, so that the renderer threads
+ * never have to call into libgimp.
+ */
+guchar *source_data = NULL;
+guchar *bump_data   = NULL;
+guchar *env_data    = NULL;
+gint    source_bpp, bump_bpp, env_bpp;
 
-GimpDrawable *env_drawable = NULL;
-GimpPixelRgn  env_region;
+static gint32 bump_data_id = -1;
+static gint32 env_data_id  = -1;
 
 guchar          *preview_rgb_data = NULL;
 gint             preview_rgb_stride;
@@ -65,16 +70,16 @@ GimpRGB
 peek (gint x,
       gint y)
 {
-  guchar data[4];
-  GimpRGB color;
+  const guchar *data;
+  GimpRGB       color;
 
-  gimp_pixel_rgn_get_pixel (&source_region,data, x, y);
+  data = source_data + ((gsize) y * width + x) * source_bpp;
 
   color.r = (gdouble) (data[0]) / 255.0;
   color.g = (gdouble) (data[1]) / 255.0;
   color.b = (gdouble) (data[2]) / 255.0;
 
-  if (input_drawable->bpp == 4)
+  if (source_bpp == 4)
     {
       if (in_channels == 4)
         color.a = (gdouble) (data[3]) / 255.0;
@@ -93,8 +98,8 @@ GimpRGB
 peek_env_map (gint x,
 	      gint y)
 {
-  guchar data[4];
-  GimpRGB color;
+  const guchar *data;
+  GimpRGB       color;
 
   if (x < 0)
     x = 0;
@@ -105,11 +110,18 @@ peek_env_map (gint x,
   else if (y >= env_height)
     y = env_height - 1;
 
-  gimp_pixel_rgn_get_pixel (&env_region, data, x, y);
+  data = env_data + ((gsize) y * env_width + x) * env_bpp;
 
-  color.r = (gdouble) (data[0]) / 255.0;
-  color.g = (gdouble) (data[1]) / 255.0;
-  color.b = (gdouble) (data[2]) / 255.0;
+  if (env_bpp >= 3)
+    {
+      color.r = (gdouble) (data[0]) / 255.0;
+      color.g = (gdouble) (data[1]) / 255.0;
+      color.b = (gdouble) (data[2]) / 255.0;
+    }
+  else
+    {
+      color.r = color.g = color.b = (gdouble) (data[0]) / 255.0;
+    }
   color.a = 1.0;
 
   return color;
@@ -339,6 +351,72 @@ compute_maps (void)
     }
 }
 
+/*************************************************/
+/* Read a whole drawable into memory, tile row   */
+/* by tile row.                                  */
+/*************************************************/
+
+static guchar *
+read_drawable (gint32  drawable_id,
+               gint    w,
+               gint    h,
+               gint   *bpp)
+{
+  GimpDrawable *drawable;
+  GimpPixelRgn  region;
+  guchar       *data;
+  gint          tile_height = gimp_tile_height ();
+  gint          y;
+
+  drawable = gimp_drawable_get (drawable_id);
+  *bpp = drawable->bpp;
+
+  data = g_new (guchar, (gsize) w * h * *bpp);
+
+  gimp_pixel_rgn_init (&region, drawable, 0, 0, w, h, FALSE, FALSE);
+
+  for (y = 0; y < h; y += tile_height)
+    gimp_pixel_rgn_get_rect (&region, data + (gsize) y * w * *bpp,
+                             0, y, w, MIN (tile_height, h - y));
+
+  gimp_drawable_detach (drawable);
+
+  return data;
+}
+
+/*****************************************************/
+/* Make sure the bump and environment maps selected  */
+/* in mapvals are in memory.  Call this before       */
+/* rendering.                                        */
+/*****************************************************/
+
+void
+image_load_maps (void)
+{
+  if (mapvals.bump_mapped && mapvals.bumpmap_id != -1 &&
+      mapvals.bumpmap_id != bump_data_id)
+    {
+      g_free (bump_data);
+
+      bump_data    = read_drawable (mapvals.bumpmap_id, width, height,
+                                    &bump_bpp);
+      bump_data_id = mapvals.bumpmap_id;
+    }
+
+  if (mapvals.env_mapped && mapvals.envmap_id != -1 &&
+      mapvals.envmap_id != env_data_id)
+    {
+      g_free (env_data);
+
+      env_width  = gimp_drawable_width (mapvals.envmap_id);
+      env_height = gimp_drawable_height (mapvals.envmap_id);
+
+      env_data    = read_drawable (mapvals.envmap_id, env_width, env_height,
+                                   &env_bpp);
+      env_data_id = mapvals.envmap_id;
+    }
+}
+
 /****************************************/
 /* Allocate memory for temporary images */
 /****************************************/
@@ -361,8 +439,9 @@ image_setup (GimpDrawable *drawable,
   width  = input_drawable->width;
   height = input_drawable->height;
 
-  gimp_pixel_rgn_init (&source_region, input_drawable,
-		       0, 0, width, height, FALSE, FALSE);
+  g_free (source_data);
+  source_data = read_drawable (input_drawable->drawable_id, width, height,
+                               &source_bpp);
 
   maxcounter = (glong) width * (glong) height;
 
@@ -5,13 +5,10 @@
 #include <libgimp/gimpui.h>
 
 extern GimpDrawable *input_drawable,*output_drawable;
-extern GimpPixelRgn  source_region, dest_region;
+extern GimpPixelRgn  dest_region;
 
-extern GimpDrawable *bump_drawable;
-extern GimpPixelRgn  bump_region;
-
-extern GimpDrawable *env_drawable;
-extern GimpPixelRgn  env_region;
+extern guchar *source_data, *bump_data, *env_data;
+extern gint    source_bpp, bump_bpp, env_bpp;
 
 extern guchar          *preview_rgb_data;
 extern gint             preview_rgb_stride;
@@ -58,5 +55,6 @@ gdouble        get_map_value   (GimpPixelRgn *region,
 				gint         *inside);
 gint           image_setup     (GimpDrawable *drawable,
 				gint          interactive);
+void           image_load_maps (void);
 
 #endif  /* __LIGHTING_IMAGE_H__ */
@@ -50,6 +50,7 @@ compute_preview (gint startx, gint starty, gint w, gint h)
   GimpRGB lightcheck, darkcheck;
   GimpVector3 pos;
   get_ray_func ray_func;
+  ShadeContext *context;
 
   if (xpostab_size != w)
     {
@@ -86,7 +87,8 @@ compute_preview (gint startx, gint starty, gint w, gint h)
   for (ycnt = 0; ycnt < h; ycnt++)
     ypostab[ycnt] = (gdouble) height *((gdouble) ycnt / (gdouble) h);
 
-  precompute_init (width, height);
+  image_load_maps ();
+  context = shade_context_new (width, height);
 
   gimp_rgba_set (&lightcheck,
                  GIMP_CHECK_LIGHT, GIMP_CHECK_LIGHT, GIMP_CHECK_LIGHT,
@@ -94,13 +96,6 @@ compute_preview (gint startx, gint starty, gint w, gint h)
   gimp_rgba_set (&darkcheck, GIMP_CHECK_DARK, GIMP_CHECK_DARK,
                  GIMP_CHECK_DARK, 1.0);
 
-  if (mapvals.bump_mapped == TRUE && mapvals.bumpmap_id != -1)
-    {
-      gimp_pixel_rgn_init (&bump_region,
-                           gimp_drawable_get (mapvals.bumpmap_id),
-                           0, 0, width, height, FALSE, FALSE);
-    }
-
   imagey = 0;
 
   if (mapvals.previewquality)
@@ -110,13 +105,6 @@ compute_preview (gint startx, gint starty, gint w, gint h)
 
   if (mapvals.env_mapped == TRUE && mapvals.envmap_id != -1)
     {
-      env_width = gimp_drawable_width (mapvals.envmap_id);
-      env_height = gimp_drawable_height (mapvals.envmap_id);
-
-      gimp_pixel_rgn_init (&env_region,
-                           gimp_drawable_get (mapvals.envmap_id), 0,
-                           0, env_width, env_height, FALSE, FALSE);
-
       if (mapvals.previewquality)
         ray_func = get_ray_color_ref;
       else
@@ -142,10 +130,10 @@ compute_preview (gint startx, gint starty, gint w, gint h)
                   xcnt == startx)
                 {
                   pos_to_float (pos.x, pos.y, &imagex, &imagey);
-                  precompute_normals (0, width, RINT (imagey));
+                  precompute_normals (context, 0, width, RINT (imagey));
                 }
 
-              color = (*ray_func) (&pos);
+              color = (*ray_func) (context, &pos);
 
               if (color.a < 1.0)
                 {
@@ -188,6 +176,8 @@ compute_preview (gint startx, gint starty, gint w, gint h)
         }
     }
   cairo_surface_mark_dirty (preview_surface);
+
+  shade_context_free (context);
 }
 
 static void
@@ -11,15 +11,6 @@
 #include "lighting-shade.h"
 
 
-static GimpVector3 *triangle_normals[2] = { NULL, NULL };
-static GimpVector3 *vertex_normals[3]   = { NULL, NULL, NULL };
-static gdouble     *heights[3] = { NULL, NULL, NULL };
-static gdouble      xstep, ystep;
-static guchar      *bumprow = NULL;
-
-static gint pre_w = -1;
-static gint pre_h = -1;
-
 /*****************/
 /* Phong shading */
 /*****************/
@@ -31,7 +22,8 @@ phong_shade (GimpVector3 *position,
              GimpVector3 *lightposition,
              GimpRGB      *diff_col,
              GimpRGB      *light_col,
-             LightType    light_type)
+             LightType    light_type,
+             gdouble      diffuse_int)
 {
   GimpRGB       diffuse_color, specular_color;
   gdouble      nl, rv, dist;
@@ -82,7 +74,7 @@ phong_shade (GimpVector3 *position,
       /* =================================================== */
 
       diffuse_color = *light_col;
-      gimp_rgb_multiply (&diffuse_color, mapvals.material.diffuse_int);
+      gimp_rgb_multiply (&diffuse_color, diffuse_int);
       diffuse_color.r *= diff_col->r;
       diffuse_color.g *= diff_col->g;
       diffuse_color.b *= diff_col->b;
@@ -107,64 +99,80 @@ phong_shade (GimpVector3 *position,
   return diffuse_color;
 }
 
-void
-precompute_init (gint w,
-                 gint h)
+/*****************************************************/
+/* The normals and heights of the bump map around    */
+/* the row being shaded.  Each renderer thread has   */
+/* its own context.                                  */
+/*****************************************************/
+
+static void
+shade_context_reset (ShadeContext *context)
 {
+  gint w = context->width;
   gint n;
-  gint bpp=1;
-
-  xstep = 1.0 / (gdouble) width;
-  ystep = 1.0 / (gdouble) height;
-
-  pre_w = w;
-  pre_h = h;
 
-  for (n = 0; n < 3; n++)
+  for (n = 0; n < (w << 1) + 1; n++)
     {
-      if (vertex_normals[n] != NULL)
-        g_free (vertex_normals[n]);
-      if (heights[n] != NULL)
-        g_free (heights[n]);
-
-      heights[n] = g_new (gdouble, w);
-      vertex_normals[n] = g_new (GimpVector3, w);
+      gimp_vector3_set (&context->triangle_normals[0][n], 0.0, 0.0, 1.0);
+      gimp_vector3_set (&context->triangle_normals[1][n], 0.0, 0.0, 1.0);
     }
 
-  for (n = 0; n < 2; n++)
-    if (triangle_normals[n] != NULL)
-      g_free (triangle_normals[n]);
-
-  if (bumprow != NULL)
-    {
-      g_free (bumprow);
-      bumprow = NULL;
-    }
-  if (mapvals.bumpmap_id != -1)
+  for (n = 0; n < w; n++)
     {
-      bpp = gimp_drawable_bpp(mapvals.bumpmap_id);
+      gimp_vector3_set (&context->vertex_normals[0][n], 0.0, 0.0, 1.0);
+      gimp_vector3_set (&context->vertex_normals[1][n], 0.0, 0.0, 1.0);
+      gimp_vector3_set (&context->vertex_normals[2][n], 0.0, 0.0, 1.0);
+      context->heights[0][n] = 0.0;
+      context->heights[1][n] = 0.0;
+      context->heights[2][n] = 0.0;
     }
 
-  bumprow = g_new (guchar, w * bpp);
+  context->y           = -1;
+  context->normals     = context->vertex_normals[1];
+  context->row_heights = context->heights[1];
+}
+
+ShadeContext *
+shade_context_new (gint w,
+                   gint h)
+{
+  ShadeContext *context = g_new0 (ShadeContext, 1);
+  gint          n;
 
-  triangle_normals[0] = g_new (GimpVector3, (w << 1) + 2);
-  triangle_normals[1] = g_new (GimpVector3, (w << 1) + 2);
+  context->width  = w;
+  context->height = h;
+  context->xstep  = 1.0 / (gdouble) width;
+  context->ystep  = 1.0 / (gdouble) height;
 
-  for (n = 0; n < (w << 1) + 1; n++)
+  for (n = 0; n < 3; n++)
     {
-      gimp_vector3_set (&triangle_normals[0][n], 0.0, 0.0, 1.0);
-      gimp_vector3_set (&triangle_normals[1][n], 0.0, 0.0, 1.0);
+      context->heights[n]        = g_new (gdouble, w);
+      context->vertex_normals[n] = g_new (GimpVector3, w);
     }
 
-  for (n = 0; n < w; n++)
+  context->triangle_normals[0] = g_new (GimpVector3, (w << 1) + 2);
+  context->triangle_normals[1] = g_new (GimpVector3, (w << 1) + 2);
+
+  shade_context_reset (context);
+
+  return context;
+}
+
+void
+shade_context_free (ShadeContext *context)
+{
+  gint n;
+
+  for (n = 0; n < 3; n++)
     {
-      gimp_vector3_set (&vertex_normals[0][n], 0.0, 0.0, 1.0);
-      gimp_vector3_set (&vertex_normals[1][n], 0.0, 0.0, 1.0);
-      gimp_vector3_set (&vertex_normals[2][n], 0.0, 0.0, 1.0);
-      heights[0][n] = 0.0;
-      heights[1][n] = 0.0;
-      heights[2][n] = 0.0;
+      g_free (context->heights[n]);
+      g_free (context->vertex_normals[n]);
     }
+
+  g_free (context->triangle_normals[0]);
+  g_free (context->triangle_normals[1]);
+
+  g_free (context);
 }
 
 /********************************************/
@@ -172,16 +180,21 @@ precompute_init (gint w,
 /********************************************/
 
 void
-precompute_normals (gint x1,
-                    gint x2,
-                    gint y)
+precompute_normals (ShadeContext *context,
+                    gint          x1,
+                    gint          x2,
+                    gint          y)
 {
-  GimpVector3 *tmpv, p1, p2, p3, normal;
-  gdouble     *tmpd;
-  gint         n, i, nv;
-  guchar      *map = NULL;
-  gint bpp = 1;
-  guchar mapval;
+  GimpVector3  *tmpv, p1, p2, p3, normal;
+  GimpVector3 **triangle_normals = context->triangle_normals;
+  GimpVector3 **vertex_normals   = context->vertex_normals;
+  gdouble     **heights          = context->heights;
+  gdouble      *tmpd;
+  gint          n, i, nv;
+  guchar       *map = NULL;
+  const guchar *bumprow;
+  gint          bpp = bump_bpp;
+  guchar        mapval;
 
 
   /* First, compute the heights */
@@ -201,12 +214,7 @@ precompute_normals (gint x1,
   heights[1] = heights[2];
   heights[2] = tmpd;
 
-  if (mapvals.bumpmap_id != -1)
-    {
-      bpp = gimp_drawable_bpp(mapvals.bumpmap_id);
-    }
-
-  gimp_pixel_rgn_get_row (&bump_region, bumprow, x1, y, x2 - x1);
+  bumprow = bump_data + ((gsize) y * width + x1) * bpp;
 
   if (mapvals.bumpmaptype > 0)
     {
@@ -260,14 +268,14 @@ precompute_normals (gint x1,
   for (n = 0; n < (x2 - x1 - 1); n++)
     {
       p1.x = 0.0;
-      p1.y = ystep;
+      p1.y = context->ystep;
       p1.z = heights[2][n] - heights[1][n];
 
-      p2.x = xstep;
-      p2.y = ystep;
+      p2.x = context->xstep;
+      p2.y = context->ystep;
       p2.z = heights[2][n+1] - heights[1][n];
 
-      p3.x = xstep;
+      p3.x = context->xstep;
       p3.y = 0.0;
       p3.z = heights[1][n+1] - heights[1][n];
 
@@ -299,14 +307,14 @@ precompute_normals (gint x1,
               nv += 2;
             }
 
-          if (y < pre_h)
+          if (y < context->height)
             {
               gimp_vector3_add (&normal, &normal, &triangle_normals[1][i-1]);
               nv++;
             }
         }
 
-      if (n <pre_w)
+      if (n < context->width)
         {
           if (y > 0)
             {
@@ -315,7 +323,7 @@ precompute_normals (gint x1,
               nv += 2;
             }
 
-          if (y < pre_h)
+          if (y < context->height)
             {
               gimp_vector3_add (&normal, &normal, &triangle_normals[1][i]);
               gimp_vector3_add (&normal, &normal, &triangle_normals[1][i+1]);
@@ -329,6 +337,49 @@ precompute_normals (gint x1,
 
       i += 2;
     }
+
+  context->y           = y;
+  context->normals     = vertex_normals[1];
+  context->row_heights = heights[1];
+}
+
+/*****************************************************/
+/* Make row y the one the ray functions shade.  The  */
+/* ring only moves forward; the row before the last  */
+/* one computed is still in it, which is all the     */
+/* supersampler needs.                               */
+/*****************************************************/
+
+#define SHADE_WARMUP_ROWS 3
+
+void
+shade_context_set_row (ShadeContext *context,
+                       gint          y)
+{
+  if (mapvals.bump_mapped == FALSE || mapvals.bumpmap_id == -1)
+    return;
+
+  y = CLAMP (y, 0, context->height - 1);
+
+  if (y == context->y - 1)
+    {
+      context->normals     = context->vertex_normals[0];
+      context->row_heights = context->heights[0];
+      return;
+    }
+
+  if (y < context->y - 1 || y > context->y + SHADE_WARMUP_ROWS)
+    {
+      /* the normals of a row depend on the three rows before it */
+      shade_context_reset (context);
+      context->y = MAX (y - SHADE_WARMUP_ROWS, 0) - 1;
+    }
+
+  while (context->y < y)
+    precompute_normals (context, 0, context->width, context->y + 1);
+
+  context->normals     = context->vertex_normals[1];
+  context->row_heights = context->heights[1];
 }
 
 /***********************************************************************/
@@ -362,8 +413,8 @@ sphere_to_image (GimpVector3 *normal,
                  gdouble     *u,
                  gdouble     *v)
 {
-  static gdouble     alpha, fac;
-  static GimpVector3 cross_prod;
+  gdouble            alpha, fac;
+  GimpVector3        cross_prod;
   static GimpVector3 firstaxis  = { 1.0, 0.0, 0.0 };
   static GimpVector3 secondaxis = { 0.0, 1.0, 0.0 };
 
@@ -401,7 +452,8 @@ sphere_to_image (GimpVector3 *normal,
 /*********************************************************************/
 
 GimpRGB
-get_ray_color (GimpVector3 *position)
+get_ray_color (ShadeContext *context,
+              GimpVector3  *position)
 {
   GimpRGB       color;
   GimpRGB       color_int;
@@ -416,7 +468,7 @@ get_ray_color (GimpVector3 *position)
 
   x = RINT (xf);
 
-  if (mapvals.transparent_background && heights[1][x] == 0)
+  if (mapvals.transparent_background && context->row_heights[x] == 0)
     {
       gimp_rgb_set_alpha (&color_sum, 0.0);
     }
@@ -448,11 +500,12 @@ get_ray_color (GimpVector3 *position)
                                          p,
                                          &color,
                                          &color_int,
-                                         mapvals.lightsource[k].type);
+                                         mapvals.lightsource[k].type,
+                                         mapvals.material.diffuse_int);
             }
           else
             {
-              normal = vertex_normals[1][(gint) RINT (xf)];
+              normal = context->normals[(gint) RINT (xf)];
 
               light_color = phong_shade (position,
                                          &mapvals.viewpoint,
@@ -460,7 +513,8 @@ get_ray_color (GimpVector3 *position)
                                          p,
                                          &color,
                                          &color_int,
-                                         mapvals.lightsource[k].type);
+                                         mapvals.lightsource[k].type,
+                                         mapvals.material.diffuse_int);
             }
 
           gimp_rgb_add (&color_sum, &light_color);
@@ -472,7 +526,8 @@ get_ray_color (GimpVector3 *position)
 }
 
 GimpRGB
-get_ray_color_ref (GimpVector3 *position)
+get_ray_color_ref (ShadeContext *context,
+                  GimpVector3  *position)
 {
   GimpRGB      color_sum;
   GimpRGB      color_int;
@@ -482,7 +537,6 @@ get_ray_color_ref (GimpVector3 *position)
   gdouble      xf, yf;
   GimpVector3  normal, *p, v, r;
   gint         k;
-  gdouble      tmpval;
 
   pos_to_float (position->x, position->y, &xf, &yf);
 
@@ -491,10 +545,10 @@ get_ray_color_ref (GimpVector3 *position)
   if (mapvals.bump_mapped == FALSE || mapvals.bumpmap_id == -1)
     normal = mapvals.planenormal;
   else
-    normal = vertex_normals[1][(gint) RINT (xf)];
+    normal = context->normals[(gint) RINT (xf)];
   gimp_vector3_normalize (&normal);
 
-  if (mapvals.transparent_background && heights[1][x] == 0)
+  if (mapvals.transparent_background && context->row_heights[x] == 0)
     {
       gimp_rgb_set_alpha (&color_sum, 0.0);
     }
@@ -523,7 +577,8 @@ get_ray_color_ref (GimpVector3 *position)
                                      p,
                                      &color,
                                      &color_int,
-                                     mapvals.lightsource[0].type);
+                                     mapvals.lightsource[0].type,
+                                     mapvals.material.diffuse_int);
         }
 
       gimp_vector3_sub (&v, &mapvals.viewpoint, position);
@@ -538,18 +593,14 @@ get_ray_color_ref (GimpVector3 *position)
       env_color = peek_env_map (RINT (env_width * xf),
                                 RINT (env_height * yf));
 
-      tmpval = mapvals.material.diffuse_int;
-      mapvals.material.diffuse_int = 0.;
-
       light_color = phong_shade (position,
                                  &mapvals.viewpoint,
                                  &normal,
                                  &r,
                                  &color,
                                  &env_color,
-                                 DIRECTIONAL_LIGHT);
-
-      mapvals.material.diffuse_int = tmpval;
+                                 DIRECTIONAL_LIGHT,
+                                 0.0);
 
       gimp_rgb_add (&color_sum, &light_color);
     }
@@ -559,7 +610,8 @@ get_ray_color_ref (GimpVector3 *position)
 }
 
 GimpRGB
-get_ray_color_no_bilinear (GimpVector3 *position)
+get_ray_color_no_bilinear (ShadeContext *context,
+                          GimpVector3  *position)
 {
   GimpRGB       color;
   GimpRGB       color_int;
@@ -575,7 +627,7 @@ get_ray_color_no_bilinear (GimpVector3 *position)
 
   x = RINT (xf);
 
-  if (mapvals.transparent_background && heights[1][x] == 0)
+  if (mapvals.transparent_background && context->row_heights[x] == 0)
     {
       gimp_rgb_set_alpha (&color_sum, 0.0);
     }
@@ -607,11 +659,12 @@ get_ray_color_no_bilinear (GimpVector3 *position)
                                          p,
                                          &color,
                                          &color_int,
-                                         mapvals.lightsource[k].type);
+                                         mapvals.lightsource[k].type,
+                                         mapvals.material.diffuse_int);
             }
           else
             {
-              normal = vertex_normals[1][x];
+              normal = context->normals[x];
 
               light_color = phong_shade (position,
                                          &mapvals.viewpoint,
@@ -619,7 +672,8 @@ get_ray_color_no_bilinear (GimpVector3 *position)
                                          p,
                                          &color,
                                          &color_int,
-                                         mapvals.lightsource[k].type);
+                                         mapvals.lightsource[k].type,
+                                         mapvals.material.diffuse_int);
             }
 
           gimp_rgb_add (&color_sum, &light_color);
@@ -631,7 +685,8 @@ get_ray_color_no_bilinear (GimpVector3 *position)
 }
 
 GimpRGB
-get_ray_color_no_bilinear_ref (GimpVector3 *position)
+get_ray_color_no_bilinear_ref (ShadeContext *context,
+                              GimpVector3  *position)
 {
   GimpRGB      color_sum;
   GimpRGB      color_int;
@@ -641,7 +696,6 @@ get_ray_color_no_bilinear_ref (GimpVector3 *position)
   gdouble      xf, yf;
   GimpVector3  normal, *p, v, r;
   gint         k;
-  gdouble      tmpval;
 
   pos_to_float (position->x, position->y, &xf, &yf);
 
@@ -650,10 +704,10 @@ get_ray_color_no_bilinear_ref (GimpVector3 *position)
   if (mapvals.bump_mapped == FALSE || mapvals.bumpmap_id == -1)
     normal = mapvals.planenormal;
   else
-    normal = vertex_normals[1][(gint) RINT (xf)];
+    normal = context->normals[(gint) RINT (xf)];
   gimp_vector3_normalize (&normal);
 
-  if (mapvals.transparent_background && heights[1][x] == 0)
+  if (mapvals.transparent_background && context->row_heights[x] == 0)
     {
       gimp_rgb_set_alpha (&color_sum, 0.0);
     }
@@ -682,7 +736,8 @@ get_ray_color_no_bilinear_ref (GimpVector3 *position)
                                          p,
                                          &color,
                                          &color_int,
-                                         mapvals.lightsource[0].type);
+                                         mapvals.lightsource[0].type,
+                                         mapvals.material.diffuse_int);
         }
 
       gimp_vector3_sub (&v, &mapvals.viewpoint, position);
@@ -697,18 +752,14 @@ get_ray_color_no_bilinear_ref (GimpVector3 *position)
       env_color = peek_env_map (RINT (env_width * xf),
                                 RINT (env_height * yf));
 
-      tmpval = mapvals.material.diffuse_int;
-      mapvals.material.diffuse_int = 0.;
-
       light_color = phong_shade (position,
                                  &mapvals.viewpoint,
                                  &normal,
                                  &r,
                                  &color,
                                  &env_color,
-                                 DIRECTIONAL_LIGHT);
-
-      mapvals.material.diffuse_int = tmpval;
+                                 DIRECTIONAL_LIGHT,
+                                 0.0);
 
       gimp_rgb_add (&color_sum, &light_color);
     }
@@ -1,17 +1,43 @@
 #ifndef __LIGHTING_SHADE_H__
 #define __LIGHTING_SHADE_H__
 
-typedef GimpRGB (* get_ray_func) (GimpVector3 *vector);
-
-GimpRGB get_ray_color                 (GimpVector3 *position);
-GimpRGB get_ray_color_no_bilinear     (GimpVector3 *position);
-GimpRGB get_ray_color_ref             (GimpVector3 *position);
-GimpRGB get_ray_color_no_bilinear_ref (GimpVector3 *position);
-
-void    precompute_init               (gint         w,
-				       gint         h);
-void    precompute_normals            (gint         x1,
-				       gint         x2,
-				       gint         y);
+/* Bump map normals and heights around the row being shaded */
+
+typedef struct
+{
+  gint          width;
+  gint          height;
+  gdouble       xstep, ystep;
+  gint          y;          /* last row given to precompute_normals () */
+
+  GimpVector3  *triangle_normals[2];
+  GimpVector3  *vertex_normals[3];
+  gdouble      *heights[3];
+
+  GimpVector3  *normals;    /* what the ray functions shade with */
+  gdouble      *row_heights;
+} ShadeContext;
+
+typedef GimpRGB (* get_ray_func) (ShadeContext *context,
+                                  GimpVector3  *vector);
+
+GimpRGB get_ray_color                 (ShadeContext *context,
+                                       GimpVector3  *position);
+GimpRGB get_ray_color_no_bilinear     (ShadeContext *context,
+                                       GimpVector3  *position);
+GimpRGB get_ray_color_ref             (ShadeContext *context,
+                                       GimpVector3  *position);
+GimpRGB get_ray_color_no_bilinear_ref (ShadeContext *context,
+                                       GimpVector3  *position);
+
+ShadeContext * shade_context_new      (gint          w,
+                                       gint          h);
+void    shade_context_free            (ShadeContext *context);
+void    shade_context_set_row         (ShadeContext *context,
+                                       gint          y);
+void    precompute_normals            (ShadeContext *context,
+                                       gint          x1,
+                                       gint          x2,
+                                       gint          y);
 
 #endif  /* __LIGHTING_SHADE_H__ */
@@ -18,6 +18,8 @@
 
 #include "libgimp/stdplugins-intl.h"
 
+#include "plug-ins/common/threads.h"
+
 
 /*************/
 /* Main loop */
@@ -128,19 +130,13 @@ init_compute (void)
 
         memcpy (rotmat, b, sizeof (gfloat) * 16);
 
-        /* Set up pixel regions for the box face images */
-        /* ============================================ */
+        compute_object_transform ();
 
-        for (i = 0; i < 6; i++)
-          {
-            box_drawables[i] = gimp_drawable_get (mapvals.boxmap_id[i]);
+        /* Get the box face images */
+        /* ======================= */
 
-            gimp_pixel_rgn_init (&box_regions[i], box_drawables[i],
-                                 0, 0,
-                                 box_drawables[i]->width,
-                                 box_drawables[i]->height,
-                                 FALSE, FALSE);
-          }
+        for (i = 0; i < 6; i++)
+          box_images[i] = map_image_get (mapvals.boxmap_id[i]);
 
         break;
 
@@ -169,20 +165,13 @@ init_compute (void)
 
         memcpy (rotmat, b, sizeof (gfloat) * 16);
 
-        /* Set up pixel regions for the cylinder cap images */
-        /* ================================================ */
+        compute_object_transform ();
 
-        for (i = 0; i < 2; i++)
-          {
-            cylinder_drawables[i] =
-              gimp_drawable_get (mapvals.cylindermap_id[i]);
+        /* Get the cylinder cap images */
+        /* =========================== */
 
-            gimp_pixel_rgn_init (&cylinder_regions[i], cylinder_drawables[i],
-                                 0, 0,
-                                 cylinder_drawables[i]->width,
-                                 cylinder_drawables[i]->height,
-                                 FALSE, FALSE);
-          }
+        for (i = 0; i < 2; i++)
+          cylinder_images[i] = map_image_get (mapvals.cylindermap_id[i]);
 
         break;
     }
@@ -190,6 +179,37 @@ init_compute (void)
   max_depth = (gint) mapvals.maxdepth;
 }
 
+typedef struct
+{
+  guchar        *dest;
+  gint           first_row;
+  gint           n_rows;
+  gint           band_height;
+  gint           bpp;
+  volatile gint  next_band;
+} RenderJob;
+
+typedef struct
+{
+  RenderJob *job;
+  guchar    *band;      /* where the first row of the band goes */
+  gint       band_row;  /* and which row that is */
+} RenderWorker;
+
+static void
+put_color (guchar        *dest,
+           const GimpRGB *color,
+           gint           bpp)
+{
+  guchar col[4];
+
+  gimp_rgba_get_uchar (color, &col[0], &col[1], &col[2], &col[3]);
+
+  memcpy (dest, col, bpp);
+}
+
+/* Callbacks for gimp_adaptive_supersample_area () */
+
 static void
 render (gdouble   x,
         gdouble   y,
@@ -206,12 +226,73 @@ render (gdouble   x,
 }
 
 static void
-show_progress (gint     min,
-               gint     max,
-               gint     curr,
-               gpointer data)
+put_pixel (gint      x,
+           gint      y,
+           GimpRGB  *color,
+           gpointer  data)
+{
+  RenderWorker *worker = data;
+  RenderJob    *job    = worker->job;
+
+  put_color (worker->band + ((y - worker->band_row) * width + x) * job->bpp,
+             color, job->bpp);
+}
+
+/* Renders bands of rows, until there are none left.  Only touches
+ * memory, so that it can run on several threads at once.
+ */
+
+static gpointer
+render_thread (gpointer data)
 {
-  gimp_progress_update ((gdouble) curr / (gdouble) max);
+  RenderJob    *job = data;
+  RenderWorker  worker;
+  gint          band;
+
+  worker.job = job;
+
+  while ((band = g_atomic_int_add (&job->next_band, 1)) * job->band_height <
+         job->n_rows)
+    {
+      gint first = band * job->band_height;
+      gint rows  = MIN (job->band_height, job->n_rows - first);
+      gint x, y;
+
+      worker.band     = job->dest + first * width * job->bpp;
+      worker.band_row = job->first_row + first;
+
+      if (mapvals.antialiasing == FALSE)
+        {
+          for (y = 0; y < rows; y++)
+            {
+              guchar *row = worker.band + y * width * job->bpp;
+
+              for (x = 0; x < width; x++)
+                {
+                  GimpVector3 p     = int_to_pos (x, worker.band_row + y);
+                  GimpRGB     color = (* get_ray_color) (&p);
+
+                  put_color (row + x * job->bpp, &color, job->bpp);
+                }
+            }
+        }
+      else
+        {
+          gimp_adaptive_supersample_area (0, worker.band_row,
+                                          width - 1,
+                                          worker.band_row + rows - 1,
+                                          max_depth,
+                                          mapvals.pixeltreshold,
+                                          render,
+                                          NULL,
+                                          put_pixel,
+                                          &worker,
+                                          NULL,
+                                          NULL);
+        }
+    }
+
+  return NULL;
 }
 
 /**************************************************/
@@ -222,13 +303,14 @@ show_progress (gint     min,
 void
 compute_image (void)
 {
-  gint         xcount, ycount;
-  GimpRGB      color;
-  glong        progress_counter = 0;
-  GimpVector3  p;
   gint32       new_image_id = -1;
   gint32       new_layer_id = -1;
   gboolean     insert_layer = FALSE;
+  guchar      *buffer;
+  RenderJob    job;
+  GThread     *threads[THREADS_MAX];
+  gint         n_threads;
+  gint         i;
 
   init_compute ();
 
@@ -282,35 +364,43 @@ compute_image (void)
         break;
     }
 
-  if (mapvals.antialiasing == FALSE)
-    {
-      for (ycount = 0; ycount < height; ycount++)
-        {
-          for (xcount = 0; xcount < width; xcount++)
-            {
-              p = int_to_pos (xcount, ycount);
-              color = (* get_ray_color) (&p);
-              poke (xcount, ycount, &color, NULL);
+  job.bpp         = output_drawable->bpp;
+  job.band_height = gimp_tile_height ();
 
-              if ((progress_counter++ % width) == 0)
-                gimp_progress_update ((gdouble) progress_counter /
-                                      (gdouble) maxcounter);
-            }
-        }
-    }
-  else
+  n_threads = threads_get_count ();
+
+  /* Every thread renders a band of a tile's height at a time, with  */
+  /* its own supersampling state; the main thread writes them out a  */
+  /* batch at a time.                                                */
+  /* =============================================================== */
+
+  buffer = g_new (guchar, n_threads * job.band_height * width * job.bpp);
+
+  for (job.first_row = 0; job.first_row < height; job.first_row += job.n_rows)
     {
-      gimp_adaptive_supersample_area (0, 0,
-                                      width - 1, height - 1,
-                                      max_depth,
-                                      mapvals.pixeltreshold,
-                                      render,
-                                      NULL,
-                                      poke,
-                                      NULL,
-                                      show_progress,
-                                      NULL);
+      job.dest      = buffer;
+      job.n_rows    = MIN (n_threads * job.band_height,
+                           height - job.first_row);
+      job.next_band = 0;
+
+      for (i = 1; i < n_threads; i++)
+        threads[i] = g_thread_create (render_thread, &job, TRUE, NULL);
+
+      render_thread (&job);
+
+      for (i = 1; i < n_threads; i++)
+        if (threads[i])
+          g_thread_join (threads[i]);
+
+      gimp_pixel_rgn_set_rect (&dest_region, buffer,
+                               0, job.first_row, width, job.n_rows);
+
+      gimp_progress_update ((gdouble) (job.first_row + job.n_rows) /
+                            (gdouble) height);
     }
+
+  g_free (buffer);
+
   gimp_progress_update (1.0);
 
   /* Update the region */
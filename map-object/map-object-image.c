@@ -24,13 +24,13 @@
 
 
 GimpDrawable *input_drawable, *output_drawable;
-GimpPixelRgn source_region,dest_region;
+GimpPixelRgn dest_region;
 
-GimpDrawable *box_drawables[6];
-GimpPixelRgn box_regions[6];
+MapImage *source_image;
+MapImage *box_images[6];
+MapImage *cylinder_images[2];
 
-GimpDrawable *cylinder_drawables[2];
-GimpPixelRgn cylinder_regions[2];
+static GHashTable *map_images = NULL;
 
 guchar          *preview_rgb_data = NULL;
 gint             preview_rgb_stride;
@@ -47,106 +47,83 @@ gint border_x1, border_y1, border_x2, border_y2;
 /* Implementation */
 /******************/
 
-GimpRGB
-peek (gint x,
-      gint y)
+/*****************************************************/
+/* Returns an in-memory copy of the drawable.  The   */
+/* renderer threads read the source image and the    */
+/* box and cylinder textures through these; they are */
+/* read once and kept until the plug-in exits.       */
+/*****************************************************/
+
+MapImage *
+map_image_get (gint32 drawable_id)
 {
-  static guchar data[4];
+  MapImage     *image;
+  GimpDrawable *drawable;
+  GimpPixelRgn  region;
+  gint          tile_height = gimp_tile_height ();
+  gint          y;
 
-  GimpRGB color;
+  if (! map_images)
+    map_images = g_hash_table_new (g_direct_hash, g_direct_equal);
 
-  gimp_pixel_rgn_get_pixel (&source_region, data, x, y);
+  image = g_hash_table_lookup (map_images, GINT_TO_POINTER (drawable_id));
 
-  color.r = (gdouble) (data[0]) / 255.0;
-  color.g = (gdouble) (data[1]) / 255.0;
-  color.b = (gdouble) (data[2]) / 255.0;
+  if (image)
+    return image;
 
-  if (input_drawable->bpp == 4)
-    {
-      if (in_channels == 4)
-        color.a = (gdouble) (data[3]) / 255.0;
-      else
-        color.a = 1.0;
-    }
-  else
-    {
-      color.a = 1.0;
-    }
+  drawable = gimp_drawable_get (drawable_id);
 
-  return color;
-}
+  image = g_new (MapImage, 1);
 
-static GimpRGB
-peek_box_image (gint image,
-                gint x,
-                gint y)
-{
-  static guchar data[4];
+  image->width  = drawable->width;
+  image->height = drawable->height;
+  image->bpp    = drawable->bpp;
+  image->data   = g_new (guchar, (gsize) image->width * image->height *
+                                 image->bpp);
 
-  GimpRGB color;
+  gimp_pixel_rgn_init (&region, drawable,
+                       0, 0, image->width, image->height, FALSE, FALSE);
 
-  gimp_pixel_rgn_get_pixel (&box_regions[image], data, x, y);
+  for (y = 0; y < image->height; y += tile_height)
+    gimp_pixel_rgn_get_rect (&region,
+                             image->data + (gsize) y * image->width * image->bpp,
+                             0, y, image->width,
+                             MIN (tile_height, image->height - y));
 
-  color.r = (gdouble) (data[0]) / 255.0;
-  color.g = (gdouble) (data[1]) / 255.0;
-  color.b = (gdouble) (data[2]) / 255.0;
+  gimp_drawable_detach (drawable);
 
-  if (box_drawables[image]->bpp == 4)
-    {
-      if (gimp_drawable_has_alpha (box_drawables[image]->drawable_id))
-        color.a = (gdouble) (data[3]) / 255.0;
-      else
-        color.a = 1.0;
-    }
-  else
-    {
-      color.a = 1.0;
-    }
+  g_hash_table_insert (map_images, GINT_TO_POINTER (drawable_id), image);
 
-  return color;
+  return image;
 }
 
 static GimpRGB
-peek_cylinder_image (gint image,
-                     gint x,
-                     gint y)
+map_image_peek (const MapImage *image,
+                gint            x,
+                gint            y)
 {
-  static guchar data[4];
+  const guchar *data;
+  GimpRGB       color;
 
-  GimpRGB color;
-
-  gimp_pixel_rgn_get_pixel (&cylinder_regions[image],data, x, y);
+  data = image->data + ((gsize) y * image->width + x) * image->bpp;
 
   color.r = (gdouble) (data[0]) / 255.0;
   color.g = (gdouble) (data[1]) / 255.0;
   color.b = (gdouble) (data[2]) / 255.0;
 
-  if (cylinder_drawables[image]->bpp == 4)
-    {
-      if (gimp_drawable_has_alpha (cylinder_drawables[image]->drawable_id))
-        color.a = (gdouble) (data[3]) / 255.0;
-      else
-        color.a = 1.0;
-    }
+  if (image->bpp == 4)
+    color.a = (gdouble) (data[3]) / 255.0;
   else
-    {
-      color.a = 1.0;
-    }
+    color.a = 1.0;
 
   return color;
 }
 
-void
-poke (gint      x,
-      gint      y,
-      GimpRGB  *color,
-      gpointer  data)
+GimpRGB
+peek (gint x,
+      gint y)
 {
-  static guchar col[4];
-
-  gimp_rgba_get_uchar (color, &col[0], &col[1], &col[2], &col[3]);
-
-  gimp_pixel_rgn_set_pixel (&dest_region, col, x, y);
+  return map_image_peek (source_image, x, y);
 }
 
 gint
@@ -166,8 +143,8 @@ checkbounds_box_image (gint image,
 {
   gint w, h;
 
-  w = box_drawables[image]->width;
-  h = box_drawables[image]->height;
+  w = box_images[image]->width;
+  h = box_images[image]->height;
 
   if (x < 0 || y < 0 || x >= w || y >= h)
     return FALSE ;
@@ -182,8 +159,8 @@ checkbounds_cylinder_image (gint image,
 {
   gint w, h;
 
-  w = cylinder_drawables[image]->width;
-  h = cylinder_drawables[image]->height;
+  w = cylinder_images[image]->width;
+  h = cylinder_images[image]->height;
 
   if (x < 0 || y < 0 || x >= w || y >= h)
     return FALSE;
@@ -286,8 +263,8 @@ get_box_image_color (gint    image,
   gint    x1, y1, x2, y2;
   GimpRGB p[4];
 
-  w = box_drawables[image]->width;
-  h = box_drawables[image]->height;
+  w = box_images[image]->width;
+  h = box_images[image]->height;
 
   x1 = (gint) ((u * (gdouble) w));
   y1 = (gint) ((v * (gdouble) h));
@@ -299,12 +276,12 @@ get_box_image_color (gint    image,
   y2 = (y1 + 1);
 
   if (checkbounds_box_image (image, x2, y2) == FALSE)
-    return peek_box_image (image, x1,y1);
+    return map_image_peek (box_images[image], x1, y1);
 
-  p[0] = peek_box_image (image, x1, y1);
-  p[1] = peek_box_image (image, x2, y1);
-  p[2] = peek_box_image (image, x1, y2);
-  p[3] = peek_box_image (image, x2, y2);
+  p[0] = map_image_peek (box_images[image], x1, y1);
+  p[1] = map_image_peek (box_images[image], x2, y1);
+  p[2] = map_image_peek (box_images[image], x1, y2);
+  p[3] = map_image_peek (box_images[image], x2, y2);
 
   return gimp_bilinear_rgba (u * w, v * h, p);
 }
@@ -318,8 +295,8 @@ get_cylinder_image_color (gint    image,
   gint    x1, y1, x2, y2;
   GimpRGB p[4];
 
-  w = cylinder_drawables[image]->width;
-  h = cylinder_drawables[image]->height;
+  w = cylinder_images[image]->width;
+  h = cylinder_images[image]->height;
 
   x1 = (gint) ((u * (gdouble) w));
   y1 = (gint) ((v * (gdouble) h));
@@ -331,12 +308,12 @@ get_cylinder_image_color (gint    image,
   y2 = (y1 + 1);
 
   if (checkbounds_cylinder_image (image, x2, y2) == FALSE)
-    return peek_cylinder_image (image, x1,y1);
+    return map_image_peek (cylinder_images[image], x1, y1);
 
-  p[0] = peek_cylinder_image (image, x1, y1);
-  p[1] = peek_cylinder_image (image, x2, y1);
-  p[2] = peek_cylinder_image (image, x1, y2);
-  p[3] = peek_cylinder_image (image, x2, y2);
+  p[0] = map_image_peek (cylinder_images[image], x1, y1);
+  p[1] = map_image_peek (cylinder_images[image], x2, y1);
+  p[2] = map_image_peek (cylinder_images[image], x1, y2);
+  p[3] = map_image_peek (cylinder_images[image], x2, y2);
 
   return gimp_bilinear_rgba (u * w, v * h, p);
 }
@@ -367,8 +344,7 @@ image_setup (GimpDrawable *drawable,
   width  = input_drawable->width;
   height = input_drawable->height;
 
-  gimp_pixel_rgn_init (&source_region, input_drawable,
-                       0, 0, width, height, FALSE, FALSE);
+  source_image = map_image_get (input_drawable->drawable_id);
 
   maxcounter = (glong) width * (glong) height;
 
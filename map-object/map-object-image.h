@@ -4,14 +4,18 @@
 /* Externally visible variables */
 /* ============================ */
 
-extern GimpDrawable *input_drawable, *output_drawable;
-extern GimpPixelRgn  source_region,dest_region;
+typedef struct
+{
+  gint    width, height, bpp;
+  guchar *data;
+} MapImage;
 
-extern GimpDrawable *box_drawables[6];
-extern GimpPixelRgn  box_regions[6];
+extern GimpDrawable *input_drawable, *output_drawable;
+extern GimpPixelRgn  dest_region;
 
-extern GimpDrawable *cylinder_drawables[2];
-extern GimpPixelRgn  cylinder_regions[2];
+extern MapImage     *source_image;
+extern MapImage     *box_images[6];
+extern MapImage     *cylinder_images[2];
 
 extern guchar          *preview_rgb_data;
 extern gint             preview_rgb_stride;
@@ -31,6 +35,7 @@ extern GimpTile *current_in_tile, *current_out_tile;
 
 extern gint        image_setup              (GimpDrawable *drawable,
                                              gint          interactive);
+extern MapImage  * map_image_get            (gint32        drawable_id);
 extern glong       in_xy_to_index           (gint          x,
                                              gint          y);
 extern glong       out_xy_to_index          (gint          x,
@@ -39,10 +44,6 @@ extern gint        checkbounds              (gint          x,
                                              gint          y);
 extern GimpRGB      peek                     (gint          x,
                                              gint          y);
-extern void        poke                     (gint          x,
-                                             gint          y,
-                                             GimpRGB      *color,
-                                             gpointer      data);
 extern GimpVector3 int_to_pos               (gint          x,
                                              gint          y);
 extern void        pos_to_int               (gdouble       x,
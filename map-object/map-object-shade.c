@@ -18,6 +18,12 @@
 static gdouble     bx1, by1, bx2, by2;
 get_ray_color_func get_ray_color;
 
+/* Set up by compute_object_transform () for the box and cylinder */
+static gfloat      inv_rotmat[16];
+static GimpVector3 local_viewpoint;
+static gfloat      face_mat[2][16];     /* 90 degrees about x and y */
+static gfloat      inv_face_mat[2][16];
+
 typedef struct
 {
   gdouble     u, v;
@@ -111,21 +117,28 @@ plane_intersect (GimpVector3 *dir,
                  gdouble     *u,
                  gdouble     *v)
 {
-  static gdouble det, det1, det2, det3, t;
+  gdouble det, det1, det2, det3, t;
+  gdouble m[4][4];
+
+  /* imat is shared by all threads; only its first column */
+  /* depends on the ray                                   */
+  /* ==================================================== */
 
-  imat[0][0] = dir->x;
-  imat[1][0] = dir->y;
-  imat[2][0] = dir->z;
+  memcpy (m, imat, sizeof (m));
+
+  m[0][0] = dir->x;
+  m[1][0] = dir->y;
+  m[2][0] = dir->z;
 
   /* Compute determinant of the first 3x3 sub matrix (denominator) */
   /* ============================================================= */
 
-  det = (imat[0][0] * imat[1][1] * imat[2][2] +
-         imat[0][1] * imat[1][2] * imat[2][0] +
-         imat[0][2] * imat[1][0] * imat[2][1] -
-         imat[0][2] * imat[1][1] * imat[2][0] -
-         imat[0][0] * imat[1][2] * imat[2][1] -
-         imat[2][2] * imat[0][1] * imat[1][0]);
+  det = (m[0][0] * m[1][1] * m[2][2] +
+         m[0][1] * m[1][2] * m[2][0] +
+         m[0][2] * m[1][0] * m[2][1] -
+         m[0][2] * m[1][1] * m[2][0] -
+         m[0][0] * m[1][2] * m[2][1] -
+         m[2][2] * m[0][1] * m[1][0]);
 
   /* If the determinant is non-zero, a intersection point exists */
   /* =========================================================== */
@@ -135,26 +148,26 @@ plane_intersect (GimpVector3 *dir,
       /* Now, lets compute the numerator determinants (wow ;) */
       /* ==================================================== */
 
-      det1 = (imat[0][3] * imat[1][1] * imat[2][2] +
-              imat[0][1] * imat[1][2] * imat[2][3] +
-              imat[0][2] * imat[1][3] * imat[2][1] -
-              imat[0][2] * imat[1][1] * imat[2][3] -
-              imat[1][2] * imat[2][1] * imat[0][3] -
-              imat[2][2] * imat[0][1] * imat[1][3]);
-
-      det2 = (imat[0][0] * imat[1][3] * imat[2][2] +
-              imat[0][3] * imat[1][2] * imat[2][0] +
-              imat[0][2] * imat[1][0] * imat[2][3] -
-              imat[0][2] * imat[1][3] * imat[2][0] -
-              imat[1][2] * imat[2][3] * imat[0][0] -
-              imat[2][2] * imat[0][3] * imat[1][0]);
-
-      det3 = (imat[0][0] * imat[1][1] * imat[2][3] +
-              imat[0][1] * imat[1][3] * imat[2][0] +
-              imat[0][3] * imat[1][0] * imat[2][1] -
-              imat[0][3] * imat[1][1] * imat[2][0] -
-              imat[1][3] * imat[2][1] * imat[0][0] -
-              imat[2][3] * imat[0][1] * imat[1][0]);
+      det1 = (m[0][3] * m[1][1] * m[2][2] +
+              m[0][1] * m[1][2] * m[2][3] +
+              m[0][2] * m[1][3] * m[2][1] -
+              m[0][2] * m[1][1] * m[2][3] -
+              m[1][2] * m[2][1] * m[0][3] -
+              m[2][2] * m[0][1] * m[1][3]);
+
+      det2 = (m[0][0] * m[1][3] * m[2][2] +
+              m[0][3] * m[1][2] * m[2][0] +
+              m[0][2] * m[1][0] * m[2][3] -
+              m[0][2] * m[1][3] * m[2][0] -
+              m[1][2] * m[2][3] * m[0][0] -
+              m[2][2] * m[0][3] * m[1][0]);
+
+      det3 = (m[0][0] * m[1][1] * m[2][3] +
+              m[0][1] * m[1][3] * m[2][0] +
+              m[0][3] * m[1][0] * m[2][1] -
+              m[0][3] * m[1][1] * m[2][0] -
+              m[1][3] * m[2][1] * m[0][0] -
+              m[2][3] * m[0][1] * m[1][0]);
 
       /* Now we have the simultanous solutions. Lets compute the unknowns */
       /* (skip u&v if t is <0, this means the intersection is behind us)  */
@@ -188,9 +201,9 @@ get_ray_color_plane (GimpVector3 *pos)
 {
   GimpRGB color = background;
 
-  static gint         inside = FALSE;
-  static GimpVector3  ray, spos;
-  static gdouble      vx, vy;
+  gint         inside = FALSE;
+  GimpVector3  ray, spos;
+  gdouble      vx, vy;
 
   /* Construct a line from our VP to the point */
   /* ========================================= */
@@ -241,8 +254,8 @@ sphere_to_image (GimpVector3 *normal,
                  gdouble     *u,
                  gdouble     *v)
 {
-  static gdouble      alpha, fac;
-  static GimpVector3  cross_prod;
+  gdouble      alpha, fac;
+  GimpVector3  cross_prod;
 
   alpha = acos (-gimp_vector3_inner_product (&mapvals.secondaxis, normal));
 
@@ -282,8 +295,8 @@ sphere_intersect (GimpVector3 *dir,
                   GimpVector3 *spos1,
                   GimpVector3 *spos2)
 {
-  static gdouble      alpha, beta, tau, s1, s2, tmp;
-  static GimpVector3  t;
+  gdouble      alpha, beta, tau, s1, s2, tmp;
+  GimpVector3  t;
 
   gimp_vector3_sub (&t, &mapvals.position, viewp);
 
@@ -328,10 +341,10 @@ get_ray_color_sphere (GimpVector3 *pos)
 {
   GimpRGB color = background;
 
-  static GimpRGB      color2;
-  static gint         inside = FALSE;
-  static GimpVector3  normal, ray, spos1, spos2;
-  static gdouble      vx, vy;
+  GimpRGB      color2;
+  gint         inside = FALSE;
+  GimpVector3  normal, ray, spos1, spos2;
+  gdouble      vx, vy;
 
   /* Check if ray is within the bounding box */
   /* ======================================= */
@@ -473,6 +486,38 @@ compute_bounding_box (void)
   by2 = p2.y;
 }
 
+/*****************************************************/
+/* Precompute what every ray shares for the box and  */
+/* cylinder: the inverse of rotmat, the viewpoint in */
+/* the object's coordinate system and the rotations  */
+/* into the side faces of the box.                   */
+/*****************************************************/
+
+void
+compute_object_transform (void)
+{
+  GimpVector3 vp, axis;
+
+  memcpy (inv_rotmat, rotmat, sizeof (gfloat) * 16);
+  transpose_mat (inv_rotmat);
+
+  vp.x = mapvals.viewpoint.x - mapvals.position.x;
+  vp.y = mapvals.viewpoint.y - mapvals.position.y;
+  vp.z = mapvals.viewpoint.z - mapvals.position.z;
+
+  vecmulmat (&local_viewpoint, &vp, inv_rotmat);
+
+  gimp_vector3_set (&axis, 1.0, 0.0, 0.0);
+  rotatemat (90, &axis, face_mat[0]);
+
+  gimp_vector3_set (&axis, 0.0, 1.0, 0.0);
+  rotatemat (90, &axis, face_mat[1]);
+
+  memcpy (inv_face_mat, face_mat, sizeof (face_mat));
+  transpose_mat (inv_face_mat[0]);
+  transpose_mat (inv_face_mat[1]);
+}
+
 /* These two were taken from the Mesa source. Mesa is written   */
 /* and is (C) by Brian Paul. vecmulmat() performs a post-mul by */
 /* a 4x4 matrix to a 1x4(3) vector. rotmat() creates a matrix   */
@@ -679,16 +724,11 @@ intersect_box (GimpVector3        scale,
                GimpVector3        dir,
                FaceIntersectInfo *face_intersect)
 {
-  GimpVector3        v, d, tmp, axis[3];
+  GimpVector3        v, d, tmp;
   FaceIntersectInfo  face_tmp;
   gboolean           result = FALSE;
-  gfloat             m[16];
   gint               i = 0;
 
-  gimp_vector3_set (&axis[0], 1.0, 0.0, 0.0);
-  gimp_vector3_set (&axis[1], 0.0, 1.0, 0.0);
-  gimp_vector3_set (&axis[2], 0.0, 0.0, 1.0);
-
   /* Front side */
   /* ========== */
 
@@ -720,17 +760,15 @@ intersect_box (GimpVector3        scale,
       /* Top: Rotate viewpoint and direction into rectangle's local coordinate system */
       /* ============================================================================ */
 
-      rotatemat (90, &axis[0], m);
-      vecmulmat (&v, &viewp, m);
-      vecmulmat (&d, &dir, m);
+      vecmulmat (&v, &viewp, face_mat[0]);
+      vecmulmat (&d, &dir, face_mat[0]);
 
       if (intersect_rect (scale.x, scale.z, scale.y / 2.0,
                           v, d, &face_intersect[i]) == TRUE)
         {
           face_intersect[i].face = 2;
 
-          transpose_mat (m);
-          vecmulmat(&tmp, &face_intersect[i].s, m);
+          vecmulmat (&tmp, &face_intersect[i].s, inv_face_mat[0]);
           face_intersect[i].s = tmp;
 
           gimp_vector3_set (&face_intersect[i++].n, 0.0, -1.0, 0.0);
@@ -746,18 +784,15 @@ intersect_box (GimpVector3        scale,
       /* Bottom: Rotate viewpoint and direction into rectangle's local coordinate system */
       /* =============================================================================== */
 
-      rotatemat (90, &axis[0], m);
-      vecmulmat (&v, &viewp, m);
-      vecmulmat (&d, &dir, m);
+      vecmulmat (&v, &viewp, face_mat[0]);
+      vecmulmat (&d, &dir, face_mat[0]);
 
       if (intersect_rect (scale.x, scale.z, -scale.y / 2.0,
                           v, d, &face_intersect[i]) == TRUE)
         {
           face_intersect[i].face = 3;
 
-          transpose_mat (m);
-
-          vecmulmat (&tmp, &face_intersect[i].s, m);
+          vecmulmat (&tmp, &face_intersect[i].s, inv_face_mat[0]);
           face_intersect[i].s = tmp;
 
           face_intersect[i].v = 1.0 - face_intersect[i].v;
@@ -776,17 +811,15 @@ intersect_box (GimpVector3        scale,
       /* Left side: Rotate viewpoint and direction into rectangle's local coordinate system */
       /* ================================================================================== */
 
-      rotatemat (90, &axis[1], m);
-      vecmulmat (&v, &viewp, m);
-      vecmulmat (&d, &dir, m);
+      vecmulmat (&v, &viewp, face_mat[1]);
+      vecmulmat (&d, &dir, face_mat[1]);
 
       if (intersect_rect (scale.z, scale.y, scale.x / 2.0,
                           v, d, &face_intersect[i]) == TRUE)
         {
           face_intersect[i].face = 4;
 
-          transpose_mat (m);
-          vecmulmat (&tmp, &face_intersect[i].s, m);
+          vecmulmat (&tmp, &face_intersect[i].s, inv_face_mat[1]);
           face_intersect[i].s = tmp;
 
           gimp_vector3_set (&face_intersect[i++].n, 1.0, 0.0, 0.0);
@@ -802,17 +835,15 @@ intersect_box (GimpVector3        scale,
       /* Right side: Rotate viewpoint and direction into rectangle's local coordinate system */
       /* =================================================================================== */
 
-      rotatemat (90, &axis[1], m);
-      vecmulmat (&v, &viewp, m);
-      vecmulmat (&d, &dir, m);
+      vecmulmat (&v, &viewp, face_mat[1]);
+      vecmulmat (&d, &dir, face_mat[1]);
 
       if (intersect_rect (scale.z, scale.y, -scale.x / 2.0,
                           v, d, &face_intersect[i]) == TRUE)
         {
           face_intersect[i].face = 5;
 
-          transpose_mat (m);
-          vecmulmat (&tmp, &face_intersect[i].s, m);
+          vecmulmat (&tmp, &face_intersect[i].s, inv_face_mat[1]);
 
           face_intersect[i].u = 1.0 - face_intersect[i].u;
 
@@ -837,9 +868,8 @@ intersect_box (GimpVector3        scale,
 GimpRGB
 get_ray_color_box (GimpVector3 *pos)
 {
-  GimpVector3        lvp, ldir, vp, p, dir, ns, nn;
+  GimpVector3        ldir, vp, p, dir, ns, nn;
   GimpRGB             color, color2;
-  gfloat             m[16];
   gint               i;
   FaceIntersectInfo  face_intersect[2];
 
@@ -865,17 +895,13 @@ get_ray_color_box (GimpVector3 *pos)
   gimp_vector3_sub (&dir, &p, &vp);
   gimp_vector3_normalize (&dir);
 
-  /* Compute inverse of rotation matrix and apply it to   */
-  /* the viewpoint and direction. This transforms the     */
-  /* observer into the local coordinate system of the box */
+  /* Apply the inverse of the rotation matrix to the     */
+  /* direction. This transforms the observer into the     */
+  /* local coordinate system of the box (the viewpoint    */
+  /* was transformed by compute_object_transform ())      */
   /* ==================================================== */
 
-  memcpy (m, rotmat, sizeof (gfloat) * 16);
-
-  transpose_mat (m);
-
-  vecmulmat (&lvp, &vp, m);
-  vecmulmat (&ldir, &dir, m);
+  vecmulmat (&ldir, &dir, inv_rotmat);
 
   /* Ok. Now the observer is in the space where the box is located */
   /* with its lower left corner at the origin and its axis aligned */
@@ -885,7 +911,7 @@ get_ray_color_box (GimpVector3 *pos)
   face_intersect[0].t = 1000000.0;
   face_intersect[1].t = 1000000.0;
 
-  if (intersect_box (mapvals.scale, lvp, ldir, face_intersect) == TRUE)
+  if (intersect_box (mapvals.scale, local_viewpoint, ldir, face_intersect) == TRUE)
     {
       /* We've hit the box. Transform the hit points and */
       /* normals back into the world coordinate system   */
@@ -1125,9 +1151,8 @@ get_cylinder_color (gint    face,
 GimpRGB
 get_ray_color_cylinder (GimpVector3 *pos)
 {
-  GimpVector3       lvp, ldir, vp, p, dir, ns, nn;
+  GimpVector3       ldir, vp, p, dir, ns, nn;
   GimpRGB            color, color2;
-  gfloat            m[16];
   gint              i;
   FaceIntersectInfo face_intersect[2];
 
@@ -1149,19 +1174,15 @@ get_ray_color_cylinder (GimpVector3 *pos)
   gimp_vector3_sub (&dir, &p, &vp);
   gimp_vector3_normalize (&dir);
 
-  /* Compute inverse of rotation matrix and apply it to   */
-  /* the viewpoint and direction. This transforms the     */
-  /* observer into the local coordinate system of the box */
+  /* Apply the inverse of the rotation matrix to the     */
+  /* direction. This transforms the observer into the     */
+  /* local coordinate system of the box (the viewpoint    */
+  /* was transformed by compute_object_transform ())      */
   /* ==================================================== */
 
-  memcpy (m, rotmat, sizeof (gfloat) * 16);
-
-  transpose_mat (m);
-
-  vecmulmat (&lvp, &vp, m);
-  vecmulmat (&ldir, &dir, m);
+  vecmulmat (&ldir, &dir, inv_rotmat);
 
-  if (intersect_cylinder (lvp, ldir, face_intersect) == TRUE)
+  if (intersect_cylinder (local_viewpoint, ldir, face_intersect) == TRUE)
     {
       /* We've hit the cylinder. Transform the hit points and */
       /* normals back into the world coordinate system        */
@@ -10,6 +10,7 @@ GimpRGB   get_ray_color_sphere   (GimpVector3 *pos);
 GimpRGB   get_ray_color_box      (GimpVector3 *pos);
 GimpRGB   get_ray_color_cylinder (GimpVector3 *pos);
 void     compute_bounding_box   (void);
+void     compute_object_transform (void);
 
 void     vecmulmat              (GimpVector3 *u,
                                  GimpVector3 *v,
@@ -252,6 +252,124 @@ static PyMappingMethods tile_as_mapping = {
     (objobjargproc)tile_ass_sub, /*ass_sub*/
 };
 
+/* The tile data is one contiguous block of ewidth * eheight * bpp
+ * bytes, which is handed out as is.  Asking for a writable buffer
+ * marks the tile dirty, as assigning to a subscript does.
+ */
+
+static Py_ssize_t
+tile_getreadbuf(PyGimpTile *self, Py_ssize_t segment, void **ptr)
+{
+    GimpTile *tile = self->tile;
+
+    if (segment != 0) {
+	PyErr_SetString(PyExc_SystemError,
+			"accessing non-existent tile segment");
+	return -1;
+    }
+
+    *ptr = tile->data;
+
+    return tile->ewidth * tile->eheight * tile->bpp;
+}
+
+static Py_ssize_t
+tile_getwritebuf(PyGimpTile *self, Py_ssize_t segment, void **ptr)
+{
+    Py_ssize_t len = tile_getreadbuf(self, segment, ptr);
+
+    if (len >= 0)
+	self->tile->dirty = TRUE;
+
+    return len;
+}
+
+static Py_ssize_t
+tile_getsegcount(PyGimpTile *self, Py_ssize_t *lenp)
+{
+    GimpTile *tile = self->tile;
+
+    if (lenp)
+	*lenp = tile->ewidth * tile->eheight * tile->bpp;
+
+    return 1;
+}
+
+static Py_ssize_t
+tile_getcharbuf(PyGimpTile *self, Py_ssize_t segment, char **ptr)
+{
+    return tile_getreadbuf(self, segment, (void **)ptr);
+}
+
+#if PY_VERSION_HEX >= 0x02060000
+static int
+tile_getbuffer(PyGimpTile *self, Py_buffer *view, int flags)
+{
+    GimpTile *tile = self->tile;
+
+    if ((flags & PyBUF_F_CONTIGUOUS) == PyBUF_F_CONTIGUOUS) {
+	PyErr_SetString(PyExc_BufferError,
+			"tile data is not Fortran contiguous");
+	view->obj = NULL;
+	return -1;
+    }
+
+    if ((flags & PyBUF_WRITABLE) == PyBUF_WRITABLE)
+	tile->dirty = TRUE;
+
+    self->shape[0] = tile->eheight;
+    self->shape[1] = tile->ewidth;
+    self->shape[2] = tile->bpp;
+
+    self->strides[0] = tile->ewidth * tile->bpp;
+    self->strides[1] = tile->bpp;
+    self->strides[2] = 1;
+
+    view->buf = tile->data;
+    view->obj = (PyObject *)self;
+    view->len = tile->ewidth * tile->eheight * tile->bpp;
+    view->readonly = ((flags & PyBUF_WRITABLE) != PyBUF_WRITABLE);
+    view->itemsize = 1;
+    view->format = (flags & PyBUF_FORMAT) ? "B" : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+
+    if ((flags & PyBUF_ND) == PyBUF_ND) {
+	view->ndim = 3;
+	view->shape = self->shape;
+    } else {
+	view->ndim = 1;
+	view->shape = NULL;
+    }
+
+    if ((flags & PyBUF_STRIDES) == PyBUF_STRIDES)
+	view->strides = self->strides;
+    else
+	view->strides = NULL;
+
+    Py_INCREF(self);
+
+    return 0;
+}
+#endif
+
+static PyBufferProcs tile_as_buffer = {
+    (readbufferproc)tile_getreadbuf,	/* bf_getreadbuffer */
+    (writebufferproc)tile_getwritebuf,	/* bf_getwritebuffer */
+    (segcountproc)tile_getsegcount,	/* bf_getsegcount */
+    (charbufferproc)tile_getcharbuf,	/* bf_getcharbuffer */
+#if PY_VERSION_HEX >= 0x02060000
+    (getbufferproc)tile_getbuffer,	/* bf_getbuffer */
+    (releasebufferproc)0,		/* bf_releasebuffer */
+#endif
+};
+
+#if PY_VERSION_HEX >= 0x02060000
+#define TILE_TPFLAGS (Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER)
+#else
+#define TILE_TPFLAGS Py_TPFLAGS_DEFAULT
+#endif
+
 PyTypeObject PyGimpTile_Type = {
     PyObject_HEAD_INIT(NULL)
     0,                                  /* ob_size */
@@ -273,8 +391,8 @@ PyTypeObject PyGimpTile_Type = {
     (reprfunc)0,                        /* tp_str */
     (getattrofunc)0,                    /* tp_getattro */
     (setattrofunc)0,                    /* tp_setattro */
-    0,					/* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT,	                /* tp_flags */
+    &tile_as_buffer,			/* tp_as_buffer */
+    TILE_TPFLAGS,	                /* tp_flags */
     NULL, /* Documentation string */
     (traverseproc)0,			/* tp_traverse */
     (inquiry)0,				/* tp_clear */
@@ -313,10 +431,99 @@ pr_resize(PyGimpPixelRgn *self, PyObject *args)
     return Py_None;
 }
 
+/* Checks the rectangle given to get_rect_into/set_rect_from against
+ * the region and returns the number of bytes it covers, or -1.
+ */
+static Py_ssize_t
+pr_rect_size(GimpPixelRgn *pr, int x, int y, int w, int h)
+{
+    if (w <= 0 || h <= 0 ||
+        x < (int)pr->x || y < (int)pr->y ||
+        x + w > (int)(pr->x + pr->w) || y + h > (int)(pr->y + pr->h)) {
+        PyErr_SetString(PyExc_IndexError, "rectangle out of range");
+        return -1;
+    }
+
+    return (Py_ssize_t)w * h * pr->bpp;
+}
+
+static PyObject *
+pr_get_rect_into(PyGimpPixelRgn *self, PyObject *args, PyObject *kwargs)
+{
+    GimpPixelRgn *pr = &(self->pr);
+    PyObject *obj;
+    void *buf;
+    Py_ssize_t len, size;
+    int x = pr->x, y = pr->y, w = pr->w, h = pr->h;
+    static char *kwlist[] = { "buffer", "x", "y", "w", "h", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs,
+                                     "O|iiii:get_rect_into", kwlist,
+                                     &obj, &x, &y, &w, &h))
+        return NULL;
+
+    size = pr_rect_size(pr, x, y, w, h);
+    if (size < 0)
+        return NULL;
+
+    if (PyObject_AsWriteBuffer(obj, &buf, &len) < 0)
+        return NULL;
+
+    if (len != size) {
+        PyErr_Format(PyExc_ValueError,
+                     "buffer is %d bytes, rectangle needs %d",
+                     (int)len, (int)size);
+        return NULL;
+    }
+
+    gimp_pixel_rgn_get_rect(pr, buf, x, y, w, h);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *
+pr_set_rect_from(PyGimpPixelRgn *self, PyObject *args, PyObject *kwargs)
+{
+    GimpPixelRgn *pr = &(self->pr);
+    PyObject *obj;
+    const void *buf;
+    Py_ssize_t len, size;
+    int x = pr->x, y = pr->y, w = pr->w, h = pr->h;
+    static char *kwlist[] = { "buffer", "x", "y", "w", "h", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs,
+                                     "O|iiii:set_rect_from", kwlist,
+                                     &obj, &x, &y, &w, &h))
+        return NULL;
+
+    size = pr_rect_size(pr, x, y, w, h);
+    if (size < 0)
+        return NULL;
+
+    if (PyObject_AsReadBuffer(obj, &buf, &len) < 0)
+        return NULL;
+
+    if (len != size) {
+        PyErr_Format(PyExc_ValueError,
+                     "buffer is %d bytes, rectangle needs %d",
+                     (int)len, (int)size);
+        return NULL;
+    }
+
+    gimp_pixel_rgn_set_rect(pr, buf, x, y, w, h);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
 
 
 static PyMethodDef pr_methods[] = {
     {"resize",	(PyCFunction)pr_resize,	METH_VARARGS},
+    {"get_rect_into", (PyCFunction)pr_get_rect_into,
+                      METH_VARARGS | METH_KEYWORDS},
+    {"set_rect_from", (PyCFunction)pr_set_rect_from,
+                      METH_VARARGS | METH_KEYWORDS},
 
     {NULL,		NULL}		/* sentinel */
 };
@@ -88,6 +88,8 @@ typedef struct {
     PyObject_HEAD
     GimpTile *tile;
     PyGimpDrawable *drawable; /* we keep a reference to the drawable */
+    Py_ssize_t shape[3];      /* rows, columns, bytes; for the buffer */
+    Py_ssize_t strides[3];    /* interface */
 } PyGimpTile;
 
 extern PyTypeObject PyGimpTile_Type;
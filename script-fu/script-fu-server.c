@@ -54,6 +54,7 @@ typedef short sa_family_t;	/* Not defined by winsock */
 #include <sys/select.h>
 #endif /* HAVE_SYS_SELECT_H */
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #endif
@@ -74,9 +75,24 @@ typedef short sa_family_t;	/* Not defined by winsock */
 #define CLOSESOCKET(fd) close(fd)
 #endif
 
-#define COMMAND_HEADER  3
-#define RESPONSE_HEADER 4
-#define MAGIC           'G'
+#define COMMAND_HEADER      3
+#define RESPONSE_HEADER     4
+#define MAGIC               'G'
+
+#define EXT_COMMAND_HEADER  5
+#define EXT_RESPONSE_HEADER 18
+#define EXT_MAGIC           'X'
+
+/*  Refuse extended commands larger than this instead of trying to
+ *  allocate whatever a broken client claims to send.
+ */
+#define MAX_COMMAND_LEN     (16 * 1024 * 1024)
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS          MSG_NOSIGNAL
+#else
+#define SEND_FLAGS          0
+#endif
 
 #ifndef HAVE_DIFFTIME
 #define difftime(a,b) (((gdouble)(a)) - ((gdouble)(b)))
@@ -106,6 +122,29 @@ typedef short sa_family_t;	/* Not defined by winsock */
 /*  Header format for outgoing responses...
  *    bytes: 1          2          3          4
  *           MAGIC      ERROR?     RSP_LEN_H  RSP_LEN_L
+ *
+ *  Responses which don't fit into 16 bits are truncated to 65535 bytes.
+ */
+
+/*  Extended header format for incoming commands...
+ *    bytes: 1          2-5
+ *           EXT_MAGIC  CMD_LEN
+ */
+
+/*  Extended header format for outgoing responses, sent in reply to
+ *  commands which came with an extended header...
+ *    bytes: 1          2          3-6        7-10        11-14      15-18
+ *           EXT_MAGIC  ERROR?     RSP_LEN    REQUEST_NO  QUEUED_US  RUN_US
+ *
+ *  All multi-byte fields are unsigned 32 bit, most significant byte
+ *  first.  QUEUED_US is the time the command waited in the request
+ *  queue and RUN_US the time it took to run, both in microseconds.
+ */
+
+/*  A client doesn't need to wait for a response before sending its next
+ *  command.  Commands are run one at a time in the order they arrived,
+ *  so the responses on a connection come back in the same order as the
+ *  commands were sent.
  */
 
 #define MAGIC_BYTE      0
@@ -117,17 +156,32 @@ typedef short sa_family_t;	/* Not defined by winsock */
 #define RSP_LEN_H_BYTE  2
 #define RSP_LEN_L_BYTE  3
 
+#define EXT_CMD_LEN_BYTE     1
+
+#define EXT_RSP_LEN_BYTE     2
+#define EXT_REQUEST_NO_BYTE  6
+#define EXT_QUEUED_BYTE      10
+#define EXT_RUN_BYTE         14
+
 /*
  *  Local Types
  */
 
 typedef struct
 {
-  gchar *command;
-  gint   filedes;
-  gint   request_no;
+  gchar    *command;
+  gint      filedes;
+  gint      request_no;
+  gboolean  extended;  /*  reply with the extended header     */
+  gdouble   received;  /*  server_timer time it was queued at  */
 } SFCommand;
 
+typedef struct
+{
+  gchar      *address;
+  GByteArray *input;   /*  received bytes not yet forming a command  */
+} SFClient;
+
 typedef struct
 {
   GtkWidget *port_entry;
@@ -155,7 +209,10 @@ typedef union
 static void      server_start       (gint         port,
                                      const gchar *logfile);
 static gboolean  execute_command    (SFCommand   *cmd);
-static gint      read_from_client   (gint         filedes);
+static gint      read_from_client   (gint         filedes,
+                                     SFClient    *client);
+static void      free_command       (SFCommand   *cmd);
+static void      free_client        (SFClient    *client);
 static gint      make_socket        (const struct addrinfo
                                                  *ai);
 static void      server_log         (const gchar *format,
@@ -180,6 +237,7 @@ static gint         queue_length    = 0;
 static gint         request_no      = 0;
 static FILE        *server_log_file = NULL;
 static GHashTable  *clients         = NULL;
+static GTimer      *server_timer    = NULL;
 static gboolean     script_fu_done  = FALSE;
 static gboolean     server_mode     = FALSE;
 
@@ -273,15 +331,16 @@ script_fu_server_read_fd (gpointer key,
                           gpointer value,
                           gpointer data)
 {
-  gint fd = GPOINTER_TO_INT (key);
+  SFClient *client = value;
+  gint      fd     = GPOINTER_TO_INT (key);
 
   if (FD_ISSET (fd, (SELECT_MASK *) data))
     {
-      if (read_from_client (fd) < 0)
+      if (read_from_client (fd, client) < 0)
         {
           GList *list;
 
-          server_log ("Server: disconnect from host %s.\n", (gchar *) value);
+          server_log ("Server: disconnect from host %s.\n", client->address);
 
           CLOSESOCKET (fd);
 
@@ -289,7 +348,7 @@ script_fu_server_read_fd (gpointer key,
               from the disconnected client.  */
           for (list = command_queue; list; list = list->next)
             {
-              SFCommand *cmd = (SFCommand *) command_queue->data;
+              SFCommand *cmd = (SFCommand *) list->data;
 
               if (cmd->filedes == fd)
                 cmd->filedes = -1;
@@ -339,11 +398,13 @@ script_fu_server_listen (gint timeout)
     {
       sa_union                 client;
       gchar                    clientname[NI_MAXHOST];
+      SFClient                *sf_client;
 
       /* Connection request on original socket. */
       guint                    size = sizeof (client);
       gint                     new;
       guint                    portno;
+      gint                     v = 1;
 
       if (! FD_ISSET (server_socks[sockno], &fds))
         {
@@ -367,8 +428,17 @@ script_fu_server_listen (gint timeout)
       (void) getnameinfo (&(client.sa), size, clientname, sizeof (clientname),
                           NULL, 0, NI_NUMERICHOST);
 
-      g_hash_table_insert (clients, GINT_TO_POINTER (new),
-                           g_strdup (clientname));
+      sf_client = g_slice_new (SFClient);
+
+      sf_client->address = g_strdup (clientname);
+      sf_client->input   = g_byte_array_new ();
+
+      g_hash_table_insert (clients, GINT_TO_POINTER (new), sf_client);
+
+      /*  Responses are written in one go, don't let Nagle hold back the
+       *  last bit of one while a pipelining client waits for it.
+       */
+      setsockopt (new, IPPROTO_TCP, TCP_NODELAY, (gchar *) &v, sizeof (v));
 
       /* Determine port number */
       switch (client.family)
@@ -495,9 +565,11 @@ server_start (gint         port,
   if (! server_log_file)
     server_log_file = stdout;
 
-  /*  Set up the clientname hash table  */
+  /*  Set up the client hash table  */
   clients = g_hash_table_new_full (g_direct_hash, NULL,
-                                   NULL, (GDestroyNotify) g_free);
+                                   NULL, (GDestroyNotify) free_client);
+
+  server_timer = g_timer_new ();
 
   progress = server_progress_install ();
 
@@ -512,17 +584,16 @@ server_start (gint         port,
         {
           SFCommand *cmd = (SFCommand *) command_queue->data;
 
-          /*  Process the command  */
-          execute_command (cmd);
-
           /*  Remove the command from the list  */
-          command_queue = g_list_remove (command_queue, cmd);
+          command_queue = g_list_delete_link (command_queue, command_queue);
           queue_length--;
 
+          /*  Process the command  */
+          execute_command (cmd);
+
           /*  Free the request  */
-          g_free (cmd->command);
-          g_free (cmd);
-      }
+          free_command (cmd);
+        }
     }
 
   server_progress_uninstall (progress);
@@ -530,18 +601,74 @@ server_start (gint         port,
   server_quit ();
 }
 
+static void
+put_uint32 (guchar  *buffer,
+            guint32  value)
+{
+  buffer[0] = (guchar) (value >> 24);
+  buffer[1] = (guchar) (value >> 16);
+  buffer[2] = (guchar) (value >> 8);
+  buffer[3] = (guchar) (value & 0xFF);
+}
+
+static guint32
+get_uint32 (const guchar *buffer)
+{
+  return (((guint32) buffer[0] << 24) | ((guint32) buffer[1] << 16) |
+          ((guint32) buffer[2] << 8)  |  (guint32) buffer[3]);
+}
+
+static guint32
+seconds_to_usecs (gdouble seconds)
+{
+  if (seconds <= 0.0)
+    return 0;
+
+  if (seconds >= G_MAXUINT32 / (gdouble) G_USEC_PER_SEC)
+    return G_MAXUINT32;
+
+  return (guint32) (seconds * G_USEC_PER_SEC);
+}
+
+static gboolean
+send_all (gint         filedes,
+          const gchar *data,
+          gsize        len)
+{
+  while (len > 0)
+    {
+      gint nbytes = send (filedes, data, len, SEND_FLAGS);
+
+      if (nbytes < 0)
+        {
+#ifndef G_OS_WIN32
+          if (errno == EINTR)
+            continue;
+#endif
+          print_socket_api_error ("send");
+          return FALSE;
+        }
+
+      data += nbytes;
+      len  -= nbytes;
+    }
+
+  return TRUE;
+}
+
 static gboolean
 execute_command (SFCommand *cmd)
 {
-  guchar    buffer[RESPONSE_HEADER];
+  guchar    buffer[EXT_RESPONSE_HEADER];
   GString  *response;
-  time_t    clock1;
-  time_t    clock2;
+  time_t    clock;
+  gdouble   started;
+  gdouble   finished;
   gboolean  error;
-  gint      i;
+  gsize     header_len;
 
   server_log ("Processing request #%d\n", cmd->request_no);
-  time (&clock1);
+  started = g_timer_elapsed (server_timer, NULL);
 
   response = g_string_new (NULL);
   ts_register_output_func (ts_gstring_output_func, response);
@@ -557,122 +684,196 @@ execute_command (SFCommand *cmd)
       error = FALSE;
 
       g_string_assign (response, ts_get_success_msg ());
+    }
+
+  finished = g_timer_elapsed (server_timer, NULL);
 
-      time (&clock2);
+  if (! error)
+    {
+      time (&clock);
       server_log ("Request #%d processed in %f seconds, finishing on %s",
-                  cmd->request_no, difftime (clock2, clock1), ctime (&clock2));
+                  cmd->request_no, finished - started, ctime (&clock));
+    }
+
+  if (cmd->extended)
+    {
+      header_len = EXT_RESPONSE_HEADER;
+
+      buffer[MAGIC_BYTE] = EXT_MAGIC;
+      buffer[ERROR_BYTE] = error ? TRUE : FALSE;
+      put_uint32 (buffer + EXT_RSP_LEN_BYTE,    response->len);
+      put_uint32 (buffer + EXT_REQUEST_NO_BYTE, cmd->request_no);
+      put_uint32 (buffer + EXT_QUEUED_BYTE,
+                  seconds_to_usecs (started - cmd->received));
+      put_uint32 (buffer + EXT_RUN_BYTE,
+                  seconds_to_usecs (finished - started));
     }
+  else
+    {
+      header_len = RESPONSE_HEADER;
 
-  buffer[MAGIC_BYTE]     = MAGIC;
-  buffer[ERROR_BYTE]     = error ? TRUE : FALSE;
-  buffer[RSP_LEN_H_BYTE] = (guchar) (response->len >> 8);
-  buffer[RSP_LEN_L_BYTE] = (guchar) (response->len & 0xFF);
-
-  /*  Write the response to the client  */
-  for (i = 0; i < RESPONSE_HEADER; i++)
-    if (cmd->filedes > 0 && send (cmd->filedes, buffer + i, 1, 0) < 0)
-      {
-        /*  Write error  */
-        print_socket_api_error ("send");
-        return FALSE;
-      }
-
-  for (i = 0; i < response->len; i++)
-    if (cmd->filedes > 0 && send (cmd->filedes, response->str + i, 1, 0) < 0)
-      {
-        /*  Write error  */
-        print_socket_api_error ("send");
-        return FALSE;
-      }
+      if (response->len > G_MAXUINT16)
+        {
+          server_log ("Response to request #%d truncated from %lu "
+                      "to %d bytes.\n",
+                      cmd->request_no, (gulong) response->len, G_MAXUINT16);
+
+          g_string_truncate (response, G_MAXUINT16);
+        }
+
+      buffer[MAGIC_BYTE]     = MAGIC;
+      buffer[ERROR_BYTE]     = error ? TRUE : FALSE;
+      buffer[RSP_LEN_H_BYTE] = (guchar) (response->len >> 8);
+      buffer[RSP_LEN_L_BYTE] = (guchar) (response->len & 0xFF);
+    }
+
+  /*  Write the response to the client, header and body in one go  */
+  g_string_prepend_len (response, (const gchar *) buffer, header_len);
+
+  if (cmd->filedes >= 0 &&
+      ! send_all (cmd->filedes, response->str, response->len))
+    {
+      g_string_free (response, TRUE);
+      return FALSE;
+    }
 
   g_string_free (response, TRUE);
 
-  return FALSE;
+  return TRUE;
 }
 
-static gint
-read_from_client (gint filedes)
+static void
+queue_command (gint          filedes,
+               SFClient     *client,
+               const guchar *data,
+               gint          command_len,
+               gboolean      extended)
 {
   SFCommand *cmd;
-  guchar     buffer[COMMAND_HEADER];
-  gchar     *command;
-  gchar     *clientaddr;
   time_t     clock;
-  gint       command_len;
-  gint       nbytes;
-  gint       i;
 
-  for (i = 0; i < COMMAND_HEADER;)
-    {
-      nbytes = recv (filedes, buffer + i, COMMAND_HEADER - i, 0);
+  cmd = g_new (SFCommand, 1);
 
-      if (nbytes < 0)
-        {
-#ifndef G_OS_WIN32
-          if (errno == EINTR)
-            continue;
-#endif
-          server_log ("Error reading command header.\n");
-          return -1;
-        }
+  cmd->command = g_new (gchar, command_len + 1);
+  memcpy (cmd->command, data, command_len);
+  cmd->command[command_len] = '\0';
 
-      if (nbytes == 0)
-        return -1;  /* EOF */
+  cmd->filedes    = filedes;
+  cmd->request_no = request_no ++;
+  cmd->extended   = extended;
+  cmd->received   = g_timer_elapsed (server_timer, NULL);
 
-      i += nbytes;
-    }
+  /*  Add the command to the queue  */
+  command_queue = g_list_append (command_queue, cmd);
+  queue_length ++;
+
+  time (&clock);
+  server_log ("Received request #%d from IP address %s: %s on %s,"
+              "[Request queue length: %d]",
+              cmd->request_no, client->address,
+              cmd->command, ctime (&clock), queue_length);
+}
+
+static gint
+read_from_client (gint      filedes,
+                  SFClient *client)
+{
+  guchar  buffer[4096];
+  guint   offset;
+  gint    nbytes;
+
+  /*  select() said there is something to read, so this doesn't block  */
+  nbytes = recv (filedes, (gchar *) buffer, sizeof (buffer), 0);
 
-  if (buffer[MAGIC_BYTE] != MAGIC)
+  if (nbytes < 0)
     {
-      server_log ("Error in script-fu command transmission.\n");
+#ifndef G_OS_WIN32
+      if (errno == EINTR)
+        return 0;
+#endif
+      server_log ("Error reading from client.\n");
       return -1;
     }
 
-  command_len = (buffer [CMD_LEN_H_BYTE] << 8) | buffer [CMD_LEN_L_BYTE];
-  command = g_new (gchar, command_len + 1);
+  if (nbytes == 0)
+    return -1;  /* EOF */
 
-  for (i = 0; i < command_len;)
+  g_byte_array_append (client->input, buffer, nbytes);
+
+  /*  Queue every complete command received so far; a client may send
+   *  several of them without waiting for the responses.
+   */
+  for (offset = 0; offset < client->input->len;)
     {
-      nbytes = recv (filedes, command + i, command_len - i, 0);
+      const guchar *data  = client->input->data + offset;
+      guint         avail = client->input->len - offset;
+      guint         header_len;
+      guint         command_len;
+      gboolean      extended;
 
-      if (nbytes <= 0)
+      if (data[MAGIC_BYTE] == MAGIC)
         {
-#ifndef G_OS_WIN32
-          if (nbytes < 0 && errno == EINTR)
-            continue;
-#endif
-           server_log ("Error reading command.  Read %d out of %d bytes.\n",
-                       i, command_len);
-           g_free (command);
-           return -1;
+          header_len = COMMAND_HEADER;
+          extended   = FALSE;
+
+          if (avail < header_len)
+            break;
+
+          command_len = (data[CMD_LEN_H_BYTE] << 8) | data[CMD_LEN_L_BYTE];
         }
+      else if (data[MAGIC_BYTE] == EXT_MAGIC)
+        {
+          header_len = EXT_COMMAND_HEADER;
+          extended   = TRUE;
 
-      i += nbytes;
-    }
+          if (avail < header_len)
+            break;
 
-  command[command_len] = '\0';
-  cmd = g_new (SFCommand, 1);
+          command_len = get_uint32 (data + EXT_CMD_LEN_BYTE);
 
-  cmd->filedes    = filedes;
-  cmd->command    = command;
-  cmd->request_no = request_no ++;
+          if (command_len > MAX_COMMAND_LEN)
+            {
+              server_log ("Command of %u bytes exceeds the limit of %d bytes.\n",
+                          command_len, MAX_COMMAND_LEN);
+              return -1;
+            }
+        }
+      else
+        {
+          server_log ("Error in script-fu command transmission.\n");
+          return -1;
+        }
 
-  /*  Add the command to the queue  */
-  command_queue = g_list_append (command_queue, cmd);
-  queue_length ++;
+      if (avail - header_len < command_len)
+        break;
 
-  /*  Get the client address from the address/socket table  */
-  clientaddr = g_hash_table_lookup (clients, GINT_TO_POINTER (cmd->filedes));
-  time (&clock);
-  server_log ("Received request #%d from IP address %s: %s on %s,"
-              "[Request queue length: %d]",
-              cmd->request_no,
-                  clientaddr ? clientaddr : "<invalid>",
-                      cmd->command, ctime (&clock), queue_length);
+      queue_command (filedes, client,
+                     data + header_len, command_len, extended);
+
+      offset += header_len + command_len;
+    }
+
+  if (offset > 0)
+    g_byte_array_remove_range (client->input, 0, offset);
 
   return 0;
 }
 
+static void
+free_command (SFCommand *cmd)
+{
+  g_free (cmd->command);
+  g_free (cmd);
+}
+
+static void
+free_client (SFClient *client)
+{
+  g_free (client->address);
+  g_byte_array_free (client->input, TRUE);
+  g_slice_free (SFClient, client);
+}
+
 static gint
 make_socket (const struct addrinfo *ai)
 {
@@ -777,15 +978,18 @@ server_quit (void)
 
   while (command_queue)
     {
-      SFCommand *cmd = command_queue->data;
+      free_command (command_queue->data);
 
-      g_free (cmd->command);
-      g_free (cmd);
+      command_queue = g_list_delete_link (command_queue, command_queue);
     }
 
-  g_list_free (command_queue);
-  command_queue = NULL;
-  queue_length  = 0;
+  queue_length = 0;
+
+  if (server_timer)
+    {
+      g_timer_destroy (server_timer);
+      server_timer = NULL;
+    }
 
   /*  Close the server log file  */
   if (server_log_file != stdout)
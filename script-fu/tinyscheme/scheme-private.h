@@ -3,6 +3,8 @@
 #ifndef _SCHEME_PRIVATE_H
 #define _SCHEME_PRIVATE_H
 
+#include <time.h>
+
 #include "scheme.h"
 /*------------------ Ugly internals -----------------------------------*/
 /*------------------ Of interest only to FFI users --------------------*/
@@ -65,10 +67,13 @@ int tracing;
 
 
 #define CELL_SEGSIZE    25000 /* # of cells in one segment */
-#define CELL_NSEGMENT   50    /* # of segments for cells */
-char *alloc_seg[CELL_NSEGMENT];
-pointer cell_seg[CELL_NSEGMENT];
+#define CELL_NSEGMENT   16    /* initial size of the segment tables */
+char  **alloc_seg;
+pointer *cell_seg;
+long   *cell_seg_size;   /* # of cells in each segment */
+int     cell_nsegment;   /* # of entries in the segment tables */
 int     last_cell_seg;
+long    ncells;          /* # of cells in all segments */
 
 /* We use 5 registers. */
 pointer args;            /* register for arguments of function */
@@ -123,6 +128,9 @@ int file_i;
 int nesting;
 
 char    gc_verbose;      /* if gc_verbose is not zero, print gc status */
+long    gc_count;        /* # of collections so far */
+long    gc_recovered;    /* # of cells recovered by all collections */
+clock_t gc_clock;        /* processor time spent in gc */
 char    no_memory;       /* Whether mem. alloc. has failed */
 
 #define LINESIZE 1024
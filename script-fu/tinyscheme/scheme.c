@@ -375,6 +375,7 @@ static void file_pop(scheme *sc);
 static int file_interactive(scheme *sc);
 static INLINE int is_one_of(char *s, gunichar c);
 static int alloc_cellseg(scheme *sc, int n);
+static int alloc_cellseg_sized(scheme *sc, long size);
 static long binary_decode(const char *s);
 static INLINE pointer get_cell(scheme *sc, pointer a, pointer b);
 static pointer _get_cell(scheme *sc, pointer a, pointer b);
@@ -605,62 +606,121 @@ static long binary_decode(const char *s) {
  return x;
 }
 
-/* allocate new cell segment */
-static int alloc_cellseg(scheme *sc, int n) {
+/* make room for one more entry in the segment tables */
+static int grow_cellseg_tables(scheme *sc) {
+     int n = sc->cell_nsegment ? 2 * sc->cell_nsegment : CELL_NSEGMENT;
+     char **alloc_seg;
+     pointer *cell_seg;
+     long *cell_seg_size;
+
+     if (sc->last_cell_seg < sc->cell_nsegment - 1)
+          return 1;
+
+     alloc_seg = (char**) sc->malloc(n * sizeof(char*));
+     cell_seg = (pointer*) sc->malloc(n * sizeof(pointer));
+     cell_seg_size = (long*) sc->malloc(n * sizeof(long));
+     if (alloc_seg == 0 || cell_seg == 0 || cell_seg_size == 0) {
+          if (alloc_seg) sc->free(alloc_seg);
+          if (cell_seg) sc->free(cell_seg);
+          if (cell_seg_size) sc->free(cell_seg_size);
+          return 0;
+     }
+
+     if (sc->cell_nsegment) {
+          memcpy(alloc_seg, sc->alloc_seg, sc->cell_nsegment * sizeof(char*));
+          memcpy(cell_seg, sc->cell_seg, sc->cell_nsegment * sizeof(pointer));
+          memcpy(cell_seg_size, sc->cell_seg_size,
+                 sc->cell_nsegment * sizeof(long));
+          sc->free(sc->alloc_seg);
+          sc->free(sc->cell_seg);
+          sc->free(sc->cell_seg_size);
+     }
+
+     sc->alloc_seg = alloc_seg;
+     sc->cell_seg = cell_seg;
+     sc->cell_seg_size = cell_seg_size;
+     sc->cell_nsegment = n;
+     return 1;
+}
+
+/* allocate a new cell segment of 'size' cells */
+static int alloc_cellseg_sized(scheme *sc, long size) {
      pointer newp;
      pointer last;
      pointer p;
      char *cp;
-     long i;
-     int k;
+     long i, t;
      int adj=ADJ;
 
      if(adj<sizeof(struct cell)) {
        adj=sizeof(struct cell);
      }
 
+     if (!grow_cellseg_tables(sc))
+          return 0;
+     cp = (char*) sc->malloc(size * sizeof(struct cell)+adj);
+     if (cp == 0)
+          return 0;
+     i = ++sc->last_cell_seg ;
+     sc->alloc_seg[i] = cp;
+     /* adjust in TYPE_BITS-bit boundary */
+     if(((unsigned long)cp)%adj!=0) {
+       cp=(char*)(adj*((unsigned long)cp/adj+1));
+     }
+     /* insert new segment in address order */
+     newp=(pointer)cp;
+     sc->cell_seg[i] = newp;
+     sc->cell_seg_size[i] = size;
+     while (i > 0 && sc->cell_seg[i - 1] > sc->cell_seg[i]) {
+          p = sc->cell_seg[i];
+          sc->cell_seg[i] = sc->cell_seg[i - 1];
+          sc->cell_seg[i - 1] = p;
+          t = sc->cell_seg_size[i];
+          sc->cell_seg_size[i] = sc->cell_seg_size[i - 1];
+          sc->cell_seg_size[--i] = t;
+     }
+     sc->fcells += size;
+     sc->ncells += size;
+     last = newp + size - 1;
+     for (p = newp; p <= last; p++) {
+          typeflag(p) = 0;
+          cdr(p) = p + 1;
+          car(p) = sc->NIL;
+     }
+     /* insert new cells in address order on free list */
+     if (sc->free_cell == sc->NIL || p < sc->free_cell) {
+          cdr(last) = sc->free_cell;
+          sc->free_cell = newp;
+     } else {
+          p = sc->free_cell;
+          while (cdr(p) != sc->NIL && newp > cdr(p))
+               p = cdr(p);
+          cdr(last) = cdr(p);
+          cdr(p) = newp;
+     }
+     return 1;
+}
+
+/* allocate new cell segments */
+static int alloc_cellseg(scheme *sc, int n) {
+     int k;
+
      for (k = 0; k < n; k++) {
-          if (sc->last_cell_seg >= CELL_NSEGMENT - 1)
-               return k;
-          cp = (char*) sc->malloc(CELL_SEGSIZE * sizeof(struct cell)+adj);
-          if (cp == 0)
+          if (!alloc_cellseg_sized(sc, CELL_SEGSIZE))
                return k;
-          i = ++sc->last_cell_seg ;
-          sc->alloc_seg[i] = cp;
-          /* adjust in TYPE_BITS-bit boundary */
-          if(((unsigned long)cp)%adj!=0) {
-            cp=(char*)(adj*((unsigned long)cp/adj+1));
-          }
-        /* insert new segment in address order */
-          newp=(pointer)cp;
-        sc->cell_seg[i] = newp;
-        while (i > 0 && sc->cell_seg[i - 1] > sc->cell_seg[i]) {
-              p = sc->cell_seg[i];
-            sc->cell_seg[i] = sc->cell_seg[i - 1];
-            sc->cell_seg[--i] = p;
-        }
-          sc->fcells += CELL_SEGSIZE;
-        last = newp + CELL_SEGSIZE - 1;
-          for (p = newp; p <= last; p++) {
-               typeflag(p) = 0;
-               cdr(p) = p + 1;
-               car(p) = sc->NIL;
-          }
-        /* insert new cells in address order on free list */
-        if (sc->free_cell == sc->NIL || p < sc->free_cell) {
-             cdr(last) = sc->free_cell;
-             sc->free_cell = newp;
-        } else {
-              p = sc->free_cell;
-              while (cdr(p) != sc->NIL && newp > cdr(p))
-                   p = cdr(p);
-              cdr(last) = cdr(p);
-              cdr(p) = newp;
-        }
      }
      return n;
 }
 
+/* number of segments to add after a gc that left too few cells free.
+ * Growing in proportion to the heap keeps the time spent in gc
+ * proportional to the number of cells allocated, however much of the
+ * heap stays live.
+ */
+static int cellseg_growth(scheme *sc) {
+     return (sc->last_cell_seg + 1) / 2 + 1;
+}
+
 static INLINE pointer get_cell_x(scheme *sc, pointer a, pointer b) {
   if (sc->free_cell != sc->NIL) {
     pointer x = sc->free_cell;
@@ -681,12 +741,11 @@ static pointer _get_cell(scheme *sc, pointer a, pointer b) {
   }
 
   if (sc->free_cell == sc->NIL) {
-    const int min_to_be_recovered = sc->last_cell_seg*8;
     gc(sc,a, b);
-    if (sc->fcells < min_to_be_recovered
+    if (sc->fcells < sc->ncells/2
         || sc->free_cell == sc->NIL) {
       /* if only a few recovered, get more to avoid fruitless gc's */
-      if (!alloc_cellseg(sc,1) && sc->free_cell == sc->NIL) {
+      if (!alloc_cellseg(sc,cellseg_growth(sc)) && sc->free_cell == sc->NIL) {
         sc->no_memory=1;
         return sc->sink;
       }
@@ -735,11 +794,16 @@ static pointer get_consecutive_cells(scheme *sc, int n) {
 
   /* If not, try gc'ing some */
   gc(sc, sc->NIL, sc->NIL);
+  if (sc->fcells < sc->ncells/2) {
+    /* if only a few recovered, get more to avoid fruitless gc's */
+    alloc_cellseg(sc,cellseg_growth(sc));
+  }
   x=find_consecutive_cells(sc,n);
   if (x != sc->NIL) { return x; }
 
-  /* If there still aren't, try getting more heap */
-  if (!alloc_cellseg(sc,1))
+  /* If there still aren't, try getting more heap; a vector may need
+     a segment larger than usual to find n consecutive cells */
+  if (!alloc_cellseg_sized(sc, n > CELL_SEGSIZE ? n : CELL_SEGSIZE))
     {
       sc->no_memory=1;
       return sc->sink;
@@ -1339,6 +1403,8 @@ E6:   /* up.  Undo the link switching from steps E4 and E5. */
 static void gc(scheme *sc, pointer a, pointer b) {
   pointer p;
   int i;
+  long fcells = sc->fcells;
+  clock_t start = clock();
 
   if(sc->gc_verbose) {
     putstr(sc, "gc...");
@@ -1378,7 +1444,7 @@ static void gc(scheme *sc, pointer a, pointer b) {
      free-list in sorted order.
   */
   for (i = sc->last_cell_seg; i >= 0; i--) {
-    p = sc->cell_seg[i] + CELL_SEGSIZE;
+    p = sc->cell_seg[i] + sc->cell_seg_size[i];
     while (--p >= sc->cell_seg[i]) {
       if (is_mark(p)) {
         clrmark(p);
@@ -1396,6 +1462,10 @@ static void gc(scheme *sc, pointer a, pointer b) {
     }
   }
 
+  sc->gc_count++;
+  sc->gc_recovered += sc->fcells - fcells;
+  sc->gc_clock += clock() - start;
+
   if (sc->gc_verbose) {
     char msg[80];
     snprintf(msg,80,"done: %ld cells were recovered.\n", sc->fcells);
@@ -1403,6 +1473,37 @@ static void gc(scheme *sc, pointer a, pointer b) {
   }
 }
 
+/* gc statistics as an association list, for (gc-stats) */
+static pointer gc_stats(scheme *sc) {
+  long count = sc->gc_count;
+  long segments = sc->last_cell_seg + 1;
+  long ncells = sc->ncells;
+  long fcells = sc->fcells;
+  long recovered = sc->gc_recovered;
+  double seconds = (double) sc->gc_clock / CLOCKS_PER_SEC;
+  pointer x = sc->NIL;
+
+  /* make sure none of the conses below triggers a gc */
+  if (reserve_cells(sc, 128) != sc->T) {
+    return sc->NIL;
+  }
+
+#define GC_STAT(name, value) \
+  x = cons(sc, cons(sc, mk_symbol(sc, name), value), x)
+
+  GC_STAT("gc-seconds", mk_real(sc, seconds));
+  GC_STAT("cells-allocated", mk_integer(sc, ncells - fcells + recovered));
+  GC_STAT("cells-recovered", mk_integer(sc, recovered));
+  GC_STAT("free-cells", mk_integer(sc, fcells));
+  GC_STAT("cells", mk_integer(sc, ncells));
+  GC_STAT("segments", mk_integer(sc, segments));
+  GC_STAT("collections", mk_integer(sc, count));
+
+#undef GC_STAT
+
+  return x;
+}
+
 static void finalize_cell(scheme *sc, pointer a) {
   if(is_string(a)) {
     sc->free(strvalue(a));
@@ -4082,6 +4183,9 @@ static pointer opexe_4(scheme *sc, enum scheme_opcodes op) {
           alloc_cellseg(sc, (int) ivalue(car(sc->args)));
           s_return(sc,sc->T);
 
+     case OP_GCSTATS: /* gc-stats */
+          s_return(sc, gc_stats(sc));
+
      case OP_OBLIST: /* oblist */
           s_return(sc, oblist_all_symbols(sc));
 
@@ -4876,7 +4980,15 @@ int scheme_init_custom_alloc(scheme *sc, func_alloc malloc, func_dealloc free) {
   sc->gensym_cnt=0;
   sc->malloc=malloc;
   sc->free=free;
+  sc->alloc_seg = 0;
+  sc->cell_seg = 0;
+  sc->cell_seg_size = 0;
+  sc->cell_nsegment = 0;
   sc->last_cell_seg = -1;
+  sc->ncells = 0;
+  sc->gc_count = 0;
+  sc->gc_recovered = 0;
+  sc->gc_clock = 0;
   sc->sink = &sc->_sink;
   sc->NIL = &sc->_NIL;
   sc->T = &sc->_HASHT;
@@ -5017,6 +5129,11 @@ void scheme_deinit(scheme *sc) {
   for(i=0; i<=sc->last_cell_seg; i++) {
     sc->free(sc->alloc_seg[i]);
   }
+  if (sc->cell_nsegment) {
+    sc->free(sc->alloc_seg);
+    sc->free(sc->cell_seg);
+    sc->free(sc->cell_seg_size);
+  }
 
 #if SHOW_ERROR_LINE
   fname = sc->load_stack[i].rep.stdio.filename;